@@ -0,0 +1,271 @@
+/*
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2022, k4m1
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIA LDAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVE RCAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Multi-pattern benchmark. Scans random text for 1 to 1000 patterns with
+ * the Aho-Corasick automaton, and with one findseq() pass per pattern,
+ * and reports GB/s of both.
+ */
+#include <sys/types.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+
+#include <ac_match.h>
+#include <intercept_helpers.h>
+
+#define BENCH_PLEN_MIN 6
+#define BENCH_PLEN_MAX 16
+
+struct bench_opts {
+	size_t dlen;
+	double secs; 		/* how long to scan per pattern count */
+};
+
+static struct bench_opts opts = { 64 * 1024, 0.5 };
+
+static uint32_t npatterns[] = { 1, 10, 100, 1000 };
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + ((double)ts.tv_nsec / 1e9);
+}
+
+static int
+count_match(void *arg, uint32_t pattern, size_t end)
+{
+	(void)pattern;
+	(void)end;
+	(*(size_t *)arg)++;
+	return 0;
+}
+
+static size_t
+scan_ac(struct ac_automaton *ac, unsigned char *data,
+		unsigned char **patterns, size_t *lens, uint32_t cnt)
+{
+	uint32_t state;
+	size_t found;
+
+	(void)patterns;
+	(void)lens;
+	(void)cnt;
+	found = 0;
+	state = AC_START;
+	ac_scan(ac, &state, data, opts.dlen, &count_match, &found);
+	return found;
+}
+
+/* What callers had to do before, one pass per pattern */
+static size_t
+scan_findseq(struct ac_automaton *ac, unsigned char *data,
+		unsigned char **patterns, size_t *lens, uint32_t cnt)
+{
+	unsigned char *where;
+	size_t found;
+	size_t off;
+	uint32_t i;
+
+	(void)ac;
+	found = 0;
+	for (i = 0; i < cnt; i++) {
+		for (off = 0; off < opts.dlen; off = (size_t)(where - data) + 1) {
+			where = (unsigned char *)findseq(&data[off], patterns[i],
+					opts.dlen - off, lens[i]);
+			if (!where) {
+				break;
+			}
+			found++;
+		}
+	}
+	return found;
+}
+
+/*
+ * Scan data over and over for opts.secs
+ *
+ * Returns:
+ * 	GB/s, and matches per scan in found
+ */
+static double
+bench_scan(size_t (*scan)(struct ac_automaton *, unsigned char *,
+			unsigned char **, size_t *, uint32_t),
+		struct ac_automaton *ac, unsigned char *data,
+		unsigned char **patterns, size_t *lens, uint32_t cnt,
+		size_t *found)
+{
+	double start;
+	double secs;
+	size_t rounds;
+
+	start = now();
+	rounds = 0;
+	do {
+		*found = scan(ac, data, patterns, lens, cnt);
+		rounds++;
+		secs = now() - start;
+	} while (secs < opts.secs);
+	return ((double)rounds * opts.dlen) / secs / 1e9;
+}
+
+/*
+ * Text and patterns are lowercase letters. Every pattern is planted in
+ * text a few times so there's something to find.
+ */
+static void
+fill(unsigned char *data, unsigned char **patterns, size_t *lens,
+		uint32_t cnt)
+{
+	uint32_t i;
+	size_t j;
+
+	for (j = 0; j < opts.dlen; j++) {
+		data[j] = (unsigned char)('a' + (rand() % 26));
+	}
+	for (i = 0; i < cnt; i++) {
+		lens[i] = BENCH_PLEN_MIN +
+			(size_t)(rand() % (BENCH_PLEN_MAX - BENCH_PLEN_MIN + 1));
+		for (j = 0; j < lens[i]; j++) {
+			patterns[i][j] = (unsigned char)('a' + (rand() % 26));
+		}
+		j = (size_t)rand() % (opts.dlen - lens[i]);
+		memcpy(&data[j], patterns[i], lens[i]);
+	}
+}
+
+static int
+bench_patterns(unsigned char *data, uint32_t cnt)
+{
+	struct ac_automaton ac;
+	unsigned char **patterns;
+	size_t *lens;
+	size_t ac_found;
+	size_t fs_found;
+	double ac_gbs;
+	double fs_gbs;
+	double build;
+	uint32_t i;
+	int stat;
+
+	stat = -1;
+	patterns = (unsigned char **)calloc(cnt, sizeof(*patterns));
+	lens = (size_t *)calloc(cnt, sizeof(*lens));
+	if (!patterns || !lens) {
+		goto out;
+	}
+	for (i = 0; i < cnt; i++) {
+		patterns[i] = (unsigned char *)malloc(BENCH_PLEN_MAX);
+		if (!patterns[i]) {
+			goto out;
+		}
+	}
+	fill(data, patterns, lens, cnt);
+
+	build = now();
+	if (ac_build(&ac, patterns, lens, cnt) < 0) {
+		goto out;
+	}
+	build = now() - build;
+	ac_gbs = bench_scan(&scan_ac, &ac, data, patterns, lens, cnt,
+			&ac_found);
+	fs_gbs = bench_scan(&scan_findseq, &ac, data, patterns, lens, cnt,
+			&fs_found);
+	if (ac_found != fs_found) {
+		fprintf(stderr, "automaton found %zu matches, findseq %zu\n",
+				ac_found, fs_found);
+	} else {
+		printf("patterns=%u states=%u table_kb=%zu build_ms=%.3f "
+				"matches=%zu ac_gb_per_s=%.3f "
+				"findseq_gb_per_s=%.3f\n", cnt, ac.nstates,
+				((size_t)ac.nstates * ac.nclasses *
+				 sizeof(*ac.delta)) / 1024, build * 1e3,
+				ac_found, ac_gbs, fs_gbs);
+		stat = 0;
+	}
+	ac_free(&ac);
+out:
+	for (i = 0; patterns && (i < cnt); i++) {
+		free(patterns[i]);
+	}
+	free(patterns);
+	free(lens);
+	return stat;
+}
+
+int
+main(int argc, char **argv)
+{
+	unsigned char *data;
+	size_t i;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:t:")) != -1) {
+		switch (opt) {
+		case ('d'):
+			opts.dlen = (size_t)strtoul(optarg, 0, 0);
+			break;
+		case ('t'):
+			opts.secs = atof(optarg);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-d data size] [-t seconds "
+					"per run]\n", argv[0]);
+			return -1;
+		}
+	}
+	if (opts.dlen < 2 * BENCH_PLEN_MAX) {
+		fprintf(stderr, "data size must be at least %d\n",
+				2 * BENCH_PLEN_MAX);
+		return -1;
+	}
+	data = (unsigned char *)malloc(opts.dlen);
+	if (!data) {
+		return -1;
+	}
+	srand(1337);
+	for (i = 0; i < sizeof(npatterns) / sizeof(npatterns[0]); i++) {
+		if (bench_patterns(data, npatterns[i]) < 0) {
+			free(data);
+			return -1;
+		}
+	}
+	free(data);
+	return 0;
+}
@@ -0,0 +1,93 @@
+#!/usr/bin/env python3
+#
+# Compare two `make bench` result files, e.g. from two commits:
+#
+#   make bench && cp bin/bench_results.txt /tmp/old.txt
+#   git checkout NEW && make bench
+#   ./bench/bench_compare.py /tmp/old.txt bin/bench_results.txt
+#
+# A result is identified by its key=value fields up to the first one with
+# a decimal value, the decimal ones after that are measurements. Those
+# ending with _per_s are better higher, _ns/_us/_ms and _per_mb lower,
+# the rest are printed but never count as regressions. Exits with 1 if
+# anything got worse by more than --threshold percent.
+import argparse
+import sys
+
+HIGHER = ("_per_s",)
+LOWER = ("_ns", "_us", "_ms", "_ms_best", "_ms_avg", "_per_mb")
+
+def is_decimal(v) -> bool:
+    if ("." not in v):
+        return False
+    try:
+        float(v)
+    except ValueError:
+        return False
+    return True
+
+def parse(path) -> dict:
+    results = {}
+    with open(path) as f:
+        for line in f:
+            key = []
+            values = {}
+            for field in line.split():
+                if ("=" not in field):
+                    continue
+                k, v = field.split("=", 1)
+                if ((not values) and (not is_decimal(v))):
+                    key.append(field)
+                elif (is_decimal(v)):
+                    values[k] = float(v)
+            if (values):
+                results[" ".join(key)] = values
+    return results
+
+def direction(name) -> int:
+    if (name.endswith(HIGHER)):
+        return 1
+    if (name.endswith(LOWER)):
+        return -1
+    return 0
+
+def main() -> int:
+    parser = argparse.ArgumentParser(description="Compare bench results")
+    parser.add_argument("old", help="results before")
+    parser.add_argument("new", help="results after")
+    parser.add_argument("--threshold", type=float, default=5.0,
+            help="percent a measurement may get worse, defaults to 5")
+    parser.add_argument("--all", action="store_true",
+            help="print unchanged measurements too")
+    args = parser.parse_args()
+
+    old = parse(args.old)
+    new = parse(args.new)
+    regressions = 0
+    for key in old:
+        if (key not in new):
+            print("missing %s" % key)
+            continue
+        for name, before in old[key].items():
+            if (name not in new[key]):
+                continue
+            after = new[key][name]
+            delta = ((after - before) * 100.0 / before) if before else 0.0
+            worse = -delta * direction(name)
+            mark = ""
+            if (direction(name) and (worse > args.threshold)):
+                mark = " REGRESSION"
+                regressions += 1
+            elif (direction(name) and (-worse > args.threshold)):
+                mark = " improved"
+            if (mark or args.all):
+                print("%s %s %.3f -> %.3f (%+.1f%%)%s" % (key, name,
+                    before, after, delta, mark))
+    for key in new:
+        if (key not in old):
+            print("new %s" % key)
+    print("%d regressions over %.1f%%" % (regressions, args.threshold))
+    return 1 if regressions else 0
+
+if (__name__ == "__main__"):
+    sys.exit(main())
@@ -0,0 +1,709 @@
+/*
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2022, k4m1
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIA LDAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVE RCAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * End-to-end benchmark. Starts a local echo & sink backend, runs bin/tap
+ * in front of it, and drives it with client threads: throughput to the
+ * sink, connection rate (connect, echo a message, close) and ping-pong
+ * latency over persistent connections. Each scenario runs against tap
+ * and against the backend directly, so the difference is what tap adds.
+ * Arguments after -- are passed to tap.
+ */
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+
+#include <net_io.h>
+
+#define BENCH_TAP_PORT 	21437
+#define BENCH_ECHO_PORT	21438
+#define BENCH_SINK_PORT	21439
+#define BENCH_CHUNK 	65536
+#define BENCH_MSG_MAX 	4096
+#define BENCH_CONNS_MAX	256
+#define BENCH_START_MS 	3000
+#define BENCH_TAP_ARGS 	64
+
+/* Backend connection kinds, kept in upper half of epoll data */
+#define BE_LISTEN 	1
+#define BE_ECHO 	2
+#define BE_SINK 	4
+
+struct bench_opts {
+	char *tap;
+	char *backend;
+	double secs; 		/* per scenario & target */
+	int conns;
+	size_t msg;
+	char **tap_args; 	/* after -- */
+	int ntap_args;
+};
+
+static struct bench_opts opts = { "./bin/tap", "epoll", 1.0, 4, 64, 0, 0 };
+
+/* Latencies in ns of one client thread */
+struct samples {
+	uint64_t *v;
+	size_t n;
+	size_t cap;
+};
+
+struct client {
+	pthread_t thread;
+	short port;
+	struct samples lat;
+	uint64_t ops;
+	int failed;
+};
+
+struct backend {
+	int epfd;
+	int lsock[2];
+	volatile int stop;
+	uint64_t sunk; 		/* bytes read by sink */
+	pthread_t thread;
+};
+
+static struct backend be;
+static volatile int clients_stop;
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + ((double)ts.tv_nsec / 1e9);
+}
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL) + (uint64_t)ts.tv_nsec;
+}
+
+static int
+samples_add(struct samples *s, uint64_t v)
+{
+	uint64_t *n;
+	size_t cap;
+
+	if (s->n == s->cap) {
+		cap = s->cap ? (s->cap * 2) : 4096;
+		n = (uint64_t *)realloc(s->v, cap * sizeof(*n));
+		if (!n) {
+			return -1;
+		}
+		s->v = n;
+		s->cap = cap;
+	}
+	s->v[s->n++] = v;
+	return 0;
+}
+
+static int
+cmp_u64(const void *a, const void *b)
+{
+	uint64_t x;
+	uint64_t y;
+
+	x = *(const uint64_t *)a;
+	y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+/* Exact percentile in us, permille of 999 is p99.9 */
+static double
+samples_permille(struct samples *s, int pm)
+{
+	size_t i;
+
+	if (!s->n) {
+		return 0;
+	}
+	i = (s->n * (size_t)pm) / 1000;
+	if (i >= s->n) {
+		i = s->n - 1;
+	}
+	return (double)s->v[i] / 1e3;
+}
+
+static void
+nodelay(int sock)
+{
+	int one;
+
+	one = 1;
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+static void
+be_add(int sock, uint64_t kind)
+{
+	struct epoll_event ev;
+
+	ev.events = EPOLLIN;
+	ev.data.u64 = (kind << 32) | (uint32_t)sock;
+	epoll_ctl(be.epfd, EPOLL_CTL_ADD, sock, &ev);
+}
+
+/* Send all of buf from non-blocking socket */
+static int
+be_send(int sock, unsigned char *buf, size_t len)
+{
+	ssize_t stat;
+
+	while (len) {
+		stat = send(sock, buf, len, MSG_NOSIGNAL);
+		if (stat < 0) {
+			if (errno != EAGAIN) {
+				return -1;
+			}
+			waitfor(sock, 1, 1, 0);
+			continue;
+		}
+		buf += stat;
+		len -= (size_t)stat;
+	}
+	return 0;
+}
+
+/* Read what's there, echo it or count it, close on EOF */
+static void
+be_read(int sock, uint64_t kind)
+{
+	unsigned char buf[BENCH_CHUNK];
+	ssize_t stat;
+
+	for (;;) {
+		stat = recv(sock, buf, sizeof(buf), 0);
+		if (stat > 0) {
+			if (kind == BE_SINK) {
+				__atomic_fetch_add(&be.sunk, (uint64_t)stat,
+						__ATOMIC_RELAXED);
+			} else if (be_send(sock, buf, (size_t)stat) < 0) {
+				break;
+			}
+			continue;
+		}
+		if ((stat < 0) && (errno == EAGAIN)) {
+			return;
+		}
+		break;
+	}
+	close(sock);
+}
+
+static void *
+be_main(void *arg)
+{
+	struct epoll_event evs[64];
+	uint64_t kind;
+	int sock;
+	int cnt;
+	int i;
+
+	(void)arg;
+	while (!be.stop) {
+		cnt = epoll_wait(be.epfd, evs, 64, 100);
+		for (i = 0; i < cnt; i++) {
+			kind = evs[i].data.u64 >> 32;
+			sock = (int)(uint32_t)evs[i].data.u64;
+			if (!(kind & BE_LISTEN)) {
+				be_read(sock, kind);
+				continue;
+			}
+			while ((sock = accept4((int)(uint32_t)evs[i].data.u64,
+					0, 0, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+				nodelay(sock);
+				be_add(sock, kind & ~BE_LISTEN);
+			}
+		}
+	}
+	return 0;
+}
+
+static int
+be_start(void)
+{
+	struct sockaddr_in saddr;
+	short ports[2] = { BENCH_ECHO_PORT, BENCH_SINK_PORT };
+	uint64_t kinds[2] = { BE_ECHO, BE_SINK };
+	int i;
+
+	be.epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (be.epfd < 0) {
+		return -1;
+	}
+	for (i = 0; i < 2; i++) {
+		be.lsock[i] = sock_op_do("127.0.0.1", ports[i], &saddr,
+				SOCK_OP_BIND | SOCK_OP_NONBLOCK);
+		if ((be.lsock[i] < 0) || (listen(be.lsock[i], SOMAXCONN) < 0)) {
+			fprintf(stderr, "backend can't listen on %d: %d\n",
+					ports[i], errno);
+			return -1;
+		}
+		be_add(be.lsock[i], kinds[i] | BE_LISTEN);
+	}
+	if (pthread_create(&be.thread, 0, be_main, 0)) {
+		return -1;
+	}
+	return 0;
+}
+
+static void
+be_stop(void)
+{
+	be.stop = 1;
+	pthread_join(be.thread, 0);
+	close(be.lsock[0]);
+	close(be.lsock[1]);
+	close(be.epfd);
+}
+
+/* Run tap in front of backend port, wait till it accepts connections */
+static pid_t
+tap_start(short rport)
+{
+	struct sockaddr_in saddr;
+	char lport[8];
+	char dport[8];
+	char *argv[BENCH_TAP_ARGS + 16];
+	double deadline;
+	pid_t pid;
+	int sock;
+	int argc;
+	int i;
+
+	snprintf(lport, sizeof(lport), "%d", BENCH_TAP_PORT);
+	snprintf(dport, sizeof(dport), "%d", rport);
+	argc = 0;
+	argv[argc++] = opts.tap;
+	argv[argc++] = "--lhost";
+	argv[argc++] = "127.0.0.1";
+	argv[argc++] = "--lport";
+	argv[argc++] = lport;
+	argv[argc++] = "--rport";
+	argv[argc++] = dport;
+	argv[argc++] = "--backend";
+	argv[argc++] = opts.backend;
+	argv[argc++] = "--drain";
+	argv[argc++] = "1";
+	argv[argc++] = "--log-level";
+	argv[argc++] = "error";
+	for (i = 0; i < opts.ntap_args; i++) {
+		argv[argc++] = opts.tap_args[i];
+	}
+	argv[argc] = 0;
+
+	pid = fork();
+	if (pid < 0) {
+		return -1;
+	}
+	if (!pid) {
+		execv(opts.tap, argv);
+		fprintf(stderr, "can't run %s: %d\n", opts.tap, errno);
+		_exit(127);
+	}
+	deadline = now() + (BENCH_START_MS / 1e3);
+	while (now() < deadline) {
+		sock = sock_op_do("127.0.0.1", BENCH_TAP_PORT, &saddr,
+				SOCK_OP_CONN);
+		if (sock >= 0) {
+			close(sock);
+			return pid;
+		}
+		if (waitpid(pid, 0, WNOHANG) == pid) {
+			return -1;
+		}
+		usleep(10000);
+	}
+	kill(pid, SIGKILL);
+	waitpid(pid, 0, 0);
+	return -1;
+}
+
+static int
+tap_stop(pid_t pid)
+{
+	int status;
+
+	kill(pid, SIGTERM);
+	if (waitpid(pid, &status, 0) != pid) {
+		return -1;
+	}
+	return (WIFEXITED(status) && !WEXITSTATUS(status)) ? 0 : -1;
+}
+
+static int
+client_connect(short port)
+{
+	struct sockaddr_in saddr;
+	int sock;
+
+	sock = sock_op_do("127.0.0.1", port, &saddr, SOCK_OP_CONN);
+	if (sock >= 0) {
+		nodelay(sock);
+	}
+	return sock;
+}
+
+/* Send message and wait for all of it to come back */
+static int
+client_echo(int sock, unsigned char *msg, unsigned char *buf)
+{
+	size_t got;
+	ssize_t stat;
+
+	if (send(sock, msg, opts.msg, MSG_NOSIGNAL) != (ssize_t)opts.msg) {
+		return -1;
+	}
+	for (got = 0; got < opts.msg; got += (size_t)stat) {
+		stat = recv(sock, &buf[got], opts.msg - got, 0);
+		if (stat <= 0) {
+			return -1;
+		}
+	}
+	return memcmp(msg, buf, opts.msg) ? -1 : 0;
+}
+
+static void *
+client_throughput(void *arg)
+{
+	unsigned char buf[BENCH_CHUNK];
+	struct client *c;
+	ssize_t stat;
+	int sock;
+
+	c = (struct client *)arg;
+	memset(buf, 'A', sizeof(buf));
+	sock = client_connect(c->port);
+	if (sock < 0) {
+		c->failed = 1;
+		return 0;
+	}
+	while (!clients_stop) {
+		stat = send(sock, buf, sizeof(buf), MSG_NOSIGNAL);
+		if (stat <= 0) {
+			c->failed = 1;
+			break;
+		}
+	}
+	close(sock);
+	return 0;
+}
+
+static void *
+client_connrate(void *arg)
+{
+	unsigned char msg[BENCH_MSG_MAX];
+	unsigned char buf[BENCH_MSG_MAX];
+	struct client *c;
+	uint64_t start;
+	int sock;
+
+	c = (struct client *)arg;
+	memset(msg, 'A', opts.msg);
+	while (!clients_stop) {
+		start = now_ns();
+		sock = client_connect(c->port);
+		if (sock < 0) {
+			c->failed = 1;
+			break;
+		}
+		if (client_echo(sock, msg, buf) < 0) {
+			c->failed = 1;
+			close(sock);
+			break;
+		}
+		close(sock);
+		if (samples_add(&c->lat, now_ns() - start) < 0) {
+			break;
+		}
+		c->ops++;
+	}
+	return 0;
+}
+
+static void *
+client_pingpong(void *arg)
+{
+	unsigned char msg[BENCH_MSG_MAX];
+	unsigned char buf[BENCH_MSG_MAX];
+	struct client *c;
+	uint64_t start;
+	int sock;
+
+	c = (struct client *)arg;
+	memset(msg, 'A', opts.msg);
+	sock = client_connect(c->port);
+	if (sock < 0) {
+		c->failed = 1;
+		return 0;
+	}
+	while (!clients_stop) {
+		start = now_ns();
+		if (client_echo(sock, msg, buf) < 0) {
+			c->failed = 1;
+			break;
+		}
+		if (samples_add(&c->lat, now_ns() - start) < 0) {
+			break;
+		}
+		c->ops++;
+	}
+	close(sock);
+	return 0;
+}
+
+/*
+ * Run nclients of fn against port for opts.secs, merge their latencies
+ * into all. Returns seconds run or -1 if a client failed.
+ */
+static double
+run_clients(void *(*fn)(void *), short port, int nclients,
+		struct samples *all, uint64_t *ops)
+{
+	struct client *c;
+	double start;
+	double secs;
+	int failed;
+	int i;
+
+	c = (struct client *)calloc((size_t)nclients, sizeof(*c));
+	if (!c) {
+		return -1;
+	}
+	clients_stop = 0;
+	start = now();
+	for (i = 0; i < nclients; i++) {
+		c[i].port = port;
+		pthread_create(&c[i].thread, 0, fn, &c[i]);
+	}
+	usleep((useconds_t)(opts.secs * 1e6));
+	clients_stop = 1;
+	secs = now() - start;
+
+	failed = 0;
+	*ops = 0;
+	for (i = 0; i < nclients; i++) {
+		pthread_join(c[i].thread, 0);
+		failed |= c[i].failed;
+		*ops += c[i].ops;
+		if (all && c[i].lat.n && !failed) {
+			all->v = (uint64_t *)realloc(all->v, (all->n +
+					c[i].lat.n) * sizeof(uint64_t));
+			if (all->v) {
+				memcpy(&all->v[all->n], c[i].lat.v,
+						c[i].lat.n * sizeof(uint64_t));
+				all->n += c[i].lat.n;
+			}
+		}
+		free(c[i].lat.v);
+	}
+	free(c);
+	if (all) {
+		if (!all->v) {
+			return -1;
+		}
+		qsort(all->v, all->n, sizeof(uint64_t), cmp_u64);
+	}
+	return failed ? -1 : secs;
+}
+
+static int
+bench_throughput(char *target, short port)
+{
+	uint64_t before;
+	uint64_t ops;
+	double secs;
+
+	before = __atomic_load_n(&be.sunk, __ATOMIC_RELAXED);
+	secs = run_clients(&client_throughput, port, 1, 0, &ops);
+	if (secs < 0) {
+		fprintf(stderr, "throughput client failed against %s\n",
+				target);
+		return -1;
+	}
+	printf("scenario=throughput target=%s backend=%s conns=1 "
+			"mb_per_s=%.1f\n", target, port == BENCH_TAP_PORT ?
+			opts.backend : "-",
+			(double)(__atomic_load_n(&be.sunk, __ATOMIC_RELAXED) -
+			before) / secs / (1024.0 * 1024.0));
+	return 0;
+}
+
+static int
+bench_latency(char *scenario, void *(*fn)(void *), char *target,
+		short port)
+{
+	struct samples all;
+	uint64_t ops;
+	double secs;
+
+	memset(&all, 0, sizeof(all));
+	secs = run_clients(fn, port, opts.conns, &all, &ops);
+	if (secs < 0) {
+		fprintf(stderr, "%s client failed against %s\n", scenario,
+				target);
+		free(all.v);
+		return -1;
+	}
+	printf("scenario=%s target=%s backend=%s conns=%d msg=%zu "
+			"ops_per_s=%.1f p50_us=%.1f p99_us=%.1f "
+			"p999_us=%.1f\n", scenario, target,
+			port == BENCH_TAP_PORT ? opts.backend : "-",
+			opts.conns, opts.msg, (double)ops / secs,
+			samples_permille(&all, 500),
+			samples_permille(&all, 990),
+			samples_permille(&all, 999));
+	free(all.v);
+	return 0;
+}
+
+/* Run every scenario against tap in front of backend port, then direct */
+static int
+bench_target(int tap, short rport)
+{
+	char *target;
+	short port;
+	pid_t pid;
+	int stat;
+
+	pid = 0;
+	target = "direct";
+	port = rport;
+	if (tap) {
+		pid = tap_start(rport);
+		if (pid < 0) {
+			fprintf(stderr, "%s didn't start\n", opts.tap);
+			return -1;
+		}
+		target = "tap";
+		port = BENCH_TAP_PORT;
+	}
+	if (rport == BENCH_SINK_PORT) {
+		stat = bench_throughput(target, port);
+	} else {
+		stat = bench_latency("connrate", &client_connrate, target,
+				port);
+		if (!stat) {
+			stat = bench_latency("pingpong", &client_pingpong,
+					target, port);
+		}
+	}
+	if (tap && (tap_stop(pid) < 0)) {
+		fprintf(stderr, "%s didn't exit cleanly\n", opts.tap);
+		stat = -1;
+	}
+	return stat;
+}
+
+int
+main(int argc, char **argv)
+{
+	int stat;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "b:c:m:s:t:")) != -1) {
+		switch (opt) {
+		case ('b'):
+			opts.backend = optarg;
+			break;
+		case ('c'):
+			opts.conns = atoi(optarg);
+			break;
+		case ('m'):
+			opts.msg = (size_t)strtoul(optarg, 0, 0);
+			break;
+		case ('s'):
+			opts.secs = atof(optarg);
+			break;
+		case ('t'):
+			opts.tap = optarg;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-b epoll|uring] [-c conns] "
+					"[-m message size] [-s seconds] "
+					"[-t tap binary] [-- tap args]\n",
+					argv[0]);
+			return -1;
+		}
+	}
+	opts.tap_args = &argv[optind];
+	opts.ntap_args = argc - optind;
+	if ((opts.conns < 1) || (opts.conns > BENCH_CONNS_MAX)) {
+		fprintf(stderr, "conns must be 1 to %d\n", BENCH_CONNS_MAX);
+		return -1;
+	}
+	if (!opts.msg || (opts.msg > BENCH_MSG_MAX)) {
+		fprintf(stderr, "message size must be 1 to %d\n",
+				BENCH_MSG_MAX);
+		return -1;
+	}
+	if (opts.ntap_args > BENCH_TAP_ARGS) {
+		fprintf(stderr, "too many tap arguments\n");
+		return -1;
+	}
+	if (be_start() < 0) {
+		return -1;
+	}
+	stat = bench_target(1, BENCH_SINK_PORT);
+	if (!stat) {
+		stat = bench_target(0, BENCH_SINK_PORT);
+	}
+	if (!stat) {
+		stat = bench_target(1, BENCH_ECHO_PORT);
+	}
+	if (!stat) {
+		stat = bench_target(0, BENCH_ECHO_PORT);
+	}
+	be_stop();
+	return stat;
+}
@@ -0,0 +1,200 @@
+/*
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2022, k4m1
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIA LDAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVE RCAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * findseq() benchmark. Searches a needle placed at the end of random
+ * text with each kernel, and reports GB/s per needle length.
+ */
+#include <sys/types.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+
+#include <findseq.h>
+#include <intercept_helpers.h>
+
+struct bench_kernel {
+	char *name;
+	findseq_fn fn;
+	size_t max_wlen; 	/* longest needle kernel handles */
+};
+
+struct bench_opts {
+	size_t dlen;
+	size_t bytes; 		/* how much to search per needle & kernel */
+	int alphabet; 		/* how many different bytes text has */
+};
+
+static struct bench_opts opts = { 64 * 1024, 256 * 1024 * 1024, 16 };
+
+static size_t wlens[] = { 2, 4, 8, 16, 32, 64, 128, 256 };
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + ((double)ts.tv_nsec / 1e9);
+}
+
+/* What findseq() did before, memcmp() at every offset */
+static void *
+findseq_naive(void *data, void *what, size_t dlen, size_t wlen)
+{
+	unsigned char *d;
+	size_t off;
+
+	d = (unsigned char *)data;
+	for (off = 0; off + wlen <= dlen; off++) {
+		if (!memcmp(&d[off], what, wlen)) {
+			return &d[off];
+		}
+	}
+	return 0;
+}
+
+/*
+ * Text has an alphabet of 16 letters by default so first & last byte
+ * filters match every now and then like they'd do with real protocols.
+ */
+static void
+fill(unsigned char *data, unsigned char *what, size_t wlen)
+{
+	size_t i;
+
+	for (i = 0; i < opts.dlen; i++) {
+		data[i] = (unsigned char)('a' + (rand() % opts.alphabet));
+	}
+	for (i = 0; i < wlen; i++) {
+		what[i] = (unsigned char)('a' + (rand() % opts.alphabet));
+	}
+	/* Only the copy at the end must be found */
+	while (findseq_naive(data, what, opts.dlen - wlen, wlen)) {
+		data[rand() % (opts.dlen - wlen)] = (unsigned char)('a' + opts.alphabet);
+	}
+	memcpy(&data[opts.dlen - wlen], what, wlen);
+}
+
+static int
+bench_kernel(struct bench_kernel *k, unsigned char *data,
+		unsigned char *what, size_t wlen)
+{
+	unsigned char *found;
+	double start;
+	double secs;
+	size_t rounds;
+	size_t i;
+
+	rounds = opts.bytes / opts.dlen;
+	start = now();
+	for (i = 0; i < rounds; i++) {
+		found = (unsigned char *)k->fn(data, what, opts.dlen, wlen);
+		if (found != &data[opts.dlen - wlen]) {
+			fprintf(stderr, "%s found wrong match with wlen %zu\n",
+					k->name, wlen);
+			return -1;
+		}
+	}
+	secs = now() - start;
+	printf("kernel=%s wlen=%zu dlen=%zu gb_per_s=%.2f\n", k->name, wlen,
+			opts.dlen, ((double)rounds * opts.dlen) / secs / 1e9);
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct bench_kernel kernels[] = {
+		{ "naive", &findseq_naive, (size_t)-1 },
+		{ "generic", findseq_kernel(FINDSEQ_GENERIC), FINDSEQ_SHORT_MAX },
+		{ "sse2", findseq_kernel(FINDSEQ_SSE2), FINDSEQ_SHORT_MAX },
+		{ "avx2", findseq_kernel(FINDSEQ_AVX2), FINDSEQ_SHORT_MAX },
+		{ "horspool", &findseq_horspool, (size_t)-1 },
+		{ "findseq", &findseq, (size_t)-1 },
+	};
+	unsigned char *data;
+	unsigned char what[256];
+	size_t i;
+	size_t j;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "a:d:m:")) != -1) {
+		switch (opt) {
+		case ('a'):
+			opts.alphabet = atoi(optarg);
+			break;
+		case ('d'):
+			opts.dlen = (size_t)strtoul(optarg, 0, 0);
+			break;
+		case ('m'):
+			opts.bytes = (size_t)strtoul(optarg, 0, 0) * 1024 * 1024;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-a alphabet size] [-d data "
+					"size] [-m MB per run]\n", argv[0]);
+			return -1;
+		}
+	}
+	if ((opts.alphabet < 1) || (opts.alphabet > 255 - 'a')) {
+		fprintf(stderr, "alphabet size must be 1 to %d\n", 254 - 'a');
+		return -1;
+	}
+	if (opts.dlen < 2 * sizeof(what)) {
+		fprintf(stderr, "data size must be at least %zu\n",
+				2 * sizeof(what));
+		return -1;
+	}
+	data = (unsigned char *)malloc(opts.dlen);
+	if (!data) {
+		return -1;
+	}
+	srand(1337);
+	for (i = 0; i < sizeof(wlens) / sizeof(wlens[0]); i++) {
+		fill(data, what, wlens[i]);
+		for (j = 0; j < sizeof(kernels) / sizeof(kernels[0]); j++) {
+			/* Kernels cpu can't run are 0 */
+			if (!kernels[j].fn || (wlens[i] > kernels[j].max_wlen)) {
+				continue;
+			}
+			if (bench_kernel(&kernels[j], data, what, wlens[i]) < 0) {
+				free(data);
+				return -1;
+			}
+		}
+	}
+	free(data);
+	return 0;
+}
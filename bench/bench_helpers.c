@@ -0,0 +1,259 @@
+/*
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2022, k4m1
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIA LDAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVE RCAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Intercept helper benchmark. Runs findseq(), replace_str_of_equal_size(),
+ * replace_str_with_pad() and shift_bytes() over random text of each size
+ * with a needle planted every N bytes, and reports GB/s & ns per call.
+ * Equal-size replacing flips the needle back & forth so data needs no
+ * restoring, replacing with pad copies pristine data back before every
+ * call, so op=copy is printed as the baseline for those.
+ */
+#include <sys/types.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+
+#include <intercept_helpers.h>
+
+#define BENCH_WLEN 8
+
+enum bench_op {
+	OP_FINDSEQ,
+	OP_REPLACE_EQUAL,
+	OP_REPLACE_PAD_HERE,
+	OP_REPLACE_PAD_END,
+	OP_SHIFT,
+	OP_COPY,
+};
+
+static char *op_names[] = {
+	"findseq",
+	"replace_equal",
+	"replace_pad_here",
+	"replace_pad_end",
+	"shift_left",
+	"copy",
+};
+
+struct bench_opts {
+	double secs; 		/* how long to run each case */
+	int alphabet;
+};
+
+static struct bench_opts opts = { 0.1, 16 };
+
+static size_t dlens[] = { 256, 4096, 65536, 1048576 };
+
+/* Needle every N bytes, 0 for none */
+static size_t everys[] = { 0, 4096, 512, 64 };
+
+static unsigned char what[BENCH_WLEN] = "NEEDLE01";
+static unsigned char with[BENCH_WLEN] = "HAYSTK02";
+static unsigned char shorter[BENCH_WLEN] = "SHORT";
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + ((double)ts.tv_nsec / 1e9);
+}
+
+/* Text is lowercase so needles never match by accident */
+static size_t
+fill(unsigned char *data, size_t dlen, size_t every)
+{
+	size_t hits;
+	size_t i;
+
+	for (i = 0; i < dlen; i++) {
+		data[i] = (unsigned char)('a' + (rand() % opts.alphabet));
+	}
+	hits = 0;
+	for (i = every; every && (i + BENCH_WLEN <= dlen); i += every) {
+		memcpy(&data[i - BENCH_WLEN / 2], what, BENCH_WLEN);
+		hits++;
+	}
+	return hits;
+}
+
+/* Count every needle like replacing does, without touching data */
+static size_t
+find_all(unsigned char *data, size_t dlen)
+{
+	unsigned char *where;
+	size_t off;
+	size_t cnt;
+
+	cnt = 0;
+	for (off = 0; off < dlen; off = (size_t)(where - data) + BENCH_WLEN) {
+		where = (unsigned char *)findseq(&data[off], what, dlen - off,
+				BENCH_WLEN);
+		if (!where) {
+			break;
+		}
+		cnt++;
+	}
+	return cnt;
+}
+
+static size_t
+run_once(enum bench_op op, unsigned char *data, unsigned char *pristine,
+		size_t dlen, size_t calls)
+{
+	switch (op) {
+	case (OP_FINDSEQ):
+		return find_all(data, dlen);
+	case (OP_REPLACE_EQUAL):
+		/* Every other call puts needles back */
+		if (calls & 1) {
+			replace_str_of_equal_size(data, dlen, BENCH_WLEN,
+					with, what);
+		} else {
+			replace_str_of_equal_size(data, dlen, BENCH_WLEN,
+					what, with);
+		}
+		break;
+	case (OP_REPLACE_PAD_HERE):
+		memcpy(data, pristine, dlen);
+		replace_str_with_pad(data, dlen, BENCH_WLEN,
+				strlen((char *)shorter), what, shorter, ' ',
+				PAD_HERE);
+		break;
+	case (OP_REPLACE_PAD_END):
+		memcpy(data, pristine, dlen);
+		replace_str_with_pad(data, dlen, BENCH_WLEN,
+				strlen((char *)shorter), what, shorter, ' ',
+				!PAD_HERE);
+		break;
+	case (OP_SHIFT):
+		shift_bytes(data, dlen - 1, 0, SHIFT_LEFT);
+		break;
+	case (OP_COPY):
+		memcpy(data, pristine, dlen);
+		break;
+	}
+	return 0;
+}
+
+static int
+bench_case(enum bench_op op, unsigned char *data, unsigned char *pristine,
+		size_t dlen, size_t every)
+{
+	size_t hits;
+	size_t calls;
+	double start;
+	double secs;
+
+	hits = fill(pristine, dlen, every);
+	memcpy(data, pristine, dlen);
+	if ((op == OP_FINDSEQ) && (find_all(data, dlen) != hits)) {
+		fprintf(stderr, "findseq found %zu needles of %zu with "
+				"dlen %zu\n", find_all(data, dlen), hits, dlen);
+		return -1;
+	}
+	calls = 0;
+	start = now();
+	do {
+		run_once(op, data, pristine, dlen, calls++);
+		secs = now() - start;
+	} while (secs < opts.secs);
+	printf("op=%s dlen=%zu every=%zu hits=%zu gb_per_s=%.3f "
+			"call_ns=%.1f\n", op_names[op], dlen, every, hits,
+			((double)calls * dlen) / secs / 1e9,
+			secs * 1e9 / (double)calls);
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	unsigned char *pristine;
+	unsigned char *data;
+	size_t max;
+	size_t i;
+	size_t j;
+	int op;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "a:t:")) != -1) {
+		switch (opt) {
+		case ('a'):
+			opts.alphabet = atoi(optarg);
+			break;
+		case ('t'):
+			opts.secs = atof(optarg) / 1e3;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-a alphabet size] "
+					"[-t ms per case]\n", argv[0]);
+			return -1;
+		}
+	}
+	if ((opts.alphabet < 1) || (opts.alphabet > 26)) {
+		fprintf(stderr, "alphabet size must be 1 to 26\n");
+		return -1;
+	}
+	max = dlens[sizeof(dlens) / sizeof(dlens[0]) - 1];
+	data = (unsigned char *)malloc(max);
+	pristine = (unsigned char *)malloc(max);
+	if (!data || !pristine) {
+		free(data);
+		free(pristine);
+		return -1;
+	}
+	srand(1337);
+	for (op = OP_FINDSEQ; op <= OP_COPY; op++) {
+		for (i = 0; i < sizeof(dlens) / sizeof(dlens[0]); i++) {
+			for (j = 0; j < sizeof(everys) / sizeof(everys[0]); j++) {
+				/* Neither cares about needles */
+				if (((op == OP_SHIFT) || (op == OP_COPY)) && j) {
+					break;
+				}
+				if (bench_case((enum bench_op)op, data, pristine,
+						dlens[i], everys[j]) < 0) {
+					free(data);
+					free(pristine);
+					return -1;
+				}
+			}
+		}
+	}
+	free(data);
+	free(pristine);
+	return 0;
+}
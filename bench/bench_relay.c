@@ -0,0 +1,328 @@
+/*
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2022, k4m1
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIA LDAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVE RCAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Relay benchmark. Pushes data through an in-process event loop to a
+ * local sink, and reports throughput & syscalls per MB for each backend,
+ * for epoll with splice() passthrough, and for both backends again with
+ * capture to pcapng on. Capture files go to a temporary directory under
+ * -C DIR, /tmp by default, and are removed afterwards.
+ */
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+
+#include <capture.h>
+#include <net_io.h>
+#include <event_loop.h>
+#include <log.h>
+
+#define BENCH_LPORT 21337
+#define BENCH_DPORT 21338
+#define BENCH_CHUNK 65536
+
+struct bench_opts {
+	size_t tx_size;
+	int conns;
+	size_t bytes; 		/* per connection */
+	char *capture_dir;
+};
+
+static struct bench_opts opts = { 16384, 8, 256 * 1024 * 1024, "/tmp" };
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + ((double)ts.tv_nsec / 1e9);
+}
+
+/* Read until peer is done, then close */
+static void *
+sink_conn(void *arg)
+{
+	unsigned char buf[BENCH_CHUNK];
+	int sock;
+
+	sock = (int)(long)arg;
+	while (recv(sock, buf, sizeof(buf), 0) > 0);
+	close(sock);
+	return 0;
+}
+
+static void *
+sink_main(void *arg)
+{
+	pthread_t t;
+	int lsock;
+	int sock;
+	int i;
+
+	lsock = (int)(long)arg;
+	for (i = 0; i < opts.conns; i++) {
+		sock = accept(lsock, 0, 0);
+		if (sock < 0) {
+			break;
+		}
+		pthread_create(&t, 0, sink_conn, (void *)(long)sock);
+		pthread_detach(t);
+	}
+	return 0;
+}
+
+static void *
+client_main(void *arg)
+{
+	unsigned char buf[BENCH_CHUNK];
+	struct sockaddr_in saddr;
+	size_t left;
+	ssize_t stat;
+	int sock;
+
+	(void)arg;
+	memset(buf, 'A', sizeof(buf));
+	sock = sock_op_do("127.0.0.1", BENCH_LPORT, &saddr, SOCK_OP_CONN);
+	if (sock < 0) {
+		fprintf(stderr, "connect failed: %d\n", errno);
+		return 0;
+	}
+	for (left = opts.bytes; left; left -= (size_t)stat) {
+		stat = send(sock, buf, (left < sizeof(buf)) ? left : sizeof(buf),
+				MSG_NOSIGNAL);
+		if (stat <= 0) {
+			break;
+		}
+	}
+	shutdown(sock, SHUT_WR);
+	/* Wait for tap to close once sink is done */
+	while (recv(sock, buf, sizeof(buf), 0) > 0);
+	close(sock);
+	return 0;
+}
+
+static void *
+loop_main(void *arg)
+{
+	ev_loop_run((struct event_loop *)arg);
+	return 0;
+}
+
+/*
+ * Remove temporary capture directory and files in it
+ */
+static void
+capture_cleanup(char *dir)
+{
+	char path[4096];
+	struct dirent *e;
+	DIR *d;
+
+	d = opendir(dir);
+	if (!d) {
+		return;
+	}
+	while ((e = readdir(d))) {
+		if (e->d_name[0] != '.') {
+			snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+			unlink(path);
+		}
+	}
+	closedir(d);
+	rmdir(dir);
+}
+
+static int
+bench_backend(int backend, int splice, int capture)
+{
+	struct sockaddr_in saddr;
+	struct event_loop loop;
+	struct relay_cfg cfg;
+	struct capture cap;
+	char dir[4096];
+	char prefix[4096];
+	pthread_t *clients;
+	pthread_t loop_thread;
+	pthread_t sink_thread;
+	double start;
+	double secs;
+	double mb;
+	int sink_sock;
+	int lsock;
+	int i;
+
+	sink_sock = sock_op_do("127.0.0.1", BENCH_DPORT, &saddr, SOCK_OP_BIND);
+	if ((sink_sock < 0) || (listen(sink_sock, SOMAXCONN) < 0)) {
+		fprintf(stderr, "sink bind failed: %d\n", errno);
+		return -1;
+	}
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.addrout = "127.0.0.1";
+	cfg.dport = BENCH_DPORT;
+	cfg.tx_size = opts.tx_size;
+	cfg.cb = 0;
+	cfg.backend = backend;
+	cfg.splice = splice;
+	memset(&cap, 0, sizeof(cap));
+	if (capture) {
+		if (snprintf(dir, sizeof(dir), "%s/tap_bench_XXXXXX", 
+				opts.capture_dir) >= (int)sizeof(dir)) {
+			fprintf(stderr, "Capture dir is too long\n");
+			close(sink_sock);
+			return -1;
+		}
+		if (!mkdtemp(dir)) {
+			fprintf(stderr, "mkdtemp failed: %d\n", errno);
+			close(sink_sock);
+			return -1;
+		}
+		if (snprintf(prefix, sizeof(prefix), "%s/relay", 
+					dir) >= (int)sizeof(prefix)) {
+			fprintf(stderr, "Capture dir is too long\n");
+			capture_cleanup(dir);
+			close(sink_sock);
+			return -1;
+		}
+		if ((capture_init(&cap, prefix, 0, 0, 1) < 0) ||
+				(capture_start(&cap) < 0)) {
+			capture_destroy(&cap);
+			capture_cleanup(dir);
+			close(sink_sock);
+			return -1;
+		}
+		cfg.capture = &cap.w[0];
+	}
+	if (ev_loop_init(&loop, &cfg) < 0) {
+		close(sink_sock);
+		return -1;
+	}
+	lsock = sock_op_do("127.0.0.1", BENCH_LPORT, &saddr, SOCK_OP_BIND);
+	if ((lsock < 0) || (listen(lsock, SOMAXCONN) < 0) ||
+			(ev_loop_add_listener(&loop, lsock) < 0)) {
+		fprintf(stderr, "listener failed: %d\n", errno);
+		close(sink_sock);
+		ev_loop_destroy(&loop);
+		return -1;
+	}
+	clients = (pthread_t *)calloc(opts.conns, sizeof(*clients));
+	pthread_create(&sink_thread, 0, sink_main, (void *)(long)sink_sock);
+	pthread_create(&loop_thread, 0, loop_main, &loop);
+
+	start = now();
+	for (i = 0; i < opts.conns; i++) {
+		pthread_create(&clients[i], 0, client_main, 0);
+	}
+	for (i = 0; i < opts.conns; i++) {
+		pthread_join(clients[i], 0);
+	}
+	secs = now() - start;
+
+	ev_loop_stop(&loop, EV_STOP_NOW);
+	pthread_join(loop_thread, 0);
+	pthread_join(sink_thread, 0);
+
+	mb = (double)loop.nbytes / (1024.0 * 1024.0);
+	printf("backend=%s%s ws=%zu conns=%d mb=%.1f seconds=%.3f "
+		"mb_per_s=%.1f syscalls=%lu syscalls_per_mb=%.1f",
+		(loop.backend == BACKEND_URING) ? "uring" : 
+		(splice ? "epoll-splice" : "epoll"), 
+		capture ? "-capture" : "",
+		opts.tx_size, opts.conns, mb, secs, mb / secs, loop.nsyscalls,
+		(double)loop.nsyscalls / mb);
+
+	ev_loop_destroy(&loop);
+	if (capture) {
+		printf(" captured_mb=%.1f dropped=%llu", 
+				(double)cap.w[0].bytes / (1024.0 * 1024.0),
+				(unsigned long long)cap.w[0].dropped);
+		capture_destroy(&cap);
+		capture_cleanup(dir);
+	}
+	printf("\n");
+	close(sink_sock);
+	free(clients);
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	int opt;
+
+	while ((opt = getopt(argc, argv, "s:c:m:C:")) != -1) {
+		switch (opt) {
+		case ('s'):
+			opts.tx_size = (size_t)strtoul(optarg, 0, 0);
+			break;
+		case ('c'):
+			opts.conns = atoi(optarg);
+			break;
+		case ('m'):
+			opts.bytes = (size_t)strtoul(optarg, 0, 0) * 1024 * 1024;
+			break;
+		case ('C'):
+			opts.capture_dir = optarg;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-s ws] [-c conns] [-m MB "
+					"per conn] [-C capture dir]\n", argv[0]);
+			return -1;
+		}
+	}
+	/* Keep disconnects out of the results */
+	log_set_level(LOG_LVL_ERR);
+	if (bench_backend(BACKEND_EPOLL, 0, 0) < 0) {
+		return -1;
+	}
+	if (bench_backend(BACKEND_EPOLL, 1, 0) < 0) {
+		return -1;
+	}
+	if (bench_backend(BACKEND_URING, 0, 0) < 0) {
+		return -1;
+	}
+	if (bench_backend(BACKEND_EPOLL, 0, 1) < 0) {
+		return -1;
+	}
+	if (bench_backend(BACKEND_URING, 0, 1) < 0) {
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,209 @@
+/*
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2022, k4m1
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIA LDAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVE RCAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Ruleset load benchmark. Writes a ruleset of 10k random rules to a
+ * temporary file and reports how long loading and compiling it takes.
+ */
+#include <sys/types.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+
+#include <intercept_parser.h>
+#include <stream_match.h>
+
+#define BENCH_PLEN_MIN 6
+#define BENCH_PLEN_MAX 16
+
+struct bench_opts {
+	uint32_t nrules;
+	int runs; 		/* loads to take best of */
+};
+
+static struct bench_opts opts = { 10000, 5 };
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + ((double)ts.tv_nsec / 1e9);
+}
+
+static void
+put_text(FILE *f, size_t len)
+{
+	size_t i;
+
+	fputc('"', f);
+	for (i = 0; i < len; i++) {
+		fputc('a' + (rand() % 26), f);
+	}
+	fputc('"', f);
+}
+
+static void
+put_hex(FILE *f, size_t len)
+{
+	size_t i;
+
+	fputc('"', f);
+	for (i = 0; i < len; i++) {
+		fprintf(f, "%02x", rand() & 0xff);
+	}
+	fputc('"', f);
+}
+
+/*
+ * Rules mix every kind of field: a quarter are hex, a third are limited
+ * to one direction, and some have a scope or a limit.
+ */
+static int
+write_rules(FILE *f)
+{
+	static const char *dirs[] = { "both", "c2u", "u2c" };
+	size_t len;
+	uint32_t i;
+
+	fprintf(f, "rules:\n");
+	for (i = 0; i < opts.nrules; i++) {
+		len = BENCH_PLEN_MIN +
+			(size_t)(rand() % (BENCH_PLEN_MAX - BENCH_PLEN_MIN + 1));
+		if (!(i % 4)) {
+			fprintf(f, "  - match_hex: ");
+			put_hex(f, len);
+			fprintf(f, "\n    replace_hex: ");
+			put_hex(f, (size_t)(rand() % BENCH_PLEN_MAX));
+		} else {
+			fprintf(f, "  - match: ");
+			put_text(f, len);
+			fprintf(f, "\n    replace: ");
+			put_text(f, (size_t)(rand() % BENCH_PLEN_MAX));
+		}
+		fprintf(f, "\n    direction: %s\n", dirs[i % 3]);
+		if (!(i % 5)) {
+			fprintf(f, "    scope:\n      offset: %d\n"
+					"      length: %d\n", rand() % 4096,
+					1 + rand() % 65536);
+		}
+		if (!(i % 7)) {
+			fprintf(f, "    limit: %d\n", 1 + rand() % 16);
+		}
+	}
+	return ferror(f) ? -1 : 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct stream_rules rules;
+	char path[] = "/tmp/tap_rulesXXXXXX";
+	double best;
+	double total;
+	double t;
+	long size;
+	FILE *f;
+	int stat;
+	int opt;
+	int fd;
+	int i;
+
+	while ((opt = getopt(argc, argv, "n:r:")) != -1) {
+		switch (opt) {
+		case ('n'):
+			opts.nrules = (uint32_t)strtoul(optarg, 0, 0);
+			break;
+		case ('r'):
+			opts.runs = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-n rules] [-r runs]\n",
+					argv[0]);
+			return -1;
+		}
+	}
+	if (!opts.nrules || opts.runs <= 0) {
+		fprintf(stderr, "rules and runs must be more than 0\n");
+		return -1;
+	}
+	fd = mkstemp(path);
+	if (fd < 0) {
+		perror("mkstemp");
+		return -1;
+	}
+	f = fdopen(fd, "w");
+	if (!f) {
+		close(fd);
+		unlink(path);
+		return -1;
+	}
+	srand(1337);
+	stat = write_rules(f);
+	size = ftell(f);
+	if (fclose(f) || stat < 0) {
+		fprintf(stderr, "failed to write %s\n", path);
+		unlink(path);
+		return -1;
+	}
+
+	best = 0;
+	total = 0;
+	for (i = 0; i < opts.runs; i++) {
+		t = now();
+		stat = ruleset_load(&rules, path);
+		t = now() - t;
+		if (stat < 0) {
+			break;
+		}
+		if (!i || t < best) {
+			best = t;
+		}
+		total += t;
+		if (i == opts.runs - 1) {
+			printf("rules=%u yaml_kb=%ld c2u_states=%u "
+					"u2c_states=%u load_ms_best=%.3f "
+					"load_ms_avg=%.3f\n", rules.nrules,
+					size / 1024, rules.ac[0].nstates,
+					rules.ac[1].nstates, best * 1e3,
+					total * 1e3 / opts.runs);
+		}
+		stream_rules_free(&rules);
+	}
+	unlink(path);
+	return (stat < 0) ? -1 : 0;
+}
@@ -0,0 +1,779 @@
+/*
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2022, k4m1
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIA LDAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVE RCAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * TLS benchmark. Makes a throwaway certificate, starts a local TLS echo
+ * & sink backend with it, and runs bin/tap in front of it terminating
+ * and originating TLS with the same certificate. Measures handshakes
+ * per second, without and with session resumption, and throughput of
+ * encrypted data, against tap and against the backend directly.
+ * Arguments after -- are passed to tap, e.g. --no-ktls.
+ */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+
+#include <net_io.h>
+
+#define BENCH_TAP_PORT 	21447
+#define BENCH_ECHO_PORT	21448
+#define BENCH_SINK_PORT	21449
+#define BENCH_CHUNK 	16384
+#define BENCH_MSG_MAX 	4096
+#define BENCH_CONNS_MAX	256
+#define BENCH_START_MS 	3000
+#define BENCH_TAP_ARGS 	64
+
+struct bench_opts {
+	char *tap;
+	double secs; 		/* per scenario & target */
+	int conns;
+	size_t msg;
+	char **tap_args; 	/* after -- */
+	int ntap_args;
+};
+
+static struct bench_opts opts = { "./bin/tap", 1.0, 4, 64, 0, 0 };
+
+/* Latencies in ns of one client thread */
+struct samples {
+	uint64_t *v;
+	size_t n;
+	size_t cap;
+};
+
+struct client {
+	pthread_t thread;
+	short port;
+	int resume; 		/* offer session of previous connection */
+	struct samples lat;
+	uint64_t ops;
+	uint64_t resumed;
+	int failed;
+};
+
+struct backend {
+	SSL_CTX *ctx;
+	int lsock[2];
+	uint64_t sunk; 		/* bytes read by sink */
+	pthread_t thread[2];
+};
+
+/* Connection to backend, and which kind it is */
+struct be_conn {
+	int sock;
+	int sink;
+};
+
+static struct backend be;
+static SSL_CTX *client_ctx;
+static char pem_path[] = "/tmp/bench_tls.XXXXXX";
+static volatile int clients_stop;
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + ((double)ts.tv_nsec / 1e9);
+}
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL) + (uint64_t)ts.tv_nsec;
+}
+
+static int
+samples_add(struct samples *s, uint64_t v)
+{
+	uint64_t *n;
+	size_t cap;
+
+	if (s->n == s->cap) {
+		cap = s->cap ? (s->cap * 2) : 4096;
+		n = (uint64_t *)realloc(s->v, cap * sizeof(*n));
+		if (!n) {
+			return -1;
+		}
+		s->v = n;
+		s->cap = cap;
+	}
+	s->v[s->n++] = v;
+	return 0;
+}
+
+static int
+cmp_u64(const void *a, const void *b)
+{
+	uint64_t x;
+	uint64_t y;
+
+	x = *(const uint64_t *)a;
+	y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+/* Exact percentile in us, permille of 990 is p99 */
+static double
+samples_permille(struct samples *s, int pm)
+{
+	size_t i;
+
+	if (!s->n) {
+		return 0;
+	}
+	i = (s->n * (size_t)pm) / 1000;
+	if (i >= s->n) {
+		i = s->n - 1;
+	}
+	return (double)s->v[i] / 1e3;
+}
+
+static void
+nodelay(int sock)
+{
+	int one;
+
+	one = 1;
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+/*
+ * Write self-signed P-256 certificate & its key for localhost to
+ * pem_path, both in one file.
+ */
+static int
+cert_make(void)
+{
+	EVP_PKEY *key;
+	X509 *x;
+	FILE *f;
+	int fd;
+	int ret;
+
+	ret = -1;
+	fd = mkstemp(pem_path);
+	if (fd < 0) {
+		return -1;
+	}
+	f = fdopen(fd, "w");
+	key = EVP_EC_gen("P-256");
+	x = X509_new();
+	if (!f || !key || !x) {
+		goto out;
+	}
+	ASN1_INTEGER_set(X509_get_serialNumber(x), 1);
+	X509_gmtime_adj(X509_getm_notBefore(x), 0);
+	X509_gmtime_adj(X509_getm_notAfter(x), 86400);
+	X509_set_pubkey(x, key);
+	X509_NAME_add_entry_by_txt(X509_get_subject_name(x), "CN",
+			MBSTRING_ASC, (const unsigned char *)"localhost",
+			-1, -1, 0);
+	X509_set_issuer_name(x, X509_get_subject_name(x));
+	if (!X509_sign(x, key, EVP_sha256()) ||
+			!PEM_write_X509(f, x) ||
+			!PEM_write_PrivateKey(f, key, 0, 0, 0, 0, 0)) {
+		goto out;
+	}
+	ret = 0;
+out:
+	if (f) {
+		fclose(f);
+	} else {
+		close(fd);
+	}
+	X509_free(x);
+	EVP_PKEY_free(key);
+	return ret;
+}
+
+/* Serve one backend connection, echo or count what's read */
+static void *
+be_serve(void *arg)
+{
+	unsigned char buf[BENCH_CHUNK];
+	struct be_conn *bc;
+	size_t got;
+	SSL *ssl;
+
+	bc = (struct be_conn *)arg;
+	ssl = SSL_new(be.ctx);
+	if (!ssl || (SSL_set_fd(ssl, bc->sock) != 1) ||
+			(SSL_accept(ssl) != 1)) {
+		goto out;
+	}
+	while (SSL_read_ex(ssl, buf, sizeof(buf), &got) == 1) {
+		if (bc->sink) {
+			__atomic_fetch_add(&be.sunk, (uint64_t)got,
+					__ATOMIC_RELAXED);
+		} else if (SSL_write(ssl, buf, (int)got) <= 0) {
+			break;
+		}
+	}
+	SSL_shutdown(ssl);
+out:
+	SSL_free(ssl);
+	close(bc->sock);
+	free(bc);
+	ERR_clear_error();
+	return 0;
+}
+
+/* Accept until listener is shut down, a thread per connection */
+static void *
+be_accept(void *arg)
+{
+	struct be_conn *bc;
+	pthread_t thread;
+	int lsock;
+	int sink;
+	int sock;
+
+	sink = (int)(intptr_t)arg;
+	lsock = be.lsock[sink];
+	while ((sock = accept4(lsock, 0, 0, SOCK_CLOEXEC)) >= 0) {
+		bc = (struct be_conn *)malloc(sizeof(*bc));
+		if (!bc) {
+			close(sock);
+			continue;
+		}
+		nodelay(sock);
+		bc->sock = sock;
+		bc->sink = sink;
+		if (pthread_create(&thread, 0, be_serve, bc)) {
+			close(sock);
+			free(bc);
+			continue;
+		}
+		pthread_detach(thread);
+	}
+	return 0;
+}
+
+static int
+be_start(void)
+{
+	struct sockaddr_in saddr;
+	short ports[2] = { BENCH_ECHO_PORT, BENCH_SINK_PORT };
+	int i;
+
+	be.ctx = SSL_CTX_new(TLS_server_method());
+	if (!be.ctx ||
+		(SSL_CTX_use_certificate_chain_file(be.ctx, pem_path) != 1) ||
+		(SSL_CTX_use_PrivateKey_file(be.ctx, pem_path,
+			SSL_FILETYPE_PEM) != 1)) {
+		fprintf(stderr, "backend can't load certificate\n");
+		return -1;
+	}
+	for (i = 0; i < 2; i++) {
+		be.lsock[i] = sock_op_do("127.0.0.1", ports[i], &saddr,
+				SOCK_OP_BIND);
+		if ((be.lsock[i] < 0) || (listen(be.lsock[i], SOMAXCONN) < 0)) {
+			fprintf(stderr, "backend can't listen on %d: %d\n",
+					ports[i], errno);
+			return -1;
+		}
+		if (pthread_create(&be.thread[i], 0, be_accept,
+					(void *)(intptr_t)i)) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void
+be_stop(void)
+{
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		shutdown(be.lsock[i], SHUT_RDWR);
+		pthread_join(be.thread[i], 0);
+		close(be.lsock[i]);
+	}
+}
+
+/* Run tap in front of backend port, wait till it accepts connections */
+static pid_t
+tap_start(short rport)
+{
+	struct sockaddr_in saddr;
+	char lport[8];
+	char dport[8];
+	char *argv[BENCH_TAP_ARGS + 16];
+	double deadline;
+	pid_t pid;
+	int sock;
+	int argc;
+	int i;
+
+	snprintf(lport, sizeof(lport), "%d", BENCH_TAP_PORT);
+	snprintf(dport, sizeof(dport), "%d", rport);
+	argc = 0;
+	argv[argc++] = opts.tap;
+	argv[argc++] = "--lhost";
+	argv[argc++] = "127.0.0.1";
+	argv[argc++] = "--lport";
+	argv[argc++] = lport;
+	argv[argc++] = "--rport";
+	argv[argc++] = dport;
+	argv[argc++] = "--tls-cert";
+	argv[argc++] = pem_path;
+	argv[argc++] = "--tls-upstream";
+	argv[argc++] = "--drain";
+	argv[argc++] = "1";
+	argv[argc++] = "--log-level";
+	argv[argc++] = "error";
+	for (i = 0; i < opts.ntap_args; i++) {
+		argv[argc++] = opts.tap_args[i];
+	}
+	argv[argc] = 0;
+
+	pid = fork();
+	if (pid < 0) {
+		return -1;
+	}
+	if (!pid) {
+		execv(opts.tap, argv);
+		fprintf(stderr, "can't run %s: %d\n", opts.tap, errno);
+		_exit(127);
+	}
+	deadline = now() + (BENCH_START_MS / 1e3);
+	while (now() < deadline) {
+		sock = sock_op_do("127.0.0.1", BENCH_TAP_PORT, &saddr,
+				SOCK_OP_CONN);
+		if (sock >= 0) {
+			close(sock);
+			return pid;
+		}
+		if (waitpid(pid, 0, WNOHANG) == pid) {
+			return -1;
+		}
+		usleep(10000);
+	}
+	kill(pid, SIGKILL);
+	waitpid(pid, 0, 0);
+	return -1;
+}
+
+static int
+tap_stop(pid_t pid)
+{
+	int status;
+
+	kill(pid, SIGTERM);
+	if (waitpid(pid, &status, 0) != pid) {
+		return -1;
+	}
+	return (WIFEXITED(status) && !WEXITSTATUS(status)) ? 0 : -1;
+}
+
+/*
+ * Connect & handshake, offering sess if it's given
+ *
+ * Returns:
+ * 	SSL of connection, or 0 on error
+ */
+static SSL *
+client_connect(short port, SSL_SESSION *sess)
+{
+	struct sockaddr_in saddr;
+	SSL *ssl;
+	int sock;
+
+	sock = sock_op_do("127.0.0.1", port, &saddr, SOCK_OP_CONN);
+	if (sock < 0) {
+		return 0;
+	}
+	nodelay(sock);
+	ssl = SSL_new(client_ctx);
+	if (!ssl || (SSL_set_fd(ssl, sock) != 1)) {
+		SSL_free(ssl);
+		close(sock);
+		return 0;
+	}
+	if (sess) {
+		SSL_set_session(ssl, sess);
+	}
+	if (SSL_connect(ssl) != 1) {
+		SSL_free(ssl);
+		close(sock);
+		ERR_clear_error();
+		return 0;
+	}
+	return ssl;
+}
+
+static void
+client_close(SSL *ssl)
+{
+	int sock;
+
+	sock = SSL_get_fd(ssl);
+	SSL_shutdown(ssl);
+	SSL_free(ssl);
+	close(sock);
+}
+
+/* Send message and wait for all of it to come back */
+static int
+client_echo(SSL *ssl, unsigned char *msg, unsigned char *buf)
+{
+	size_t got;
+	size_t n;
+
+	if (SSL_write(ssl, msg, (int)opts.msg) != (int)opts.msg) {
+		return -1;
+	}
+	for (got = 0; got < opts.msg; got += n) {
+		if (SSL_read_ex(ssl, &buf[got], opts.msg - got, &n) != 1) {
+			return -1;
+		}
+	}
+	return memcmp(msg, buf, opts.msg) ? -1 : 0;
+}
+
+static void *
+client_throughput(void *arg)
+{
+	unsigned char buf[BENCH_CHUNK];
+	struct client *c;
+	SSL *ssl;
+
+	c = (struct client *)arg;
+	memset(buf, 'A', sizeof(buf));
+	ssl = client_connect(c->port, 0);
+	if (!ssl) {
+		c->failed = 1;
+		return 0;
+	}
+	while (!clients_stop) {
+		if (SSL_write(ssl, buf, sizeof(buf)) <= 0) {
+			c->failed = 1;
+			break;
+		}
+	}
+	client_close(ssl);
+	return 0;
+}
+
+/*
+ * Connect, handshake, echo a message and close, over and over. Session
+ * comes with the echo, as TLS 1.3 sends tickets after handshake.
+ */
+static void *
+client_handshake(void *arg)
+{
+	unsigned char msg[BENCH_MSG_MAX];
+	unsigned char buf[BENCH_MSG_MAX];
+	SSL_SESSION *sess;
+	struct client *c;
+	uint64_t start;
+	SSL *ssl;
+
+	c = (struct client *)arg;
+	memset(msg, 'A', opts.msg);
+	sess = 0;
+	while (!clients_stop) {
+		start = now_ns();
+		ssl = client_connect(c->port, sess);
+		if (!ssl) {
+			c->failed = 1;
+			break;
+		}
+		if (client_echo(ssl, msg, buf) < 0) {
+			c->failed = 1;
+			client_close(ssl);
+			break;
+		}
+		c->resumed += (uint64_t)SSL_session_reused(ssl);
+		if (c->resume) {
+			if (sess) {
+				SSL_SESSION_free(sess);
+			}
+			sess = SSL_get1_session(ssl);
+		}
+		client_close(ssl);
+		if (samples_add(&c->lat, now_ns() - start) < 0) {
+			break;
+		}
+		c->ops++;
+	}
+	if (sess) {
+		SSL_SESSION_free(sess);
+	}
+	return 0;
+}
+
+/*
+ * Run nclients of fn against port for opts.secs, merge their latencies
+ * into all. Returns seconds run or -1 if a client failed.
+ */
+static double
+run_clients(void *(*fn)(void *), short port, int nclients, int resume,
+		struct samples *all, uint64_t *ops, uint64_t *resumed)
+{
+	struct client *c;
+	double start;
+	double secs;
+	int failed;
+	int i;
+
+	c = (struct client *)calloc((size_t)nclients, sizeof(*c));
+	if (!c) {
+		return -1;
+	}
+	clients_stop = 0;
+	start = now();
+	for (i = 0; i < nclients; i++) {
+		c[i].port = port;
+		c[i].resume = resume;
+		pthread_create(&c[i].thread, 0, fn, &c[i]);
+	}
+	usleep((useconds_t)(opts.secs * 1e6));
+	clients_stop = 1;
+	secs = now() - start;
+
+	failed = 0;
+	*ops = 0;
+	*resumed = 0;
+	for (i = 0; i < nclients; i++) {
+		pthread_join(c[i].thread, 0);
+		failed |= c[i].failed;
+		*ops += c[i].ops;
+		*resumed += c[i].resumed;
+		if (all && c[i].lat.n && !failed) {
+			all->v = (uint64_t *)realloc(all->v, (all->n +
+					c[i].lat.n) * sizeof(uint64_t));
+			if (all->v) {
+				memcpy(&all->v[all->n], c[i].lat.v,
+						c[i].lat.n * sizeof(uint64_t));
+				all->n += c[i].lat.n;
+			}
+		}
+		free(c[i].lat.v);
+	}
+	free(c);
+	if (all) {
+		if (!all->v) {
+			return -1;
+		}
+		qsort(all->v, all->n, sizeof(uint64_t), cmp_u64);
+	}
+	return failed ? -1 : secs;
+}
+
+static int
+bench_throughput(char *target, short port)
+{
+	uint64_t resumed;
+	uint64_t before;
+	uint64_t ops;
+	double secs;
+
+	before = __atomic_load_n(&be.sunk, __ATOMIC_RELAXED);
+	secs = run_clients(&client_throughput, port, 1, 0, 0, &ops,
+			&resumed);
+	if (secs < 0) {
+		fprintf(stderr, "throughput client failed against %s\n",
+				target);
+		return -1;
+	}
+	printf("scenario=tls_throughput target=%s conns=1 "
+			"mb_per_s=%.1f\n", target,
+			(double)(__atomic_load_n(&be.sunk, __ATOMIC_RELAXED) -
+			before) / secs / (1024.0 * 1024.0));
+	return 0;
+}
+
+static int
+bench_handshake(char *scenario, int resume, char *target, short port)
+{
+	struct samples all;
+	uint64_t resumed;
+	uint64_t ops;
+	double secs;
+
+	memset(&all, 0, sizeof(all));
+	secs = run_clients(&client_handshake, port, opts.conns, resume,
+			&all, &ops, &resumed);
+	if (secs < 0) {
+		fprintf(stderr, "%s client failed against %s\n", scenario,
+				target);
+		free(all.v);
+		return -1;
+	}
+	printf("scenario=%s target=%s conns=%d msg=%zu "
+			"ops_per_s=%.1f resumed_pct=%.1f p50_us=%.1f "
+			"p99_us=%.1f\n", scenario, target, opts.conns,
+			opts.msg, (double)ops / secs,
+			ops ? (100.0 * (double)resumed / (double)ops) : 0,
+			samples_permille(&all, 500),
+			samples_permille(&all, 990));
+	free(all.v);
+	return 0;
+}
+
+/* Run every scenario against tap in front of backend port, then direct */
+static int
+bench_target(int tap, short rport)
+{
+	char *target;
+	short port;
+	pid_t pid;
+	int stat;
+
+	pid = 0;
+	target = "direct";
+	port = rport;
+	if (tap) {
+		pid = tap_start(rport);
+		if (pid < 0) {
+			fprintf(stderr, "%s didn't start\n", opts.tap);
+			return -1;
+		}
+		target = "tap";
+		port = BENCH_TAP_PORT;
+	}
+	if (rport == BENCH_SINK_PORT) {
+		stat = bench_throughput(target, port);
+	} else {
+		stat = bench_handshake("tls_handshake_full", 0, target, port);
+		if (!stat) {
+			stat = bench_handshake("tls_handshake_resumed", 1,
+					target, port);
+		}
+	}
+	if (tap && (tap_stop(pid) < 0)) {
+		fprintf(stderr, "%s didn't exit cleanly\n", opts.tap);
+		stat = -1;
+	}
+	return stat;
+}
+
+int
+main(int argc, char **argv)
+{
+	int stat;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "c:m:s:t:")) != -1) {
+		switch (opt) {
+		case ('c'):
+			opts.conns = atoi(optarg);
+			break;
+		case ('m'):
+			opts.msg = (size_t)strtoul(optarg, 0, 0);
+			break;
+		case ('s'):
+			opts.secs = atof(optarg);
+			break;
+		case ('t'):
+			opts.tap = optarg;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-c conns] "
+					"[-m message size] [-s seconds] "
+					"[-t tap binary] [-- tap args]\n",
+					argv[0]);
+			return -1;
+		}
+	}
+	opts.tap_args = &argv[optind];
+	opts.ntap_args = argc - optind;
+	if ((opts.conns < 1) || (opts.conns > BENCH_CONNS_MAX)) {
+		fprintf(stderr, "conns must be 1 to %d\n", BENCH_CONNS_MAX);
+		return -1;
+	}
+	if (!opts.msg || (opts.msg > BENCH_MSG_MAX)) {
+		fprintf(stderr, "message size must be 1 to %d\n",
+				BENCH_MSG_MAX);
+		return -1;
+	}
+	if (opts.ntap_args > BENCH_TAP_ARGS) {
+		fprintf(stderr, "too many tap arguments\n");
+		return -1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+	if (cert_make() < 0) {
+		fprintf(stderr, "can't make certificate\n");
+		unlink(pem_path);
+		return -1;
+	}
+	client_ctx = SSL_CTX_new(TLS_client_method());
+	if (!client_ctx || (be_start() < 0)) {
+		unlink(pem_path);
+		return -1;
+	}
+	/* Sessions are kept by client_handshake() itself */
+	SSL_CTX_set_session_cache_mode(client_ctx, SSL_SESS_CACHE_CLIENT |
+			SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	stat = bench_target(1, BENCH_SINK_PORT);
+	if (!stat) {
+		stat = bench_target(0, BENCH_SINK_PORT);
+	}
+	if (!stat) {
+		stat = bench_target(1, BENCH_ECHO_PORT);
+	}
+	if (!stat) {
+		stat = bench_target(0, BENCH_ECHO_PORT);
+	}
+	be_stop();
+	SSL_CTX_free(client_ctx);
+	SSL_CTX_free(be.ctx);
+	unlink(pem_path);
+	return stat;
+}
@@ -0,0 +1,134 @@
+/*
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2022, k4m1
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIA LDAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVE RCAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Aho-Corasick automaton for matching many byte patterns at once
+ */
+
+#ifndef __AC_MATCH_H__
+#define __AC_MATCH_H__
+
+#include <sys/types.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* State to start scanning from */
+#define AC_START 0
+
+/*
+ * Compiled automaton. Transitions form a dense table of nstates rows,
+ * one column per byte class, so scanning a byte is two loads. Bytes
+ * that no pattern has share one class to keep rows short. Entries are
+ * row offsets of the next state, and states where patterns end are
+ * numbered last, so telling whether we have a match is one compare.
+ *
+ * If only one byte can start a match, it's searched with memchr()
+ * while in AC_START.
+ *
+ * Automaton isn't modified after ac_build(), so threads may share it.
+ */
+struct ac_automaton {
+	uint8_t classes[256]; 	/* byte -> column */
+	uint32_t nclasses;
+	uint32_t nstates;
+	uint32_t *delta; 	/* nstates * nclasses transitions */
+	uint32_t match_from; 	/* row offset of first state with outputs */
+	uint32_t *out_off; 	/* outputs of state N are out[out_off[N]..] */
+	uint32_t *out; 		/* pattern ids, longest first */
+	uint32_t npatterns;
+	uint32_t *plen; 	/* length of each pattern */
+	uint32_t *hold; 	/* see ac_hold() */
+	int start_byte; 	/* only byte leaving AC_START, or -1 */
+};
+
+/*
+ * Called for every match found, end is offset right after last byte of
+ * match within data given to ac_scan().
+ *
+ * Returns:
+ * 	0 to continue scanning, anything else to stop
+ */
+typedef int (*ac_match_cb)(void *arg, uint32_t pattern, size_t end);
+
+/*
+ * Compile patterns to automaton
+ *
+ * Requires:
+ * 	struct ac_automaton *ac 	- where to build to
+ * 	unsigned char **patterns 	- patterns, pattern id is the index
+ * 	size_t *lens 			- length of each pattern, 0 not allowed
+ * 	uint32_t npatterns 		- how many patterns there are
+ * Returns:
+ * 	0 on success or -1 on error
+ */
+int
+ac_build(struct ac_automaton *ac, unsigned char **patterns, size_t *lens,
+		uint32_t npatterns);
+
+/*
+ * Find every match of every pattern in single pass over data.
+ *
+ * Requires:
+ * 	struct ac_automaton *ac 	- automaton to scan with
+ * 	uint32_t *state 		- AC_START or state left by previous
+ * 					  call, to continue over chunks
+ * 	unsigned char *data 		- data to scan
+ * 	size_t len 			- size of data
+ * 	ac_match_cb cb 			- called for each match
+ * 	void *arg 			- passed to cb
+ * Returns:
+ * 	0 if whole data was scanned, or what cb returned to stop
+ */
+int
+ac_scan(struct ac_automaton *ac, uint32_t *state, unsigned char *data,
+		size_t len, ac_match_cb cb, void *arg);
+
+/*
+ * How many of the last bytes scanned may still become part of a match,
+ * when scan continues from state with more data.
+ *
+ * Requires:
+ * 	struct ac_automaton *ac 	- automaton scanned with
+ * 	uint32_t state 			- state left by ac_scan()
+ * Returns:
+ * 	amount of bytes, less than longest pattern
+ */
+size_t
+ac_hold(struct ac_automaton *ac, uint32_t state);
+
+/*
+ * Release memory of automaton
+ */
+void
+ac_free(struct ac_automaton *ac);
+
+#endif /* __AC_MATCH_H__ */
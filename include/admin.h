@@ -0,0 +1,78 @@
+/*
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2022, k4m1
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIA LDAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVE RCAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Admin socket serving metrics over HTTP, on a unix socket or loopback
+ * TCP port, from a thread of its own.
+ */
+
+#ifndef __ADMIN_H__
+#define __ADMIN_H__
+
+#include <pthread.h>
+
+#include <metrics.h>
+
+/* How long a client may take to send its request */
+#define ADMIN_TIMEOUT_MS 1000
+
+struct admin {
+	int fd; 		/* listening socket */
+	int wake; 		/* eventfd that stops the thread */
+	char *path; 		/* of unix socket, removed on stop */
+	int running;
+	pthread_t thread;
+	int (*render)(struct mbuf *, void *); 	/* see metrics_render() */
+	void *arg;
+};
+
+/*
+ * Start serving GET /metrics
+ *
+ * Requires:
+ * 	struct admin *a 		- admin socket to start
+ * 	const char *addr 		- "unix:PATH" or loopback "ADDR:PORT"
+ * 	int (*render)(...) 		- renders response body
+ * 	void *arg 			- passed to render
+ * Returns:
+ * 	0 on success or -1 on error
+ */
+int
+admin_start(struct admin *a, const char *addr,
+		int (*render)(struct mbuf *, void *), void *arg);
+
+/*
+ * Stop serving and release everything
+ */
+void
+admin_stop(struct admin *a);
+
+#endif /* __ADMIN_H__ */
@@ -0,0 +1,207 @@
+/*
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2022, k4m1
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIA LDAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVE RCAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Set of upstream backends connections are balanced over
+ */
+
+#ifndef __BACKEND_SET_H__
+#define __BACKEND_SET_H__
+
+#include <netinet/in.h>
+
+#include <pthread.h>
+#include <stdint.h>
+
+#define LB_ROUND_ROBIN 	0
+#define LB_LEAST_CONN 	1 	/* less loaded of two random backends */
+#define LB_HASH 	2 	/* consistent hash of client address */
+
+#define BACKEND_MAX 256
+
+/* Connect failures in a row that eject a backend, and for how long */
+#define BACKEND_FAILS 		3
+#define BACKEND_EJECT_MS 	10000
+
+/* How often backends are probed by default, and how long a probe waits */
+#define BACKEND_PROBE_MS 	2000
+#define BACKEND_PROBE_TIMEOUT_MS 1000
+
+/* Size of consistent hash lookup table, prime */
+#define BACKEND_TABLE 65537
+
+/* Table entries looked at past an unusable backend before giving up */
+#define BACKEND_HASH_WALK 8
+
+/*
+ * One upstream. Counters are updated by every worker, so each backend
+ * has its own cache line.
+ */
+struct backend {
+	struct sockaddr_in saddr;
+	char name[32]; 			/* host:port */
+	uint32_t active; 		/* connections of all workers */
+	uint32_t fails; 		/* connect failures in a row */
+	uint64_t ejected_until; 	/* ms, see backend_now_ms(), or 0 */
+	int down; 			/* last health probe failed */
+	uint64_t conns; 		/* connections it was picked for */
+	uint64_t failed; 		/* connects that failed */
+	uint64_t ejections;
+} __attribute__((aligned(64)));
+
+/*
+ * Backends are added before workers start and never change after, so
+ * picking one only reads the set and updates counters of the backend.
+ */
+struct backend_set {
+	struct backend *b;
+	int n;
+	int policy; 		/* LB_* */
+	uint16_t *table; 	/* LB_HASH: hash -> backend */
+	int probe_ms;
+	int probe_wake; 	/* eventfd that stops the prober */
+	int probing;
+	pthread_t prober;
+};
+
+/*
+ * Per-worker picking state, so workers never share a cursor
+ */
+struct backend_cursor {
+	unsigned int rr;
+	unsigned int seed;
+};
+
+/*
+ * Initialise empty set
+ *
+ * Requires:
+ * 	struct backend_set *set 	- set to initialise
+ * 	int policy 			- LB_*
+ */
+void
+backend_set_init(struct backend_set *set, int policy);
+
+/*
+ * Add backend to set
+ *
+ * Requires:
+ * 	struct backend_set *set 	- set to add to
+ * 	const char *addr 		- IPv4 address and port, "a.b.c.d:port"
+ * Returns:
+ * 	0 on success or -1 on error
+ */
+int
+backend_set_add(struct backend_set *set, const char *addr);
+
+/*
+ * Build lookup structures, after every backend is added
+ *
+ * Returns:
+ * 	0 on success or -1 on error
+ */
+int
+backend_set_build(struct backend_set *set);
+
+/*
+ * Start thread probing backends with TCP connects every probe_ms
+ *
+ * Returns:
+ * 	0 on success or -1 on error
+ */
+int
+backend_probe_start(struct backend_set *set, int probe_ms);
+
+/*
+ * Stop probing thread, if it runs
+ */
+void
+backend_probe_stop(struct backend_set *set);
+
+/*
+ * Release everything, prober must be stopped
+ */
+void
+backend_set_free(struct backend_set *set);
+
+/*
+ * Pick backend for a connection by policy of set, skipping ejected and
+ * down backends unless every one is. O(1) unless many are unusable.
+ *
+ * Requires:
+ * 	struct backend_set *set 	- set to pick from
+ * 	struct backend_cursor *cur 	- picking state of calling worker
+ * 	uint32_t hash 			- hash of client, see backend_hash()
+ * Returns:
+ * 	backend, counted as active until backend_release()
+ */
+struct backend *
+backend_pick(struct backend_set *set, struct backend_cursor *cur,
+		uint32_t hash);
+
+/*
+ * Connection to b is gone, or never got connected
+ */
+void
+backend_release(struct backend *b);
+
+/*
+ * Connecting to b failed or timed out, BACKEND_FAILS in a row eject it
+ */
+void
+backend_failed(struct backend *b);
+
+/*
+ * Connecting to b succeeded
+ */
+static inline void
+backend_connected(struct backend *b)
+{
+	if (__atomic_load_n(&b->fails, __ATOMIC_RELAXED)) {
+		__atomic_store_n(&b->fails, 0, __ATOMIC_RELAXED);
+	}
+}
+
+/*
+ * Returns:
+ * 	hash of client address for LB_HASH
+ */
+uint32_t
+backend_hash(const struct sockaddr_in *saddr);
+
+/*
+ * Returns:
+ * 	monotonic milliseconds
+ */
+uint64_t
+backend_now_ms(void);
+
+#endif /* __BACKEND_SET_H__ */
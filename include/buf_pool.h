@@ -0,0 +1,141 @@
+/*
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2022, k4m1
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIA LDAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVE RCAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Per-worker pool of relay buffers
+ */
+
+#ifndef __BUF_POOL_H__
+#define __BUF_POOL_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Buffers are powers of 2 from 4K, smaller requests are rounded up */
+#define POOL_MIN_SHIFT 	12
+#define POOL_CLASSES 	10 	/* 4K .. 2M */
+#define POOL_MAX_BUF 	((size_t)1 << (POOL_MIN_SHIFT + POOL_CLASSES - 1))
+
+/* Buffers of a class are carved from slabs of this size, a huge page */
+#define POOL_SLAB_SIZE 	((size_t)2 * 1024 * 1024)
+
+/* Empty slabs kept per class so churn doesn't map & unmap all the time */
+#define POOL_KEEP_EMPTY 1
+
+/*
+ * Slab of buffers of one size class
+ */
+struct pool_slab {
+	unsigned char *mem;
+	int cls;
+	int huge; 		/* backed by hugetlbfs */
+	uint32_t nbufs; 	/* buffers that fit */
+	uint32_t carved; 	/* buffers handed out at least once */
+	uint32_t used; 		/* buffers handed out now */
+	void *free; 		/* returned buffers, linked through 1st bytes */
+	struct pool_slab *prev; 	/* slabs of class with room */
+	struct pool_slab *next;
+	int avail; 		/* on list of slabs with room */
+};
+
+/*
+ * Occupancy of pool, may be read from other threads with
+ * buf_pool_stats()
+ */
+struct buf_pool_stats {
+	size_t used[POOL_CLASSES]; 	/* buffers handed out per class */
+	size_t used_bytes; 		/* bytes handed out, large ones too */
+	size_t slabs; 			/* slabs mapped */
+	size_t huge_slabs; 		/* of them backed by hugetlbfs */
+	size_t large; 			/* buffers over POOL_MAX_BUF */
+	size_t mapped_bytes; 		/* slabs and large buffers */
+};
+
+/*
+ * Pool is owned by one thread, buffers are handed out and returned by
+ * it only, so nothing is locked. Slabs are looked up from slab[] that
+ * is sorted by address.
+ */
+struct buf_pool {
+	struct pool_slab *avail[POOL_CLASSES];
+	uint32_t empty[POOL_CLASSES]; 	/* slabs of class with nothing used */
+	struct pool_slab **slab;
+	size_t nslabs;
+	size_t cap;
+	int hugetlb; 		/* 0 once MAP_HUGETLB has failed */
+	int scrub; 		/* zero buffers when they're returned */
+	struct buf_pool_stats stats;
+};
+
+/*
+ * Initialise pool, nothing is mapped until buffers are asked for
+ *
+ * Requires:
+ * 	struct buf_pool *pool 		- pool to initialise
+ * 	int scrub 			- zero returned buffers
+ */
+void
+buf_pool_init(struct buf_pool *pool, int scrub);
+
+/*
+ * Get buffer of at least size bytes, contents are undefined
+ *
+ * Returns:
+ * 	pointer to buffer or 0 if out of memory
+ */
+void *
+buf_pool_get(struct buf_pool *pool, size_t size);
+
+/*
+ * Return buffer, size must be what it was asked with
+ */
+void
+buf_pool_put(struct buf_pool *pool, void *buf, size_t size);
+
+/*
+ * Size buffer asked with size actually has
+ */
+size_t
+buf_pool_size(size_t size);
+
+/*
+ * Copy occupancy of pool, safe to call from any thread
+ */
+void
+buf_pool_stats(struct buf_pool *pool, struct buf_pool_stats *stats);
+
+/*
+ * Unmap everything, buffers handed out are gone after this
+ */
+void
+buf_pool_destroy(struct buf_pool *pool);
+
+#endif /* __BUF_POOL_H__ */
@@ -0,0 +1,237 @@
+/*
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2022, k4m1
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIA LDAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVE RCAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ * Capture of relayed traffic to pcapng files
+ */
+
+#ifndef __CAPTURE_H__
+#define __CAPTURE_H__
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <netinet/in.h>
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Default size of a capture file, next one is started once it's full */
+#define CAPTURE_FILE_SIZE (64 * 1024 * 1024)
+
+/* Default amount of files kept per worker, oldest is removed */
+#define CAPTURE_FILES 4
+
+/* How often capture thread syncs what's written to disk */
+#define CAPTURE_SYNC_MS 1000
+
+/* Most payload per synthesized packet, IPv4 length has 16 bits */
+#define CAPTURE_SEG_MAX (65535 - 40)
+
+/* Interfaces of capture files */
+#define CAPTURE_IF_RX 0 	/* as received, before rules */
+#define CAPTURE_IF_TX 1 	/* as sent, after rules */
+
+/*
+ * Synthesized TCP connection of a relayed one, between client and
+ * the address it connected to. Both interfaces have one of their own.
+ */
+struct capture_flow {
+	uint32_t addr[2]; 	/* client, tap, network order */
+	uint16_t port[2];
+	uint32_t seq[2][2]; 	/* next sequence, [interface][direction] */
+	int open;
+};
+
+/*
+ * Pre-allocated file mapped to memory
+ */
+struct capture_file {
+	int fd;
+	unsigned char *map;
+	size_t size;
+	size_t used; 		/* written by worker */
+	size_t synced; 		/* by capture thread */
+};
+
+/*
+ * Files of a worker. Worker appends to cur, capture thread has next
+ * one ready for it and finishes ones it's done with.
+ */
+struct capture_writer {
+	struct capture *cap;
+	int id;
+	unsigned int nfile; 		/* number of next file */
+	struct capture_file *cur;
+	struct capture_file *next;
+	struct capture_file *done;
+	uint64_t packets __attribute__((aligned(64)));
+	uint64_t bytes; 		/* payload */
+	uint64_t dropped; 		/* packets, no file was ready */
+};
+
+struct capture {
+	char *prefix;
+	size_t file_size;
+	int nfiles;
+	int nwriters;
+	struct capture_writer *w;
+	int wake; 			/* eventfd, file was rotated */
+	int stop;
+	int running;
+	pthread_t thread;
+};
+
+/*
+ * Create first file of every writer. Files are named
+ * PREFIX.WORKER.N.pcapng.
+ *
+ * Requires:
+ * 	struct capture *cap 	- capture to initialise
+ * 	char *prefix 		- path and start of file names
+ * 	size_t file_size 	- size of a file, 0 for CAPTURE_FILE_SIZE
+ * 	int nfiles 		- files to keep per writer, 0 for CAPTURE_FILES
+ * 	int nwriters 		- one per worker
+ * Returns:
+ * 	0 on success or -1 on error
+ */
+int
+capture_init(struct capture *cap, char *prefix, size_t file_size,
+		int nfiles, int nwriters);
+
+/*
+ * Start capture thread, it syncs files and has next ones ready
+ *
+ * Returns:
+ * 	0 on success or -1 on error
+ */
+int
+capture_start(struct capture *cap);
+
+/*
+ * Stop capture thread and finish every file, writers must be done
+ */
+void
+capture_destroy(struct capture *cap);
+
+/*
+ * Start flow of connection accepted from client to local
+ */
+void
+capture_flow_open(struct capture_writer *w, struct capture_flow *f,
+		const struct sockaddr_in *client,
+		const struct sockaddr_in *local);
+
+/*
+ * Capture len bytes of iov as payload of flow
+ *
+ * Requires:
+ * 	struct capture_writer *w 	- writer of calling worker
+ * 	struct capture_flow *f 		- flow of connection
+ * 	int iface 			- CAPTURE_IF_RX or CAPTURE_IF_TX
+ * 	int dir 			- DIR_C2U or DIR_U2C
+ * 	const struct iovec *iov 	- payload
+ * 	size_t len 			- bytes of iov to capture
+ */
+void
+capture_data(struct capture_writer *w, struct capture_flow *f, int iface,
+		int dir, const struct iovec *iov, size_t len);
+
+/*
+ * End flow, both sides send FIN
+ */
+void
+capture_flow_close(struct capture_writer *w, struct capture_flow *f);
+
+/*
+ * Payload of a packet of a session read back from capture
+ */
+struct capture_chunk {
+	uint64_t us; 		/* since epoch */
+	size_t off; 		/* in data of session */
+	uint32_t len;
+	uint32_t dir; 		/* 0 from client, 1 to client */
+};
+
+/*
+ * Connection read back from capture, packets in the order captured
+ */
+struct capture_session {
+	uint32_t addr[2]; 	/* client, tap, network order */
+	uint16_t port[2];
+	struct capture_chunk *chunks;
+	size_t nchunks;
+	size_t chunks_cap;
+	unsigned char *data;
+	size_t len;
+	size_t data_cap;
+	int closed; 		/* both sides sent FIN */
+	int fin[2];
+};
+
+/*
+ * Sessions of capture files
+ */
+struct capture_set {
+	struct capture_session *s;
+	size_t n;
+	size_t cap;
+	uint32_t *table; 	/* latest session of flow + 1, or 0 */
+	size_t table_size; 	/* power of 2 */
+};
+
+/*
+ * Read sessions from pcapng file to set. Only packets as received are
+ * read, that is interface "rx" of files of capture_init(), or every
+ * interface of files from elsewhere. Files are read in the order given,
+ * a session can continue from one file to next.
+ *
+ * Session starts with SYN, or if that wasn't captured, with its first
+ * packet, which is then taken to be from client.
+ *
+ * Requires:
+ * 	struct capture_set *set 	- set to add to, zeroed at first
+ * 	char *path 			- pcapng file, IPv4 & TCP
+ * Returns:
+ * 	0 on success or -1 on error
+ */
+int
+capture_load(struct capture_set *set, char *path);
+
+/*
+ * Release memory of set
+ */
+void
+capture_set_free(struct capture_set *set);
+
+#endif /* __CAPTURE_H__ */
@@ -0,0 +1,130 @@
+/*
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2022, k4m1
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIA LDAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVE RCAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Worker driver. Owns worker threads, their event loops and listening
+ * sockets, and shuts them down gracefully on SIGINT/SIGTERM.
+ */
+
+#ifndef __DRIVER_H__
+#define __DRIVER_H__
+
+#include <sys/types.h>
+
+#include <pthread.h>
+#include <stddef.h>
+
+#include <event_loop.h>
+#include <rules_domain.h>
+
+#define DRIVER_MAX_WORKERS 1024
+
+/* Seconds to wait for connections to finish on shutdown */
+#define DRIVER_DRAIN_TIMEOUT 10
+
+/* What is relayed */
+#define PROTO_TCP 0
+#define PROTO_UDP 1
+
+/*
+ * Everything needed to run the proxy
+ */
+struct tap_config {
+	char *addrin; 				/* address to bind */
+	short lport; 				/* port to listen to */
+	char *addrout; 				/* address to forward to */
+	short dport; 				/* port to forward to */
+	struct backend_set *backends; 		/* upstreams, or 0 for above */
+	int health_ms; 				/* probe interval, 0 for none */
+	size_t tx_size; 			/* transmit buffer size */
+	void (*cb)(unsigned char *, size_t); 	/* interception callback */
+	struct rules_domain *rules; 		/* patterns to replace, with
+						 * a reader per worker + 1 */
+	struct relay_filter *filter; 		/* rewrites reads, or 0 */
+	struct plugin *plugin; 			/* sees every read, or 0 */
+	char *rules_path; 			/* ruleset to reload, or 0 */
+	int watch_rules; 			/* reload when file changes */
+	int workers; 				/* amount of worker threads */
+	int pin_cpus; 				/* pin worker N to Nth cpu */
+	int drain_timeout; 			/* seconds, see above */
+	int backend; 				/* BACKEND_EPOLL/URING */
+	int splice; 				/* zero-copy passthrough */
+	size_t hwm; 				/* per-direction queue limit */
+	size_t conn_mem; 			/* per-connection queue memory */
+	int hold_ms; 				/* max delay of split patterns */
+	int scrub; 				/* zero released buffers */
+	int connect_timeout_ms; 		/* per upstream connect attempt */
+	int pool_min; 				/* warm upstream connections */
+	int pool_max; 				/* ... per worker under load */
+	char *admin_addr; 			/* metrics socket, or 0 */
+	char *capture_prefix; 			/* pcapng files, or 0 */
+	size_t capture_size; 			/* bytes per capture file */
+	int capture_files; 			/* capture files per worker */
+	int proto; 				/* PROTO_TCP or PROTO_UDP */
+	int udp_idle_ms; 			/* UDP flow expiry */
+	struct tls_config *tls; 		/* TLS of either side, or 0 */
+};
+
+struct tap_worker {
+	int id;
+	int cpu; 		/* cpu to pin to or -1 */
+	int started;
+	int done; 		/* set by worker when its loop returns */
+	int failed;
+	pthread_t thread;
+	struct event_loop loop;
+};
+
+/*
+ * Start workers, each with own SO_REUSEPORT listener and event loop,
+ * and run until we're signaled to stop.
+ *
+ * First SIGINT/SIGTERM stops accepting new connections and waits for
+ * up to cfg->drain_timeout seconds for active ones to finish, second
+ * one (or timeout) stops immediately.
+ *
+ * SIGHUP, or a change to cfg->rules_path when cfg->watch_rules is set,
+ * loads the ruleset again and publishes it to cfg->rules. Directions of
+ * live connections move to the new rules once they aren't in the middle
+ * of a pattern, UDP flows keep theirs. If the ruleset doesn't load,
+ * current rules stay.
+ *
+ * SIGUSR1 logs buffer pool occupancy of every worker.
+ *
+ * Requires:
+ * 	struct tap_config *cfg 		- what to run
+ * Returns:
+ * 	0 on clean exit or -1 on error
+ */
+int
+tap_driver_run(struct tap_config *cfg);
+
+#endif /* __DRIVER_H__ */
@@ -0,0 +1,107 @@
+/*
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2022, k4m1
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIA LDAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVE RCAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Timers of an event loop
+ */
+
+#ifndef __EV_TIMER_H__
+#define __EV_TIMER_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Timer is not armed */
+#define EV_TIMER_IDLE SIZE_MAX
+
+/*
+ * Timer embedded in whatever it times, arg is passed back to fn
+ */
+struct ev_timer {
+	uint64_t when; 		/* ms, see ev_now_ms() */
+	size_t idx; 		/* place in heap or EV_TIMER_IDLE */
+	void (*fn)(void *loop, void *arg);
+	void *arg;
+};
+
+/*
+ * Binary min-heap of armed timers, earliest first
+ */
+struct ev_timers {
+	struct ev_timer **heap;
+	size_t cnt;
+	size_t cap;
+};
+
+/*
+ * Set up timer, it's not armed
+ */
+void
+ev_timer_init(struct ev_timer *t, void (*fn)(void *, void *), void *arg);
+
+/*
+ * Arm timer to expire at when, or move it there if armed
+ *
+ * Returns:
+ * 	0 on success or -1 if out of memory
+ */
+int
+ev_timer_arm(struct ev_timers *timers, struct ev_timer *t, uint64_t when);
+
+/*
+ * Disarm timer if it's armed
+ */
+void
+ev_timer_cancel(struct ev_timers *timers, struct ev_timer *t);
+
+/*
+ * Take earliest timer off the heap if it's expired at now
+ *
+ * Returns:
+ * 	expired timer, disarmed, or 0 if none
+ */
+struct ev_timer *
+ev_timer_expired(struct ev_timers *timers, uint64_t now);
+
+/*
+ * Returns:
+ * 	when earliest timer expires, or UINT64_MAX if none is armed
+ */
+uint64_t
+ev_timer_next(struct ev_timers *timers);
+
+/*
+ * Release heap, timers in it are disarmed
+ */
+void
+ev_timers_free(struct ev_timers *timers);
+
+#endif /* __EV_TIMER_H__ */
@@ -0,0 +1,563 @@
+/*
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2022, k4m1
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIA LDAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVE RCAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Event driven relay core. One event loop multiplexes any number of
+ * client <-> upstream socket pairs with edge-triggered epoll.
+ */
+
+#ifndef __EVENT_LOOP_H__
+#define __EVENT_LOOP_H__
+
+#include <sys/types.h>
+
+#include <netinet/in.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <backend_set.h>
+#include <buf_pool.h>
+#include <capture.h>
+#include <ev_timer.h>
+#include <hist.h>
+#include <ring_buf.h>
+#include <rules_domain.h>
+#include <stream_match.h>
+#include <tap_plugin.h>
+
+/* I/O backends, see uring_loop.c for BACKEND_URING */
+#define BACKEND_EPOLL 0
+#define BACKEND_URING 1
+
+/* Directions of a connection */
+#define DIR_C2U 0 	/* client -> upstream */
+#define DIR_U2C 1 	/* upstream -> client */
+
+/* Kinds of things we get events for */
+#define EV_LISTENER 0
+#define EV_CLIENT   1
+#define EV_UPSTREAM 2
+#define EV_WAKE     3
+#define EV_POOL     4 	/* warm upstream socket, see upstream_pool.c */
+#define EV_UDP      5 	/* UDP listener, see udp_relay.c */
+#define EV_UDP_FLOW 6 	/* upstream socket of UDP flow */
+
+/* How event loop should stop, see ev_loop_stop() */
+#define EV_RUN 		0
+#define EV_STOP_DRAIN 	1 	/* stop accepting, run until no conns */
+#define EV_STOP_NOW 	2 	/* return as soon as possible */
+
+/* Connection states */
+#define CONN_CONNECTING 0
+#define CONN_RELAY 	1
+#define CONN_CLOSED 	2
+#define CONN_BACKOFF 	3 	/* waiting to connect again */
+
+/* How many times we try to connect upstream before giving up */
+#define CONN_RETRIES 10
+
+/* How long a connect to upstream may take by default */
+#define CONN_TIMEOUT_MS 3000
+
+/*
+ * Delay before connecting again doubles from CONN_BACKOFF_MS up to
+ * CONN_BACKOFF_MAX_MS, and a random half of it is taken off
+ */
+#define CONN_BACKOFF_MS 	10
+#define CONN_BACKOFF_MAX_MS 	2000
+
+/* Warm upstream pool grows up to this many times pool_min by default */
+#define RELAY_POOL_GROWTH 4
+
+/* How many reads we do for one direction before letting others run */
+#define RELAY_BUDGET 16
+
+/* How much we splice() at once on passthrough, default pipe capacity */
+#define RELAY_SPLICE_MAX (64 * 1024)
+
+/* Stop reading a direction once this much waits for its destination */
+#define RELAY_HWM (64 * 1024)
+
+/* How much memory queued data of one connection may take */
+#define RELAY_CONN_MEM (256 * 1024)
+
+/* Most iovecs sent at once, replacements take one each */
+#define RELAY_IOV_MAX 64
+
+#define EV_MAX_EVENTS 256
+
+struct tap_conn;
+struct ssl_st;
+struct ssl_session_st;
+struct tls_config;
+struct relay_filter;
+struct plugin;
+
+/*
+ * Something that is registered to epoll, epoll_event.data.ptr points
+ * to one of these.
+ */
+struct ev_source {
+	int kind;
+	int fd;
+	struct tap_conn *conn;
+	struct ssl_st *ssl; 	/* TLS of connection socket, or 0 */
+	int ktls; 		/* TLS_KTLS_* kernel does for ssl */
+};
+
+/*
+ * One direction of a connection, data read from src is passed through
+ * the callback and rules, and queued to ring until dst takes it. Bytes
+ * rules hold back at the end of ring aren't sent yet.
+ */
+struct relay_dir {
+	struct ev_source *src;
+	struct ev_source *dst;
+	struct ring_buf ring; 	/* intercepted data not yet sent */
+	struct rules_gen *gen; 		/* pinned generation of rules, or 0 */
+	struct stream_rules *rules; 	/* rules of gen, or 0 */
+	struct stream_ctx match; 	/* state of rules for this direction */
+	uint32_t filter_state; 	/* of relay filter's patterns */
+	uint64_t held_since; 	/* ms, when match started holding bytes */
+	uint64_t queued_us; 	/* when data was read to empty queue, or 0 */
+	int readable; 		/* src not yet drained (edge-triggered) */
+	int eof; 		/* src has been shut down */
+	int shut; 		/* dst has been shut down for writing */
+	int pipe[2]; 		/* passthrough: src -> pipe -> dst, or -1 */
+	size_t piped; 		/* passthrough: bytes in pipe */
+	int bid; 		/* uring: provided buffer being sent or -1 */
+	size_t sending; 	/* uring: bytes of bid being sent */
+	int starved; 		/* uring: recv ran out of buffers */
+};
+
+struct tap_conn {
+	int state;
+	int retries;
+	int inflight; 			/* uring: requests not completed */
+	struct sockaddr_in saddr; 	/* uring: upstream address */
+	int64_t ts[2]; 			/* uring: timeout, __kernel_timespec */
+	struct backend *backend; 	/* upstream picked, or 0 */
+	uint32_t hash; 			/* of client address, for LB_HASH */
+	struct ev_source client;
+	struct ev_source upstream;
+	struct relay_dir dir[2];
+	struct ev_timer timer; 		/* connect timeout or backoff */
+	uint64_t accepted_us; 		/* see ev_now_us() */
+	uint64_t connect_us; 		/* when connect attempt started */
+	int relayed; 			/* first byte has been relayed */
+	struct capture_flow flow; 	/* when capturing */
+	struct tap_conn *prev; 		/* all connections of loop */
+	struct tap_conn *next;
+	struct tap_conn *next_ready; 	/* ran out of budget, continue */
+	struct tap_conn *next_closed; 	/* free at end of event batch */
+	int queued;
+	struct tap_conn *prev_held; 	/* some direction holds bytes back */
+	struct tap_conn *next_held;
+	int holding;
+	int handshaking; 		/* TLS_HS_* sides not done yet */
+	struct tap_plugin_conn plug; 	/* what plugin knows of us */
+	int plugged; 			/* plugin accepted connection */
+};
+
+/*
+ * Configuration shared by all connections of an event loop.
+ */
+struct relay_cfg {
+	char *addrout; 		/* upstream when there's no backend set */
+	short dport;
+	struct backend_set *backends; 	/* upstreams to balance over, or 0 */
+	size_t tx_size;
+	void (*cb)(unsigned char *, size_t); 	/* sees one read at a time */
+	struct rules_domain *rules; 	/* replaced across reads, or 0 */
+	struct relay_filter *filter; 	/* rewrites reads that match, or 0 */
+	struct plugin *plugin; 		/* sees every read, or 0 */
+	int reader; 		/* slot of loop in rules domain */
+	int backend; 		/* BACKEND_EPOLL or BACKEND_URING */
+	int splice; 		/* zero-copy passthrough when not intercepting */
+	size_t hwm; 		/* see RELAY_HWM, 0 for default */
+	size_t conn_mem; 	/* see RELAY_CONN_MEM, 0 for default */
+	int hold_ms; 		/* see STREAM_HOLD_MS, 0 for default */
+	int scrub; 		/* zero relay buffers when they're released */
+	int connect_timeout_ms; 	/* see CONN_TIMEOUT_MS, 0 for default */
+	int pool_min; 		/* warm upstream connections to keep */
+	int pool_max; 		/* most warm connections under load, 0 for
+				 * RELAY_POOL_GROWTH times pool_min */
+	struct capture_writer *capture; 	/* traffic to capture, or 0 */
+	int udp; 		/* relay UDP datagrams instead of TCP */
+	int udp_idle_ms; 	/* see UDP_IDLE_MS, 0 for default */
+	struct tls_config *tls; 	/* TLS of either side, or 0 */
+};
+
+/*
+ * Counters of an event loop, written by the loop only and readable from
+ * other threads with ev_loop_stats()
+ */
+struct relay_stats {
+	uint64_t accepted;
+	uint64_t active; 		/* connections now */
+	uint64_t closed;
+	uint64_t rx_bytes[2]; 		/* per direction */
+	uint64_t tx_bytes[2];
+	uint64_t chunks[2]; 		/* reads that got data */
+	struct hist ttfb; 		/* us, accept to first byte relayed */
+	struct hist forward[2]; 	/* us, read to queue drained */
+	struct hist connect; 		/* us, connect attempt that worked */
+	uint64_t connect_retries; 	/* failed & timed out connects */
+	uint64_t connect_timeouts;
+	uint64_t connect_failed; 	/* gave up after CONN_RETRIES */
+	uint64_t pool_hits; 		/* clients given a warm connection */
+	uint64_t pool_misses;
+	uint64_t pool_idle; 		/* warm connections now */
+	uint64_t udp_flows; 		/* UDP flows now */
+	uint64_t udp_flows_opened;
+	uint64_t udp_flows_expired; 	/* closed after being idle */
+	uint64_t udp_dgrams_rx[2]; 	/* per direction, GRO split */
+	uint64_t udp_dgrams_tx[2];
+	uint64_t udp_dropped; 		/* datagrams we couldn't relay */
+	uint64_t tls_handshakes[2]; 	/* client & upstream side */
+	uint64_t tls_resumed[2]; 	/* ... of them resumed a session */
+	uint64_t tls_failed; 		/* handshakes that failed */
+	uint64_t tls_ktls; 		/* sockets kernel does TLS for */
+	uint64_t filtered[2]; 		/* reads filter function saw */
+	uint64_t plugin_rewrites[2]; 	/* reads plugin replaced */
+};
+
+/*
+ * Warm upstream connections of an event loop, see upstream_pool.c
+ */
+struct upstream_pool {
+	struct warm_conn *idle; 	/* connected, waiting for a client */
+	struct warm_conn *connecting;
+	struct warm_conn *dead; 	/* freed at end of event batch */
+	size_t nidle;
+	size_t nconnecting;
+	size_t target; 		/* grows toward max on misses */
+	uint64_t last_miss; 	/* ms */
+	int failures; 		/* in a row, for backoff */
+	struct ev_timer retry; 	/* refill after backoff */
+};
+
+/*
+ * UDP flows of an event loop, see udp_relay.c
+ */
+struct udp_relay {
+	struct ev_source listener; 	/* datagrams from every client */
+	struct udp_flow **flows; 	/* open addressing by client */
+	size_t size; 		/* slots in flows, power of 2 */
+	size_t nflows;
+	struct udp_flow *lru; 	/* most recently active first */
+	struct udp_flow *lru_tail;
+	struct udp_flow *dead; 	/* freed at end of event batch */
+	struct ev_timer sweep; 	/* expires idle flows */
+	int gso; 		/* kernel takes UDP_SEGMENT */
+	struct udp_batch *batch; 	/* datagrams in flight */
+};
+
+/*
+ * Sessions to resume with upstreams, one per backend, see tls_relay.c
+ */
+struct tls_cache {
+	struct ssl_session_st **sessions;
+	int n;
+};
+
+struct uring_loop;
+
+struct event_loop {
+	int epfd;
+	int stop; 		/* EV_RUN, EV_STOP_*, set by ev_loop_stop() */
+	int backend; 		/* BACKEND_EPOLL or BACKEND_URING */
+	struct ev_source listener;
+	struct ev_source waker; /* eventfd to wake loop from other threads */
+	struct relay_cfg cfg;
+	int accept_paused; 	/* out of fds, retry accept on close */
+	size_t nconns;
+	struct tap_conn *conns;
+	struct tap_conn *ready;
+	struct tap_conn *closed;
+	struct tap_conn *held; 	/* connections holding bytes back */
+	struct buf_pool pool; 	/* ring buffers of connections */
+	struct ev_timers timers;
+	struct upstream_pool upstreams;
+	struct udp_relay udp;
+	struct tls_cache tls; 	/* used by this loop only */
+	unsigned int seed; 	/* for backoff jitter */
+	struct backend_cursor cursor; 	/* this loop's place in backends */
+	struct relay_stats stats;
+	struct uring_loop *uring; 	/* set if BACKEND_URING is in use */
+	unsigned long nsyscalls; 	/* syscalls made by relay path */
+	unsigned long long nbytes; 	/* bytes relayed */
+	uint64_t plugin_ids; 		/* connections plugin has seen */
+	unsigned char *scratch; 	/* plugin output being queued */
+	size_t scratch_size;
+};
+
+/* Count a syscall done by relay path */
+#define EV_SYSCALL(loop) ((loop)->nsyscalls++)
+
+/* Update counter of loop, loop is the only writer */
+#define EV_STAT_ADD(loop, field, n) \
+	__atomic_store_n(&(loop)->stats.field, (loop)->stats.field + (n), \
+			__ATOMIC_RELAXED)
+#define EV_STAT_SET(loop, field, n) \
+	__atomic_store_n(&(loop)->stats.field, (n), __ATOMIC_RELAXED)
+
+/*
+ * Initialise event loop. If cfg asks for BACKEND_URING but the kernel
+ * can't do what we need, there are rules, a filter or plugin to apply,
+ * datagrams to relay or TLS to terminate, loop falls back to
+ * BACKEND_EPOLL.
+ *
+ * Requires:
+ * 	struct event_loop *loop 	- loop to initialise
+ * 	struct relay_cfg *cfg 		- where & how to relay data
+ * Returns:
+ * 	0 on success or -1 on error
+ */
+int
+ev_loop_init(struct event_loop *loop, struct relay_cfg *cfg);
+
+/*
+ * Register listening socket to event loop. Socket is set non-blocking
+ * and is owned by the loop after this.
+ *
+ * Requires:
+ * 	struct event_loop *loop 	- loop to operate with
+ * 	int lsock 			- bound & listening socket
+ * Returns:
+ * 	0 on success or -1 on error
+ */
+int
+ev_loop_add_listener(struct event_loop *loop, int lsock);
+
+/*
+ * Run event loop until ev_loop_stop() is called or an unrecoverable
+ * error happens.
+ *
+ * Requires:
+ * 	struct event_loop *loop 	- loop to run
+ * Returns:
+ * 	0 on clean exit or -1 on error
+ */
+int
+ev_loop_run(struct event_loop *loop);
+
+/*
+ * Ask event loop to stop, safe to call from any thread.
+ *
+ * Requires:
+ * 	struct event_loop *loop 	- loop to stop
+ * 	int how 			- EV_STOP_DRAIN or EV_STOP_NOW
+ */
+void
+ev_loop_stop(struct event_loop *loop, int how);
+
+/*
+ * Close all connections and sockets owned by event loop.
+ *
+ * Requires:
+ * 	struct event_loop *loop 	- loop to destroy
+ */
+void
+ev_loop_destroy(struct event_loop *loop);
+
+/*
+ * Copy counters of loop, safe to call from any thread
+ */
+void
+ev_loop_stats(struct event_loop *loop, struct relay_stats *stats);
+
+/* Helpers shared by backends */
+
+/*
+ * Register source to epoll
+ *
+ * Returns:
+ * 	0 on success or -1 on error
+ */
+int
+ev_add(struct event_loop *loop, struct ev_source *src, uint32_t events);
+
+/*
+ * Point registered fd to another source
+ *
+ * Returns:
+ * 	0 on success or -1 on error
+ */
+int
+ev_mod(struct event_loop *loop, struct ev_source *src, uint32_t events);
+
+/*
+ * Check how non-blocking connect went
+ *
+ * Returns:
+ * 	1 if connected, 0 if still in progress, -1 on error
+ */
+int
+ev_connect_result(int fd);
+
+/*
+ * Returns:
+ * 	coarse monotonic time in ms, for timers
+ */
+uint64_t
+ev_now_ms(void);
+
+/*
+ * Returns:
+ * 	monotonic time in us, for latencies
+ */
+uint64_t
+ev_now_us(void);
+
+/*
+ * Delay before attempt N (from 1) to connect again, with jitter
+ *
+ * Returns:
+ * 	ms to wait
+ */
+uint64_t
+ev_backoff_ms(struct event_loop *loop, int attempt);
+
+/*
+ * Pick upstream to connect to by balancing policy, in place of the one
+ * *backend held. Without backend set, upstream is cfg.addrout.
+ *
+ * Requires:
+ * 	struct event_loop *loop 	- loop to pick for
+ * 	struct backend **backend 	- picked backend, released later
+ * 					  with backend_release()
+ * 	uint32_t hash 			- hash of client, see backend_hash()
+ * 	struct sockaddr_in *saddr 	- address to connect to
+ */
+void
+ev_pick_upstream(struct event_loop *loop, struct backend **backend,
+		uint32_t hash, struct sockaddr_in *saddr);
+
+/*
+ * Count accept to first byte latency of connection
+ */
+void
+ev_conn_first_byte(struct event_loop *loop, struct tap_conn *conn);
+
+/*
+ * Note that connection sent len bytes of direction dir
+ */
+static inline void
+ev_conn_relayed(struct event_loop *loop, struct tap_conn *conn, int dir,
+		size_t len)
+{
+	EV_STAT_ADD(loop, tx_bytes[dir], len);
+	if (!conn->relayed) {
+		ev_conn_first_byte(loop, conn);
+	}
+}
+
+/*
+ * Note that direction dir of connection received len bytes
+ */
+static inline void
+ev_dir_received(struct event_loop *loop, struct relay_dir *d, int dir,
+		size_t len)
+{
+	EV_STAT_ADD(loop, rx_bytes[dir], len);
+	EV_STAT_ADD(loop, chunks[dir], 1);
+	/* Forwarding latency is timed from read to an empty queue */
+	if (!d->queued_us) {
+		d->queued_us = ev_now_us();
+	}
+}
+
+/*
+ * Note that direction dir of connection has sent all it read
+ */
+static inline void
+ev_dir_drained(struct event_loop *loop, struct relay_dir *d, int dir)
+{
+	if (d->queued_us) {
+		hist_add(&loop->stats.forward[dir], ev_now_us() - d->queued_us);
+		d->queued_us = 0;
+	}
+}
+
+/*
+ * Allocate connection for accepted client socket and link it to loop.
+ *
+ * Returns:
+ * 	pointer to connection or 0 on error
+ */
+struct tap_conn *
+ev_conn_alloc(struct event_loop *loop, int nsock);
+
+/*
+ * Unlink connection from loop
+ */
+void
+ev_conn_unlink(struct event_loop *loop, struct tap_conn *conn);
+
+/*
+ * Free connection memory
+ */
+void
+ev_conn_free(struct tap_conn *conn);
+
+/*
+ * Pass data received for direction through interception
+ *
+ * Requires:
+ * 	struct event_loop *loop 	- loop connection belongs to
+ * 	struct tap_conn *conn 		- connection data was received for
+ * 	int dir 			- DIR_C2U or DIR_U2C
+ * 	unsigned char *buf 		- received data
+ * 	size_t len 			- amount of bytes received
+ * Returns:
+ * 	amount of bytes in buf to forward
+ */
+size_t
+relay_intercept(struct event_loop *loop, struct tap_conn *conn, int dir,
+		unsigned char *buf, size_t len);
+
+/*
+ * Check if data of direction can bypass interception. This is asked
+ * again for every read, so the answer may change mid-stream.
+ *
+ * Requires:
+ * 	struct event_loop *loop 	- loop connection belongs to
+ * 	struct tap_conn *conn 		- connection to check
+ * 	int dir 			- DIR_C2U or DIR_U2C
+ * Returns:
+ * 	1 if nothing would touch the data, 0 otherwise
+ */
+int
+relay_passthrough(struct event_loop *loop, struct tap_conn *conn, int dir);
+
+#endif /* __EVENT_LOOP_H__ */
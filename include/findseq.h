@@ -0,0 +1,95 @@
+/*
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2022, k4m1
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIA LDAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVE RCAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Substring search kernels behind findseq()
+ */
+
+#ifndef __FINDSEQ_H__
+#define __FINDSEQ_H__
+
+#include <sys/types.h>
+
+#include <stddef.h>
+
+/*
+ * Needles longer than this are searched with Horspool. It skips enough
+ * by then to win, and this bounds how much work a position where first
+ * and last byte match may cost.
+ */
+#define FINDSEQ_SHORT_MAX 128
+
+/* Kernels, FINDSEQ_GENERIC is always available */
+#define FINDSEQ_GENERIC 0
+#define FINDSEQ_SSE2 1
+#define FINDSEQ_AVX2 2
+
+/*
+ * Search kernel for needles of 2 to FINDSEQ_SHORT_MAX bytes.
+ * Positions where both first and last byte of needle match are
+ * looked for a block at a time, and only those are compared fully.
+ *
+ * Requires:
+ * 	void 	*data, 	data being processed
+ * 	void 	*what, 	what to look for
+ * 	size_t 	dlen, 	size of data, at least wlen
+ * 	size_t 	wlen, 	size of what, at least 2
+ * Returns:
+ * 	0 if what isn't found from data or
+ * 	pointer to what if it was found.
+ */
+typedef void *(*findseq_fn)(void *data, void *what, size_t dlen,
+		size_t wlen);
+
+/*
+ * Get kernel for short needles
+ *
+ * Requires:
+ * 	int kind 	- FINDSEQ_GENERIC/SSE2/AVX2
+ * Returns:
+ * 	the kernel or 0 if cpu doesn't support it
+ */
+findseq_fn
+findseq_kernel(int kind);
+
+/*
+ * Kernel picked for this cpu, set up before main() runs
+ */
+extern findseq_fn findseq_short;
+
+/*
+ * Boyer-Moore-Horspool search for long needles, same arguments as
+ * above except wlen may be anything from 1 up.
+ */
+void *
+findseq_horspool(void *data, void *what, size_t dlen, size_t wlen);
+
+#endif /* __FINDSEQ_H__ */
@@ -0,0 +1,118 @@
+/*
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2022, k4m1
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIA LDAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVE RCAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Log-linear latency histograms, HDR style: every power of 2 is split
+ * into HIST_SUB buckets, so a bucket is within 1/HIST_SUB of its values.
+ */
+
+#ifndef __HIST_H__
+#define __HIST_H__
+
+#include <stdint.h>
+
+#define HIST_SUB_BITS 	2
+#define HIST_SUB 	(1 << HIST_SUB_BITS)
+
+/* Values of 2^HIST_MAX_SHIFT and more are counted in the last bucket */
+#define HIST_MAX_SHIFT 	27
+#define HIST_BUCKETS 	((HIST_MAX_SHIFT - HIST_SUB_BITS + 1) * HIST_SUB)
+
+/*
+ * Histogram of one thread. Only the owning thread writes it, others
+ * may read it at any time, see hist_merge().
+ */
+struct hist {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t b[HIST_BUCKETS];
+};
+
+/*
+ * Returns:
+ * 	bucket of value v
+ */
+static inline int
+hist_bucket(uint64_t v)
+{
+	int e;
+
+	if (v < HIST_SUB) {
+		return (int)v;
+	}
+	e = 63 - __builtin_clzll(v);
+	if (e >= HIST_MAX_SHIFT) {
+		return HIST_BUCKETS - 1;
+	}
+	return ((e - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + 
+		(int)((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/*
+ * Count value v, owning thread only. Plain increments, stores are
+ * atomic only so readers never see torn values.
+ */
+static inline void
+hist_add(struct hist *h, uint64_t v)
+{
+	int b;
+
+	b = hist_bucket(v);
+	__atomic_store_n(&h->b[b], h->b[b] + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&h->count, h->count + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&h->sum, h->sum + v, __ATOMIC_RELAXED);
+	if (v > h->max) {
+		__atomic_store_n(&h->max, v, __ATOMIC_RELAXED);
+	}
+}
+
+/*
+ * Returns:
+ * 	smallest value that doesn't fit bucket b anymore
+ */
+uint64_t
+hist_bucket_end(int b);
+
+/*
+ * Add histogram another thread may be writing to dst
+ */
+void
+hist_merge(struct hist *dst, struct hist *src);
+
+/*
+ * Returns:
+ * 	end of bucket holding pct percent of values, or 0 if empty
+ */
+uint64_t
+hist_percentile(struct hist *h, int pct);
+
+#endif /* __HIST_H__ */
@@ -37,6 +37,7 @@
 #define __INTERCEPT_HELPERS_H__
 
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -44,6 +45,8 @@
 
 #include <unistd.h>
 
+#include <ac_match.h>
+
 #define SHIFT_LEFT 0
 #define SHIFT_RIGHT 1
 #define PAD_HERE 0
@@ -93,10 +96,50 @@ void
 replace_str_of_equal_size(unsigned char *data, size_t dlen, size_t count, 
 		unsigned char *what, unsigned char *with);
 
+/*
+ * Replace every pattern of automaton with equal-length string from data
+ * that is being passed through, in a single pass. When matches overlap
+ * the one ending first is replaced, longest one if many end there.
+ *
+ * Requires:
+ * 	unsigned char 		*data, 	pointer to data to operate with
+ * 	size_t 			dlen, 	size of data
+ * 	struct ac_automaton 	*ac, 	patterns to replace
+ * 	unsigned char 		**with, with[N] replaces pattern N
+ * Returns:
+ * 	amount of strings replaced
+ */
+size_t
+replace_patterns_of_equal_size(unsigned char *data, size_t dlen,
+		struct ac_automaton *ac, unsigned char **with);
+
+/*
+ * Describe data with every pattern of automaton replaced as iovecs,
+ * unchanged slices of data interleaved with replacements of any length,
+ * to be sent with writev() or sendmsg(). Data isn't modified. Overlaps
+ * are resolved like in replace_patterns_of_equal_size().
+ *
+ * Requires:
+ * 	unsigned char 		*data, 	 data to operate with
+ * 	size_t 			dlen, 	 size of data
+ * 	struct ac_automaton 	*ac, 	 patterns to replace
+ * 	unsigned char 		**with,  with[N] replaces pattern N
+ * 	size_t 			*wlens,  length of with[N], may be 0
+ * 	struct iovec 		*iov, 	 where to describe output to
+ * 	int 			iovmax,  size of iov
+ * Returns:
+ * 	amount of iovecs filled in or -1 if iov is too small
+ */
+int
+replace_patterns_to_iov(unsigned char *data, size_t dlen,
+		struct ac_automaton *ac, unsigned char **with, size_t *wlens,
+		struct iovec *iov, int iovmax);
+
 /*
  * Replace string with shorter string from data that is being
  * passed through, pad the remaining data right after the replaced string
- * or at the end of data.
+ * or at the end of data. See replace_patterns_to_iov() for replacing
+ * with strings of any length.
  *
  * Requires:
  * 	unsigned char 	*data, 	pointer to data to operate with
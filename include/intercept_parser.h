@@ -0,0 +1,85 @@
+/*
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2022, k4m1
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIA LDAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVE RCAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Interception ruleset loading
+ */
+
+#ifndef __INTERCEPT_PARSER_H__
+#define __INTERCEPT_PARSER_H__
+
+#include <stddef.h>
+
+#include <stream_match.h>
+
+/*
+ * Ruleset is YAML of form
+ *
+ * rules:
+ *   - match: "TEST" 		# or match_hex: "54455354"
+ *     replace: "LMAO" 		# or replace_hex, "" deletes match
+ *     direction: both 		# c2u, u2c or both, defaults to both
+ *     scope: 			# optional, stream offsets of direction
+ *       offset: 0
+ *       length: 4096 		# 0 or missing for rest of stream
+ *     limit: 1 		# per direction of a connection, 0 for any
+ *
+ * Rules are compiled to one immutable table shared by all workers.
+ */
+
+/*
+ * Load and compile ruleset from file
+ *
+ * Requires:
+ * 	struct stream_rules *rules 	- where to compile to
+ * 	char *path 			- ruleset file
+ * Returns:
+ * 	0 on success or -1 on error
+ */
+int
+ruleset_load(struct stream_rules *rules, char *path);
+
+/*
+ * Compile ruleset from memory
+ *
+ * Requires:
+ * 	struct stream_rules *rules 	- where to compile to
+ * 	const unsigned char *buf 	- ruleset YAML
+ * 	size_t len 			- size of buf
+ * 	char *name 			- name of ruleset for errors
+ * Returns:
+ * 	0 on success or -1 on error
+ */
+int
+ruleset_parse(struct stream_rules *rules, const unsigned char *buf,
+		size_t len, char *name);
+
+#endif /* __INTERCEPT_PARSER_H__ */
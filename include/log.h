@@ -35,27 +35,98 @@
 #ifndef LOG_H
 #define LOG_H
 
-#include <stdio.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Messages are captured as binary records (call site, timestamp and
+ * arguments) to a lock-free ring of the calling thread, and formatted &
+ * written by a thread of their own, see log.c. Until log_start() and
+ * after log_stop() they're written right away.
+ */
+
+#define LOG_LVL_ERR 	0 	/* ERR() */
+#define LOG_LVL_INFO 	1 	/* LOG() */
+
+/* Bytes of records each thread can have waiting, power of 2 */
+#define LOG_RING_SIZE (256 * 1024)
+
+/* Largest record, longer messages are cut */
+#define LOG_REC_MAX 2048
+
+/* Messages of a call site per second, the rest are only counted */
+#define LOG_BURST 20
+
+/* How often the log thread looks for records when idle */
+#define LOG_FLUSH_MS 10
+
+/*
+ * Call site of LOG() or ERR(), one static instance per site
+ */
+struct log_site {
+	int level;
+	const char *file;
+	int line;
+	uint64_t window; 	/* second of rate limit window */
+	uint32_t count; 	/* messages in window */
+	uint32_t suppressed; 	/* not logged since window started */
+};
+
+/*
+ * Counters of the log, readable any time
+ */
+struct log_stats {
+	uint64_t dropped; 	/* rings were full */
+	uint64_t suppressed; 	/* rate limited */
+};
+
+/* Messages of this level and more important are logged */
+extern int log_level;
+
+/*
+ * Log message of call site, use LOG() and ERR() instead
+ */
+void
+log_write(struct log_site *site, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+/*
+ * Start log thread
+ *
+ * Returns:
+ * 	0 on success or -1 on error
+ */
+int
+log_start(void);
+
+/*
+ * Write what's waiting and stop log thread, other threads may not log
+ * during this
+ */
+void
+log_stop(void);
+
+/*
+ * Set level of least important messages logged, LOG_LVL_*
+ */
+void
+log_set_level(int level);
+
+void
+log_get_stats(struct log_stats *st);
+
+#define LOG_AT(lvl, ...) \
+	do { \
+		static struct log_site log_site_ = { \
+			(lvl), __FILE__, __LINE__, 0, 0, 0 \
+		}; \
+		if ((lvl) <= __atomic_load_n(&log_level, __ATOMIC_RELAXED)) { \
+			log_write(&log_site_, __VA_ARGS__); \
+		} \
+	} while (0)
 
-#ifdef DEBUG
-	#define LOG_msg(where, ...) \
-		do { \
-			fprintf(where, "%s: %d: ", __FILE__, __LINE__); \
-			fprintf(where, __VA_ARGS__); \
-		} while (0);
-
-	#define LOG(...) LOG_msg(stdout, __VA_ARGS__);
-	#define ERR(...) fprintf(stderr, "Error: "); \
-		LOG_msg(stderr, __VA_ARGS__);
-#else
-	#define LOG_msg(where, ...) \
-		do { \
-			fprintf(where, __VA_ARGS__); \
-		} while (0);
-
-	#define LOG(...) LOG_msg(stdout,  __VA_ARGS__);
-	#define ERR(...) LOG_msg(stderr,  __VA_ARGS__);
-#endif /* DEBUG */
+#define LOG(...) LOG_AT(LOG_LVL_INFO, __VA_ARGS__)
+#define ERR(...) LOG_AT(LOG_LVL_ERR, __VA_ARGS__)
 
 #endif /* LOG_H */
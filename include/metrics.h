@@ -0,0 +1,89 @@
+/*
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2022, k4m1
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIA LDAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVE RCAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Metrics of workers in Prometheus text format
+ */
+
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <stddef.h>
+
+#include <driver.h>
+
+/*
+ * Growing text buffer, printing to it after an error does nothing
+ */
+struct mbuf {
+	char *p;
+	size_t len;
+	size_t cap;
+	int err; 		/* ran out of memory */
+};
+
+/*
+ * Append formatted text to m
+ */
+void
+mbuf_printf(struct mbuf *m, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+/*
+ * Release memory of m, m can be reused after this
+ */
+void
+mbuf_free(struct mbuf *m);
+
+/*
+ * What metrics are read from
+ */
+struct metrics_src {
+	struct tap_config *cfg;
+	struct tap_worker *workers; 	/* cfg->workers of them */
+	int reader; 			/* slot in cfg->rules of caller */
+	struct capture *capture; 	/* or 0 */
+};
+
+/*
+ * Render metrics of every worker. Counters are read from the worker
+ * threads while they run, histograms of workers are merged.
+ *
+ * Requires:
+ * 	struct mbuf *m 		- where to render to
+ * 	void *arg 		- struct metrics_src
+ * Returns:
+ * 	0 on success or -1 on error
+ */
+int
+metrics_render(struct mbuf *m, void *arg);
+
+#endif /* __METRICS_H__ */
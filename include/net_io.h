@@ -0,0 +1,171 @@
+/*
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2022, k4m1
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIA LDAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVE RCAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Networking input/output helpers
+ */
+
+#ifndef __NET_IO_H__
+#define __NET_IO_H__
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <arpa/inet.h>
+#include <netinet/ip.h>
+
+#include <stddef.h>
+
+#define WAIT_DIR_OUT 1
+#define WAIT_DIR_IN  2
+
+#define SOCK_OP_BIND 0
+#define SOCK_OP_CONN 1
+/* Flags that can be or'd to SOCK_OP_BIND/SOCK_OP_CONN */
+#define SOCK_OP_NONBLOCK 4
+#define SOCK_OP_REUSEPORT 8 	/* bind only, share port between workers */
+#define SOCK_OP_UDP 16 		/* datagram socket instead of stream */
+
+/*
+ * This function simply binds socket based on options provided OR
+ * 		 	connects socket to remote host based
+ *
+ * With SOCK_OP_NONBLOCK the socket is non-blocking, and a connect that
+ * is still in progress (EINPROGRESS) is returned as success.
+ * With SOCK_OP_REUSEPORT many sockets can be bound to same address,
+ * and the kernel balances inbound connections between them.
+ * With SOCK_OP_UDP the socket is a UDP one instead of TCP, connecting
+ * it only fixes the peer.
+ *
+ * Requires:
+ * 	char *dst, 			where to bind/connect
+ * 	short port, 			which port to bind/connect
+ * 	struct sockaddr_in *s_addr 	ptr to uninitialized sockaddr_in
+ * 	int op 				1 to connect, 0 to bind
+ * Modifies:
+ * 	struct sockaddr_in is populated for the user.
+ * Returns:
+ * 	int socket on success or -1 on error
+ */
+int
+sock_op_do(char *dst, short port, struct sockaddr_in *saddr, int op);
+
+/*
+ * Start non-blocking connect to saddr, connect still in progress
+ * (EINPROGRESS) is success.
+ *
+ * Requires:
+ * 	struct sockaddr_in *saddr 	where to connect
+ * Returns:
+ * 	int socket on success or -1 on error
+ */
+int
+sock_connect_nb(const struct sockaddr_in *saddr);
+
+/*
+ * Open non-blocking UDP socket connected to saddr, so only datagrams
+ * from saddr are received from it.
+ *
+ * Requires:
+ * 	struct sockaddr_in *saddr 	peer of socket
+ * Returns:
+ * 	int socket on success or -1 on error
+ */
+int
+sock_connect_dgram(const struct sockaddr_in *saddr);
+
+/*
+ * Fill in sockaddr_in for IPv4 address & port
+ *
+ * Requires:
+ * 	char *dst, 			address as a string
+ * 	short port, 			port
+ * 	struct sockaddr_in *saddr 	what to fill in
+ */
+void
+sock_addr_init(char *dst, short port, struct sockaddr_in *saddr);
+
+/*
+ * Set socket to non-blocking mode.
+ *
+ * Requires:
+ * 	int sock, 			socket to operate with
+ * Returns:
+ * 	0 on success or -1 on error
+ */
+int
+set_nonblocking(int sock);
+
+/*
+ * Wait for a socket to be readable or writable.
+ *
+ * Requires:
+ * 	int sock, 			socket to waitfor
+ * 	int dir, 			WAIT_DIR_OUT or WAIT_DIR_IN
+ * 	int s_timeout 			how many seconds until timeout
+ * 	int u_timeout 			how many microseconds until timeout
+ * Returns:
+ * 	1 if socket is operable
+ * 	0 if timed out
+ * 	-1 on error
+ */
+int
+waitfor(int sock, int dir, int s_timeout, int u_timeout);
+
+/* 
+ * Helper to read data from socket, waits until socket becomes
+ * readable & reads data from socket to *dstptr
+ *
+ * Requires:
+ * 	int sock, 			socket to read from
+ * 	size_t size, 			amount of bytes to read
+ * 	unsigned char *dst 		where to read to
+ * Returns:
+ * 	-1 on error, 0 on timeout, or amount of bytes read.
+ */
+size_t
+rx(int sock, size_t size, unsigned char *dst);
+
+/*
+ * Helper to send data over socket, waits until socket becomes
+ * writable & sends data from *srcptr to socket
+ *
+ * Requires:
+ * 	int sock, 			socket to write to
+ * 	size_t size, 			amount of bytes to write
+ * 	unsigned char *src, 		what to write
+ * Returns:
+ * 	-1 on error, 0 on timeout, or amounts of bytes written
+ */
+size_t
+tx(int sock, size_t size, unsigned char *src);
+
+#endif /* __NET_IO_H__ */
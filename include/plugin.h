@@ -0,0 +1,81 @@
+/*
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2022, k4m1
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIA LDAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVE RCAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Loading interception plugins, see tap_plugin.h for what they export
+ */
+
+#ifndef __PLUGIN_H__
+#define __PLUGIN_H__
+
+#include <sys/types.h>
+
+#include <stddef.h>
+
+#include <tap_plugin.h>
+
+/*
+ * Loaded plugin
+ */
+struct plugin {
+	void *handle; 			/* from dlopen() */
+	const struct tap_plugin *ops;
+	void *global; 			/* from ops->init() */
+};
+
+/*
+ * Whether plugin has hook, tables of older plugins end before hooks
+ * added after them
+ */
+#define PLUGIN_HAS(ops, hook) \
+	((offsetof(struct tap_plugin, hook) < (ops)->size) && (ops)->hook)
+
+/*
+ * Load shared object, check it was built for our ABI, and initialise
+ * it. Relative paths are taken as they are, not searched for.
+ *
+ * Requires:
+ * 	struct plugin *p 		- plugin to load
+ * 	const char *path 		- shared object to load
+ * 	const char *arg 		- passed to init() of plugin, or 0
+ * Returns:
+ * 	0 on success or -1 on error
+ */
+int
+plugin_load(struct plugin *p, const char *path, const char *arg);
+
+/*
+ * Finish plugin and unload it, no connection may be open anymore
+ */
+void
+plugin_unload(struct plugin *p);
+
+#endif /* __PLUGIN_H__ */
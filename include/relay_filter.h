@@ -0,0 +1,118 @@
+/*
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2022, k4m1
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIA LDAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVE RCAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Rewriting whole reads with a function of the embedder, called only for
+ * reads that contain one of the filter's patterns
+ */
+
+#ifndef __RELAY_FILTER_H__
+#define __RELAY_FILTER_H__
+
+#include <sys/types.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <ac_match.h>
+
+/*
+ * Rewrite a read that matched. Function may change buf in place and
+ * keep it, or give a replacement of any length, in memory from
+ * malloc() that relay frees. Called from worker threads, one read at a
+ * time per worker.
+ *
+ * Requires:
+ * 	void *arg 			- relay_filter.arg
+ * 	int dir 			- 0 client->upstream, 1 other way
+ * 	unsigned char *buf 		- what was read
+ * 	size_t len 			- amount of bytes read
+ * 	unsigned char **out 		- where to put replacement
+ * 	size_t *out_len 		- where to put its length
+ * Returns:
+ * 	0 to relay buf, 1 to relay *out instead, which may be 0 if
+ * 	*out_len is 0, or -1 to close the connection
+ */
+typedef int (*relay_filter_fn)(void *arg, int dir, unsigned char *buf,
+		size_t len, unsigned char **out, size_t *out_len);
+
+/*
+ * Patterns and the function to call for reads containing any of them.
+ * A pattern split over reads counts for the read it ends in. Without
+ * patterns function sees every read.
+ */
+struct relay_filter {
+	struct ac_automaton ac;
+	int npatterns;
+	relay_filter_fn fn;
+	void *arg;
+};
+
+/*
+ * Build filter
+ *
+ * Requires:
+ * 	struct relay_filter *f 		- filter to build
+ * 	unsigned char **patterns 	- patterns, or 0 for every read
+ * 	size_t *lens 			- length of each pattern, not 0
+ * 	int cnt 			- amount of patterns
+ * 	relay_filter_fn fn 		- called for reads that match
+ * 	void *arg 			- passed to fn
+ * Returns:
+ * 	0 on success or -1 on error
+ */
+int
+relay_filter_init(struct relay_filter *f, unsigned char **patterns,
+		size_t *lens, int cnt, relay_filter_fn fn, void *arg);
+
+/*
+ * Check if fn of filter should see a read. State carries the start of a
+ * pattern over to the next read of the same direction.
+ *
+ * Requires:
+ * 	struct relay_filter *f 		- filter to match with
+ * 	uint32_t *state 		- of direction, AC_START at first
+ * 	unsigned char *buf 		- what was read
+ * 	size_t len 			- amount of bytes read
+ * Returns:
+ * 	1 if it should, 0 if not
+ */
+int
+relay_filter_match(struct relay_filter *f, uint32_t *state, 
+		unsigned char *buf, size_t len);
+
+/*
+ * Release memory of filter
+ */
+void
+relay_filter_free(struct relay_filter *f);
+
+#endif /* __RELAY_FILTER_H__ */
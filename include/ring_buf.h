@@ -0,0 +1,117 @@
+/*
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2022, k4m1
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIA LDAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVE RCAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Byte ring buffer used to queue data waiting for a slow peer.
+ */
+
+#ifndef __RING_BUF_H__
+#define __RING_BUF_H__
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <stddef.h>
+
+#include <buf_pool.h>
+
+/*
+ * head and tail only grow, size is a power of 2 so positions are
+ * masked when used.
+ */
+struct ring_buf {
+	unsigned char *data;
+	size_t size;
+	size_t head; 		/* next byte to read */
+	size_t tail; 		/* next byte to write */
+	struct buf_pool *pool; 	/* where data comes from, 0 for malloc */
+};
+
+static inline size_t
+ring_used(struct ring_buf *r)
+{
+	return r->tail - r->head;
+}
+
+/*
+ * Make room for writing up to want bytes contiguously, growing ring by
+ * doubling while it is no bigger than max_size.
+ *
+ * Requires:
+ * 	struct ring_buf *r 		- ring to operate with
+ * 	size_t want 			- how much we'd like to write
+ * 	size_t max_size 		- how big ring may grow
+ * 	size_t *len 			- where to store size of region
+ * Returns:
+ * 	pointer to region to write to, or 0 if ring is full or allocating
+ * 	memory failed
+ */
+unsigned char *
+ring_reserve(struct ring_buf *r, size_t want, size_t max_size, size_t *len);
+
+/*
+ * Mark len bytes of region returned by ring_reserve() written
+ */
+void
+ring_commit(struct ring_buf *r, size_t len);
+
+/*
+ * Copy len bytes to ring, growing it up to max_size
+ *
+ * Returns:
+ * 	amount of bytes copied
+ */
+size_t
+ring_push(struct ring_buf *r, const void *src, size_t len, size_t max_size);
+
+/*
+ * Describe up to max bytes from start of ring as at most 2 iovecs
+ *
+ * Returns:
+ * 	amount of iovecs filled in
+ */
+int
+ring_peek_iov(struct ring_buf *r, struct iovec iov[2], size_t max);
+
+/*
+ * Drop len bytes from start of ring
+ */
+void
+ring_consume(struct ring_buf *r, size_t len);
+
+/*
+ * Release memory of ring, ring can be reused with the same pool after
+ * this
+ */
+void
+ring_free(struct ring_buf *r);
+
+#endif /* __RING_BUF_H__ */
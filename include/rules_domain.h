@@ -0,0 +1,173 @@
+/*
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2022, k4m1
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIA LDAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVE RCAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Published ruleset that can be replaced while workers run
+ */
+
+#ifndef __RULES_DOMAIN_H__
+#define __RULES_DOMAIN_H__
+
+#include <stdint.h>
+
+#include <stream_match.h>
+
+/* Reader is not looking at the domain, see rules_domain_offline() */
+#define RULES_OFFLINE UINT64_MAX
+
+/*
+ * One generation of rules. Every direction of a connection pins the
+ * generation it matches with, so its matching state stays valid until it
+ * moves to a newer one.
+ */
+struct rules_gen {
+	struct stream_rules rules;
+	uint64_t *hits; 	/* per reader, replacements per rule */
+	size_t stride; 		/* counters of a reader, whole cache lines */
+	uint32_t refs; 		/* connections + 1 while published */
+	uint64_t retired_at; 	/* epoch it was replaced at */
+	struct rules_gen *next; 	/* retired, waiting for grace period */
+};
+
+/*
+ * Epoch each reader has seen last, own cache line so readers don't
+ * slow each other down.
+ */
+struct rules_reader {
+	uint64_t seen;
+} __attribute__((aligned(64)));
+
+/*
+ * Current generation is swapped atomically by one writer thread, and
+ * read without locks by event loops. Generation that was replaced is
+ * released once every reader has passed a quiescent point after the
+ * swap (QSBR), so a reader that loaded the old pointer is done with it.
+ */
+struct rules_domain {
+	struct rules_gen *cur;
+	uint64_t epoch; 	/* bumped on every swap */
+	struct rules_reader *readers;
+	int nreaders;
+	struct rules_gen *retired; 	/* only touched by writer */
+};
+
+/*
+ * Initialise domain with no rules published
+ *
+ * Requires:
+ * 	struct rules_domain *dom 	- domain to initialise
+ * 	int nreaders 			- amount of reader threads
+ * Returns:
+ * 	0 on success or -1 on error
+ */
+int
+rules_domain_init(struct rules_domain *dom, int nreaders);
+
+/*
+ * Publish rules as the current generation, and retire the one they
+ * replace. Writer thread only.
+ *
+ * Requires:
+ * 	struct rules_domain *dom 	- domain to publish to
+ * 	struct stream_rules *rules 	- compiled rules, owned by domain
+ * 					  after this even on error
+ * Returns:
+ * 	0 on success or -1 on error
+ */
+int
+rules_domain_publish(struct rules_domain *dom, struct stream_rules *rules);
+
+/*
+ * Release retired generations whose grace period has passed. Writer
+ * thread only.
+ *
+ * Returns:
+ * 	amount of generations still waiting for readers
+ */
+int
+rules_domain_reclaim(struct rules_domain *dom);
+
+/*
+ * Release everything, no readers may be running
+ */
+void
+rules_domain_destroy(struct rules_domain *dom);
+
+/*
+ * Pin current generation, reader must be online
+ *
+ * Returns:
+ * 	generation to release with rules_gen_put(), or 0 if none
+ */
+struct rules_gen *
+rules_domain_get(struct rules_domain *dom);
+
+/*
+ * Returns:
+ * 	replacement counters per rule of reader, or 0
+ */
+static inline uint64_t *
+rules_gen_hits(struct rules_gen *gen, int reader)
+{
+	return gen->hits ? &gen->hits[(size_t)reader * gen->stride] : 0;
+}
+
+/*
+ * Unpin generation, last one out frees it. Any thread.
+ */
+void
+rules_gen_put(struct rules_gen *gen);
+
+/*
+ * Quiescent point: reader holds no unpinned generation from before
+ * this, and may use the domain again after.
+ */
+static inline void
+rules_domain_online(struct rules_domain *dom, int reader)
+{
+	/* Store must be visible before reader loads dom->cur again */
+	__atomic_store_n(&dom->readers[reader].seen,
+			__atomic_load_n(&dom->epoch, __ATOMIC_RELAXED),
+			__ATOMIC_SEQ_CST);
+}
+
+/*
+ * Extended quiescent state, for when reader blocks. Writer doesn't
+ * wait for readers that are offline.
+ */
+static inline void
+rules_domain_offline(struct rules_domain *dom, int reader)
+{
+	__atomic_store_n(&dom->readers[reader].seen, RULES_OFFLINE,
+			__ATOMIC_RELEASE);
+}
+
+#endif /* __RULES_DOMAIN_H__ */
@@ -0,0 +1,258 @@
+/*
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2022, k4m1
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIA LDAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVE RCAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Streaming pattern replacement over data queued to a ring buffer
+ */
+
+#ifndef __STREAM_MATCH_H__
+#define __STREAM_MATCH_H__
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <ac_match.h>
+#include <ring_buf.h>
+
+/* How long held back bytes may wait for rest of a pattern by default */
+#define STREAM_HOLD_MS 100
+
+/* Directions rule applies to, bit N is direction N of event loop */
+#define STREAM_C2U 	1
+#define STREAM_U2C 	2
+#define STREAM_BOTH 	(STREAM_C2U | STREAM_U2C)
+
+/*
+ * What a rule is built from
+ */
+struct stream_rule_def {
+	unsigned char *what; 	/* pattern, not empty */
+	size_t what_len;
+	unsigned char *with; 	/* replacement, may be empty */
+	size_t with_len;
+	int dirs; 		/* STREAM_C2U and/or STREAM_U2C */
+	uint64_t scope_off; 	/* match only within scope_len bytes */
+	uint64_t scope_len; 	/* from scope_off of direction, 0 for all */
+	uint32_t limit; 	/* per direction of a connection, 0 for any */
+};
+
+/*
+ * Compiled rule
+ */
+struct stream_rule {
+	size_t with_off; 	/* replacement is at rules->with[with_off] */
+	size_t with_len;
+	uint64_t scope_start; 	/* stream offsets match must be within */
+	uint64_t scope_end;
+	uint32_t limit;
+	uint32_t counter; 	/* index to stream_ctx.counts if limit */
+	uint64_t id; 		/* of pattern & replacement, same in every
+				 * ruleset that has the rule */
+};
+
+/*
+ * Counter of a rule with a limit, for finding the same rule in another
+ * ruleset
+ */
+struct stream_counter {
+	uint64_t id; 		/* stream_rule.id */
+	uint32_t counter;
+};
+
+/*
+ * Compiled ruleset, shared by all connections and not modified after
+ * stream_rules_build(). Each direction has an automaton of its own
+ * rules, pattern N of ac[dir] is rule rule_of[dir][N]. Rules, pattern
+ * maps and replacements are in one block of memory.
+ */
+struct stream_rules {
+	struct ac_automaton ac[2];
+	uint32_t *rule_of[2];
+	struct stream_rule *rules;
+	unsigned char *with; 	/* replacements back to back */
+	uint32_t nrules;
+	uint32_t ncounters; 	/* rules with a limit */
+	struct stream_counter *counters; 	/* ncounters, sorted by id */
+};
+
+/*
+ * Replacement of different length than what it replaces. Original bytes
+ * stay in ring, and replacement is sent in their place.
+ */
+struct stream_edit {
+	uint64_t start; 	/* stream offset of original bytes */
+	size_t olen; 		/* amount of original bytes */
+	unsigned char *with;
+	size_t wlen;
+};
+
+/*
+ * Matching state of one direction of a connection. Bytes that may be
+ * start of a pattern continuing in next read are held back at the end
+ * of ring, and are not to be sent before stream_scan() or
+ * stream_release() says so.
+ *
+ * Equal-length replacements are done in ring, others are queued to
+ * edits and the output is sent from ring & rules with
+ * stream_peek_iov() and stream_consume().
+ */
+struct stream_ctx {
+	uint32_t state; 	/* automaton state after last byte scanned */
+	uint64_t pos; 		/* bytes scanned so far */
+	uint64_t done; 		/* stream offset after last replacement */
+	size_t held; 		/* bytes at end of ring held back */
+	struct stream_edit *edits;
+	size_t first; 		/* first edit not sent yet */
+	size_t nedits; 		/* edits[first..nedits] are queued */
+	size_t cap;
+	size_t partial; 	/* bytes of first edit sent already */
+	uint32_t *counts; 	/* replacements per limited rule */
+	uint64_t *hits; 	/* replacements per rule, counters of the
+				 * calling thread, or 0 */
+};
+
+/*
+ * Compile rules
+ *
+ * Requires:
+ * 	struct stream_rules *rules 	- where to build to
+ * 	struct stream_rule_def *defs 	- rules to build
+ * 	uint32_t cnt 			- amount of rules
+ * Returns:
+ * 	0 on success or -1 on error
+ */
+int
+stream_rules_build(struct stream_rules *rules, struct stream_rule_def *defs,
+		uint32_t cnt);
+
+/*
+ * Release memory of rules
+ */
+void
+stream_rules_free(struct stream_rules *rules);
+
+/*
+ * Replace patterns in len bytes just committed to end of ring. Matches
+ * may begin in bytes held back from earlier calls.
+ *
+ * Requires:
+ * 	struct stream_rules *rules 	- what to replace
+ * 	struct stream_ctx *ctx 		- state of direction
+ * 	int dir 			- 0 client->upstream, 1 other way
+ * 	struct ring_buf *r 		- ring data was committed to
+ * 	size_t len 			- amount of new bytes
+ * Returns:
+ * 	0 on success or -1 if out of memory, bytes to hold back are in
+ * 	ctx->held
+ */
+int
+stream_scan(struct stream_rules *rules, struct stream_ctx *ctx, int dir,
+		struct ring_buf *r, size_t len);
+
+/*
+ * Replace patterns in one datagram, matches don't continue from one
+ * datagram to next and scopes are offsets within the datagram. Data
+ * isn't modified, output is described as iovecs like with
+ * stream_peek_iov(). Only limits of rules carry over in ctx.
+ *
+ * Requires:
+ * 	struct stream_rules *rules 	- what to replace
+ * 	struct stream_ctx *ctx 		- state of direction of flow
+ * 	int dir 			- 0 client->upstream, 1 other way
+ * 	unsigned char *data 		- datagram
+ * 	size_t len 			- size of datagram
+ * 	struct iovec *iov 		- where to describe output to
+ * 	int max 			- size of iov
+ * Returns:
+ * 	amount of iovecs filled in, or -1 if iov is too small or out of
+ * 	memory
+ */
+int
+stream_scan_datagram(struct stream_rules *rules, struct stream_ctx *ctx,
+		int dir, unsigned char *data, size_t len, struct iovec *iov,
+		int max);
+
+/*
+ * Describe output that can be sent now as iovecs, unchanged slices of
+ * ring interleaved with replacements.
+ *
+ * Requires:
+ * 	struct stream_ctx *ctx 		- state of direction
+ * 	struct ring_buf *r 		- ring of direction
+ * 	struct iovec *iov 		- where to describe to
+ * 	int max 			- size of iov, at least 2
+ * Returns:
+ * 	amount of iovecs filled in
+ */
+int
+stream_peek_iov(struct stream_ctx *ctx, struct ring_buf *r,
+		struct iovec *iov, int max);
+
+/*
+ * Drop len bytes of output that were sent, and edits that produce no
+ * output at the start of ring.
+ */
+void
+stream_consume(struct stream_ctx *ctx, struct ring_buf *r, size_t len);
+
+/*
+ * Give up on held back bytes, when peer is done or they've waited long
+ * enough. A pattern continuing from them won't be replaced.
+ */
+void
+stream_release(struct stream_ctx *ctx);
+
+/*
+ * Move ctx from one ruleset to another when it's between patterns,
+ * nothing held back and no edits queued. Replacements counted against
+ * limits carry over to rules of the same pattern and replacement.
+ *
+ * Requires:
+ * 	struct stream_ctx *ctx 		- state of direction
+ * 	struct stream_rules *from 	- rules ctx was used with
+ * 	struct stream_rules *to 	- rules ctx is used with after
+ * Returns:
+ * 	0 on success or -1 if out of memory, ctx is unchanged then
+ */
+int
+stream_ctx_rebind(struct stream_ctx *ctx, struct stream_rules *from,
+		struct stream_rules *to);
+
+/*
+ * Release memory of ctx, ctx can be reused after this
+ */
+void
+stream_ctx_free(struct stream_ctx *ctx);
+
+#endif /* __STREAM_MATCH_H__ */
@@ -0,0 +1,148 @@
+/*
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2022, k4m1
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIA LDAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVE RCAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * ABI of interception plugins, shared objects tap loads with dlopen().
+ * This is the only header a plugin needs.
+ */
+
+#ifndef __TAP_PLUGIN_H__
+#define __TAP_PLUGIN_H__
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <netinet/in.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Version of this ABI, bumped when functions are added to the end of
+ * struct tap_plugin. tap loads plugins of this version or older, and
+ * refuses ones built against a newer header.
+ */
+#define TAP_PLUGIN_ABI 1
+
+/* Symbol plugin exports, see tap_plugin_entry_fn */
+#define TAP_PLUGIN_ENTRY "tap_plugin_entry"
+
+/* Directions */
+#define TAP_PLUGIN_C2U 0 	/* client to upstream */
+#define TAP_PLUGIN_U2C 1 	/* upstream to client */
+
+/* What data() did */
+#define TAP_PLUGIN_PASS 0 	/* relay input, maybe changed in place */
+#define TAP_PLUGIN_REWRITE 1 	/* relay *out instead */
+#define TAP_PLUGIN_CLOSE -1 	/* close connection */
+
+/*
+ * Connection as plugin sees it. Every call for a connection is made
+ * from the worker thread that owns it, one at a time, so state needs
+ * no locking.
+ */
+struct tap_plugin_conn {
+	uint64_t id; 			/* unique within worker */
+	int worker; 			/* 0 .. workers - 1 */
+	struct sockaddr_in client; 	/* peer of accepted socket */
+	void *state; 			/* plugin's own, 0 until set */
+};
+
+/*
+ * Functions of plugin. Any but data may be 0.
+ */
+struct tap_plugin {
+	uint32_t abi; 		/* TAP_PLUGIN_ABI plugin was built with */
+	uint32_t size; 		/* sizeof(struct tap_plugin) of plugin */
+	const char *name;
+
+	/*
+	 * Called once after loading, before any connection
+	 *
+	 * Requires:
+	 * 	const char *arg 	- --plugin-arg, or 0
+	 * 	void **global 		- where to put state passed to others
+	 * Returns:
+	 * 	0 on success or -1 to refuse to run
+	 */
+	int (*init)(const char *arg, void **global);
+
+	/*
+	 * Called once after every connection has been closed
+	 */
+	void (*fini)(void *global);
+
+	/*
+	 * Called for a new connection before any of its data
+	 *
+	 * Returns:
+	 * 	0 on success or -1 to close the connection
+	 */
+	int (*conn_open)(void *global, struct tap_plugin_conn *conn);
+
+	/*
+	 * Called once for every connection conn_open() accepted, release
+	 * conn->state here
+	 */
+	void (*conn_close)(void *global, struct tap_plugin_conn *conn);
+
+	/*
+	 * Called with a batch of data read from one side, in order. Input
+	 * may be changed in place. Output is a list of iovecs plugin owns,
+	 * they may point to input, to conn->state or anywhere else, and
+	 * they need to stay valid only until data() returns. Output may be
+	 * longer or shorter than input, or empty to drop it.
+	 *
+	 * Requires:
+	 * 	void *global 			- from init()
+	 * 	struct tap_plugin_conn *conn 	- connection data is of
+	 * 	int dir 			- TAP_PLUGIN_C2U/U2C
+	 * 	const struct iovec *iov 	- what was read
+	 * 	int iovcnt 			- amount of iovecs
+	 * 	struct iovec **out 		- where to put output
+	 * 	int *outcnt 			- where to put amount of it
+	 * Returns:
+	 * 	TAP_PLUGIN_PASS, TAP_PLUGIN_REWRITE or TAP_PLUGIN_CLOSE
+	 */
+	int (*data)(void *global, struct tap_plugin_conn *conn, int dir,
+			const struct iovec *iov, int iovcnt,
+			struct iovec **out, int *outcnt);
+};
+
+/*
+ * Type of TAP_PLUGIN_ENTRY
+ *
+ * Returns:
+ * 	functions of plugin, which stay valid until it's unloaded
+ */
+typedef const struct tap_plugin *(*tap_plugin_entry_fn)(void);
+
+#endif /* __TAP_PLUGIN_H__ */
@@ -0,0 +1,186 @@
+/*
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2022, k4m1
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIA LDAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVE RCAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * TLS termination toward clients and origination toward upstreams
+ */
+
+#ifndef __TLS_RELAY_H__
+#define __TLS_RELAY_H__
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <openssl/ssl.h>
+
+#include <event_loop.h>
+
+/* Sides of a connection */
+#define TLS_CLIENT 	0
+#define TLS_UPSTREAM 	1
+
+/* Handshakes a connection waits for, tap_conn.handshaking */
+#define TLS_HS_CLIENT 	(1 << TLS_CLIENT)
+#define TLS_HS_UPSTREAM (1 << TLS_UPSTREAM)
+
+/* What kernel does for a socket, ev_source.ktls */
+#define TLS_KTLS_TX 	1
+#define TLS_KTLS_RX 	2
+
+/* Plaintext of a full record, directions with TLS read this much */
+#define TLS_RECORD_MAX 	16384
+
+/* Session tickets server side hands to each client */
+#define TLS_TICKETS 1
+
+/*
+ * Contexts shared by every worker
+ */
+struct tls_config {
+	SSL_CTX *server; 	/* terminates clients, or 0 */
+	SSL_CTX *client; 	/* originates to upstreams, or 0 */
+	char *sni; 		/* name sent to & verified of upstream, or 0 */
+};
+
+/*
+ * Build TLS contexts. Clients are served cert if it's given, and
+ * upstreams are connected to with TLS if upstream is set, verified
+ * against ca if it's given. Sessions are resumed on both sides, with
+ * tickets toward clients and a session per backend toward upstreams.
+ * With ktls, kernel does the record layer when it can.
+ *
+ * Requires:
+ * 	struct tls_config *tc 		- contexts to build
+ * 	char *cert 			- certificate chain PEM file, or 0
+ * 	char *key 			- private key PEM file of cert
+ * 	int upstream 			- originate TLS to upstreams
+ * 	char *ca 			- CA PEM file to verify upstream, or 0
+ * 	char *sni 			- name of upstream, or 0
+ * 	int ktls 			- try kernel TLS
+ * Returns:
+ * 	0 on success or -1 on error
+ */
+int
+tls_config_init(struct tls_config *tc, char *cert, char *key, int upstream,
+		char *ca, char *sni, int ktls);
+
+/*
+ * Release contexts, connections using them must be gone
+ */
+void
+tls_config_free(struct tls_config *tc);
+
+/*
+ * Set up session cache of loop, a slot for every backend
+ *
+ * Returns:
+ * 	0 on success or -1 on error
+ */
+int
+tls_cache_init(struct event_loop *loop);
+
+/*
+ * Release sessions cached by loop
+ */
+void
+tls_cache_free(struct event_loop *loop);
+
+/*
+ * Start handshake with client of new connection
+ *
+ * Returns:
+ * 	0 on success or -1 on error
+ */
+int
+tls_conn_accept(struct event_loop *loop, struct tap_conn *conn);
+
+/*
+ * Start handshake with upstream of connection, its socket is
+ * connected. Session of backend is resumed if there's one.
+ *
+ * Returns:
+ * 	0 on success or -1 on error
+ */
+int
+tls_conn_connect(struct event_loop *loop, struct tap_conn *conn);
+
+/*
+ * Continue handshakes connection waits for
+ *
+ * Returns:
+ * 	0 if no error, conn->handshaking is 0 once done, or -1 on error
+ */
+int
+tls_handshake(struct event_loop *loop, struct tap_conn *conn);
+
+/*
+ * Read like recv() from source with TLS
+ *
+ * Returns:
+ * 	amount of bytes read, 0 on eof, -1 on error with errno set
+ */
+ssize_t
+tls_recv(struct event_loop *loop, struct ev_source *src, void *buf,
+		size_t len);
+
+/*
+ * Write like sendmsg() to destination with TLS
+ *
+ * Returns:
+ * 	amount of bytes written, -1 on error with errno set
+ */
+ssize_t
+tls_sendv(struct event_loop *loop, struct ev_source *dst,
+		struct iovec *iov, size_t cnt);
+
+/*
+ * Tell peer with TLS we won't send more, best effort
+ */
+void
+tls_shutdown(struct event_loop *loop, struct ev_source *dst);
+
+/*
+ * Check if src and dst of direction can be read & written as plain
+ * sockets, as the kernel does TLS for them or they have none.
+ *
+ * Returns:
+ * 	1 if they can, 0 otherwise
+ */
+int
+tls_plain(struct ev_source *src, struct ev_source *dst);
+
+/*
+ * Release TLS state of connection
+ */
+void
+tls_conn_free(struct tap_conn *conn);
+
+#endif /* __TLS_RELAY_H__ */
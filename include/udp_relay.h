@@ -0,0 +1,139 @@
+/*
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2022, k4m1
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIA LDAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVE RCAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * UDP relaying, datagrams of every client 4-tuple go through their own
+ * connected upstream socket.
+ */
+
+#ifndef __UDP_RELAY_H__
+#define __UDP_RELAY_H__
+
+#include <netinet/in.h>
+
+#include <stdint.h>
+
+#include <event_loop.h>
+#include <rules_domain.h>
+#include <stream_match.h>
+
+/* Datagrams received with one recvmmsg(), and receive buffers */
+#define UDP_BATCH 64
+
+/* Size of a receive buffer, GRO gives up to this much at once */
+#define UDP_BUF_SIZE (64 * 1024)
+
+/* Datagrams queued for sending before we have to flush */
+#define UDP_OUT_MAX 1024
+
+/* Most iovecs one datagram takes after rules, and all of them */
+#define UDP_DGRAM_IOV 64
+#define UDP_IOV_MAX (UDP_OUT_MAX * 4)
+
+/* Most datagrams sent as one with UDP_SEGMENT */
+#define UDP_GSO_SEGS 64
+
+/* Flow is closed after this long without datagrams either way */
+#define UDP_IDLE_MS 30000
+
+/* Flow table starts with this many slots */
+#define UDP_FLOWS_MIN 256
+
+/*
+ * Client 4-tuple and its own socket to upstream
+ */
+struct udp_flow {
+	struct ev_source src; 	/* first, epoll events point here */
+	struct sockaddr_in client;
+	struct in_addr local; 	/* address client sent to */
+	uint32_t hash; 		/* of above, place in table */
+	uint64_t last_ms; 	/* last datagram either way */
+	struct backend *backend; 	/* upstream picked, or 0 */
+	struct rules_gen *rules_gen; 	/* pinned for life of flow */
+	struct stream_ctx match[2]; 	/* rule limits of directions */
+	int queued; 		/* first C2U datagram waiting, or -1 */
+	int queued_tail;
+	struct udp_flow *next_queued; 	/* flows with C2U waiting */
+	struct udp_flow *prev; 	/* lru of loop */
+	struct udp_flow *next;
+	struct udp_flow *next_dead;
+};
+
+/*
+ * Set up UDP relaying of loop, nothing is bound yet
+ */
+void
+udp_relay_init(struct event_loop *loop);
+
+/*
+ * Register bound UDP socket to loop, clients send datagrams to it.
+ * Socket is owned by the loop after this.
+ *
+ * Requires:
+ * 	struct event_loop *loop 	- loop to operate with
+ * 	int sock 			- bound UDP socket
+ * Returns:
+ * 	0 on success or -1 on error
+ */
+int
+udp_relay_add_listener(struct event_loop *loop, int sock);
+
+/*
+ * Handle epoll event of listener or flow socket
+ */
+void
+udp_relay_event(struct event_loop *loop, struct ev_source *src);
+
+/*
+ * Send datagrams queued during event batch
+ */
+void
+udp_relay_flush(struct event_loop *loop);
+
+/*
+ * Free flows closed during event batch
+ */
+void
+udp_relay_reap(struct event_loop *loop);
+
+/*
+ * Stop taking datagrams, close listener and every flow
+ */
+void
+udp_relay_stop(struct event_loop *loop);
+
+/*
+ * Close everything and release memory
+ */
+void
+udp_relay_destroy(struct event_loop *loop);
+
+#endif /* __UDP_RELAY_H__ */
@@ -0,0 +1,104 @@
+/*
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2022, k4m1
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIA LDAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVE RCAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Warm pool of connections to upstream
+ */
+
+#ifndef __UPSTREAM_POOL_H__
+#define __UPSTREAM_POOL_H__
+
+#include <stdint.h>
+
+#include <event_loop.h>
+#include <ev_timer.h>
+
+/* Pool shrinks back toward pool_min after this long without misses */
+#define POOL_DECAY_MS 10000
+
+/*
+ * Connection to upstream made before any client needs it
+ */
+struct warm_conn {
+	struct ev_source src; 	/* first, epoll events point here */
+	struct ev_timer timer; 	/* connect timeout */
+	int connected;
+	struct backend *backend; 	/* goes with socket to client */
+	struct warm_conn *prev;
+	struct warm_conn *next;
+};
+
+/*
+ * Set up pool of loop, nothing is connected yet
+ */
+void
+upstream_pool_init(struct event_loop *loop);
+
+/*
+ * Start connecting until there are as many warm connections as pool
+ * wants. Does nothing while backing off after failures.
+ */
+void
+upstream_pool_fill(struct event_loop *loop);
+
+/*
+ * Give a warm connection to a client. Socket is registered to epoll
+ * with src instead of pool.
+ *
+ * Requires:
+ * 	struct event_loop *loop 	- loop to operate with
+ * 	struct ev_source *src 		- upstream source of connection
+ * Returns:
+ * 	0 if src->fd is now connected to upstream, or -1 if pool had none
+ */
+int
+upstream_pool_take(struct event_loop *loop, struct ev_source *src);
+
+/*
+ * Handle epoll event of a warm connection
+ */
+void
+upstream_pool_event(struct event_loop *loop, struct ev_source *src,
+		uint32_t events);
+
+/*
+ * Free warm connections dropped during event batch
+ */
+void
+upstream_pool_reap(struct event_loop *loop);
+
+/*
+ * Close every warm connection
+ */
+void
+upstream_pool_destroy(struct event_loop *loop);
+
+#endif /* __UPSTREAM_POOL_H__ */
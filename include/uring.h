@@ -0,0 +1,174 @@
+/*
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2022, k4m1
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIA LDAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVE RCAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Minimal io_uring helpers on top of the raw system calls, just what
+ * the relay needs: ring setup, sqe/cqe handling and provided buffer
+ * rings.
+ */
+
+#ifndef __URING_H__
+#define __URING_H__
+
+#include <sys/types.h>
+
+#include <linux/io_uring.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct uring {
+	int fd;
+	unsigned features;
+	unsigned sq_entries;
+	unsigned cq_entries;
+	unsigned sqe_tail; 		/* sqes handed out, not visible yet */
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring;
+	void *cq_ring;
+	size_t sq_ring_size;
+	size_t cq_ring_size;
+	size_t sqes_size;
+};
+
+/*
+ * Ring of buffers provided to the kernel, recv picks a buffer itself
+ * and tells us which one in cqe flags.
+ */
+struct uring_buf_ring {
+	struct io_uring_buf_ring *ring;
+	unsigned char *bufs;
+	size_t ring_size;
+	size_t buf_size;
+	unsigned entries;
+	unsigned short tail;
+	unsigned short bgid;
+};
+
+/*
+ * Set up io_uring instance
+ *
+ * Requires:
+ * 	struct uring *r 		- ring to initialise
+ * 	unsigned entries 		- sq size, power of 2
+ * Returns:
+ * 	0 on success or -errno on error
+ */
+int
+uring_init(struct uring *r, unsigned entries);
+
+/*
+ * Tear down io_uring instance, pending requests are cancelled.
+ */
+void
+uring_exit(struct uring *r);
+
+/*
+ * Check if kernel supports an opcode
+ *
+ * Returns:
+ * 	1 if it does, 0 if not
+ */
+int
+uring_op_supported(struct uring *r, int op);
+
+/*
+ * Get empty sqe to fill in
+ *
+ * Returns:
+ * 	pointer to sqe, or 0 if submission queue is full
+ */
+struct io_uring_sqe *
+uring_get_sqe(struct uring *r);
+
+/*
+ * Submit queued sqes and wait for at least wait_nr completions
+ *
+ * Returns:
+ * 	amount of sqes submitted or -errno on error
+ */
+int
+uring_submit(struct uring *r, unsigned wait_nr);
+
+/*
+ * Returns:
+ * 	next completion or 0 if there's none
+ */
+struct io_uring_cqe *
+uring_peek_cqe(struct uring *r);
+
+/*
+ * Mark completion returned by uring_peek_cqe() consumed
+ */
+void
+uring_cqe_seen(struct uring *r);
+
+/*
+ * Register ring of entries * buf_size byte buffers as buffer group bgid
+ *
+ * Returns:
+ * 	0 on success or -errno on error
+ */
+int
+uring_buf_ring_init(struct uring *r, struct uring_buf_ring *br,
+		unsigned entries, size_t buf_size, unsigned short bgid);
+
+/*
+ * Unregister & free buffer ring
+ */
+void
+uring_buf_ring_free(struct uring *r, struct uring_buf_ring *br);
+
+/*
+ * Returns:
+ * 	pointer to buffer bid of ring
+ */
+static inline unsigned char *
+uring_buf(struct uring_buf_ring *br, unsigned bid)
+{
+	return &br->bufs[(size_t)bid * br->buf_size];
+}
+
+/*
+ * Give buffer bid back to kernel
+ */
+void
+uring_buf_ring_put(struct uring_buf_ring *br, unsigned bid);
+
+#endif /* __URING_H__ */
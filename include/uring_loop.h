@@ -0,0 +1,73 @@
+/*
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2022, k4m1
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIA LDAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVE RCAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * io_uring backend for the event loop.
+ */
+
+#ifndef __URING_LOOP_H__
+#define __URING_LOOP_H__
+
+#include <event_loop.h>
+
+/* Memory we give to kernel for receiving, per loop */
+#define URING_BUF_MEM (32 * 1024 * 1024)
+#define URING_BUFS_MIN 64
+#define URING_BUFS_MAX 4096
+#define URING_ENTRIES 4096
+
+/*
+ * Set up io_uring for loop, checks kernel supports everything we use.
+ *
+ * Requires:
+ * 	struct event_loop *loop 	- loop being initialised
+ * Returns:
+ * 	0 on success or -1 if io_uring can't be used
+ */
+int
+uring_loop_init(struct event_loop *loop);
+
+/*
+ * Run loop with io_uring, see ev_loop_run()
+ *
+ * Returns:
+ * 	0 on clean exit or -1 on error
+ */
+int
+uring_loop_run(struct event_loop *loop);
+
+/*
+ * Tear down io_uring and every connection of loop
+ */
+void
+uring_loop_destroy(struct event_loop *loop);
+
+#endif /* __URING_LOOP_H__ */
@@ -0,0 +1,191 @@
+/*
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2022, k4m1
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIA LDAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVE RCAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Example plugin, replaces WHAT with WITH within each read when loaded
+ * with --plugin-arg WHAT=WITH. Output is built into a buffer of the
+ * connection, so reads need no allocation once it's big enough, and
+ * the parts before the first match are relayed from the read itself.
+ */
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <tap_plugin.h>
+
+struct replace {
+	unsigned char *what;
+	size_t what_len;
+	unsigned char *with;
+	size_t with_len;
+};
+
+/* Output of a connection */
+struct replace_conn {
+	unsigned char *buf;
+	size_t size;
+	struct iovec out[2];
+};
+
+static int
+replace_init(const char *arg, void **global)
+{
+	struct replace *r;
+	char *eq;
+
+	if (!arg || !(eq = strchr(arg, '=')) || (eq == arg)) {
+		return -1;
+	}
+	r = (struct replace *)calloc(1, sizeof(*r));
+	if (!r) {
+		return -1;
+	}
+	r->what = (unsigned char *)strndup(arg, (size_t)(eq - arg));
+	r->with = (unsigned char *)strdup(eq + 1);
+	if (!r->what || !r->with) {
+		free(r->what);
+		free(r->with);
+		free(r);
+		return -1;
+	}
+	r->what_len = (size_t)(eq - arg);
+	r->with_len = strlen(eq + 1);
+	*global = r;
+	return 0;
+}
+
+static void
+replace_fini(void *global)
+{
+	struct replace *r;
+
+	r = (struct replace *)global;
+	free(r->what);
+	free(r->with);
+	free(r);
+}
+
+static int
+replace_conn_open(void *global, struct tap_plugin_conn *conn)
+{
+	(void)global;
+	conn->state = calloc(1, sizeof(struct replace_conn));
+	return conn->state ? 0 : -1;
+}
+
+static void
+replace_conn_close(void *global, struct tap_plugin_conn *conn)
+{
+	struct replace_conn *c;
+
+	(void)global;
+	c = (struct replace_conn *)conn->state;
+	free(c->buf);
+	free(c);
+	conn->state = 0;
+}
+
+static int
+replace_data(void *global, struct tap_plugin_conn *conn, int dir,
+		const struct iovec *iov, int iovcnt, struct iovec **out,
+		int *outcnt)
+{
+	struct replace_conn *c;
+	struct replace *r;
+	unsigned char *buf;
+	unsigned char *hit;
+	unsigned char *p;
+	size_t need;
+	size_t len;
+	size_t off;
+
+	(void)dir;
+	r = (struct replace *)global;
+	c = (struct replace_conn *)conn->state;
+	/* Tap passes one read at a time, see tap_plugin.h for more */
+	if (iovcnt != 1) {
+		return TAP_PLUGIN_CLOSE;
+	}
+	buf = (unsigned char *)iov[0].iov_base;
+	len = iov[0].iov_len;
+	hit = (unsigned char *)memmem(buf, len, r->what, r->what_len);
+	if (!hit) {
+		return TAP_PLUGIN_PASS;
+	}
+	/* Every match may grow the rest by with_len */
+	need = (len / r->what_len + 1) * r->with_len + len;
+	if (need > c->size) {
+		p = (unsigned char *)realloc(c->buf, need);
+		if (!p) {
+			return TAP_PLUGIN_CLOSE;
+		}
+		c->buf = p;
+		c->size = need;
+	}
+	c->out[0].iov_base = buf;
+	c->out[0].iov_len = (size_t)(hit - buf);
+	off = 0;
+	while (hit) {
+		memcpy(c->buf + off, r->with, r->with_len);
+		off += r->with_len;
+		p = hit + r->what_len;
+		hit = (unsigned char *)memmem(p, (size_t)(buf + len - p),
+				r->what, r->what_len);
+		need = (size_t)((hit ? hit : buf + len) - p);
+		memcpy(c->buf + off, p, need);
+		off += need;
+	}
+	c->out[1].iov_base = c->buf;
+	c->out[1].iov_len = off;
+	*out = c->out;
+	*outcnt = 2;
+	return TAP_PLUGIN_REWRITE;
+}
+
+static const struct tap_plugin replace_plugin = {
+	.abi = TAP_PLUGIN_ABI,
+	.size = sizeof(struct tap_plugin),
+	.name = "replace",
+	.init = replace_init,
+	.fini = replace_fini,
+	.conn_open = replace_conn_open,
+	.conn_close = replace_conn_close,
+	.data = replace_data,
+};
+
+const struct tap_plugin *
+tap_plugin_entry(void)
+{
+	return &replace_plugin;
+}
@@ -1,13 +1,22 @@
 #!/usr/local/bin/python3
 import argparse
+import asyncio
+import os
 from socket import *
 import select
+import signal
 import ssl
 import string
 import sys
 import threading
 from time import sleep
 
+# Native relay engine, built with `make python`
+try:
+    import _tap
+except ImportError:
+    _tap = None
+
 def decode(data) -> str:
     ret = ""
     try:
@@ -65,10 +74,14 @@ class tap:
                  win_size=4096,
                  tls=False, tls_key_private=False,
                  tls_key_public=False, threads=20, callback=None,
-                 backlog=1):
+                 backlog=1, patterns=None, workers=1, native=True,
+                 admin=None, use_async=True):
         self.running = False
+        self.native_running = False
         self.threads = []
         self.lsock = None
+        self.aloop = None
+        self.serving = None
 
         self.backlog = backlog
         self.win_size = win_size
@@ -82,7 +95,16 @@ class tap:
         # TODO: implement preset/user provided private/public key usage
         self.tls_privkey = tls_key_public
         self.tls_pubkey = tls_key_private
+        # Concurrent connections, new ones wait in backlog
         self.max_threads = threads
+        self.slots = threading.BoundedSemaphore(max(threads, 1))
+        # Callback only sees reads containing one of these, if given
+        self.patterns = [p.encode() if (type(p) == str) else p
+                         for p in (patterns or [])]
+        self.workers = workers
+        self.native = native
+        self.admin = admin
+        self.use_async = use_async
 
         if (callback != None):
             self.callback = callback
@@ -95,6 +117,8 @@ class tap:
     def bind(self):
         try:
             self.lsock = socket(AF_INET, self.proto, 0)
+            # Don't wait for connections of last run to time out
+            self.lsock.setsockopt(SOL_SOCKET, SO_REUSEADDR, 1)
             self.lsock.bind((self.lhost, self.lport))
             self.lsock.listen(self.backlog)
         except Exception as err:
@@ -109,7 +133,9 @@ class tap:
             sock = socket(AF_INET, self.proto, 0)
             sock.connect((self.rhost, self.rport))
         except Exception as err:
-            error(err)
+            self.error(err)
+            sock.close()
+            sock = None
         finally:
             return sock
 
@@ -142,47 +168,96 @@ class tap:
         finally:
             return ret
 
-    # Try to transmit data, return amount of bytes sent on success or
-    # 0 on error
+    # Try to transmit data, return amount of bytes sent on success, 0
+    # if socket didn't get writable within timeout or -1 on error
     #
     def tx(self, sock, data, timeout=None) -> int:
-        ret = 0
+        ret = -1
         try:
             writable = select.select([], [sock], [], timeout)
+            ret = 0
             if (len(writable[1]) != 0):
                 ret = sock.send(data)
         except:
-            pass
+            ret = -1
         finally:
             return ret
 
+    # Check if callback should see first n bytes of data, see patterns
+    # of __init__
+    #
+    def matches(self, data, n=None) -> bool:
+        if (n is None):
+            n = len(data)
+        if (not self.patterns):
+            return True
+        for p in self.patterns:
+            if (data.find(p, 0, n) >= 0):
+                return True
+        return False
+
+    # Check if there's a callback to call at all
+    #
+    def intercepting(self) -> bool:
+        return ((self.callback != tap.callback_default) or
+                bool(self.patterns))
+
+    # Pass data read through callback if it matches, return bytes to
+    # send or None to send nothing
+    #
+    def intercept(self, data):
+        if (self.matches(data)):
+            data = self.callback(data)
+        if (type(data) == str):
+            data = data.encode()
+        return data
+
+    # Close both sockets of connection once both directions are done,
+    # and give its slot to next connection
+    #
+    def relay_done(self, session, conn_in, conn_out):
+        with session["lock"]:
+            session["left"] -= 1
+            if (session["left"] != 0):
+                return
+        for sock in (conn_in, conn_out):
+            try:
+                sock.close()
+            except Exception as err:
+                self.log("Failed to close connection: %s" % err)
+        self.slots.release()
+
     # relay data from connection A to connection B via modifier function
     #
-    def relay(self, conn_in, conn_out):
+    def relay(self, conn_in, conn_out, session):
+        eof = False
         while (self.running):
             # XXX: Should we have timeout? select isn't blocking, right?
             data = self.rx(conn_in, timeout=None)
-            data = self.callback(data)
-            if (type(data) == str):
-                data = data.encode()
-            if (data != None):
-                stat = 0
-                while (stat != len(data)):
-                    if (self.running == False):
-                        break
-                    stat = self.tx(conn_out, data, timeout=None)
-                    # Retry until we've sent all the data
-                    data = data[stat:]
-        try:
-            conn_in.close()
-        except Exception as err:
-            self.log("Failed to close inbound connection: %s" % err)
-            pass
+            if (not data):
+                # b"" is end of stream, None an error
+                eof = (data == b"")
+                break
+            data = self.intercept(data)
+            # Retry until we've sent all the data
+            while (data and self.running):
+                stat = self.tx(conn_out, data, timeout=None)
+                if (stat < 0):
+                    break
+                data = data[stat:]
+            if (data):
+                # Send failed or we're stopping, close both
+                break
         try:
-            conn_out.close()
-        except Exception as err:
-            self.log("Failed to close outbound connection: %s" % err)
+            if (eof):
+                # Other direction may still have something to say
+                conn_out.shutdown(SHUT_WR)
+            else:
+                conn_in.shutdown(SHUT_RDWR)
+                conn_out.shutdown(SHUT_RDWR)
+        except OSError:
             pass
+        self.relay_done(session, conn_in, conn_out)
 
     # Handle inbound connection, connect to remote peer and
     # pass both connections to connection handler
@@ -195,17 +270,159 @@ class tap:
         cout = self.conn()
         if (cout == None):
             cin.close()
+            self.slots.release()
             return
-        t1 = threading.Thread(target=self.relay, args=(cin, cout,))
-        t2 = threading.Thread(target=self.relay, args=(cout, cin,))
+        session = { "lock": threading.Lock(), "left": 2 }
+        t1 = threading.Thread(target=self.relay, args=(cin, cout, session))
+        t2 = threading.Thread(target=self.relay, args=(cout, cin, session))
+        # Forget threads of connections that are done
+        self.threads = [t for t in self.threads if t.is_alive()]
         self.threads.append(t1)
         self.threads.append(t2)
         t1.start()
         t2.start()
 
+    # Relay one direction, reading up to win_size bytes at a time to a
+    # buffer of its own. Data nothing intercepts is sent from a
+    # memoryview of the buffer, and sock_sendall() slices it further on
+    # partial sends, so bytes aren't copied. Returns at end of stream,
+    # after telling dst nothing more is coming.
+    #
+    async def pump(self, loop, src, dst):
+        buf = bytearray(self.win_size)
+        view = memoryview(buf)
+        intercepting = self.intercepting()
+        while True:
+            n = await loop.sock_recv_into(src, buf)
+            if (n == 0):
+                break
+            if (intercepting and self.matches(buf, n)):
+                data = self.intercept(bytes(view[:n]))
+                if (not data):
+                    continue
+            else:
+                data = view[:n]
+            await loop.sock_sendall(dst, data)
+        try:
+            dst.shutdown(SHUT_WR)
+        except OSError:
+            pass
+
+    # Relay connection until both directions are done, or either one
+    # fails, then close it and give its slot to next connection
+    #
+    async def session(self, loop, cin, addr, slots):
+        cout = None
+        pumps = []
+        try:
+            self.log("Got connection from %s" % str(addr))
+            cin.setblocking(False)
+            cout = socket(AF_INET, self.proto, 0)
+            cout.setblocking(False)
+            await loop.sock_connect(cout, self.raddr)
+            pumps = [loop.create_task(self.pump(loop, cin, cout)),
+                     loop.create_task(self.pump(loop, cout, cin))]
+            await asyncio.gather(*pumps)
+        except OSError as err:
+            self.error(err)
+        finally:
+            for p in pumps:
+                p.cancel()
+            await asyncio.gather(*pumps, return_exceptions=True)
+            cin.close()
+            if (cout != None):
+                cout.close()
+            slots.release()
+
+    # Accept connections while there are free slots, a task per
+    # connection and one per direction
+    #
+    async def serve(self):
+        loop = asyncio.get_running_loop()
+        slots = asyncio.Semaphore(max(self.max_threads, 1))
+        sessions = set()
+        # Resolved once here, not by a thread per connect
+        self.raddr = (gethostbyname(self.rhost), self.rport)
+        self.lsock.setblocking(False)
+        self.log("Started proxying with asyncio...")
+        try:
+            while (self.running):
+                await slots.acquire()
+                try:
+                    conn, addr = await loop.sock_accept(self.lsock)
+                except OSError as err:
+                    slots.release()
+                    self.error(err)
+                    continue
+                task = loop.create_task(self.session(loop, conn, addr,
+                                                     slots))
+                sessions.add(task)
+                task.add_done_callback(sessions.discard)
+        finally:
+            for task in list(sessions):
+                task.cancel()
+            await asyncio.gather(*sessions, return_exceptions=True)
+
+    # Relay with asyncio, every connection in this one thread
+    #
+    def run_async(self):
+        self.running = True
+        self.bind()
+        if (not self.running):
+            return
+        self.aloop = asyncio.new_event_loop()
+        self.serving = self.aloop.create_task(self.serve())
+        try:
+            self.aloop.run_until_complete(self.serving)
+        except (KeyboardInterrupt, asyncio.CancelledError):
+            self.log("Got interrupted, quiting")
+            self.serving.cancel()
+            try:
+                self.aloop.run_until_complete(self.serving)
+            except (KeyboardInterrupt, asyncio.CancelledError):
+                pass
+        finally:
+            self.running = False
+            self.aloop.close()
+            self.aloop = None
+            self.lsock.close()
+
+    # Check if native engine can do what we were asked to
+    #
+    def can_run_native(self) -> bool:
+        return ((_tap is not None) and self.native and
+                (self.proto == SOCK_STREAM) and (not self.use_tls))
+
+    # Relay with native engine, bytes are moved by its worker threads
+    # with GIL released and callback is only called for reads that
+    # match patterns. Returns once interrupted or quit() is called.
+    #
+    def run_native(self):
+        cb = self.callback
+        if ((cb == tap.callback_default) and (not self.patterns)):
+            # Nothing to intercept, let the engine splice
+            cb = None
+        self.log("Started proxying with native engine...")
+        self.native_running = True
+        try:
+            _tap.run(self.lhost, self.lport, self.rhost, self.rport,
+                     ws=self.win_size, workers=self.workers,
+                     callback=cb, patterns=self.patterns or None,
+                     admin=self.admin)
+        except Exception as err:
+            self.error(err)
+        finally:
+            self.native_running = False
+
     # Listen for inbound connections from target, and handle them
     # 
     def run(self):
+        if (self.can_run_native()):
+            self.run_native()
+            return
+        if (self.use_async and (self.proto == SOCK_STREAM)):
+            self.run_async()
+            return
         self.running = True
         self.bind()
         tui = threading.Thread(target=self.tui)
@@ -215,7 +432,14 @@ class tap:
             self.lsock.settimeout(0.1)
         while (self.running):
             try:
-                conn, addr = self.lsock.accept()
+                # At --mt connections, wait for one to finish first
+                if (not self.slots.acquire(timeout=0.1)):
+                    continue
+                try:
+                    conn, addr = self.lsock.accept()
+                except:
+                    self.slots.release()
+                    raise
                 self.log("Got connection from %s" % str(addr))
                 self.connect_sockets(conn)
             except KeyboardInterrupt:
@@ -238,7 +462,14 @@ class tap:
     # Set running to False, and wait for threads to be terminated
     #
     def quit(self):
+        if (self.native_running):
+            # Engine stops on SIGTERM like bin/tap does
+            os.kill(os.getpid(), signal.SIGTERM)
+            return
         self.running = False
+        if (self.aloop != None):
+            self.aloop.call_soon_threadsafe(self.serving.cancel)
+            return
         for t in self.threads:
             try:
                 t.join()
@@ -354,6 +585,34 @@ def main():
             help="Show callback function usage and quit",
             action='store_true'
             )
+    parser.add_argument(
+            "--pattern",
+            action="append",
+            help="Only pass reads containing PATTERN to callback, may be given many times",
+            default=None
+            )
+    parser.add_argument(
+            "--workers",
+            type=int,
+            help="Worker threads of native engine, defaults to 1",
+            default=1
+            )
+    parser.add_argument(
+            "--admin",
+            type=str,
+            help="Serve metrics of native engine at unix:PATH or HOST:PORT",
+            default=None
+            )
+    parser.add_argument(
+            "--no-native",
+            help="Relay with Python threads even if native engine is built",
+            action='store_true'
+            )
+    parser.add_argument(
+            "--threads",
+            help="Without native engine, relay with two threads per connection instead of asyncio",
+            action='store_true'
+            )
     parser.add_argument(
             "--backlog",
             type=int,
@@ -376,14 +635,15 @@ def main():
     if ((not args.rhost) or (not args.rport) or (not args.lport)):
         print("Missing required parameters, see %s -h for usage" % sys.argv[0])
         return
+    cb = None
     if (args.callback is not None):
         if ("interactive" in args.callback):
             cb = tap.callback_intercept
-    else:
-        cb = None
     t = tap(args.rport, args.lport, args.rhost, args.lhost, proto=proto,
             win_size=args.ws, tls=args.ssl, threads=args.mt, callback=cb, 
-            backlog=args.backlog)
+            backlog=args.backlog, patterns=args.pattern, 
+            workers=args.workers, native=(not args.no_native),
+            admin=args.admin, use_async=(not args.threads))
 
     t.run()
 
@@ -0,0 +1,327 @@
+/*
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2022, k4m1
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIA LDAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVE RCAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * _tap, the relay engine of bin/tap as a Python extension for pytap.py.
+ *
+ * _tap.run() relays like bin/tap does, on worker threads of its own and
+ * with the GIL released, until SIGINT or SIGTERM. Python is only called
+ * back for reads that contain one of the patterns given, through a
+ * relay filter, or for every read if there are none. Callback gets
+ * bytes read and returns what to send instead, as pytap.py callbacks
+ * do: bytes or str to send, None to send nothing.
+ */
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <sys/types.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <log.h>
+#include <backend_set.h>
+#include <driver.h>
+#include <relay_filter.h>
+#include <stream_match.h>
+#include <udp_relay.h>
+
+/* Most patterns a filter takes */
+#define PYTAP_PATTERNS_MAX 1024
+
+/*
+ * Copy what callback returned to memory from malloc()
+ *
+ * Returns:
+ * 	0 on success or -1 with Python exception set
+ */
+static int
+pytap_result(PyObject *res, unsigned char **out, size_t *out_len)
+{
+	Py_buffer view;
+	PyObject *enc;
+	int ret;
+
+	if (res == Py_None) {
+		return 0;
+	}
+	enc = 0;
+	if (PyUnicode_Check(res)) {
+		enc = PyUnicode_AsUTF8String(res);
+		if (!enc) {
+			return -1;
+		}
+		res = enc;
+	}
+	ret = -1;
+	if (PyObject_GetBuffer(res, &view, PyBUF_SIMPLE) < 0) {
+		goto out;
+	}
+	if (view.len) {
+		*out = (unsigned char *)malloc((size_t)view.len);
+		if (!*out) {
+			PyErr_NoMemory();
+			PyBuffer_Release(&view);
+			goto out;
+		}
+		memcpy(*out, view.buf, (size_t)view.len);
+		*out_len = (size_t)view.len;
+	}
+	PyBuffer_Release(&view);
+	ret = 0;
+out:
+	Py_XDECREF(enc);
+	return ret;
+}
+
+/*
+ * Filter function calling Python callback arg. A callback that raises
+ * is reported and the read is relayed as it is.
+ */
+static int
+pytap_filter(void *arg, int dir, unsigned char *buf, size_t len,
+		unsigned char **out, size_t *out_len)
+{
+	PyGILState_STATE gil;
+	PyObject *res;
+	int ret;
+
+	(void)dir;
+	gil = PyGILState_Ensure();
+	ret = 0;
+	res = PyObject_CallFunction((PyObject *)arg, "y#", buf,
+			(Py_ssize_t)len);
+	if (res) {
+		ret = (pytap_result(res, out, out_len) < 0) ? 0 : 1;
+		Py_DECREF(res);
+	}
+	if (PyErr_Occurred()) {
+		PyErr_Print();
+		ret = 0;
+	}
+	PyGILState_Release(gil);
+	return ret;
+}
+
+/*
+ * Collect patterns from sequence of bytes or str, references to what
+ * they point to are kept in keep
+ *
+ * Returns:
+ * 	amount of patterns, or -1 with Python exception set
+ */
+static int
+pytap_patterns(PyObject *seq, PyObject *keep, unsigned char **pats,
+		size_t *lens)
+{
+	PyObject *item;
+	PyObject *b;
+	Py_ssize_t n;
+	Py_ssize_t i;
+
+	n = PySequence_Length(seq);
+	if (n < 0) {
+		return -1;
+	}
+	if (n > PYTAP_PATTERNS_MAX) {
+		PyErr_Format(PyExc_ValueError, "at most %d patterns",
+				PYTAP_PATTERNS_MAX);
+		return -1;
+	}
+	for (i = 0; i < n; i++) {
+		item = PySequence_GetItem(seq, i);
+		if (!item) {
+			return -1;
+		}
+		b = PyUnicode_Check(item) ? PyUnicode_AsUTF8String(item) :
+			PyBytes_FromObject(item);
+		Py_DECREF(item);
+		if (!b) {
+			return -1;
+		}
+		if (!PyBytes_GET_SIZE(b)) {
+			Py_DECREF(b);
+			PyErr_SetString(PyExc_ValueError, "empty pattern");
+			return -1;
+		}
+		if (PyList_Append(keep, b) < 0) {
+			Py_DECREF(b);
+			return -1;
+		}
+		pats[i] = (unsigned char *)PyBytes_AS_STRING(b);
+		lens[i] = (size_t)PyBytes_GET_SIZE(b);
+		Py_DECREF(b);
+	}
+	return (int)n;
+}
+
+PyDoc_STRVAR(pytap_run_doc,
+"run(lhost, lport, rhost, rport, ws=4096, workers=1, callback=None,\n"
+"    patterns=None, splice=True, admin=None)\n"
+"\n"
+"Relay TCP from lhost:lport to rhost:rport until SIGINT or SIGTERM.\n"
+"callback(data) is called for reads containing any of patterns, or\n"
+"for every read without patterns, and returns what to send instead.\n"
+"A pattern split over reads counts for the read it ends in, and data\n"
+"is the whole of that read.\n"
+"Metrics are served at admin, unix:PATH or HOST:PORT, if it's given.");
+
+static PyObject *
+pytap_run(PyObject *self, PyObject *args, PyObject *kw)
+{
+	static char *kwlist[] = { "lhost", "lport", "rhost", "rport", "ws",
+		"workers", "callback", "patterns", "splice", "admin", 0 };
+	unsigned char *pats[PYTAP_PATTERNS_MAX];
+	size_t lens[PYTAP_PATTERNS_MAX];
+	struct relay_filter filter;
+	struct backend_set backends;
+	struct tap_config cfg;
+	PyObject *callback;
+	PyObject *patterns;
+	PyObject *keep;
+	char rhost[64];
+	char *lhost;
+	char *raddr;
+	Py_ssize_t ws;
+	int lport;
+	int rport;
+	int npats;
+	int stat;
+
+	(void)self;
+	memset(&cfg, 0, sizeof(cfg));
+	ws = 4096;
+	cfg.workers = 1;
+	cfg.splice = 1;
+	callback = Py_None;
+	patterns = Py_None;
+	if (!PyArg_ParseTupleAndKeywords(args, kw, "sisi|niOOpz", kwlist,
+				&lhost, &lport, &raddr, &rport, &ws,
+				&cfg.workers, &callback, &patterns,
+				&cfg.splice, &cfg.admin_addr)) {
+		return 0;
+	}
+	if ((lport <= 0) || (lport > 65535) || (rport <= 0) ||
+			(rport > 65535) || (ws <= 0)) {
+		PyErr_SetString(PyExc_ValueError, "bad port or ws");
+		return 0;
+	}
+	cfg.tx_size = (size_t)ws;
+	if ((callback != Py_None) && !PyCallable_Check(callback)) {
+		PyErr_SetString(PyExc_TypeError, "callback is not callable");
+		return 0;
+	}
+	cfg.addrin = lhost;
+	cfg.lport = (short)lport;
+	cfg.addrout = raddr;
+	cfg.dport = (short)rport;
+	cfg.drain_timeout = DRIVER_DRAIN_TIMEOUT;
+	cfg.hwm = RELAY_HWM;
+	cfg.conn_mem = RELAY_CONN_MEM;
+	cfg.hold_ms = STREAM_HOLD_MS;
+	cfg.connect_timeout_ms = CONN_TIMEOUT_MS;
+	cfg.health_ms = BACKEND_PROBE_MS;
+	cfg.udp_idle_ms = UDP_IDLE_MS;
+
+	keep = PyList_New(0);
+	if (!keep) {
+		return 0;
+	}
+	npats = 0;
+	if ((patterns != Py_None) &&
+			((npats = pytap_patterns(patterns, keep, pats,
+				lens)) < 0)) {
+		Py_DECREF(keep);
+		return 0;
+	}
+	if (callback != Py_None) {
+		if (relay_filter_init(&filter, npats ? pats : 0, lens, npats,
+					&pytap_filter, callback) < 0) {
+			Py_DECREF(keep);
+			PyErr_SetString(PyExc_RuntimeError,
+					"can't build filter");
+			return 0;
+		}
+		cfg.filter = &filter;
+	}
+
+	backend_set_init(&backends, LB_ROUND_ROBIN);
+	snprintf(rhost, sizeof(rhost), "%s:%d", raddr, rport);
+	if ((backend_set_add(&backends, rhost) < 0) ||
+			(backend_set_build(&backends) < 0)) {
+		PyErr_Format(PyExc_ValueError, "bad upstream %s", rhost);
+		stat = -2;
+		goto out;
+	}
+	cfg.backends = &backends;
+	stat = -1;
+	if (log_start() == 0) {
+		Py_BEGIN_ALLOW_THREADS
+		stat = tap_driver_run(&cfg);
+		Py_END_ALLOW_THREADS
+		log_stop();
+	}
+	if (stat == -1) {
+		PyErr_SetString(PyExc_RuntimeError, "relay failed");
+	}
+out:
+	backend_set_free(&backends);
+	if (cfg.filter) {
+		relay_filter_free(&filter);
+	}
+	Py_DECREF(keep);
+	if (stat < 0) {
+		return 0;
+	}
+	Py_RETURN_NONE;
+}
+
+static PyMethodDef pytap_methods[] = {
+	{ "run", (PyCFunction)(void (*)(void))pytap_run,
+		METH_VARARGS | METH_KEYWORDS, pytap_run_doc },
+	{ 0, 0, 0, 0 }
+};
+
+static struct PyModuleDef pytap_module = {
+	PyModuleDef_HEAD_INIT,
+	"_tap",
+	"Native relay engine of tap",
+	-1,
+	pytap_methods,
+	0, 0, 0, 0
+};
+
+PyMODINIT_FUNC
+PyInit__tap(void)
+{
+	return PyModule_Create(&pytap_module);
+}
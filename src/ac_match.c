@@ -0,0 +1,458 @@
+/*
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2022, k4m1
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIA LDAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVE RCAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Aho-Corasick automaton for matching many byte patterns at once
+ */
+#include <sys/types.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <log.h>
+#include <ac_match.h>
+
+/* Marks missing trie edges while building, root is never a child */
+#define AC_NONE 0
+
+/*
+ * Map each byte some pattern has to a column of its own, rest share
+ * column 0.
+ */
+static void
+ac_classes(struct ac_automaton *ac, unsigned char **patterns, size_t *lens,
+		uint32_t npatterns)
+{
+	uint8_t used[256];
+	uint32_t i;
+	size_t j;
+
+	memset(used, 0, sizeof(used));
+	for (i = 0; i < npatterns; i++) {
+		for (j = 0; j < lens[i]; j++) {
+			used[patterns[i][j]] = 1;
+		}
+	}
+	ac->nclasses = 1;
+	for (i = 0; i < 256; i++) {
+		ac->classes[i] = used[i] ? (uint8_t)ac->nclasses++ : 0;
+	}
+}
+
+/*
+ * Build trie of patterns to ac->delta, own[] gets the first pattern
+ * ending at each state and next[] the rest of them. ac->hold gets depth
+ * of each state for now.
+ */
+static void
+ac_trie(struct ac_automaton *ac, unsigned char **patterns, size_t *lens,
+		uint32_t *own, uint32_t *next)
+{
+	uint32_t *edge;
+	uint32_t s;
+	uint32_t i;
+	size_t j;
+
+	ac->nstates = 1;
+	for (i = 0; i < ac->npatterns; i++) {
+		s = 0;
+		for (j = 0; j < lens[i]; j++) {
+			edge = &ac->delta[(s * ac->nclasses) +
+				ac->classes[patterns[i][j]]];
+			if (*edge == AC_NONE) {
+				ac->hold[ac->nstates] = (uint32_t)j + 1;
+				*edge = ac->nstates++;
+			}
+			s = *edge;
+		}
+		next[i] = own[s];
+		own[s] = i;
+	}
+}
+
+/*
+ * Fill in failure transitions breadth first, so that the state we fail
+ * to is always complete already. Every missing edge becomes the edge of
+ * the failure state, which leaves a DFA with no failure links to follow
+ * while scanning.
+ *
+ * States with no edges of their own can't be extended to a longer match,
+ * so they only need to hold what their failure state holds.
+ *
+ * Returns:
+ * 	states in breadth first order in order[]
+ */
+static void
+ac_fail(struct ac_automaton *ac, uint32_t *fail, uint32_t *order)
+{
+	uint32_t *row;
+	uint32_t head;
+	uint32_t tail;
+	uint32_t s;
+	uint32_t c;
+	int leaf;
+
+	tail = 0;
+	order[tail++] = 0;
+	for (c = 0; c < ac->nclasses; c++) {
+		s = ac->delta[c];
+		if (s != AC_NONE) {
+			fail[s] = 0;
+			order[tail++] = s;
+		}
+	}
+	head = 1;
+	while (head < tail) {
+		s = order[head++];
+		row = &ac->delta[s * ac->nclasses];
+		leaf = 1;
+		for (c = 0; c < ac->nclasses; c++) {
+			if (row[c] == AC_NONE) {
+				row[c] = ac->delta[(fail[s] * ac->nclasses) + c];
+				continue;
+			}
+			fail[row[c]] = ac->delta[(fail[s] * ac->nclasses) + c];
+			order[tail++] = row[c];
+			leaf = 0;
+		}
+		/* Failure state is shallower, so it's done already */
+		if (leaf) {
+			ac->hold[s] = ac->hold[fail[s]];
+		}
+	}
+}
+
+/*
+ * Outputs of a state are its own patterns followed by outputs of its
+ * failure state, which are shorter.
+ *
+ * Returns:
+ * 	0 on success or -1 on error
+ */
+static int
+ac_outputs(struct ac_automaton *ac, uint32_t *own, uint32_t *next,
+		uint32_t *fail, uint32_t *order)
+{
+	uint32_t *cnt;
+	uint32_t total;
+	uint32_t s;
+	uint32_t i;
+	uint32_t p;
+
+	/* Counts first, failure state is counted before state itself */
+	cnt = (uint32_t *)calloc(ac->nstates, sizeof(*cnt));
+	ac->out_off = (uint32_t *)malloc((ac->nstates + 1) *
+			sizeof(*ac->out_off));
+	if (!cnt || !ac->out_off) {
+		free(cnt);
+		return -1;
+	}
+	for (i = 1; i < ac->nstates; i++) {
+		s = order[i];
+		for (p = own[s]; p != UINT32_MAX; p = next[p]) {
+			cnt[s]++;
+		}
+		cnt[s] += cnt[fail[s]];
+	}
+	total = 0;
+	for (s = 0; s < ac->nstates; s++) {
+		ac->out_off[s] = total;
+		total += cnt[s];
+	}
+	ac->out_off[ac->nstates] = total;
+	free(cnt);
+
+	ac->out = (uint32_t *)malloc((total ? total : 1) * sizeof(*ac->out));
+	if (!ac->out) {
+		return -1;
+	}
+	for (i = 1; i < ac->nstates; i++) {
+		s = order[i];
+		total = ac->out_off[s];
+		for (p = own[s]; p != UINT32_MAX; p = next[p]) {
+			ac->out[total++] = p;
+		}
+		memcpy(&ac->out[total], &ac->out[ac->out_off[fail[s]]],
+				(ac->out_off[fail[s] + 1] -
+				 ac->out_off[fail[s]]) * sizeof(*ac->out));
+	}
+	return 0;
+}
+
+/*
+ * Move states with outputs after the rest and turn state numbers in
+ * transitions to row offsets.
+ *
+ * Returns:
+ * 	0 on success or -1 on error
+ */
+static int
+ac_renumber(struct ac_automaton *ac)
+{
+	uint32_t *map;
+	uint32_t *delta;
+	uint32_t *out_off;
+	uint32_t *hold;
+	uint32_t n;
+	uint32_t s;
+	uint32_t c;
+	int pass;
+
+	map = (uint32_t *)malloc(ac->nstates * sizeof(*map));
+	delta = (uint32_t *)malloc((size_t)ac->nstates * ac->nclasses *
+			sizeof(*delta));
+	out_off = (uint32_t *)malloc((ac->nstates + 1) * sizeof(*out_off));
+	hold = (uint32_t *)malloc(ac->nstates * sizeof(*hold));
+	if (!map || !delta || !out_off || !hold) {
+		free(map);
+		free(delta);
+		free(out_off);
+		free(hold);
+		return -1;
+	}
+	/*
+	 * Root has no outputs so it stays 0. States with outputs keep
+	 * their order, so their outputs stay where they are in ac->out.
+	 */
+	n = 0;
+	for (pass = 0; pass < 2; pass++) {
+		for (s = 0; s < ac->nstates; s++) {
+			if ((ac->out_off[s + 1] != ac->out_off[s]) != pass) {
+				continue;
+			}
+			out_off[n] = ac->out_off[s];
+			hold[n] = ac->hold[s];
+			map[s] = n++;
+		}
+		if (!pass) {
+			ac->match_from = n * ac->nclasses;
+		}
+	}
+	out_off[n] = ac->out_off[ac->nstates];
+	for (s = 0; s < ac->nstates; s++) {
+		for (c = 0; c < ac->nclasses; c++) {
+			delta[(map[s] * ac->nclasses) + c] = ac->nclasses *
+				map[ac->delta[(s * ac->nclasses) + c]];
+		}
+	}
+	free(map);
+	free(ac->delta);
+	free(ac->out_off);
+	free(ac->hold);
+	ac->delta = delta;
+	ac->out_off = out_off;
+	ac->hold = hold;
+	return 0;
+}
+
+static void
+ac_start_byte(struct ac_automaton *ac)
+{
+	int i;
+
+	ac->start_byte = -1;
+	for (i = 0; i < 256; i++) {
+		if (ac->delta[ac->classes[i]] == AC_START) {
+			continue;
+		}
+		if (ac->start_byte >= 0) {
+			ac->start_byte = -1;
+			return;
+		}
+		ac->start_byte = i;
+	}
+}
+
+int
+ac_build(struct ac_automaton *ac, unsigned char **patterns, size_t *lens,
+		uint32_t npatterns)
+{
+	uint32_t *own;
+	uint32_t *next;
+	uint32_t *fail;
+	uint32_t *order;
+	size_t max_states;
+	size_t i;
+	int stat;
+
+	memset(ac, 0, sizeof(*ac));
+	max_states = 1;
+	for (i = 0; i < npatterns; i++) {
+		if (!lens[i]) {
+			ERR("ac_build: pattern %zu is empty\n", i);
+			return -1;
+		}
+		max_states += lens[i];
+	}
+	ac_classes(ac, patterns, lens, npatterns);
+	/* Row offsets must fit to transitions */
+	if (max_states > (UINT32_MAX / ac->nclasses)) {
+		ERR("ac_build: patterns too long\n");
+		return -1;
+	}
+	ac->npatterns = npatterns;
+	ac->delta = (uint32_t *)calloc(max_states * ac->nclasses,
+			sizeof(*ac->delta));
+	ac->plen = (uint32_t *)malloc((npatterns ? npatterns : 1) *
+			sizeof(*ac->plen));
+	ac->hold = (uint32_t *)calloc(max_states, sizeof(*ac->hold));
+	own = (uint32_t *)malloc(max_states * sizeof(*own));
+	next = (uint32_t *)malloc((npatterns ? npatterns : 1) * sizeof(*next));
+	fail = (uint32_t *)calloc(max_states, sizeof(*fail));
+	order = (uint32_t *)malloc(max_states * sizeof(*order));
+	stat = -1;
+	if (!ac->delta || !ac->plen || !ac->hold || !own || !next || !fail || !order) {
+		ERR("ac_build: out of memory\n");
+		goto out;
+	}
+	memset(own, 0xff, max_states * sizeof(*own));
+	for (i = 0; i < npatterns; i++) {
+		ac->plen[i] = (uint32_t)lens[i];
+	}
+
+	ac_trie(ac, patterns, lens, own, next);
+	ac_fail(ac, fail, order);
+	if (ac_outputs(ac, own, next, fail, order) < 0) {
+		ERR("ac_build: out of memory\n");
+		goto out;
+	}
+
+	if (ac_renumber(ac) < 0) {
+		ERR("ac_build: out of memory\n");
+		goto out;
+	}
+	ac_start_byte(ac);
+	stat = 0;
+out:
+	free(own);
+	free(next);
+	free(fail);
+	free(order);
+	if (stat < 0) {
+		ac_free(ac);
+	}
+	return stat;
+}
+
+/*
+ * Report outputs of state s found at end
+ *
+ * Returns:
+ * 	0 or what cb returned to stop
+ */
+static int
+ac_report(struct ac_automaton *ac, uint32_t s, size_t end, ac_match_cb cb,
+		void *arg)
+{
+	uint32_t o;
+	uint32_t last;
+	int stat;
+
+	o = s / ac->nclasses;
+	last = ac->out_off[o + 1];
+	for (o = ac->out_off[o]; o < last; o++) {
+		stat = cb(arg, ac->out[o], end);
+		if (stat) {
+			return stat;
+		}
+	}
+	return 0;
+}
+
+int
+ac_scan(struct ac_automaton *ac, uint32_t *state, unsigned char *data,
+		size_t len, ac_match_cb cb, void *arg)
+{
+	unsigned char *p;
+	uint32_t *delta;
+	uint8_t *classes;
+	uint32_t match_from;
+	uint32_t s;
+	size_t i;
+	int stat;
+
+	delta = ac->delta;
+	classes = ac->classes;
+	match_from = ac->match_from;
+	s = *state;
+	stat = 0;
+	if (ac->start_byte < 0) {
+		for (i = 0; i < len; i++) {
+			s = delta[s + classes[data[i]]];
+			if (s >= match_from) {
+				stat = ac_report(ac, s, i + 1, cb, arg);
+				if (stat) {
+					break;
+				}
+			}
+		}
+		*state = s;
+		return stat;
+	}
+	/* Same with skipping to the start byte while in AC_START */
+	for (i = 0; i < len; i++) {
+		if (s == AC_START) {
+			p = (unsigned char *)memchr(&data[i], ac->start_byte,
+					len - i);
+			if (!p) {
+				break;
+			}
+			i = (size_t)(p - data);
+		}
+		s = delta[s + classes[data[i]]];
+		if (s >= match_from) {
+			stat = ac_report(ac, s, i + 1, cb, arg);
+			if (stat) {
+				break;
+			}
+		}
+	}
+	*state = s;
+	return stat;
+}
+
+size_t
+ac_hold(struct ac_automaton *ac, uint32_t state)
+{
+	return ac->hold[state / ac->nclasses];
+}
+
+void
+ac_free(struct ac_automaton *ac)
+{
+	free(ac->delta);
+	free(ac->out_off);
+	free(ac->out);
+	free(ac->plen);
+	free(ac->hold);
+	memset(ac, 0, sizeof(*ac));
+}
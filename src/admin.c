@@ -0,0 +1,317 @@
+/*
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2022, k4m1
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIA LDAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVE RCAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Admin socket. A thread of its own accepts one client at a time and
+ * answers GET /metrics, so scraping never runs on a relay thread.
+ */
+#include <sys/types.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+
+#include <log.h>
+#include <admin.h>
+#include <metrics.h>
+
+#define ADMIN_REQ_MAX 4096
+
+/*
+ * Bind listening socket to "unix:PATH" or loopback "ADDR:PORT"
+ *
+ * Returns:
+ * 	socket or -1 on error
+ */
+static int
+admin_listen(struct admin *a, const char *addr)
+{
+	struct sockaddr_un sun;
+	struct sockaddr_in sin;
+	struct stat st;
+	char host[INET_ADDRSTRLEN];
+	const char *colon;
+	char *end;
+	long port;
+	size_t len;
+	int one;
+	int fd;
+
+	if (!strncmp(addr, "unix:", 5)) {
+		addr += 5;
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		if (!*addr || (strlen(addr) >= sizeof(sun.sun_path))) {
+			ERR("Admin socket path %s is not usable\n", addr);
+			return -1;
+		}
+		strcpy(sun.sun_path, addr);
+		/* Left over from an earlier run */
+		if ((lstat(addr, &st) == 0) && S_ISSOCK(st.st_mode)) {
+			unlink(addr);
+		}
+		fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd < 0) {
+			ERR("socket() errored with errno: %d\n", errno);
+			return -1;
+		}
+		if ((bind(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0) ||
+				(listen(fd, 16) < 0)) {
+			ERR("Failed to listen on %s, errno: %d\n", addr, errno);
+			close(fd);
+			return -1;
+		}
+		a->path = strdup(addr);
+		return fd;
+	}
+	colon = strrchr(addr, ':');
+	len = colon ? (size_t)(colon - addr) : 0;
+	if (!len || (len >= sizeof(host))) {
+		ERR("Admin address %s is not unix:PATH or ADDR:PORT\n", addr);
+		return -1;
+	}
+	memcpy(host, addr, len);
+	host[len] = 0;
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	port = strtol(colon + 1, &end, 10);
+	if ((inet_pton(AF_INET, host, &sin.sin_addr) != 1) || *end ||
+			(port <= 0) || (port > 65535)) {
+		ERR("Admin address %s is not unix:PATH or ADDR:PORT\n", addr);
+		return -1;
+	}
+	/* Nothing here is meant for the network */
+	if ((ntohl(sin.sin_addr.s_addr) >> 24) != 127) {
+		ERR("Admin address %s is not loopback\n", addr);
+		return -1;
+	}
+	sin.sin_port = htons((uint16_t)port);
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		ERR("socket() errored with errno: %d\n", errno);
+		return -1;
+	}
+	one = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if ((bind(fd, (struct sockaddr *)&sin, sizeof(sin)) < 0) ||
+			(listen(fd, 16) < 0)) {
+		ERR("Failed to listen on %s, errno: %d\n", addr, errno);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int
+send_all(int fd, const char *p, size_t len)
+{
+	ssize_t stat;
+
+	while (len) {
+		stat = send(fd, p, len, MSG_NOSIGNAL);
+		if (stat < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		p += stat;
+		len -= (size_t)stat;
+	}
+	return 0;
+}
+
+static void
+admin_reply(int fd, const char *status, const char *type, 
+		const char *body, size_t len)
+{
+	char head[256];
+	int hlen;
+
+	hlen = snprintf(head, sizeof(head), "HTTP/1.0 %s\r\n"
+			"Content-Type: %s\r\nContent-Length: %zu\r\n"
+			"Connection: close\r\n\r\n", status, type, len);
+	if (send_all(fd, head, (size_t)hlen) == 0) {
+		send_all(fd, body, len);
+	}
+}
+
+/*
+ * Read request and answer it, client gets ADMIN_TIMEOUT_MS to send it
+ */
+static void
+admin_serve(struct admin *a, int fd)
+{
+	struct timeval tv;
+	struct mbuf m;
+	char req[ADMIN_REQ_MAX];
+	ssize_t stat;
+	size_t len;
+
+	tv.tv_sec = ADMIN_TIMEOUT_MS / 1000;
+	tv.tv_usec = (ADMIN_TIMEOUT_MS % 1000) * 1000;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	len = 0;
+	while (len < sizeof(req) - 1) {
+		stat = recv(fd, &req[len], sizeof(req) - 1 - len, 0);
+		if ((stat < 0) && (errno == EINTR)) {
+			continue;
+		}
+		if (stat <= 0) {
+			return;
+		}
+		len += (size_t)stat;
+		req[len] = 0;
+		if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n")) {
+			break;
+		}
+	}
+	req[len] = 0;
+	if (strncmp(req, "GET /metrics ", 13) && strncmp(req, "GET / ", 6)) {
+		admin_reply(fd, "404 Not Found", "text/plain", 
+				"Try GET /metrics\n", 17);
+		return;
+	}
+	memset(&m, 0, sizeof(m));
+	if (a->render(&m, a->arg) < 0) {
+		admin_reply(fd, "500 Internal Server Error", "text/plain",
+				"Out of memory\n", 14);
+	} else {
+		admin_reply(fd, "200 OK", "text/plain; version=0.0.4", 
+				m.p ? m.p : "", m.len);
+	}
+	mbuf_free(&m);
+}
+
+static void *
+admin_main(void *arg)
+{
+	struct pollfd pfd[2];
+	struct admin *a;
+	int fd;
+
+	a = (struct admin *)arg;
+	pfd[0].fd = a->fd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = a->wake;
+	pfd[1].events = POLLIN;
+	for (;;) {
+		if (poll(pfd, 2, -1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			ERR("Admin socket poll() errored with errno: %d\n", errno);
+			break;
+		}
+		if (pfd[1].revents) {
+			break;
+		}
+		if (!pfd[0].revents) {
+			continue;
+		}
+		fd = accept4(a->fd, 0, 0, SOCK_CLOEXEC);
+		if (fd < 0) {
+			continue;
+		}
+		admin_serve(a, fd);
+		close(fd);
+	}
+	return 0;
+}
+
+int
+admin_start(struct admin *a, const char *addr,
+		int (*render)(struct mbuf *, void *), void *arg)
+{
+	memset(a, 0, sizeof(*a));
+	a->render = render;
+	a->arg = arg;
+	a->wake = -1;
+	a->fd = admin_listen(a, addr);
+	if (a->fd < 0) {
+		return -1;
+	}
+	a->wake = eventfd(0, EFD_CLOEXEC);
+	if (a->wake < 0) {
+		ERR("eventfd() errored with errno: %d\n", errno);
+		admin_stop(a);
+		return -1;
+	}
+	if (pthread_create(&a->thread, 0, admin_main, a)) {
+		ERR("Failed to start admin thread\n");
+		admin_stop(a);
+		return -1;
+	}
+	a->running = 1;
+	return 0;
+}
+
+void
+admin_stop(struct admin *a)
+{
+	uint64_t one;
+
+	if (a->running) {
+		one = 1;
+		if (write(a->wake, &one, sizeof(one)) < 0) {
+			ERR("Failed to wake admin thread, errno: %d\n", errno);
+		}
+		pthread_join(a->thread, 0);
+		a->running = 0;
+	}
+	if (a->fd >= 0) {
+		close(a->fd);
+		a->fd = -1;
+	}
+	if (a->wake >= 0) {
+		close(a->wake);
+		a->wake = -1;
+	}
+	if (a->path) {
+		unlink(a->path);
+		free(a->path);
+		a->path = 0;
+	}
+}
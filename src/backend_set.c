@@ -0,0 +1,528 @@
+/*
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2022, k4m1
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIA LDAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVE RCAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Upstream backends and load-balancing policies. Workers pick backends
+ * without locks: the set is read-only once built, and per-backend
+ * counters are updated with relaxed atomics.
+ *
+ * LB_HASH uses a Maglev lookup table, so a client maps to the same
+ * backend on every worker, and adding or losing a backend moves only
+ * the clients of that backend.
+ *
+ * Health is tracked two ways. Connect failures reported by workers
+ * eject a backend for BACKEND_EJECT_MS (passive), and a probe thread
+ * connects to every backend every probe_ms (active), off the relay path.
+ */
+#include <sys/types.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+
+#include <log.h>
+#include <net_io.h>
+#include <backend_set.h>
+
+#define TABLE_EMPTY 0xffff
+
+uint64_t
+backend_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static uint32_t
+fnv1a(const char *s, uint32_t seed)
+{
+	uint32_t h;
+
+	h = 2166136261u ^ seed;
+	while (*s) {
+		h ^= (unsigned char)*s++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+uint32_t
+backend_hash(const struct sockaddr_in *saddr)
+{
+	uint32_t h;
+
+	/* Finaliser of murmur3, spreads nearby addresses apart */
+	h = saddr->sin_addr.s_addr;
+	h ^= h >> 16;
+	h *= 0x85ebca6bu;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35u;
+	h ^= h >> 16;
+	return h;
+}
+
+void
+backend_set_init(struct backend_set *set, int policy)
+{
+	memset(set, 0, sizeof(*set));
+	set->policy = policy;
+	set->probe_wake = -1;
+}
+
+int
+backend_set_add(struct backend_set *set, const char *addr)
+{
+	struct backend *b;
+	char host[INET_ADDRSTRLEN];
+	const char *colon;
+	struct in_addr in;
+	char *end;
+	long port;
+	size_t len;
+
+	colon = strrchr(addr, ':');
+	len = colon ? (size_t)(colon - addr) : 0;
+	if (!colon || !len || (len >= sizeof(host))) {
+		ERR("Backend %s is not address:port\n", addr);
+		return -1;
+	}
+	memcpy(host, addr, len);
+	host[len] = 0;
+	port = strtol(colon + 1, &end, 10);
+	if ((inet_pton(AF_INET, host, &in) != 1) || *end || 
+			(port <= 0) || (port > 65535)) {
+		ERR("Backend %s is not address:port\n", addr);
+		return -1;
+	}
+	if (set->n >= BACKEND_MAX) {
+		ERR("Too many backends, at most %d\n", BACKEND_MAX);
+		return -1;
+	}
+	b = (struct backend *)aligned_alloc(64, 
+			(size_t)(set->n + 1) * sizeof(*b));
+	if (!b) {
+		ERR("aligned_alloc() failed\n");
+		return -1;
+	}
+	if (set->n) {
+		memcpy(b, set->b, (size_t)set->n * sizeof(*b));
+	}
+	free(set->b);
+	set->b = b;
+	b = &set->b[set->n++];
+	memset(b, 0, sizeof(*b));
+	b->saddr.sin_family = AF_INET;
+	b->saddr.sin_addr = in;
+	b->saddr.sin_port = htons((uint16_t)port);
+	snprintf(b->name, sizeof(b->name), "%s:%ld", host, port);
+	return 0;
+}
+
+/*
+ * Fill lookup table the Maglev way: every backend walks its own
+ * permutation of the table, taking turns to claim the next free slot.
+ */
+static int
+build_table(struct backend_set *set)
+{
+	uint32_t *offset;
+	uint32_t *skip;
+	uint32_t *next;
+	uint32_t filled;
+	uint32_t c;
+	int i;
+
+	set->table = (uint16_t *)malloc(BACKEND_TABLE * sizeof(uint16_t));
+	offset = (uint32_t *)calloc((size_t)set->n * 3, sizeof(uint32_t));
+	if (!set->table || !offset) {
+		ERR("malloc() of backend table failed\n");
+		free(offset);
+		return -1;
+	}
+	skip = &offset[set->n];
+	next = &skip[set->n];
+	for (i = 0; i < set->n; i++) {
+		offset[i] = fnv1a(set->b[i].name, 0) % BACKEND_TABLE;
+		skip[i] = fnv1a(set->b[i].name, 0x9e3779b9u) % 
+			(BACKEND_TABLE - 1) + 1;
+	}
+	memset(set->table, 0xff, BACKEND_TABLE * sizeof(uint16_t));
+	filled = 0;
+	while (filled < BACKEND_TABLE) {
+		for (i = 0; (i < set->n) && (filled < BACKEND_TABLE); i++) {
+			do {
+				c = (uint32_t)(((uint64_t)offset[i] + 
+					(uint64_t)next[i] * skip[i]) % 
+					BACKEND_TABLE);
+				next[i]++;
+			} while (set->table[c] != TABLE_EMPTY);
+			set->table[c] = (uint16_t)i;
+			filled++;
+		}
+	}
+	free(offset);
+	return 0;
+}
+
+int
+backend_set_build(struct backend_set *set)
+{
+	if (!set->n) {
+		ERR("No backends to connect to\n");
+		return -1;
+	}
+	if (set->policy == LB_HASH) {
+		return build_table(set);
+	}
+	return 0;
+}
+
+static int
+backend_usable(struct backend *b)
+{
+	uint64_t until;
+
+	if (__atomic_load_n(&b->down, __ATOMIC_RELAXED)) {
+		return 0;
+	}
+	until = __atomic_load_n(&b->ejected_until, __ATOMIC_RELAXED);
+	if (!until) {
+		return 1;
+	}
+	if (backend_now_ms() < until) {
+		return 0;
+	}
+	/* Give it another chance, one worker clears this */
+	__atomic_compare_exchange_n(&b->ejected_until, &until, 0, 0,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED);
+	return 1;
+}
+
+/*
+ * Next usable backend in round robin order of the worker, or just
+ * the next one if none is usable
+ */
+static struct backend *
+pick_rr(struct backend_set *set, struct backend_cursor *cur)
+{
+	struct backend *b;
+	int i;
+
+	for (i = 0; i < set->n; i++) {
+		b = &set->b[cur->rr++ % (unsigned int)set->n];
+		if (backend_usable(b)) {
+			return b;
+		}
+	}
+	return &set->b[cur->rr++ % (unsigned int)set->n];
+}
+
+/*
+ * Power of two choices: less loaded of two random backends is nearly
+ * as good as the least loaded of all, without looking at all of them
+ */
+static struct backend *
+pick_least(struct backend_set *set, struct backend_cursor *cur)
+{
+	struct backend *a;
+	struct backend *b;
+	int i;
+	int j;
+
+	if (set->n == 1) {
+		return pick_rr(set, cur);
+	}
+	i = rand_r(&cur->seed) % set->n;
+	j = rand_r(&cur->seed) % (set->n - 1);
+	if (j >= i) {
+		j++;
+	}
+	a = &set->b[i];
+	b = &set->b[j];
+	if (!backend_usable(a)) {
+		return backend_usable(b) ? b : pick_rr(set, cur);
+	}
+	if (!backend_usable(b)) {
+		return a;
+	}
+	return (__atomic_load_n(&b->active, __ATOMIC_RELAXED) <
+		__atomic_load_n(&a->active, __ATOMIC_RELAXED)) ? b : a;
+}
+
+static struct backend *
+pick_hash(struct backend_set *set, struct backend_cursor *cur, 
+		uint32_t hash)
+{
+	struct backend *b;
+	uint32_t step;
+	uint32_t c;
+	int i;
+
+	c = hash % BACKEND_TABLE;
+	/* Walk on from slot of client, same walk for same client */
+	step = (hash >> 16) % (BACKEND_TABLE - 1) + 1;
+	for (i = 0; i < BACKEND_HASH_WALK; i++) {
+		b = &set->b[set->table[c]];
+		if (backend_usable(b)) {
+			return b;
+		}
+		c = (c + step) % BACKEND_TABLE;
+	}
+	return pick_rr(set, cur);
+}
+
+struct backend *
+backend_pick(struct backend_set *set, struct backend_cursor *cur,
+		uint32_t hash)
+{
+	struct backend *b;
+
+	switch (set->policy) {
+	case (LB_LEAST_CONN):
+		b = pick_least(set, cur);
+		break;
+	case (LB_HASH):
+		b = pick_hash(set, cur, hash);
+		break;
+	default:
+		b = pick_rr(set, cur);
+		break;
+	}
+	__atomic_add_fetch(&b->active, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&b->conns, 1, __ATOMIC_RELAXED);
+	return b;
+}
+
+void
+backend_release(struct backend *b)
+{
+	__atomic_sub_fetch(&b->active, 1, __ATOMIC_RELAXED);
+}
+
+void
+backend_failed(struct backend *b)
+{
+	uint64_t until;
+
+	__atomic_add_fetch(&b->failed, 1, __ATOMIC_RELAXED);
+	/* Connects started before ejection don't eject it again */
+	if (__atomic_load_n(&b->ejected_until, __ATOMIC_RELAXED)) {
+		return;
+	}
+	if (__atomic_add_fetch(&b->fails, 1, __ATOMIC_RELAXED) < 
+			BACKEND_FAILS) {
+		return;
+	}
+	until = 0;
+	if (!__atomic_compare_exchange_n(&b->ejected_until, &until, 
+				backend_now_ms() + BACKEND_EJECT_MS, 0,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		return;
+	}
+	__atomic_store_n(&b->fails, 0, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&b->ejections, 1, __ATOMIC_RELAXED);
+	ERR("Backend %s ejected after %d failed connects\n", b->name,
+			BACKEND_FAILS);
+}
+
+/*
+ * Mark backend up or down by result of probe
+ */
+static void
+probe_result(struct backend *b, int down)
+{
+	if (down != __atomic_load_n(&b->down, __ATOMIC_RELAXED)) {
+		LOG("Backend %s is %s\n", b->name, down ? "down" : "up");
+		__atomic_store_n(&b->down, down, __ATOMIC_RELAXED);
+	}
+	if (!down) {
+		/* Probe says it's fine, end passive ejection */
+		__atomic_store_n(&b->ejected_until, 0, __ATOMIC_RELAXED);
+	}
+}
+
+/*
+ * Connect to every backend at once and wait for results, backends
+ * that don't answer in BACKEND_PROBE_TIMEOUT_MS are down
+ *
+ * Returns:
+ * 	0 when done or -1 if prober should stop
+ */
+static int
+probe_round(struct backend_set *set)
+{
+	struct pollfd *pfd;
+	uint64_t deadline;
+	uint64_t now;
+	socklen_t len;
+	int pending;
+	int stop;
+	int err;
+	int i;
+
+	pfd = (struct pollfd *)calloc((size_t)set->n + 1, sizeof(*pfd));
+	if (!pfd) {
+		return 0;
+	}
+	pending = 0;
+	for (i = 0; i < set->n; i++) {
+		/* Negative fds are skipped by poll() */
+		pfd[i].fd = sock_connect_nb(&set->b[i].saddr);
+		pfd[i].events = POLLOUT;
+		if (pfd[i].fd < 0) {
+			probe_result(&set->b[i], 1);
+		} else {
+			pending++;
+		}
+	}
+	pfd[set->n].fd = set->probe_wake;
+	pfd[set->n].events = POLLIN;
+	stop = 0;
+	deadline = backend_now_ms() + BACKEND_PROBE_TIMEOUT_MS;
+	while (pending && !stop && ((now = backend_now_ms()) < deadline)) {
+		if (poll(pfd, (nfds_t)set->n + 1, (int)(deadline - now)) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		stop = (pfd[set->n].revents != 0);
+		for (i = 0; (i < set->n) && !stop; i++) {
+			if ((pfd[i].fd < 0) || !pfd[i].revents) {
+				continue;
+			}
+			len = sizeof(err);
+			if (getsockopt(pfd[i].fd, SOL_SOCKET, SO_ERROR, &err, 
+						&len) < 0) {
+				err = errno;
+			}
+			probe_result(&set->b[i], err != 0);
+			close(pfd[i].fd);
+			pfd[i].fd = -1;
+			pending--;
+		}
+	}
+	for (i = 0; i < set->n; i++) {
+		if (pfd[i].fd >= 0) {
+			close(pfd[i].fd);
+			if (!stop) {
+				probe_result(&set->b[i], 1);
+			}
+		}
+	}
+	free(pfd);
+	return stop ? -1 : 0;
+}
+
+static void *
+prober_main(void *arg)
+{
+	struct backend_set *set;
+	struct pollfd pfd;
+
+	set = (struct backend_set *)arg;
+	pfd.fd = set->probe_wake;
+	pfd.events = POLLIN;
+	for (;;) {
+		if (probe_round(set) < 0) {
+			break;
+		}
+		pfd.revents = 0;
+		if ((poll(&pfd, 1, set->probe_ms) < 0) && (errno != EINTR)) {
+			break;
+		}
+		if (pfd.revents) {
+			break;
+		}
+	}
+	return 0;
+}
+
+int
+backend_probe_start(struct backend_set *set, int probe_ms)
+{
+	set->probe_ms = probe_ms;
+	set->probe_wake = eventfd(0, EFD_CLOEXEC);
+	if (set->probe_wake < 0) {
+		ERR("eventfd() errored with errno: %d\n", errno);
+		return -1;
+	}
+	if (pthread_create(&set->prober, 0, prober_main, set)) {
+		ERR("Failed to start health prober\n");
+		close(set->probe_wake);
+		set->probe_wake = -1;
+		return -1;
+	}
+	set->probing = 1;
+	return 0;
+}
+
+void
+backend_probe_stop(struct backend_set *set)
+{
+	uint64_t one;
+
+	if (!set->probing) {
+		return;
+	}
+	one = 1;
+	if (write(set->probe_wake, &one, sizeof(one)) < 0) {
+		ERR("Failed to wake health prober, errno: %d\n", errno);
+	}
+	pthread_join(set->prober, 0);
+	close(set->probe_wake);
+	set->probe_wake = -1;
+	set->probing = 0;
+}
+
+void
+backend_set_free(struct backend_set *set)
+{
+	free(set->table);
+	free(set->b);
+	set->table = 0;
+	set->b = 0;
+	set->n = 0;
+}
@@ -0,0 +1,390 @@
+/*
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2022, k4m1
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIA LDAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVE RCAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Per-worker pool of relay buffers. Buffers come in power of 2 size
+ * classes, each class is carved from slabs of one huge page. Slabs are
+ * mapped with MAP_HUGETLB when the system has huge pages reserved, and
+ * aligned & advised for transparent huge pages otherwise. A slab that
+ * has nothing handed out is unmapped, unless it's the only empty one of
+ * its class. Buffers bigger than any class are mapped one by one.
+ */
+#include <sys/mman.h>
+#include <sys/types.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+
+#include <buf_pool.h>
+
+/* Stats have one writer, readers of other threads only need whole values */
+#define POOL_STAT_ADD(pool, field, n) \
+	__atomic_store_n(&(pool)->stats.field, (pool)->stats.field + (n), \
+			__ATOMIC_RELAXED)
+#define POOL_STAT_SUB(pool, field, n) \
+	__atomic_store_n(&(pool)->stats.field, (pool)->stats.field - (n), \
+			__ATOMIC_RELAXED)
+
+static int
+pool_class(size_t size)
+{
+	int cls;
+
+	for (cls = 0; ((size_t)1 << (cls + POOL_MIN_SHIFT)) < size; cls++);
+	return cls;
+}
+
+static size_t
+pool_class_size(int cls)
+{
+	return (size_t)1 << (cls + POOL_MIN_SHIFT);
+}
+
+size_t
+buf_pool_size(size_t size)
+{
+	size_t page;
+
+	if (size <= POOL_MAX_BUF) {
+		return pool_class_size(pool_class(size));
+	}
+	page = (size_t)sysconf(_SC_PAGESIZE);
+	return (size + page - 1) & ~(page - 1);
+}
+
+void
+buf_pool_init(struct buf_pool *pool, int scrub)
+{
+	memset(pool, 0, sizeof(*pool));
+	pool->hugetlb = 1;
+	pool->scrub = scrub;
+}
+
+/*
+ * Map memory for a slab
+ *
+ * Returns:
+ * 	slab memory or 0 on error
+ */
+static unsigned char *
+pool_map_slab(struct buf_pool *pool, int *huge)
+{
+	unsigned char *mem;
+	uintptr_t aligned;
+	size_t head;
+
+	if (pool->hugetlb) {
+		mem = mmap(0, POOL_SLAB_SIZE, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (mem != MAP_FAILED) {
+			*huge = 1;
+			return mem;
+		}
+		/* None reserved, or we ran out, don't ask again */
+		pool->hugetlb = 0;
+	}
+	/* Map twice the size to get a huge page aligned slab out of it */
+	mem = mmap(0, 2 * POOL_SLAB_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED) {
+		return 0;
+	}
+	aligned = ((uintptr_t)mem + POOL_SLAB_SIZE - 1) &
+		~(uintptr_t)(POOL_SLAB_SIZE - 1);
+	head = aligned - (uintptr_t)mem;
+	if (head) {
+		munmap(mem, head);
+	}
+	munmap((unsigned char *)aligned + POOL_SLAB_SIZE,
+			POOL_SLAB_SIZE - head);
+	madvise((void *)aligned, POOL_SLAB_SIZE, MADV_HUGEPAGE);
+	*huge = 0;
+	return (unsigned char *)aligned;
+}
+
+static void
+pool_avail_add(struct buf_pool *pool, struct pool_slab *slab)
+{
+	slab->prev = 0;
+	slab->next = pool->avail[slab->cls];
+	if (slab->next) {
+		slab->next->prev = slab;
+	}
+	pool->avail[slab->cls] = slab;
+	slab->avail = 1;
+}
+
+static void
+pool_avail_del(struct buf_pool *pool, struct pool_slab *slab)
+{
+	if (slab->prev) {
+		slab->prev->next = slab->next;
+	} else {
+		pool->avail[slab->cls] = slab->next;
+	}
+	if (slab->next) {
+		slab->next->prev = slab->prev;
+	}
+	slab->prev = 0;
+	slab->next = 0;
+	slab->avail = 0;
+}
+
+/*
+ * Find index of slab buf belongs to, or where slab at buf would go
+ */
+static size_t
+pool_find(struct buf_pool *pool, void *buf)
+{
+	size_t lo;
+	size_t hi;
+	size_t mid;
+
+	lo = 0;
+	hi = pool->nslabs;
+	while (lo < hi) {
+		mid = lo + ((hi - lo) / 2);
+		if ((unsigned char *)buf < pool->slab[mid]->mem) {
+			hi = mid;
+		} else if ((unsigned char *)buf >=
+				pool->slab[mid]->mem + POOL_SLAB_SIZE) {
+			lo = mid + 1;
+		} else {
+			return mid;
+		}
+	}
+	return lo;
+}
+
+/*
+ * Map new slab for class and make it available
+ *
+ * Returns:
+ * 	slab or 0 on error
+ */
+static struct pool_slab *
+pool_slab_new(struct buf_pool *pool, int cls)
+{
+	struct pool_slab **slabs;
+	struct pool_slab *slab;
+	size_t cap;
+	size_t at;
+
+	if (pool->nslabs == pool->cap) {
+		cap = pool->cap ? (pool->cap * 2) : 16;
+		slabs = (struct pool_slab **)realloc(pool->slab,
+				cap * sizeof(*slabs));
+		if (!slabs) {
+			return 0;
+		}
+		pool->slab = slabs;
+		pool->cap = cap;
+	}
+	slab = (struct pool_slab *)calloc(1, sizeof(*slab));
+	if (!slab) {
+		return 0;
+	}
+	slab->mem = pool_map_slab(pool, &slab->huge);
+	if (!slab->mem) {
+		free(slab);
+		return 0;
+	}
+	slab->cls = cls;
+	slab->nbufs = (uint32_t)(POOL_SLAB_SIZE / pool_class_size(cls));
+	at = pool_find(pool, slab->mem);
+	memmove(&pool->slab[at + 1], &pool->slab[at],
+			(pool->nslabs - at) * sizeof(*pool->slab));
+	pool->slab[at] = slab;
+	pool->nslabs++;
+	pool->empty[cls]++;
+	pool_avail_add(pool, slab);
+
+	POOL_STAT_ADD(pool, slabs, 1);
+	POOL_STAT_ADD(pool, mapped_bytes, POOL_SLAB_SIZE);
+	if (slab->huge) {
+		POOL_STAT_ADD(pool, huge_slabs, 1);
+	}
+	return slab;
+}
+
+static void
+pool_slab_free(struct buf_pool *pool, size_t at)
+{
+	struct pool_slab *slab;
+
+	slab = pool->slab[at];
+	if (slab->avail) {
+		pool_avail_del(pool, slab);
+	}
+	pool->nslabs--;
+	memmove(&pool->slab[at], &pool->slab[at + 1],
+			(pool->nslabs - at) * sizeof(*pool->slab));
+	munmap(slab->mem, POOL_SLAB_SIZE);
+	POOL_STAT_SUB(pool, slabs, 1);
+	POOL_STAT_SUB(pool, mapped_bytes, POOL_SLAB_SIZE);
+	if (slab->huge) {
+		POOL_STAT_SUB(pool, huge_slabs, 1);
+	}
+	free(slab);
+}
+
+static void *
+pool_get_large(struct buf_pool *pool, size_t size)
+{
+	void *buf;
+
+	size = buf_pool_size(size);
+	buf = mmap(0, size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buf == MAP_FAILED) {
+		return 0;
+	}
+	madvise(buf, size, MADV_HUGEPAGE);
+	POOL_STAT_ADD(pool, large, 1);
+	POOL_STAT_ADD(pool, used_bytes, size);
+	POOL_STAT_ADD(pool, mapped_bytes, size);
+	return buf;
+}
+
+void *
+buf_pool_get(struct buf_pool *pool, size_t size)
+{
+	struct pool_slab *slab;
+	unsigned char *buf;
+	int cls;
+
+	if (size > POOL_MAX_BUF) {
+		return pool_get_large(pool, size);
+	}
+	cls = pool_class(size);
+	slab = pool->avail[cls];
+	if (!slab) {
+		slab = pool_slab_new(pool, cls);
+		if (!slab) {
+			return 0;
+		}
+	}
+	if (slab->free) {
+		buf = (unsigned char *)slab->free;
+		slab->free = *(void **)buf;
+	} else {
+		/* Untouched pages stay unbacked until they're needed */
+		buf = &slab->mem[(size_t)slab->carved++ * pool_class_size(cls)];
+	}
+	if (!slab->used++) {
+		pool->empty[cls]--;
+	}
+	if (!slab->free && (slab->carved == slab->nbufs)) {
+		pool_avail_del(pool, slab);
+	}
+	POOL_STAT_ADD(pool, used[cls], 1);
+	POOL_STAT_ADD(pool, used_bytes, pool_class_size(cls));
+	return buf;
+}
+
+void
+buf_pool_put(struct buf_pool *pool, void *buf, size_t size)
+{
+	struct pool_slab *slab;
+	size_t at;
+	int cls;
+
+	size = buf_pool_size(size);
+	if (pool->scrub) {
+		explicit_bzero(buf, size);
+	}
+	if (size > POOL_MAX_BUF) {
+		munmap(buf, size);
+		POOL_STAT_SUB(pool, large, 1);
+		POOL_STAT_SUB(pool, used_bytes, size);
+		POOL_STAT_SUB(pool, mapped_bytes, size);
+		return;
+	}
+	at = pool_find(pool, buf);
+	slab = pool->slab[at];
+	cls = slab->cls;
+	POOL_STAT_SUB(pool, used[cls], 1);
+	POOL_STAT_SUB(pool, used_bytes, size);
+	if (--slab->used) {
+		*(void **)buf = slab->free;
+		slab->free = buf;
+		if (!slab->avail) {
+			pool_avail_add(pool, slab);
+		}
+		return;
+	}
+	if (pool->empty[cls] >= POOL_KEEP_EMPTY) {
+		pool_slab_free(pool, at);
+		return;
+	}
+	/* Start over, so buffers are carved from the start again */
+	pool->empty[cls]++;
+	slab->free = 0;
+	slab->carved = 0;
+	if (!slab->avail) {
+		pool_avail_add(pool, slab);
+	}
+}
+
+void
+buf_pool_stats(struct buf_pool *pool, struct buf_pool_stats *stats)
+{
+	int i;
+
+	for (i = 0; i < POOL_CLASSES; i++) {
+		stats->used[i] = __atomic_load_n(&pool->stats.used[i],
+				__ATOMIC_RELAXED);
+	}
+	stats->used_bytes = __atomic_load_n(&pool->stats.used_bytes,
+			__ATOMIC_RELAXED);
+	stats->slabs = __atomic_load_n(&pool->stats.slabs, __ATOMIC_RELAXED);
+	stats->huge_slabs = __atomic_load_n(&pool->stats.huge_slabs,
+			__ATOMIC_RELAXED);
+	stats->large = __atomic_load_n(&pool->stats.large, __ATOMIC_RELAXED);
+	stats->mapped_bytes = __atomic_load_n(&pool->stats.mapped_bytes,
+			__ATOMIC_RELAXED);
+}
+
+void
+buf_pool_destroy(struct buf_pool *pool)
+{
+	size_t i;
+
+	for (i = 0; i < pool->nslabs; i++) {
+		munmap(pool->slab[i]->mem, POOL_SLAB_SIZE);
+		free(pool->slab[i]);
+	}
+	free(pool->slab);
+	memset(pool, 0, sizeof(*pool));
+}
@@ -0,0 +1,1000 @@
+/*
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2022, k4m1
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIA LDAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVE RCAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ * Capture of relayed traffic as pcapng. Every connection is written as
+ * a TCP connection between client and tap, on interface "rx" as tap
+ * received it and on "tx" as tap sent it after rules.
+ *
+ * Each worker appends to files of its own which are allocated up front
+ * and mapped to memory, so capturing a packet is only a copy. A thread
+ * of its own creates the files, syncs them to disk and trims them to
+ * what was written once workers move on. If no file is ready when one
+ * fills up, packets are dropped instead of waiting.
+ *
+ * capture_load() reads sessions back from files, for tap-replay.
+ */
+#include <sys/types.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <capture.h>
+#include <log.h>
+
+#define PCAPNG_SHB 0x0a0d0d0a
+#define PCAPNG_IDB 0x00000001
+#define PCAPNG_EPB 0x00000006
+#define PCAPNG_MAGIC 0x1a2b3c4d
+
+#define LINKTYPE_RAW 101 	/* packets start with IP header */
+
+/* Packet headers in capture, IPv4 and TCP without options */
+#define CAPTURE_HDR_LEN (sizeof(struct iphdr) + sizeof(struct tcphdr))
+
+/*
+ * Enhanced packet block, followed by packet, padding and block length
+ */
+struct pcapng_epb {
+	uint32_t type;
+	uint32_t len;
+	uint32_t iface;
+	uint32_t ts_high; 	/* us since epoch */
+	uint32_t ts_low;
+	uint32_t caplen;
+	uint32_t origlen;
+};
+
+/*
+ * Position in payload being captured
+ */
+struct iov_cursor {
+	const struct iovec *iov;
+	size_t off;
+};
+
+static const char *if_names[2] = { "rx", "tx" };
+
+static size_t
+pad4(size_t len)
+{
+	return (len + 3) & ~(size_t)3;
+}
+
+static unsigned char *
+put32(unsigned char *p, uint32_t v)
+{
+	memcpy(p, &v, sizeof(v));
+	return p + sizeof(v);
+}
+
+static unsigned char *
+put16(unsigned char *p, uint16_t v)
+{
+	memcpy(p, &v, sizeof(v));
+	return p + sizeof(v);
+}
+
+/*
+ * Option of block, value is padded to 4 bytes
+ */
+static unsigned char *
+put_opt(unsigned char *p, uint16_t code, const char *val)
+{
+	size_t len = strlen(val);
+
+	p = put16(p, code);
+	p = put16(p, (uint16_t)len);
+	memset(p, 0, pad4(len));
+	memcpy(p, val, len);
+	return p + pad4(len);
+}
+
+/*
+ * Write section header and interfaces to start of file
+ *
+ * Returns:
+ * 	bytes written
+ */
+static size_t
+put_header(unsigned char *map)
+{
+	unsigned char *p = map;
+	unsigned char *start;
+	int i;
+
+	/* Section of unknown length, little or big endian as we are */
+	start = p;
+	p = put32(p, PCAPNG_SHB);
+	p += 4;
+	p = put32(p, PCAPNG_MAGIC);
+	p = put16(p, 1);
+	p = put16(p, 0);
+	p = put32(p, 0xffffffff);
+	p = put32(p, 0xffffffff);
+	p = put_opt(p, 4, "tap"); 	/* shb_userappl */
+	p = put32(p, 0); 		/* opt_endofopt */
+	p = put32(p, (uint32_t)(p - start + 4));
+	put32(start + 4, (uint32_t)(p - start));
+
+	for (i = 0; i < 2; i++) {
+		start = p;
+		p = put32(p, PCAPNG_IDB);
+		p += 4;
+		p = put16(p, LINKTYPE_RAW);
+		p = put16(p, 0);
+		p = put32(p, 0); 		/* no snap length */
+		p = put_opt(p, 2, if_names[i]); /* if_name */
+		p = put32(p, 0);
+		p = put32(p, (uint32_t)(p - start + 4));
+		put32(start + 4, (uint32_t)(p - start));
+	}
+	return (size_t)(p - map);
+}
+
+static void
+file_path(struct capture *cap, struct capture_writer *w, unsigned int n,
+		char *path, size_t size)
+{
+	snprintf(path, size, "%s.%d.%u.pcapng", cap->prefix, w->id, n);
+}
+
+/*
+ * Create next file of writer, removing the one it replaces in ring
+ *
+ * Returns:
+ * 	file or 0 on error
+ */
+static struct capture_file *
+file_open(struct capture *cap, struct capture_writer *w)
+{
+	struct capture_file *f;
+	char path[4096];
+	int stat;
+
+	/* Spare file isn't one of the nfiles kept */
+	if (w->nfile > (unsigned int)cap->nfiles) {
+		file_path(cap, w, w->nfile - cap->nfiles - 1, path, 
+				sizeof(path));
+		unlink(path);
+	}
+	file_path(cap, w, w->nfile, path, sizeof(path));
+	f = (struct capture_file *)calloc(1, sizeof(*f));
+	if (!f) {
+		ERR("calloc(%zu) failed\n", sizeof(*f));
+		return 0;
+	}
+	f->size = cap->file_size;
+	f->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0640);
+	if (f->fd < 0) {
+		ERR("Failed to create %s: %s\n", path, strerror(errno));
+		free(f);
+		return 0;
+	}
+	/* Blocks are allocated now, not when a worker first touches them */
+	stat = posix_fallocate(f->fd, 0, (off_t)f->size);
+	if (stat) {
+		ERR("Failed to allocate %s: %s\n", path, strerror(stat));
+		goto fail;
+	}
+	f->map = (unsigned char *)mmap(0, f->size, PROT_READ | PROT_WRITE,
+			MAP_SHARED, f->fd, 0);
+	if (f->map == MAP_FAILED) {
+		ERR("Failed to map %s: %s\n", path, strerror(errno));
+		goto fail;
+	}
+#ifdef MADV_POPULATE_WRITE
+	/* Fault pages in here rather than in the worker, if kernel can */
+	madvise(f->map, f->size, MADV_POPULATE_WRITE);
+#endif
+	f->used = put_header(f->map);
+	w->nfile++;
+	return f;
+fail:
+	close(f->fd);
+	unlink(path);
+	free(f);
+	return 0;
+}
+
+/*
+ * Sync what writer has written since last sync
+ */
+static void
+file_sync(struct capture_file *f)
+{
+	size_t used;
+	size_t start;
+
+	used = __atomic_load_n(&f->used, __ATOMIC_ACQUIRE);
+	if (used == f->synced) {
+		return;
+	}
+	start = f->synced & ~(size_t)(sysconf(_SC_PAGESIZE) - 1);
+	msync(f->map + start, used - start, MS_SYNC);
+	f->synced = used;
+}
+
+/*
+ * Sync file, trim it to what was written and close it
+ */
+static void
+file_close(struct capture_file *f)
+{
+	file_sync(f);
+	munmap(f->map, f->size);
+	if (ftruncate(f->fd, (off_t)f->used) < 0) {
+		ERR("Failed to trim capture file: %s\n", strerror(errno));
+	}
+	close(f->fd);
+	free(f);
+}
+
+/*
+ * Finish files writer is done with and have next one ready
+ */
+static void
+writer_tend(struct capture *cap, struct capture_writer *w)
+{
+	struct capture_file *f;
+
+	f = __atomic_exchange_n(&w->done, 0, __ATOMIC_ACQUIRE);
+	if (f) {
+		file_close(f);
+	}
+	/* Writer only moves on to next, so done is free until it's taken */
+	if (!__atomic_load_n(&w->next, __ATOMIC_ACQUIRE)) {
+		f = file_open(cap, w);
+		if (f) {
+			__atomic_store_n(&w->next, f, __ATOMIC_RELEASE);
+		}
+	}
+	/* We're the only one to close cur, so it stays mapped */
+	f = __atomic_load_n(&w->cur, __ATOMIC_ACQUIRE);
+	if (f) {
+		file_sync(f);
+	}
+}
+
+static void *
+capture_main(void *arg)
+{
+	struct capture *cap;
+	struct pollfd pfd;
+	uint64_t val;
+	int i;
+
+	cap = (struct capture *)arg;
+	pfd.fd = cap->wake;
+	pfd.events = POLLIN;
+	while (!__atomic_load_n(&cap->stop, __ATOMIC_ACQUIRE)) {
+		for (i = 0; i < cap->nwriters; i++) {
+			writer_tend(cap, &cap->w[i]);
+		}
+		if ((poll(&pfd, 1, CAPTURE_SYNC_MS) > 0) &&
+				(read(cap->wake, &val, sizeof(val)) < 0)) {
+			/* Nothing to do, we'll look anyway */
+		}
+	}
+	return 0;
+}
+
+int
+capture_init(struct capture *cap, char *prefix, size_t file_size,
+		int nfiles, int nwriters)
+{
+	unsigned char hdr[256];
+	struct capture_writer *w;
+	size_t min;
+	int i;
+
+	memset(cap, 0, sizeof(*cap));
+	cap->prefix = prefix;
+	cap->file_size = file_size ? file_size : CAPTURE_FILE_SIZE;
+	cap->nfiles = (nfiles > 0) ? nfiles : CAPTURE_FILES;
+	cap->nwriters = nwriters;
+	cap->wake = -1;
+	/* Header and the largest packet must fit in one file */
+	min = put_header(hdr) + sizeof(struct pcapng_epb) + 
+		pad4(CAPTURE_HDR_LEN + CAPTURE_SEG_MAX) + 4;
+	if (cap->file_size < min) {
+		ERR("Capture files must be at least %zu bytes\n", min);
+		return -1;
+	}
+	cap->w = (struct capture_writer *)aligned_alloc(64, 
+			(size_t)nwriters * sizeof(*cap->w));
+	if (!cap->w) {
+		ERR("Out of memory for capture writers\n");
+		return -1;
+	}
+	memset(cap->w, 0, (size_t)nwriters * sizeof(*cap->w));
+	for (i = 0; i < nwriters; i++) {
+		w = &cap->w[i];
+		w->cap = cap;
+		w->id = i;
+		w->cur = file_open(cap, w);
+		if (!w->cur) {
+			capture_destroy(cap);
+			return -1;
+		}
+	}
+	cap->wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (cap->wake < 0) {
+		ERR("eventfd() failed: %s\n", strerror(errno));
+		capture_destroy(cap);
+		return -1;
+	}
+	return 0;
+}
+
+int
+capture_start(struct capture *cap)
+{
+	int i;
+
+	/* Second file of each writer is ready before any traffic */
+	for (i = 0; i < cap->nwriters; i++) {
+		writer_tend(cap, &cap->w[i]);
+	}
+	cap->stop = 0;
+	if (pthread_create(&cap->thread, 0, capture_main, cap)) {
+		ERR("Failed to start capture thread\n");
+		return -1;
+	}
+	cap->running = 1;
+	return 0;
+}
+
+void
+capture_destroy(struct capture *cap)
+{
+	struct capture_writer *w;
+	struct capture_file *files[3];
+	char path[4096];
+	int i;
+	int j;
+
+	if (cap->running) {
+		__atomic_store_n(&cap->stop, 1, __ATOMIC_RELEASE);
+		eventfd_write(cap->wake, 1);
+		pthread_join(cap->thread, 0);
+		cap->running = 0;
+	}
+	for (i = 0; cap->w && (i < cap->nwriters); i++) {
+		w = &cap->w[i];
+		files[0] = w->done;
+		files[1] = w->cur;
+		files[2] = w->next;
+		for (j = 0; j < 3; j++) {
+			if (files[j]) {
+				file_close(files[j]);
+			}
+		}
+		/* Spare file was never written to */
+		if (w->next) {
+			file_path(cap, w, w->nfile - 1, path, sizeof(path));
+			unlink(path);
+		}
+	}
+	if (cap->wake >= 0) {
+		close(cap->wake);
+	}
+	free(cap->w);
+	memset(cap, 0, sizeof(*cap));
+	cap->wake = -1;
+}
+
+/*
+ * Room for len bytes in current file of writer, moving on to next file
+ * if it doesn't fit
+ *
+ * Returns:
+ * 	pointer to write to, or 0 if there was no room
+ */
+static unsigned char *
+writer_reserve(struct capture_writer *w, size_t len)
+{
+	struct capture_file *f;
+
+	f = w->cur;
+	if (f->size - f->used >= len) {
+		return f->map + f->used;
+	}
+	/* 
+	 * Capture thread may refill next before it has collected the file
+	 * we finished last, moving on now would lose that one
+	 */
+	f = __atomic_load_n(&w->next, __ATOMIC_ACQUIRE);
+	if (!f || (f->size - f->used < len) ||
+			__atomic_load_n(&w->done, __ATOMIC_ACQUIRE)) {
+		__atomic_store_n(&w->dropped, w->dropped + 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+	__atomic_store_n(&w->next, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&w->done, w->cur, __ATOMIC_RELEASE);
+	__atomic_store_n(&w->cur, f, __ATOMIC_RELEASE);
+	eventfd_write(w->cap->wake, 1);
+	return f->map + f->used;
+}
+
+/*
+ * Returns:
+ * 	contiguous bytes at cursor, up to n
+ */
+static size_t
+iov_next(struct iov_cursor *c, size_t n)
+{
+	size_t left;
+
+	/* Skip empty slices */
+	while (c->iov->iov_len == c->off) {
+		c->iov++;
+		c->off = 0;
+	}
+	left = c->iov->iov_len - c->off;
+	return (left < n) ? left : n;
+}
+
+static void
+iov_skip(struct iov_cursor *c, size_t n)
+{
+	size_t i;
+
+	for (; n; n -= i) {
+		i = iov_next(c, n);
+		c->off += i;
+	}
+}
+
+/*
+ * Write packet of flow with len bytes of payload at cursor
+ */
+static void
+put_packet(struct capture_writer *w, struct capture_flow *f, int iface,
+		int dir, int flags, struct iov_cursor *c, size_t len,
+		uint64_t us)
+{
+	struct pcapng_epb *epb;
+	struct iphdr *ip;
+	struct tcphdr *tcp;
+	unsigned char *p;
+	uint32_t sum;
+	size_t plen;
+	size_t blen;
+	size_t n;
+	size_t i;
+
+	plen = CAPTURE_HDR_LEN + len;
+	blen = sizeof(*epb) + pad4(plen) + 4;
+	p = writer_reserve(w, blen);
+	if (!p) {
+		/* Readers see the gap as lost segments */
+		f->seq[iface][dir] += (uint32_t)len + 
+			!!(flags & (TH_SYN | TH_FIN));
+		iov_skip(c, len);
+		return;
+	}
+
+	epb = (struct pcapng_epb *)p;
+	epb->type = PCAPNG_EPB;
+	epb->len = (uint32_t)blen;
+	epb->iface = (uint32_t)iface;
+	epb->ts_high = (uint32_t)(us >> 32);
+	epb->ts_low = (uint32_t)us;
+	epb->caplen = (uint32_t)plen;
+	epb->origlen = (uint32_t)plen;
+
+	ip = (struct iphdr *)(epb + 1);
+	memset(ip, 0, CAPTURE_HDR_LEN);
+	ip->version = 4;
+	ip->ihl = sizeof(*ip) / 4;
+	ip->tot_len = htons((uint16_t)plen);
+	ip->frag_off = htons(IP_DF);
+	ip->ttl = 64;
+	ip->protocol = IPPROTO_TCP;
+	ip->saddr = f->addr[dir];
+	ip->daddr = f->addr[!dir];
+	sum = 0;
+	for (i = 0; i < sizeof(*ip); i += 2) {
+		sum += ((uint32_t)((unsigned char *)ip)[i] << 8) |
+			((unsigned char *)ip)[i + 1];
+	}
+	sum = (sum & 0xffff) + (sum >> 16);
+	ip->check = htons((uint16_t)~(sum + (sum >> 16)));
+
+	/* Checksum of TCP is left 0, it would cost another pass */
+	tcp = (struct tcphdr *)(ip + 1);
+	tcp->source = f->port[dir];
+	tcp->dest = f->port[!dir];
+	tcp->seq = htonl(f->seq[iface][dir]);
+	tcp->ack_seq = htonl(f->seq[iface][!dir]);
+	tcp->doff = sizeof(*tcp) / 4;
+	tcp->window = htons(65535);
+	tcp->syn = !!(flags & TH_SYN);
+	tcp->fin = !!(flags & TH_FIN);
+	tcp->psh = !!(flags & TH_PUSH);
+	tcp->ack = !!(flags & TH_ACK);
+
+	p = (unsigned char *)(tcp + 1);
+	for (n = len; n; n -= i) {
+		i = iov_next(c, n);
+		memcpy(p, (unsigned char *)c->iov->iov_base + c->off, i);
+		p += i;
+		iov_skip(c, i);
+	}
+	memset(p, 0, pad4(plen) - plen);
+	put32(p + pad4(plen) - plen, (uint32_t)blen);
+
+	f->seq[iface][dir] += (uint32_t)len + !!(flags & (TH_SYN | TH_FIN));
+	__atomic_store_n(&w->cur->used, w->cur->used + blen,
+			__ATOMIC_RELEASE);
+	__atomic_store_n(&w->packets, w->packets + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&w->bytes, w->bytes + len, __ATOMIC_RELAXED);
+}
+
+static uint64_t
+now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+void
+capture_flow_open(struct capture_writer *w, struct capture_flow *f,
+		const struct sockaddr_in *client,
+		const struct sockaddr_in *local)
+{
+	struct iov_cursor c = { 0, 0 };
+	uint64_t us;
+	int i;
+
+	f->addr[0] = client->sin_addr.s_addr;
+	f->addr[1] = local->sin_addr.s_addr;
+	f->port[0] = client->sin_port;
+	f->port[1] = local->sin_port;
+	us = now_us();
+	for (i = 0; i < 2; i++) {
+		f->seq[i][0] = 0;
+		f->seq[i][1] = 0;
+		put_packet(w, f, i, 0, TH_SYN, &c, 0, us);
+		put_packet(w, f, i, 1, TH_SYN | TH_ACK, &c, 0, us);
+		put_packet(w, f, i, 0, TH_ACK, &c, 0, us);
+	}
+	f->open = 1;
+}
+
+void
+capture_data(struct capture_writer *w, struct capture_flow *f, int iface,
+		int dir, const struct iovec *iov, size_t len)
+{
+	struct iov_cursor c = { iov, 0 };
+	uint64_t us;
+	size_t n;
+
+	us = now_us();
+	for (; len; len -= n) {
+		n = (len < CAPTURE_SEG_MAX) ? len : CAPTURE_SEG_MAX;
+		put_packet(w, f, iface, dir, TH_PUSH | TH_ACK, &c, n, us);
+	}
+}
+
+void
+capture_flow_close(struct capture_writer *w, struct capture_flow *f)
+{
+	struct iov_cursor c = { 0, 0 };
+	uint64_t us;
+	int i;
+
+	us = now_us();
+	for (i = 0; i < 2; i++) {
+		put_packet(w, f, i, 0, TH_FIN | TH_ACK, &c, 0, us);
+		put_packet(w, f, i, 1, TH_FIN | TH_ACK, &c, 0, us);
+	}
+	f->open = 0;
+}
+
+/* Link types read back */
+#define LINKTYPE_ETHERNET 1
+
+/* Most interfaces of a section that are read back */
+#define CAPTURE_IF_MAX 64
+
+static uint32_t
+flow_hash(uint32_t a0, uint16_t p0, uint32_t a1, uint16_t p1)
+{
+	uint64_t h;
+
+	/* Same for both directions of flow */
+	h = ((uint64_t)(a0 ^ a1) << 16) ^ (uint64_t)(p0 ^ p1) ^
+		((uint64_t)(a0 + a1) << 32);
+	h *= 0x9e3779b97f4a7c15ull;
+	return (uint32_t)(h >> 32);
+}
+
+static int
+flow_is(struct capture_session *s, uint32_t saddr, uint16_t sport,
+		uint32_t daddr, uint16_t dport, int *dir)
+{
+	if ((s->addr[0] == saddr) && (s->port[0] == sport) &&
+			(s->addr[1] == daddr) && (s->port[1] == dport)) {
+		*dir = 0;
+		return 1;
+	}
+	if ((s->addr[1] == saddr) && (s->port[1] == sport) &&
+			(s->addr[0] == daddr) && (s->port[0] == dport)) {
+		*dir = 1;
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Slot of flow in table of set, which is empty or has flow's latest
+ * session
+ */
+static uint32_t *
+flow_slot(struct capture_set *set, uint32_t saddr, uint16_t sport,
+		uint32_t daddr, uint16_t dport)
+{
+	size_t mask;
+	size_t i;
+	int dir;
+
+	mask = set->table_size - 1;
+	i = flow_hash(saddr, sport, daddr, dport) & mask;
+	while (set->table[i] && !flow_is(&set->s[set->table[i] - 1],
+				saddr, sport, daddr, dport, &dir)) {
+		i = (i + 1) & mask;
+	}
+	return &set->table[i];
+}
+
+static int
+table_grow(struct capture_set *set)
+{
+	struct capture_session *s;
+	uint32_t *old;
+	size_t old_size;
+	size_t i;
+
+	old = set->table;
+	old_size = set->table_size;
+	set->table_size = old_size ? old_size * 2 : 1024;
+	set->table = (uint32_t *)calloc(set->table_size, sizeof(uint32_t));
+	if (!set->table) {
+		set->table = old;
+		set->table_size = old_size;
+		return -1;
+	}
+	/* Later sessions of a flow replace earlier ones */
+	for (i = 0; i < set->n; i++) {
+		s = &set->s[i];
+		*flow_slot(set, s->addr[0], s->port[0], s->addr[1], 
+				s->port[1]) = (uint32_t)i + 1;
+	}
+	free(old);
+	return 0;
+}
+
+static struct capture_session *
+session_new(struct capture_set *set, uint32_t saddr, uint16_t sport,
+		uint32_t daddr, uint16_t dport)
+{
+	struct capture_session *s;
+	size_t cap;
+
+	if ((set->n + 1) * 2 > set->table_size) {
+		if (table_grow(set) < 0) {
+			return 0;
+		}
+	}
+	if (set->n == set->cap) {
+		cap = set->cap ? set->cap * 2 : 64;
+		s = (struct capture_session *)realloc(set->s, 
+				cap * sizeof(*s));
+		if (!s) {
+			return 0;
+		}
+		set->s = s;
+		set->cap = cap;
+	}
+	s = &set->s[set->n];
+	memset(s, 0, sizeof(*s));
+	s->addr[0] = saddr;
+	s->port[0] = sport;
+	s->addr[1] = daddr;
+	s->port[1] = dport;
+	set->n++;
+	*flow_slot(set, saddr, sport, daddr, dport) = (uint32_t)set->n;
+	return s;
+}
+
+static int
+session_add(struct capture_session *s, int dir, uint64_t us,
+		const unsigned char *buf, size_t len)
+{
+	struct capture_chunk *c;
+	unsigned char *data;
+	size_t cap;
+
+	if (s->nchunks == s->chunks_cap) {
+		cap = s->chunks_cap ? s->chunks_cap * 2 : 16;
+		c = (struct capture_chunk *)realloc(s->chunks, 
+				cap * sizeof(*c));
+		if (!c) {
+			return -1;
+		}
+		s->chunks = c;
+		s->chunks_cap = cap;
+	}
+	if (s->len + len > s->data_cap) {
+		cap = s->data_cap ? s->data_cap : 4096;
+		while (cap < s->len + len) {
+			cap *= 2;
+		}
+		data = (unsigned char *)realloc(s->data, cap);
+		if (!data) {
+			return -1;
+		}
+		s->data = data;
+		s->data_cap = cap;
+	}
+	memcpy(s->data + s->len, buf, len);
+	c = &s->chunks[s->nchunks++];
+	c->us = us;
+	c->off = s->len;
+	c->len = (uint32_t)len;
+	c->dir = (uint32_t)dir;
+	s->len += len;
+	return 0;
+}
+
+/*
+ * Add IPv4 packet to session it belongs to
+ *
+ * Returns:
+ * 	0 on success or if packet isn't TCP, -1 if out of memory
+ */
+static int
+load_packet(struct capture_set *set, uint64_t us, const unsigned char *p,
+		size_t len)
+{
+	struct capture_session *s;
+	struct iphdr ip;
+	struct tcphdr tcp;
+	uint32_t *slot;
+	size_t ihl;
+	size_t doff;
+	size_t tot;
+	int dir = 0;
+
+	if (len < sizeof(ip)) {
+		return 0;
+	}
+	memcpy(&ip, p, sizeof(ip));
+	ihl = (size_t)ip.ihl * 4;
+	tot = ntohs(ip.tot_len);
+	if ((ip.version != 4) || (ip.protocol != IPPROTO_TCP) ||
+			(tot > len) || (ihl + sizeof(tcp) > tot)) {
+		return 0;
+	}
+	memcpy(&tcp, p + ihl, sizeof(tcp));
+	doff = (size_t)tcp.doff * 4;
+	if (ihl + doff > tot) {
+		return 0;
+	}
+
+	s = 0;
+	if (set->table_size) {
+		slot = flow_slot(set, ip.saddr, tcp.source, ip.daddr, 
+				tcp.dest);
+		if (*slot) {
+			s = &set->s[*slot - 1];
+		}
+	}
+	if (tcp.syn && !tcp.ack) {
+		s = session_new(set, ip.saddr, tcp.source, ip.daddr, 
+				tcp.dest);
+		return s ? 0 : -1;
+	}
+	if (!s || s->closed) {
+		if (tcp.syn || tcp.fin || tcp.rst) {
+			return 0;
+		}
+		s = session_new(set, ip.saddr, tcp.source, ip.daddr, 
+				tcp.dest);
+		if (!s) {
+			return -1;
+		}
+	}
+	flow_is(s, ip.saddr, tcp.source, ip.daddr, tcp.dest, &dir);
+	if (tot > ihl + doff) {
+		if (session_add(s, dir, us, p + ihl + doff, 
+					tot - ihl - doff) < 0) {
+			return -1;
+		}
+	}
+	if (tcp.fin) {
+		s->fin[dir] = 1;
+	}
+	if (tcp.rst || (s->fin[0] && s->fin[1])) {
+		s->closed = 1;
+	}
+	return 0;
+}
+
+int
+capture_load(struct capture_set *set, char *path)
+{
+	unsigned char linktype[CAPTURE_IF_MAX];
+	struct pcapng_epb epb;
+	unsigned char *map;
+	unsigned char *p;
+	struct stat st;
+	uint32_t type;
+	uint32_t len;
+	uint16_t code;
+	uint16_t olen;
+	size_t off;
+	size_t o;
+	int nif;
+	int fd;
+	int ret;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		ERR("Failed to open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	if ((fstat(fd, &st) < 0) || (st.st_size < 12)) {
+		ERR("%s is not a pcapng file\n", path);
+		close(fd);
+		return -1;
+	}
+	map = (unsigned char *)mmap(0, (size_t)st.st_size, PROT_READ,
+			MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		ERR("Failed to map %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	ret = 0;
+	nif = 0;
+	for (off = 0; off + 12 <= (size_t)st.st_size; off += len) {
+		p = map + off;
+		memcpy(&type, p, 4);
+		memcpy(&len, p + 4, 4);
+		if ((len < 12) || (len & 3) || (len > (size_t)st.st_size - off)) {
+			ERR("%s: bad block at %zu\n", path, off);
+			ret = -1;
+			break;
+		}
+		switch (type) {
+		case (PCAPNG_SHB):
+			memcpy(&type, p + 8, 4);
+			if (type != PCAPNG_MAGIC) {
+				ERR("%s: byte order of section isn't ours\n",
+						path);
+				ret = -1;
+				goto out;
+			}
+			nif = 0;
+			break;
+		case (PCAPNG_IDB):
+			if (nif == CAPTURE_IF_MAX) {
+				break;
+			}
+			memcpy(&code, p + 8, 2);
+			linktype[nif] = ((code == LINKTYPE_RAW) ||
+					(code == LINKTYPE_ETHERNET)) ? 
+				(unsigned char)code : 0;
+			/* Packets we sent are skipped */
+			for (o = 16; o + 4 <= len - 4; o += 4 + pad4(olen)) {
+				memcpy(&code, p + o, 2);
+				memcpy(&olen, p + o + 2, 2);
+				if (!code) {
+					break;
+				}
+				if ((code == 2) && (olen == 2) && 
+						!memcmp(p + o + 4, "tx", 2)) {
+					linktype[nif] = 0;
+				}
+			}
+			nif++;
+			break;
+		case (PCAPNG_EPB):
+			if (len < sizeof(epb) + 4) {
+				break;
+			}
+			memcpy(&epb, p, sizeof(epb));
+			if ((epb.iface >= (uint32_t)nif) ||
+					!linktype[epb.iface] ||
+					(epb.caplen > len - sizeof(epb) - 4)) {
+				break;
+			}
+			p += sizeof(epb);
+			o = 0;
+			if (linktype[epb.iface] == LINKTYPE_ETHERNET) {
+				/* Only untagged IPv4 frames */
+				if ((epb.caplen < 14) || (p[12] != 0x08) ||
+						(p[13] != 0x00)) {
+					break;
+				}
+				o = 14;
+			}
+			if (load_packet(set, ((uint64_t)epb.ts_high << 32) |
+						epb.ts_low, p + o, 
+						epb.caplen - o) < 0) {
+				ERR("Out of memory reading %s\n", path);
+				ret = -1;
+				goto out;
+			}
+			break;
+		}
+	}
+out:
+	munmap(map, (size_t)st.st_size);
+	return ret;
+}
+
+void
+capture_set_free(struct capture_set *set)
+{
+	size_t i;
+
+	for (i = 0; i < set->n; i++) {
+		free(set->s[i].chunks);
+		free(set->s[i].data);
+	}
+	free(set->s);
+	free(set->table);
+	memset(set, 0, sizeof(*set));
+}
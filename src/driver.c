@@ -0,0 +1,621 @@
+/*
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2022, k4m1
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIA LDAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVE RCAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Worker driver. Every worker is a thread with its own listening socket
+ * (SO_REUSEPORT lets the kernel balance accepts between them), its own
+ * event loop and its own connections & buffers, so workers share nothing
+ * on the relay path. The thread calling tap_driver_run() only waits for
+ * signals, manages worker lifecycle and reloads rules.
+ */
+#include <sys/types.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+
+#include <errno.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+
+#include <log.h>
+#include <net_io.h>
+#include <event_loop.h>
+#include <driver.h>
+#include <admin.h>
+#include <backend_set.h>
+#include <hist.h>
+#include <intercept_parser.h>
+#include <metrics.h>
+#include <rules_domain.h>
+#include <udp_relay.h>
+
+/*
+ * Open listening socket for a worker
+ *
+ * Returns:
+ * 	socket on success or -1 on error
+ */
+static int
+worker_listener(struct tap_config *cfg)
+{
+	struct sockaddr_in saddr;
+	int sock;
+	int op;
+
+	op = SOCK_OP_BIND | SOCK_OP_REUSEPORT;
+	if (cfg->proto == PROTO_UDP) {
+		op |= SOCK_OP_UDP;
+	}
+	sock = sock_op_do(cfg->addrin, cfg->lport, &saddr, op);
+	if (sock < 0) {
+		ERR("Unable to bind %s:%d, errno: %d\n", cfg->addrin,
+				cfg->lport, errno);
+		return -1;
+	}
+	/* Clients of a UDP socket are kept apart by udp_relay.c */
+	if (cfg->proto == PROTO_UDP) {
+		return sock;
+	}
+	if (listen(sock, SOMAXCONN) < 0) {
+		ERR("listen() errored with errno: %d\n", errno);
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+/*
+ * Find n:th cpu we're allowed to run on, wrapping around
+ *
+ * Returns:
+ * 	cpu number or -1 on error
+ */
+static int
+nth_cpu(int n)
+{
+	cpu_set_t set;
+	int count;
+	int cpu;
+
+	if (sched_getaffinity(0, sizeof(set), &set) < 0) {
+		return -1;
+	}
+	count = CPU_COUNT(&set);
+	if (!count) {
+		return -1;
+	}
+	n %= count;
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (CPU_ISSET(cpu, &set) && (n-- == 0)) {
+			return cpu;
+		}
+	}
+	return -1;
+}
+
+static void *
+worker_main(void *arg)
+{
+	struct tap_worker *w;
+	cpu_set_t set;
+	int stat;
+
+	w = (struct tap_worker *)arg;
+	if (w->cpu >= 0) {
+		CPU_ZERO(&set);
+		CPU_SET(w->cpu, &set);
+		stat = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		if (stat) {
+			ERR("Failed to pin worker %d to cpu %d: %d\n", w->id,
+					w->cpu, stat);
+		}
+	}
+	if (ev_loop_run(&w->loop) < 0) {
+		w->failed = 1;
+	}
+	__atomic_store_n(&w->done, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+static void
+stop_workers(struct tap_worker *workers, int count, int how)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (workers[i].started) {
+			ev_loop_stop(&workers[i].loop, how);
+		}
+	}
+}
+
+/*
+ * Returns:
+ * 	1 if every started worker has returned from its loop, 0 otherwise
+ */
+static int
+workers_done(struct tap_worker *workers, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (workers[i].started &&
+			!__atomic_load_n(&workers[i].done, __ATOMIC_ACQUIRE)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+ * Set up worker, its listener and event loop. Thread is not started.
+ *
+ * Returns:
+ * 	0 on success or -1 on error
+ */
+static int
+worker_init(struct tap_worker *w, int id, struct tap_config *cfg,
+		struct capture *cap)
+{
+	struct relay_cfg rcfg;
+	int lsock;
+	int stat;
+
+	memset(w, 0, sizeof(*w));
+	w->id = id;
+	w->cpu = cfg->pin_cpus ? nth_cpu(id) : -1;
+
+	rcfg.addrout = cfg->addrout;
+	rcfg.dport = cfg->dport;
+	rcfg.backends = cfg->backends;
+	rcfg.tx_size = cfg->tx_size;
+	rcfg.cb = cfg->cb;
+	rcfg.filter = cfg->filter;
+	rcfg.plugin = cfg->plugin;
+	rcfg.rules = cfg->rules;
+	rcfg.reader = id;
+	rcfg.backend = cfg->backend;
+	rcfg.splice = cfg->splice;
+	rcfg.hwm = cfg->hwm;
+	rcfg.conn_mem = cfg->conn_mem;
+	rcfg.hold_ms = cfg->hold_ms;
+	rcfg.scrub = cfg->scrub;
+	rcfg.connect_timeout_ms = cfg->connect_timeout_ms;
+	rcfg.pool_min = cfg->pool_min;
+	rcfg.pool_max = cfg->pool_max;
+	rcfg.capture = cap->w ? &cap->w[id] : 0;
+	rcfg.udp = (cfg->proto == PROTO_UDP);
+	rcfg.udp_idle_ms = cfg->udp_idle_ms;
+	rcfg.tls = cfg->tls;
+	if (ev_loop_init(&w->loop, &rcfg) < 0) {
+		return -1;
+	}
+	lsock = worker_listener(cfg);
+	if (lsock < 0) {
+		ev_loop_destroy(&w->loop);
+		return -1;
+	}
+	stat = rcfg.udp ? udp_relay_add_listener(&w->loop, lsock) :
+		ev_loop_add_listener(&w->loop, lsock);
+	if (stat < 0) {
+		close(lsock);
+		ev_loop_destroy(&w->loop);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Log state of every backend: up, down or ejected, and its active
+ * connections, connections, failed connects and ejections
+ */
+static void
+log_backends(struct backend_set *set)
+{
+	struct backend *b;
+	uint64_t until;
+	int i;
+
+	for (i = 0; i < set->n; i++) {
+		b = &set->b[i];
+		until = __atomic_load_n(&b->ejected_until, __ATOMIC_RELAXED);
+		LOG("Backend %s: %s, %u active, %llu connections, "
+				"%llu failed connects, %llu ejections\n", b->name,
+				__atomic_load_n(&b->down, __ATOMIC_RELAXED) ? 
+				"down" : ((until > backend_now_ms()) ? 
+				"ejected" : "up"),
+				__atomic_load_n(&b->active, __ATOMIC_RELAXED),
+				(unsigned long long)__atomic_load_n(&b->conns,
+					__ATOMIC_RELAXED),
+				(unsigned long long)__atomic_load_n(&b->failed,
+					__ATOMIC_RELAXED),
+				(unsigned long long)__atomic_load_n(
+					&b->ejections, __ATOMIC_RELAXED));
+	}
+}
+
+/*
+ * Log buffer pool occupancy of every worker, with its relay counters
+ */
+static void
+log_stats(struct tap_worker *workers, int count)
+{
+	struct buf_pool_stats st;
+	struct relay_stats rs;
+	char line[256];
+	size_t off;
+	int cls;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (!workers[i].started) {
+			continue;
+		}
+		buf_pool_stats(&workers[i].loop.pool, &st);
+		off = 0;
+		for (cls = 0; cls < POOL_CLASSES; cls++) {
+			if (st.used[cls] && (off < sizeof(line))) {
+				off += (size_t)snprintf(&line[off],
+						sizeof(line) - off, " %zuK:%zu",
+						((size_t)1 << (cls +
+						POOL_MIN_SHIFT)) / 1024,
+						st.used[cls]);
+			}
+		}
+		line[(off < sizeof(line)) ? off : (sizeof(line) - 1)] = 0;
+		LOG("Worker %d: %zu slabs (%zu huge), %zu KB mapped, "
+				"%zu KB in use, %zu large, buffers:%s\n", i,
+				st.slabs, st.huge_slabs,
+				st.mapped_bytes / 1024, st.used_bytes / 1024,
+				st.large, off ? line : " none");
+		ev_loop_stats(&workers[i].loop, &rs);
+		LOG("Worker %d: %llu accepted, first byte avg %llu us, "
+				"p50 <%llu us, p99 <%llu us, max %llu us\n", i,
+				(unsigned long long)rs.accepted,
+				(unsigned long long)(rs.ttfb.count ? 
+				rs.ttfb.sum / rs.ttfb.count : 0),
+				(unsigned long long)hist_percentile(&rs.ttfb, 50),
+				(unsigned long long)hist_percentile(&rs.ttfb, 99),
+				(unsigned long long)rs.ttfb.max);
+		LOG("Worker %d: upstream pool %llu hits, %llu misses, "
+				"%llu idle, connect %llu retries, %llu timeouts, "
+				"%llu failed\n", i,
+				(unsigned long long)rs.pool_hits,
+				(unsigned long long)rs.pool_misses,
+				(unsigned long long)rs.pool_idle,
+				(unsigned long long)rs.connect_retries,
+				(unsigned long long)rs.connect_timeouts,
+				(unsigned long long)rs.connect_failed);
+		if (workers[i].loop.cfg.udp) {
+			LOG("Worker %d: %llu UDP flows, %llu opened, "
+					"%llu expired, %llu datagrams dropped\n", 
+					i, (unsigned long long)rs.udp_flows,
+					(unsigned long long)rs.udp_flows_opened,
+					(unsigned long long)rs.udp_flows_expired,
+					(unsigned long long)rs.udp_dropped);
+		}
+		if (workers[i].loop.cfg.tls) {
+			LOG("Worker %d: TLS handshakes %llu/%llu resumed with "
+					"clients, %llu/%llu with upstreams, "
+					"%llu failed, %llu kTLS sockets\n", i,
+					(unsigned long long)rs.tls_resumed[0],
+					(unsigned long long)rs.tls_handshakes[0],
+					(unsigned long long)rs.tls_resumed[1],
+					(unsigned long long)rs.tls_handshakes[1],
+					(unsigned long long)rs.tls_failed,
+					(unsigned long long)rs.tls_ktls);
+		}
+	}
+}
+
+/*
+ * Load ruleset again and publish it, current rules stay on error
+ */
+static void
+rules_reload(struct tap_config *cfg)
+{
+	struct stream_rules rules;
+
+	if (!cfg->rules || !cfg->rules_path) {
+		LOG("No ruleset file to reload\n");
+		return;
+	}
+	if (ruleset_load(&rules, cfg->rules_path) < 0) {
+		ERR("Failed to reload %s, keeping current rules\n",
+				cfg->rules_path);
+		return;
+	}
+	if (rules_domain_publish(cfg->rules, &rules) < 0) {
+		return;
+	}
+	LOG("Reloaded %u rules from %s\n", rules.nrules, cfg->rules_path);
+}
+
+/*
+ * Watch directory of ruleset, editors often replace the file instead
+ * of writing to it.
+ *
+ * Returns:
+ * 	non-blocking inotify fd or -1 on error
+ */
+static int
+rules_watch(struct tap_config *cfg)
+{
+	char *path;
+	int fd;
+
+	path = strdup(cfg->rules_path);
+	if (!path) {
+		return -1;
+	}
+	fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd < 0) {
+		ERR("inotify_init1() errored with errno: %d\n", errno);
+		free(path);
+		return -1;
+	}
+	if (inotify_add_watch(fd, dirname(path),
+				IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+		ERR("Unable to watch %s, errno: %d\n", cfg->rules_path, errno);
+		close(fd);
+		fd = -1;
+	}
+	free(path);
+	return fd;
+}
+
+/*
+ * Drain inotify events
+ *
+ * Returns:
+ * 	1 if ruleset was written or replaced, 0 otherwise
+ */
+static int
+rules_changed(int fd, char *rules_path)
+{
+	char buf[4096] __attribute__((aligned(8)));
+	struct inotify_event *ev;
+	char *path;
+	char *base;
+	ssize_t len;
+	ssize_t off;
+	int changed;
+
+	path = strdup(rules_path);
+	if (!path) {
+		return 0;
+	}
+	base = basename(path);
+	changed = 0;
+	while ((len = read(fd, buf, sizeof(buf))) > 0) {
+		for (off = 0; off < len; off += sizeof(*ev) + ev->len) {
+			ev = (struct inotify_event *)&buf[off];
+			if (ev->len && !strcmp(ev->name, base)) {
+				changed = 1;
+			}
+		}
+	}
+	free(path);
+	return changed;
+}
+
+int
+tap_driver_run(struct tap_config *cfg)
+{
+	struct tap_worker *workers;
+	struct metrics_src msrc;
+	struct capture cap;
+	struct admin admin;
+	struct timespec ts;
+	char dst[64];
+	sigset_t set;
+	sigset_t oldset;
+	time_t deadline;
+	int admin_up;
+	int draining;
+	int watch_fd;
+	int reload;
+	int ninit;
+	int ret;
+	int sig;
+	int i;
+
+	if ((cfg->workers < 1) || (cfg->workers > DRIVER_MAX_WORKERS)) {
+		ERR("Invalid amount of workers: %d\n", cfg->workers);
+		return -1;
+	}
+	workers = (struct tap_worker *)calloc(cfg->workers, sizeof(*workers));
+	if (!workers) {
+		ERR("calloc() failed\n");
+		return -1;
+	}
+
+	/* 
+	 * Signals are only handled by this thread, workers inherit
+	 * the blocked mask.
+	 */
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	sigaddset(&set, SIGHUP);
+	sigaddset(&set, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &set, &oldset);
+	signal(SIGPIPE, SIG_IGN);
+
+	ret = 0;
+	admin_up = 0;
+	watch_fd = -1;
+	ninit = 0;
+	memset(&cap, 0, sizeof(cap));
+	if (cfg->rules && cfg->rules_path && cfg->watch_rules) {
+		watch_fd = rules_watch(cfg);
+	}
+	if (cfg->capture_prefix) {
+		if ((capture_init(&cap, cfg->capture_prefix, cfg->capture_size,
+				cfg->capture_files, cfg->workers) < 0) ||
+				(capture_start(&cap) < 0)) {
+			ret = -1;
+			goto end;
+		}
+	}
+	for (ninit = 0; ninit < cfg->workers; ninit++) {
+		if (worker_init(&workers[ninit], ninit, cfg, &cap) < 0) {
+			ret = -1;
+			goto end;
+		}
+	}
+	for (i = 0; i < cfg->workers; i++) {
+		if (pthread_create(&workers[i].thread, 0, worker_main,
+					&workers[i])) {
+			ERR("Failed to start worker %d\n", i);
+			ret = -1;
+			goto stop;
+		}
+		workers[i].started = 1;
+	}
+	if (!cfg->backends) {
+		snprintf(dst, sizeof(dst), "%s:%d", cfg->addrout, cfg->dport);
+	} else if (cfg->backends->n == 1) {
+		snprintf(dst, sizeof(dst), "%s", cfg->backends->b[0].name);
+	} else {
+		snprintf(dst, sizeof(dst), "%d backends", cfg->backends->n);
+	}
+	LOG("Started proxying %s %s:%d -> %s with %d %s workers\n",
+			(cfg->proto == PROTO_UDP) ? "UDP" : "TCP",
+			cfg->addrin, cfg->lport, dst, cfg->workers, 
+			(workers[0].loop.backend == BACKEND_URING) ? 
+			"io_uring" : "epoll");
+	/*
+	 * Lone backend is used even when down, nothing to probe for.
+	 * UDP backends are ejected when they refuse datagrams instead.
+	 */
+	if (cfg->backends && (cfg->backends->n > 1) && (cfg->health_ms > 0) &&
+			(cfg->proto == PROTO_TCP) &&
+			(backend_probe_start(cfg->backends, cfg->health_ms) < 0)) {
+		ret = -1;
+		goto stop;
+	}
+	if (cfg->admin_addr) {
+		msrc.cfg = cfg;
+		msrc.workers = workers;
+		msrc.reader = cfg->workers;
+		msrc.capture = cap.w ? &cap : 0;
+		if (admin_start(&admin, cfg->admin_addr, metrics_render, 
+					&msrc) < 0) {
+			ret = -1;
+			goto stop;
+		}
+		admin_up = 1;
+	}
+
+	draining = 0;
+	deadline = 0;
+	while (!workers_done(workers, cfg->workers)) {
+		ts.tv_sec = 1;
+		ts.tv_nsec = 0;
+		sig = sigtimedwait(&set, 0, &ts);
+		reload = (sig == SIGHUP);
+		if ((watch_fd >= 0) &&
+				rules_changed(watch_fd, cfg->rules_path)) {
+			reload = 1;
+		}
+		if (reload) {
+			rules_reload(cfg);
+		}
+		if (sig == SIGUSR1) {
+			log_stats(workers, cfg->workers);
+			if (cfg->backends) {
+				log_backends(cfg->backends);
+			}
+		}
+		if (cfg->rules) {
+			rules_domain_reclaim(cfg->rules);
+		}
+		if ((sig == SIGINT) || (sig == SIGTERM)) {
+			if (draining) {
+				LOG("Stopping now\n");
+				stop_workers(workers, cfg->workers, EV_STOP_NOW);
+				continue;
+			}
+			LOG("Got signal %d, finishing active connections\n", sig);
+			draining = 1;
+			deadline = time(0) + cfg->drain_timeout;
+			stop_workers(workers, cfg->workers, EV_STOP_DRAIN);
+		}
+		if (draining && (time(0) >= deadline)) {
+			stop_workers(workers, cfg->workers, EV_STOP_NOW);
+		}
+		for (i = 0; i < cfg->workers; i++) {
+			if (__atomic_load_n(&workers[i].done, __ATOMIC_ACQUIRE) &&
+					workers[i].failed && !draining) {
+				ERR("Worker %d failed, stopping\n", i);
+				ret = -1;
+				draining = 1;
+				deadline = time(0);
+				stop_workers(workers, cfg->workers, EV_STOP_NOW);
+			}
+		}
+	}
+stop:
+	if (admin_up) {
+		admin_stop(&admin);
+	}
+	if (cfg->backends) {
+		backend_probe_stop(cfg->backends);
+	}
+	stop_workers(workers, cfg->workers, EV_STOP_NOW);
+	for (i = 0; i < cfg->workers; i++) {
+		if (workers[i].started) {
+			pthread_join(workers[i].thread, 0);
+		}
+	}
+end:
+	for (i = 0; i < ninit; i++) {
+		ev_loop_destroy(&workers[i].loop);
+	}
+	/* Connections closed above were the last to capture */
+	if (cap.w) {
+		capture_destroy(&cap);
+	}
+	free(workers);
+	if (watch_fd >= 0) {
+		close(watch_fd);
+	}
+	pthread_sigmask(SIG_SETMASK, &oldset, 0);
+	return ret;
+}
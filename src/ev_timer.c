@@ -0,0 +1,181 @@
+/*
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2022, k4m1
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIA LDAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVE RCAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Timers of an event loop, kept in a binary min-heap. Arming, moving
+ * and cancelling are O(log n), and every timer knows its place in the
+ * heap so it can be cancelled without searching.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <ev_timer.h>
+
+static void
+heap_set(struct ev_timers *timers, size_t i, struct ev_timer *t)
+{
+	timers->heap[i] = t;
+	t->idx = i;
+}
+
+static void
+heap_up(struct ev_timers *timers, size_t i)
+{
+	struct ev_timer *t;
+	size_t parent;
+
+	t = timers->heap[i];
+	while (i) {
+		parent = (i - 1) / 2;
+		if (timers->heap[parent]->when <= t->when) {
+			break;
+		}
+		heap_set(timers, i, timers->heap[parent]);
+		i = parent;
+	}
+	heap_set(timers, i, t);
+}
+
+static void
+heap_down(struct ev_timers *timers, size_t i)
+{
+	struct ev_timer *t;
+	size_t child;
+
+	t = timers->heap[i];
+	for (;;) {
+		child = (2 * i) + 1;
+		if (child >= timers->cnt) {
+			break;
+		}
+		if ((child + 1 < timers->cnt) && (timers->heap[child + 1]->when <
+					timers->heap[child]->when)) {
+			child++;
+		}
+		if (t->when <= timers->heap[child]->when) {
+			break;
+		}
+		heap_set(timers, i, timers->heap[child]);
+		i = child;
+	}
+	heap_set(timers, i, t);
+}
+
+void
+ev_timer_init(struct ev_timer *t, void (*fn)(void *, void *), void *arg)
+{
+	t->when = 0;
+	t->idx = EV_TIMER_IDLE;
+	t->fn = fn;
+	t->arg = arg;
+}
+
+int
+ev_timer_arm(struct ev_timers *timers, struct ev_timer *t, uint64_t when)
+{
+	struct ev_timer **heap;
+	size_t cap;
+
+	if (t->idx != EV_TIMER_IDLE) {
+		t->when = when;
+		heap_up(timers, t->idx);
+		heap_down(timers, t->idx);
+		return 0;
+	}
+	if (timers->cnt == timers->cap) {
+		cap = timers->cap ? (timers->cap * 2) : 64;
+		heap = (struct ev_timer **)realloc(timers->heap,
+				cap * sizeof(*heap));
+		if (!heap) {
+			return -1;
+		}
+		timers->heap = heap;
+		timers->cap = cap;
+	}
+	t->when = when;
+	heap_set(timers, timers->cnt++, t);
+	heap_up(timers, t->idx);
+	return 0;
+}
+
+void
+ev_timer_cancel(struct ev_timers *timers, struct ev_timer *t)
+{
+	struct ev_timer *moved;
+	size_t i;
+
+	if (t->idx == EV_TIMER_IDLE) {
+		return;
+	}
+	i = t->idx;
+	t->idx = EV_TIMER_IDLE;
+	if (i == --timers->cnt) {
+		return;
+	}
+	/* Last one takes its place, and may need to go either way */
+	moved = timers->heap[timers->cnt];
+	heap_set(timers, i, moved);
+	heap_up(timers, i);
+	heap_down(timers, moved->idx);
+}
+
+struct ev_timer *
+ev_timer_expired(struct ev_timers *timers, uint64_t now)
+{
+	struct ev_timer *t;
+
+	if (!timers->cnt || (timers->heap[0]->when > now)) {
+		return 0;
+	}
+	t = timers->heap[0];
+	ev_timer_cancel(timers, t);
+	return t;
+}
+
+uint64_t
+ev_timer_next(struct ev_timers *timers)
+{
+	return timers->cnt ? timers->heap[0]->when : UINT64_MAX;
+}
+
+void
+ev_timers_free(struct ev_timers *timers)
+{
+	size_t i;
+
+	for (i = 0; i < timers->cnt; i++) {
+		timers->heap[i]->idx = EV_TIMER_IDLE;
+	}
+	free(timers->heap);
+	timers->heap = 0;
+	timers->cnt = 0;
+	timers->cap = 0;
+}
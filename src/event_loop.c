@@ -0,0 +1,1675 @@
+/*
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2022, k4m1
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIA LDAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVE RCAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Event driven relay core.
+ *
+ * Every socket is non-blocking and registered to epoll in edge-triggered
+ * mode for both reading and writing, so each socket is added once and
+ * never modified. Because edges are only reported once, every direction
+ * remembers whether its source still has data (readable).
+ *
+ * Intercepted data is queued to the ring buffer of its direction and
+ * flushed whenever destination is writable. Direction keeps reading
+ * until its queue reaches the high-water mark or connection's memory
+ * cap, so a slow destination pushes back on its own source only, and
+ * other directions & connections keep going.
+ *
+ * Rules are matched as a stream, a pattern may be split over any number
+ * of reads. Bytes that may start a pattern stay at the end of ring, and
+ * are released when the pattern can't match anymore, the source is done,
+ * or they've waited for cfg.hold_ms.
+ *
+ * Every direction pins the rules it matches with, see rules_domain.c,
+ * and moves to reloaded rules only between patterns, so reloading never
+ * changes rules under a match in progress.
+ *
+ * A direction nothing intercepts is moved socket -> pipe -> socket with
+ * splice(), so the bytes never reach user space. Whether to splice or
+ * copy is decided again before every read: pipe is flushed before the
+ * copying path takes over, and vice versa, so order is kept when rules
+ * come and go mid-stream.
+ *
+ * UDP flows are relayed on the same loop by udp_relay.c.
+ *
+ * With TLS, a connection relays once handshakes of tls_relay.c are
+ * done, and its sockets are read & written through OpenSSL unless the
+ * kernel does TLS for them.
+ */
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+
+#include <log.h>
+#include <net_io.h>
+#include <event_loop.h>
+#include <ev_timer.h>
+#include <plugin.h>
+#include <relay_filter.h>
+#include <tls_relay.h>
+#include <udp_relay.h>
+#include <upstream_pool.h>
+#include <uring_loop.h>
+
+#define EV_RELAY_EVENTS (EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET)
+
+static void on_listener(struct event_loop *loop);
+
+int
+ev_add(struct event_loop *loop, struct ev_source *src, uint32_t events)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = src;
+	EV_SYSCALL(loop);
+	return epoll_ctl(loop->epfd, EPOLL_CTL_ADD, src->fd, &ev);
+}
+
+int
+ev_mod(struct event_loop *loop, struct ev_source *src, uint32_t events)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = src;
+	EV_SYSCALL(loop);
+	return epoll_ctl(loop->epfd, EPOLL_CTL_MOD, src->fd, &ev);
+}
+
+/*
+ * Queue connection to be pumped again after current event batch,
+ * used when a direction runs out of budget before draining its source.
+ */
+static void
+ev_defer(struct event_loop *loop, struct tap_conn *conn)
+{
+	if (conn->queued) {
+		return;
+	}
+	conn->queued = 1;
+	conn->next_ready = loop->ready;
+	loop->ready = conn;
+}
+
+void
+ev_conn_free(struct tap_conn *conn)
+{
+	tls_conn_free(conn);
+	ring_free(&conn->dir[DIR_C2U].ring);
+	ring_free(&conn->dir[DIR_U2C].ring);
+	stream_ctx_free(&conn->dir[DIR_C2U].match);
+	stream_ctx_free(&conn->dir[DIR_U2C].match);
+	if (conn->dir[DIR_C2U].gen) {
+		rules_gen_put(conn->dir[DIR_C2U].gen);
+	}
+	if (conn->dir[DIR_U2C].gen) {
+		rules_gen_put(conn->dir[DIR_U2C].gen);
+	}
+	if (conn->backend) {
+		backend_release(conn->backend);
+	}
+	free(conn);
+}
+
+void
+ev_conn_unlink(struct event_loop *loop, struct tap_conn *conn)
+{
+	if (conn->prev) {
+		conn->prev->next = conn->next;
+	} else {
+		loop->conns = conn->next;
+	}
+	if (conn->next) {
+		conn->next->prev = conn->prev;
+	}
+	if (conn->flow.open) {
+		capture_flow_close(loop->cfg.capture, &conn->flow);
+	}
+	conn->prev = 0;
+	conn->next = 0;
+	loop->nconns--;
+	EV_STAT_SET(loop, active, loop->nconns);
+	EV_STAT_ADD(loop, closed, 1);
+}
+
+/*
+ * Make direction match with rules of gen, or with none if gen is 0.
+ * Reference to gen is taken over, and the one to rules direction had is
+ * dropped. Limits hit carry over to the same rules in gen, so a reload
+ * doesn't let them fire again. If that runs out of memory, direction
+ * stays on its rules and the reference to gen is dropped instead.
+ */
+static int
+dir_set_rules(struct event_loop *loop, struct relay_dir *d,
+		struct rules_gen *gen)
+{
+	if (d->gen && gen) {
+		if (stream_ctx_rebind(&d->match, &d->gen->rules, 
+					&gen->rules) < 0) {
+			ERR("dir_set_rules: out of memory\n");
+			rules_gen_put(gen);
+			return -1;
+		}
+	} else {
+		free(d->match.counts);
+		d->match.counts = 0;
+	}
+	if (d->gen) {
+		rules_gen_put(d->gen);
+	}
+	d->gen = gen;
+	d->rules = gen ? &gen->rules : 0;
+	d->match.hits = gen ? rules_gen_hits(gen, loop->cfg.reader) : 0;
+	return 0;
+}
+
+struct tap_conn *
+ev_conn_alloc(struct event_loop *loop, int nsock)
+{
+	struct sockaddr_in saddr;
+	struct sockaddr_in local;
+	struct tap_conn *conn;
+	socklen_t len;
+	int hash;
+	int i;
+
+	/* Ring buffers are allocated once there's something to queue */
+	conn = (struct tap_conn *)calloc(1, sizeof(*conn));
+	if (!conn) {
+		ERR("calloc(%zu) failed\n", sizeof(*conn));
+		return 0;
+	}
+	conn->client.kind = EV_CLIENT;
+	conn->client.fd = nsock;
+	conn->client.conn = conn;
+	conn->upstream.kind = EV_UPSTREAM;
+	conn->upstream.fd = -1;
+	conn->upstream.conn = conn;
+	conn->accepted_us = ev_now_us();
+	ev_timer_init(&conn->timer, 0, conn);
+	conn->dir[DIR_C2U].src = &conn->client;
+	conn->dir[DIR_C2U].dst = &conn->upstream;
+	conn->dir[DIR_U2C].src = &conn->upstream;
+	conn->dir[DIR_U2C].dst = &conn->client;
+	for (i = 0; i < 2; i++) {
+		conn->dir[i].pipe[0] = -1;
+		conn->dir[i].pipe[1] = -1;
+		conn->dir[i].bid = -1;
+		conn->dir[i].ring.pool = &loop->pool;
+	}
+	/* Directions move to rules reloaded later, see dir_repin() */
+	if (loop->cfg.rules) {
+		for (i = 0; i < 2; i++) {
+			dir_set_rules(loop, &conn->dir[i], 
+					rules_domain_get(loop->cfg.rules));
+		}
+	}
+	hash = loop->cfg.backends && (loop->cfg.backends->policy == LB_HASH);
+	if (hash || loop->cfg.capture || loop->cfg.plugin) {
+		len = sizeof(saddr);
+		EV_SYSCALL(loop);
+		if (getpeername(nsock, (struct sockaddr *)&saddr, &len) < 0) {
+			memset(&saddr, 0, sizeof(saddr));
+		}
+		if (hash) {
+			conn->hash = backend_hash(&saddr);
+		}
+		conn->plug.client = saddr;
+	}
+	if (loop->cfg.capture) {
+		len = sizeof(local);
+		EV_SYSCALL(loop);
+		if (getsockname(nsock, (struct sockaddr *)&local, &len) < 0) {
+			memset(&local, 0, sizeof(local));
+		}
+		capture_flow_open(loop->cfg.capture, &conn->flow, &saddr, 
+				&local);
+	}
+
+	conn->next = loop->conns;
+	if (loop->conns) {
+		loop->conns->prev = conn;
+	}
+	loop->conns = conn;
+	loop->nconns++;
+	EV_STAT_SET(loop, active, loop->nconns);
+	EV_STAT_ADD(loop, accepted, 1);
+	return conn;
+}
+
+void
+ev_conn_first_byte(struct event_loop *loop, struct tap_conn *conn)
+{
+	conn->relayed = 1;
+	hist_add(&loop->stats.ttfb, ev_now_us() - conn->accepted_us);
+}
+
+void
+ev_loop_stats(struct event_loop *loop, struct relay_stats *stats)
+{
+	uint64_t *dst;
+	uint64_t *src;
+	size_t i;
+
+	/* Every field is an uint64_t counter */
+	dst = (uint64_t *)stats;
+	src = (uint64_t *)&loop->stats;
+	for (i = 0; i < sizeof(*stats) / sizeof(uint64_t); i++) {
+		dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+	}
+}
+
+size_t
+relay_intercept(struct event_loop *loop, struct tap_conn *conn, int dir,
+		unsigned char *buf, size_t len)
+{
+	struct iovec iov;
+
+	if (loop->cfg.capture) {
+		iov.iov_base = buf;
+		iov.iov_len = len;
+		capture_data(loop->cfg.capture, &conn->flow, CAPTURE_IF_RX,
+				dir, &iov, len);
+	}
+	/* If callback, do it */
+	if (loop->cfg.cb != 0) {
+		loop->cfg.cb(buf, len);
+	}
+	return len;
+}
+
+int
+relay_passthrough(struct event_loop *loop, struct tap_conn *conn, int dir)
+{
+	struct stream_rules *rules;
+
+	/* Direction may have no rules even if the other one has */
+	rules = conn->dir[dir].rules;
+	return loop->cfg.splice && (loop->cfg.cb == 0) &&
+		(loop->cfg.filter == 0) && (loop->cfg.plugin == 0) &&
+		(loop->cfg.capture == 0) &&
+		tls_plain(conn->dir[dir].src, conn->dir[dir].dst) &&
+		((rules == 0) || !rules->ac[dir].npatterns);
+}
+
+uint64_t
+ev_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ((uint64_t)ts.tv_sec * 1000) +
+		((uint64_t)ts.tv_nsec / 1000000);
+}
+
+uint64_t
+ev_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000) +
+		((uint64_t)ts.tv_nsec / 1000);
+}
+
+uint64_t
+ev_backoff_ms(struct event_loop *loop, int attempt)
+{
+	uint64_t delay;
+
+	delay = CONN_BACKOFF_MS;
+	while ((--attempt > 0) && (delay < CONN_BACKOFF_MAX_MS)) {
+		delay <<= 1;
+	}
+	if (delay > CONN_BACKOFF_MAX_MS) {
+		delay = CONN_BACKOFF_MAX_MS;
+	}
+	/* Keep half, so retries of many connections spread out */
+	return (delay / 2) + ((uint64_t)rand_r(&loop->seed) % ((delay / 2) + 1));
+}
+
+void
+ev_pick_upstream(struct event_loop *loop, struct backend **backend,
+		uint32_t hash, struct sockaddr_in *saddr)
+{
+	if (!loop->cfg.backends) {
+		sock_addr_init(loop->cfg.addrout, loop->cfg.dport, saddr);
+		return;
+	}
+	if (*backend) {
+		backend_release(*backend);
+	}
+	*backend = backend_pick(loop->cfg.backends, &loop->cursor, hash);
+	*saddr = (*backend)->saddr;
+}
+
+/* Put connection to list of ones holding bytes back */
+static void
+conn_hold(struct event_loop *loop, struct tap_conn *conn)
+{
+	if (conn->holding) {
+		return;
+	}
+	conn->holding = 1;
+	conn->prev_held = 0;
+	conn->next_held = loop->held;
+	if (loop->held) {
+		loop->held->prev_held = conn;
+	}
+	loop->held = conn;
+}
+
+static void
+conn_unhold(struct event_loop *loop, struct tap_conn *conn)
+{
+	if (!conn->holding) {
+		return;
+	}
+	if (conn->prev_held) {
+		conn->prev_held->next_held = conn->next_held;
+	} else {
+		loop->held = conn->next_held;
+	}
+	if (conn->next_held) {
+		conn->next_held->prev_held = conn->prev_held;
+	}
+	conn->holding = 0;
+}
+
+static void
+dir_pipe_close(struct event_loop *loop, struct relay_dir *d)
+{
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		if (d->pipe[i] >= 0) {
+			EV_SYSCALL(loop);
+			close(d->pipe[i]);
+			d->pipe[i] = -1;
+		}
+	}
+	d->piped = 0;
+}
+
+/*
+ * Close connection. Memory is released only after the current event
+ * batch, as there may still be events pointing to this connection.
+ */
+static void
+conn_close(struct event_loop *loop, struct tap_conn *conn)
+{
+	struct plugin *plug;
+
+	if (conn->state == CONN_CLOSED) {
+		return;
+	}
+	conn->state = CONN_CLOSED;
+	ev_timer_cancel(&loop->timers, &conn->timer);
+	if (conn->client.fd >= 0) {
+		EV_SYSCALL(loop);
+		close(conn->client.fd);
+		conn->client.fd = -1;
+	}
+	if (conn->upstream.fd >= 0) {
+		EV_SYSCALL(loop);
+		close(conn->upstream.fd);
+		conn->upstream.fd = -1;
+	}
+	dir_pipe_close(loop, &conn->dir[DIR_C2U]);
+	dir_pipe_close(loop, &conn->dir[DIR_U2C]);
+	if (conn->plugged) {
+		plug = loop->cfg.plugin;
+		if (PLUGIN_HAS(plug->ops, conn_close)) {
+			plug->ops->conn_close(plug->global, &conn->plug);
+		}
+		conn->plugged = 0;
+	}
+	conn_unhold(loop, conn);
+	ev_conn_unlink(loop, conn);
+	conn->next_closed = loop->closed;
+	loop->closed = conn;
+}
+
+/*
+ * Connect to upstream failed or timed out, try again after a backoff
+ * until we've tried CONN_RETRIES times.
+ *
+ * Returns:
+ * 	0 if we'll try again or -1 if we gave up
+ */
+static int
+conn_retry(struct event_loop *loop, struct tap_conn *conn)
+{
+	if (conn->upstream.fd >= 0) {
+		EV_SYSCALL(loop);
+		close(conn->upstream.fd);
+		conn->upstream.fd = -1;
+	}
+	if (conn->backend) {
+		backend_failed(conn->backend);
+	}
+	if (++conn->retries >= CONN_RETRIES) {
+		ERR("Failed to connect to %s\n", loop->cfg.addrout);
+		EV_STAT_ADD(loop, connect_failed, 1);
+		return -1;
+	}
+	EV_STAT_ADD(loop, connect_retries, 1);
+	conn->state = CONN_BACKOFF;
+	if (ev_timer_arm(&loop->timers, &conn->timer, ev_now_ms() +
+				ev_backoff_ms(loop, conn->retries)) < 0) {
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Start non-blocking connect to upstream, it may take up to
+ * cfg.connect_timeout_ms.
+ *
+ * Returns:
+ * 	0 if connect is in progress or we'll try again later, or -1 if we
+ * 	gave up
+ */
+static int
+conn_connect(struct event_loop *loop, struct tap_conn *conn)
+{
+	struct sockaddr_in saddr;
+	int sock;
+	int one;
+
+	ev_pick_upstream(loop, &conn->backend, conn->hash, &saddr);
+	conn->connect_us = ev_now_us();
+	loop->nsyscalls += 2;
+	sock = sock_connect_nb(&saddr);
+	if (sock < 0) {
+		return conn_retry(loop, conn);
+	}
+	one = 1;
+	EV_SYSCALL(loop);
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	conn->upstream.fd = sock;
+	if (ev_add(loop, &conn->upstream, EV_RELAY_EVENTS) < 0) {
+		ERR("epoll_ctl() errored with errno: %d\n", errno);
+		close(sock);
+		conn->upstream.fd = -1;
+		return -1;
+	}
+	conn->state = CONN_CONNECTING;
+	if (ev_timer_arm(&loop->timers, &conn->timer, ev_now_ms() +
+				(uint64_t)loop->cfg.connect_timeout_ms) < 0) {
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Connect took too long, or backoff is over
+ */
+static void
+on_conn_timer(void *loop, void *arg)
+{
+	struct tap_conn *conn;
+	int stat;
+
+	conn = (struct tap_conn *)arg;
+	if (conn->state == CONN_CONNECTING) {
+		EV_STAT_ADD((struct event_loop *)loop, connect_timeouts, 1);
+		stat = conn_retry(loop, conn);
+	} else {
+		stat = conn_connect(loop, conn);
+	}
+	if (stat < 0) {
+		conn_close(loop, conn);
+	}
+}
+
+/*
+ * Introduce connection to plugin
+ *
+ * Returns:
+ * 	0 on success or -1 if plugin refused connection
+ */
+static int
+conn_plug(struct event_loop *loop, struct tap_conn *conn)
+{
+	struct plugin *plug;
+
+	plug = loop->cfg.plugin;
+	conn->plug.id = loop->plugin_ids++;
+	conn->plug.worker = loop->cfg.reader;
+	if (PLUGIN_HAS(plug->ops, conn_open) && 
+			(plug->ops->conn_open(plug->global, &conn->plug) < 0)) {
+		return -1;
+	}
+	conn->plugged = 1;
+	return 0;
+}
+
+/*
+ * Set up new connection for accepted client socket
+ *
+ * Returns:
+ * 	0 on success or -1 on error, nsock is closed on error
+ */
+static int
+conn_new(struct event_loop *loop, int nsock)
+{
+	struct tap_conn *conn;
+	int one;
+
+	conn = ev_conn_alloc(loop, nsock);
+	if (!conn) {
+		close(nsock);
+		return -1;
+	}
+	if (loop->cfg.plugin && (conn_plug(loop, conn) < 0)) {
+		conn_close(loop, conn);
+		return -1;
+	}
+	one = 1;
+	EV_SYSCALL(loop);
+	setsockopt(nsock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if (ev_add(loop, &conn->client, EV_RELAY_EVENTS) < 0) {
+		ERR("epoll_ctl() errored with errno: %d\n", errno);
+		conn_close(loop, conn);
+		return -1;
+	}
+	if (loop->cfg.tls && loop->cfg.tls->server &&
+			(tls_conn_accept(loop, conn) < 0)) {
+		conn_close(loop, conn);
+		return -1;
+	}
+	ev_timer_init(&conn->timer, on_conn_timer, conn);
+	if (upstream_pool_take(loop, &conn->upstream) == 0) {
+		/* Epoll tells if upstream sent something already */
+		conn->state = CONN_RELAY;
+		if (loop->cfg.tls && loop->cfg.tls->client &&
+				(tls_conn_connect(loop, conn) < 0)) {
+			conn_close(loop, conn);
+			return -1;
+		}
+		return 0;
+	}
+	if (conn_connect(loop, conn) < 0) {
+		conn_close(loop, conn);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Flush data waiting in pipe of direction
+ *
+ * Returns:
+ * 	1 if pipe is empty, 0 if dst can't take more now, -1 on error
+ */
+static int
+dir_flush_pipe(struct event_loop *loop, struct relay_dir *d)
+{
+	ssize_t stat;
+
+	while (d->piped) {
+		EV_SYSCALL(loop);
+		stat = splice(d->pipe[0], 0, d->dst->fd, 0, d->piped,
+				SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (stat < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+				return 0;
+			}
+			return -1;
+		}
+		d->piped -= (size_t)stat;
+		loop->nbytes += (size_t)stat;
+		ev_conn_relayed(loop, d->src->conn, 
+				(int)(d - d->src->conn->dir), (size_t)stat);
+	}
+	return 1;
+}
+
+/*
+ * Flush data queued to ring of direction, with replacements of rules
+ * in place of what they replace
+ *
+ * Returns:
+ * 	1 if everything not held back is sent, 0 if dst can't take more
+ * 	now, -1 on error
+ */
+static int
+dir_flush_ring(struct event_loop *loop, struct relay_dir *d)
+{
+	struct iovec iov[RELAY_IOV_MAX];
+	struct msghdr msg;
+	ssize_t stat;
+
+	for (;;) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		if (d->rules) {
+			/* Replacements are sent between slices of ring */
+			msg.msg_iovlen = stream_peek_iov(&d->match, &d->ring,
+					iov, RELAY_IOV_MAX);
+			if (!msg.msg_iovlen) {
+				/* Deleted bytes may still be at the start */
+				stream_consume(&d->match, &d->ring, 0);
+				break;
+			}
+		} else {
+			msg.msg_iovlen = ring_peek_iov(&d->ring, iov,
+					ring_used(&d->ring));
+			if (!msg.msg_iovlen) {
+				break;
+			}
+		}
+		if (d->dst->ssl && !(d->dst->ktls & TLS_KTLS_TX)) {
+			stat = tls_sendv(loop, d->dst, iov, msg.msg_iovlen);
+		} else {
+			EV_SYSCALL(loop);
+			stat = sendmsg(d->dst->fd, &msg, MSG_NOSIGNAL);
+		}
+		if (stat < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+				return 0;
+			}
+			return -1;
+		}
+		if (loop->cfg.capture) {
+			capture_data(loop->cfg.capture, &d->src->conn->flow,
+					CAPTURE_IF_TX, 
+					(int)(d - d->src->conn->dir), iov, 
+					(size_t)stat);
+		}
+		if (d->rules) {
+			stream_consume(&d->match, &d->ring, (size_t)stat);
+		} else {
+			ring_consume(&d->ring, (size_t)stat);
+		}
+		loop->nbytes += (size_t)stat;
+		ev_conn_relayed(loop, d->src->conn, 
+				(int)(d - d->src->conn->dir), (size_t)stat);
+	}
+	/* Idle directions hold no buffer, pool makes getting one cheap */
+	if (!ring_used(&d->ring)) {
+		ring_free(&d->ring);
+	}
+	return 1;
+}
+
+/*
+ * Apply rules to len bytes just queued to ring of direction
+ *
+ * Returns:
+ * 	0 on success or -1 on error
+ */
+static int
+dir_match(struct event_loop *loop, struct tap_conn *conn, int dir,
+		size_t len)
+{
+	struct relay_dir *d;
+	size_t held;
+
+	d = &conn->dir[dir];
+	held = d->match.held;
+	if (stream_scan(d->rules, &d->match, dir, &d->ring, len) < 0) {
+		return -1;
+	}
+	if (d->match.held && !held) {
+		d->held_since = ev_now_ms();
+		conn_hold(loop, conn);
+	}
+	return 0;
+}
+
+/*
+ * Move direction to the current rules if they've been reloaded since it
+ * pinned its own. A direction that's in the middle of a pattern, holds
+ * bytes back or has replacements queued still needs the rules it has,
+ * it moves once it's done with them. Stream offsets carry over, so
+ * scopes of new rules count from the start of connection.
+ */
+static void
+dir_repin(struct event_loop *loop, struct relay_dir *d)
+{
+	struct rules_gen *cur;
+
+	cur = __atomic_load_n(&loop->cfg.rules->cur, __ATOMIC_ACQUIRE);
+	if ((cur == d->gen) || (d->match.state != AC_START) || 
+			d->match.held || (d->match.first != d->match.nedits)) {
+		return;
+	}
+	/* Out of memory leaves it on the rules it has until next read */
+	dir_set_rules(loop, d, rules_domain_get(loop->cfg.rules));
+}
+
+/*
+ * Pass read to function of filter, and queue what it gives in place of
+ * the read. Read is at the end of ring, reserved but not committed.
+ *
+ * Returns:
+ * 	0 on success or -1 on error, len is set to bytes queued
+ */
+static int
+dir_filter(struct event_loop *loop, struct relay_dir *d, int dir,
+		unsigned char *buf, size_t *len)
+{
+	struct relay_filter *f;
+	unsigned char *out;
+	size_t out_len;
+	size_t pushed;
+	int stat;
+
+	f = loop->cfg.filter;
+	out = 0;
+	out_len = 0;
+	EV_STAT_ADD(loop, filtered[dir], 1);
+	stat = f->fn(f->arg, dir, buf, *len, &out, &out_len);
+	if (stat <= 0) {
+		if (!stat) {
+			ring_commit(&d->ring, *len);
+		}
+		free(out);
+		return stat;
+	}
+	/* Function decides how much it gives, memory cap is for reads */
+	pushed = ring_push(&d->ring, out, out_len, SIZE_MAX);
+	free(out);
+	*len = pushed;
+	return (pushed == out_len) ? 0 : -1;
+}
+
+/*
+ * Check if any of iovecs points to region
+ *
+ * Returns:
+ * 	1 if one does, 0 if not
+ */
+static int
+iov_overlaps(const struct iovec *iov, int cnt, unsigned char *buf,
+		size_t len)
+{
+	unsigned char *base;
+	int i;
+
+	for (i = 0; i < cnt; i++) {
+		base = (unsigned char *)iov[i].iov_base;
+		if (iov[i].iov_len && (base < buf + len) && 
+				(buf < base + iov[i].iov_len)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Copy iovecs to scratch buffer of loop
+ *
+ * Returns:
+ * 	scratch buffer or 0 if allocating memory failed
+ */
+static unsigned char *
+iov_gather(struct event_loop *loop, const struct iovec *iov, int cnt,
+		size_t len)
+{
+	unsigned char *p;
+	size_t off;
+	int i;
+
+	if (len > loop->scratch_size) {
+		p = (unsigned char *)realloc(loop->scratch, len);
+		if (!p) {
+			ERR("realloc(%zu) failed\n", len);
+			return 0;
+		}
+		loop->scratch = p;
+		loop->scratch_size = len;
+	}
+	off = 0;
+	for (i = 0; i < cnt; i++) {
+		memcpy(loop->scratch + off, iov[i].iov_base, iov[i].iov_len);
+		off += iov[i].iov_len;
+	}
+	return loop->scratch;
+}
+
+/*
+ * Pass read to plugin, and queue what it gives in place of the read.
+ * Read is at the end of ring, reserved but not committed. Output that
+ * starts with the read is committed where it is, rest of output is
+ * copied after it, through scratch buffer if it points to the read, as
+ * queueing writes over the read or moves the ring.
+ *
+ * Returns:
+ * 	1 if output was queued, 0 if read is to be queued as it is, or -1
+ * 	on error, len is set to bytes queued
+ */
+static int
+dir_plugin(struct event_loop *loop, struct tap_conn *conn, int dir,
+		unsigned char *buf, size_t *len)
+{
+	struct relay_dir *d;
+	struct plugin *plug;
+	struct iovec iov;
+	struct iovec *out;
+	unsigned char *src;
+	size_t queued;
+	size_t want;
+	int outcnt;
+	int stat;
+	int i;
+	int j;
+
+	d = &conn->dir[dir];
+	plug = loop->cfg.plugin;
+	iov.iov_base = buf;
+	iov.iov_len = *len;
+	out = 0;
+	outcnt = 0;
+	stat = plug->ops->data(plug->global, &conn->plug, dir, &iov, 1,
+			&out, &outcnt);
+	if (stat == TAP_PLUGIN_PASS) {
+		return 0;
+	}
+	if ((stat != TAP_PLUGIN_REWRITE) || (outcnt < 0) || 
+			(outcnt && !out)) {
+		return -1;
+	}
+	EV_STAT_ADD(loop, plugin_rewrites[dir], 1);
+	i = 0;
+	queued = 0;
+	if (outcnt && (out[0].iov_base == buf) && (out[0].iov_len <= *len)) {
+		queued = out[0].iov_len;
+		i = 1;
+	}
+	ring_commit(&d->ring, queued);
+	*len = queued;
+	want = 0;
+	for (j = i; j < outcnt; j++) {
+		want += out[j].iov_len;
+	}
+	if (!want) {
+		return 1;
+	}
+	/* Function decides how much it gives, memory cap is for reads */
+	if (iov_overlaps(out + i, outcnt - i, buf, iov.iov_len)) {
+		src = iov_gather(loop, out + i, outcnt - i, want);
+		if (!src) {
+			return -1;
+		}
+		queued = ring_push(&d->ring, src, want, SIZE_MAX);
+	} else {
+		for (queued = 0; i < outcnt; i++) {
+			queued += ring_push(&d->ring, out[i].iov_base,
+					out[i].iov_len, SIZE_MAX);
+		}
+	}
+	*len += queued;
+	return (queued == want) ? 1 : -1;
+}
+
+/*
+ * Read from source of direction to its pipe
+ *
+ * Returns:
+ * 	amount of bytes read, 0 on eof, -1 on error with errno set
+ */
+static ssize_t
+dir_splice_in(struct event_loop *loop, struct relay_dir *d)
+{
+	if (d->pipe[0] < 0) {
+		EV_SYSCALL(loop);
+		if (pipe2(d->pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+			d->pipe[0] = -1;
+			d->pipe[1] = -1;
+			return -1;
+		}
+	}
+	EV_SYSCALL(loop);
+	return splice(d->src->fd, 0, d->pipe[1], 0, RELAY_SPLICE_MAX,
+			SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+}
+
+/*
+ * Move data of one direction from source to destination until source
+ * is drained, destination can't take more, or budget runs out.
+ *
+ * Returns:
+ * 	0 on success or -1 if connection should be closed
+ */
+static int
+dir_pump(struct event_loop *loop, struct tap_conn *conn, int dir)
+{
+	struct relay_dir *d;
+	unsigned char *dst;
+	ssize_t stat;
+	size_t max_size;
+	size_t space;
+	size_t want;
+	size_t len;
+	int budget;
+	int pass;
+
+	d = &conn->dir[dir];
+	dst = 0;
+	want = loop->cfg.tx_size;
+	if ((d->src->ssl || d->dst->ssl) && (want < TLS_RECORD_MAX)) {
+		/* Small reads make small records, each costs as much */
+		want = TLS_RECORD_MAX;
+	}
+	/* Ring may take what connection's memory cap leaves from other */
+	max_size = 0;
+	if (conn->dir[!dir].ring.size < loop->cfg.conn_mem) {
+		max_size = loop->cfg.conn_mem - conn->dir[!dir].ring.size;
+	}
+	budget = RELAY_BUDGET;
+	for (;;) {
+		/* 
+		 * Flush what we have. Ring can keep filling while dst is
+		 * full, pipe can not.
+		 */
+		stat = dir_flush_ring(loop, d);
+		if (stat < 0) {
+			return -1;
+		}
+		if (d->piped) {
+			stat = dir_flush_pipe(loop, d);
+			if (stat <= 0) {
+				return (int)stat;
+			}
+		}
+		if (!ring_used(&d->ring)) {
+			ev_dir_drained(loop, d, dir);
+		}
+
+		if (d->eof) {
+			if (!d->shut && !ring_used(&d->ring)) {
+				if (d->dst->ssl) {
+					tls_shutdown(loop, d->dst);
+				}
+				EV_SYSCALL(loop);
+				shutdown(d->dst->fd, SHUT_WR);
+				d->shut = 1;
+			}
+			return 0;
+		}
+		if (!d->readable || (ring_used(&d->ring) >= loop->cfg.hwm)) {
+			/* Either drained or waiting for dst, see above */
+			return 0;
+		}
+		if (budget-- == 0) {
+			ev_defer(loop, conn);
+			return 0;
+		}
+		if (loop->cfg.rules) {
+			dir_repin(loop, d);
+		}
+		/* Queued data goes first, splice only once ring is empty */
+		pass = !ring_used(&d->ring) &&
+			relay_passthrough(loop, conn, dir);
+		if (pass) {
+			stat = dir_splice_in(loop, d);
+			if ((stat < 0) && (errno == EMFILE || errno == ENFILE)) {
+				/* Out of fds for pipes, copy instead */
+				pass = 0;
+			} else if ((stat < 0) && d->src->ssl &&
+					((errno == EIO) || (errno == EINVAL) ||
+					 (errno == EBADMSG))) {
+				/* Record kernel won't splice, OpenSSL takes it */
+				d->src->ktls &= ~TLS_KTLS_RX;
+				pass = 0;
+			}
+		} else if (d->pipe[0] >= 0) {
+			/* Intercepting now, pipe is empty, we're done with it */
+			dir_pipe_close(loop, d);
+		}
+		if (!pass) {
+			dst = ring_reserve(&d->ring, want, max_size, &space);
+			if (!dst) {
+				/* At memory cap, wait for dst */
+				return 0;
+			}
+			if (d->src->ssl) {
+				stat = tls_recv(loop, d->src, dst, space);
+			} else {
+				EV_SYSCALL(loop);
+				stat = recv(d->src->fd, dst, space, 0);
+			}
+		}
+		if (stat < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+				d->readable = 0;
+				return 0;
+			}
+			return -1;
+		}
+		if (stat == 0) {
+			/* Nothing can complete what's held back anymore */
+			d->eof = 1;
+			d->readable = 0;
+			stream_release(&d->match);
+			continue;
+		}
+		ev_dir_received(loop, d, dir, (size_t)stat);
+		if (pass) {
+			/* Scopes of rules count spliced bytes too */
+			d->piped = (size_t)stat;
+			d->match.pos += (size_t)stat;
+			continue;
+		}
+		/* Only what was received is intercepted & forwarded */
+		len = relay_intercept(loop, conn, dir, dst, (size_t)stat);
+		stat = 0;
+		if (loop->cfg.plugin) {
+			stat = dir_plugin(loop, conn, dir, dst, &len);
+			if (stat < 0) {
+				return -1;
+			}
+		}
+		/* What plugin gives is queued already */
+		if (!stat && loop->cfg.filter && 
+				relay_filter_match(loop->cfg.filter, 
+					&d->filter_state, dst, len)) {
+			if (dir_filter(loop, d, dir, dst, &len) < 0) {
+				return -1;
+			}
+		} else if (!stat) {
+			ring_commit(&d->ring, len);
+		}
+		if (d->rules && (dir_match(loop, conn, dir, len) < 0)) {
+			return -1;
+		}
+		if (!d->rules) {
+			/* Rules loaded later count offsets from the start */
+			d->match.pos += len;
+		}
+	}
+}
+
+/*
+ * Relay whatever can be relayed for both directions of connection,
+ * and close it once both directions are done or something errored.
+ */
+static void
+conn_pump(struct event_loop *loop, struct tap_conn *conn)
+{
+	if (conn->state == CONN_CLOSED) {
+		return;
+	}
+	/* Client may finish handshake while upstream is connecting */
+	if (conn->handshaking && (tls_handshake(loop, conn) < 0)) {
+		conn_close(loop, conn);
+		return;
+	}
+	if ((conn->state != CONN_RELAY) || conn->handshaking) {
+		return;
+	}
+	if ((dir_pump(loop, conn, DIR_C2U) < 0) ||
+	    (dir_pump(loop, conn, DIR_U2C) < 0)) {
+		LOG("Peer disconnected mid transmission?\n");
+		conn_close(loop, conn);
+		return;
+	}
+	if (conn->dir[DIR_C2U].shut && conn->dir[DIR_U2C].shut) {
+		LOG("Peer disconnected\n");
+		conn_close(loop, conn);
+	}
+}
+
+int
+ev_connect_result(int fd)
+{
+	struct sockaddr_in saddr;
+	socklen_t len;
+	int err;
+
+	err = 0;
+	len = sizeof(err);
+	if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) {
+		return -1;
+	}
+	if (err) {
+		return -1;
+	}
+	len = sizeof(saddr);
+	if (getpeername(fd, (struct sockaddr *)&saddr, &len) < 0) {
+		return (errno == ENOTCONN) ? 0 : -1;
+	}
+	return 1;
+}
+
+static void
+on_upstream_connecting(struct event_loop *loop, struct tap_conn *conn)
+{
+	int stat;
+
+	loop->nsyscalls += 2;
+	stat = ev_connect_result(conn->upstream.fd);
+	if (stat == 0) {
+		return;
+	}
+	if (stat < 0) {
+		if (conn_retry(loop, conn) < 0) {
+			conn_close(loop, conn);
+		}
+		return;
+	}
+	ev_timer_cancel(&loop->timers, &conn->timer);
+	hist_add(&loop->stats.connect, ev_now_us() - conn->connect_us);
+	if (conn->backend) {
+		backend_connected(conn->backend);
+	}
+	conn->state = CONN_RELAY;
+	conn->retries = 0;
+	/* Anything upstream sent before we noticed is readable */
+	conn->dir[DIR_U2C].readable = 1;
+	if (loop->cfg.tls && loop->cfg.tls->client &&
+			(tls_conn_connect(loop, conn) < 0)) {
+		conn_close(loop, conn);
+		return;
+	}
+	conn_pump(loop, conn);
+}
+
+static void
+on_relay_event(struct event_loop *loop, struct ev_source *src, 
+		uint32_t events)
+{
+	struct tap_conn *conn;
+
+	conn = src->conn;
+	if (conn->state == CONN_CLOSED) {
+		return;
+	}
+	if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+		if (src->kind == EV_CLIENT) {
+			conn->dir[DIR_C2U].readable = 1;
+		} else {
+			conn->dir[DIR_U2C].readable = 1;
+		}
+	}
+	/* OpenSSL may have to write before it can read again */
+	if ((events & EPOLLOUT) && src->ssl) {
+		if (src->kind == EV_CLIENT) {
+			conn->dir[DIR_C2U].readable = 1;
+		} else {
+			conn->dir[DIR_U2C].readable = 1;
+		}
+	}
+	if ((src->kind == EV_UPSTREAM) && (conn->state == CONN_CONNECTING)) {
+		on_upstream_connecting(loop, conn);
+		return;
+	}
+	conn_pump(loop, conn);
+}
+
+/*
+ * Accept every pending connection from listener
+ */
+static void
+on_listener(struct event_loop *loop)
+{
+	int nsock;
+
+	loop->accept_paused = 0;
+	for (;;) {
+		EV_SYSCALL(loop);
+		nsock = accept4(loop->listener.fd, 0, 0, SOCK_NONBLOCK);
+		if (nsock < 0) {
+			switch (errno) {
+			case (EINTR):
+			case (ECONNABORTED):
+				continue;
+			case (EAGAIN):
+#if EAGAIN != EWOULDBLOCK
+			case (EWOULDBLOCK):
+#endif
+				return;
+			case (EMFILE):
+			case (ENFILE):
+			case (ENOBUFS):
+			case (ENOMEM):
+				/* Try again once some connection is gone */
+				loop->accept_paused = 1;
+				return;
+			default:
+				ERR("Failed to accept() from socket, errno: %d\n",
+						errno);
+				return;
+			}
+		}
+		conn_new(loop, nsock);
+	}
+}
+
+/*
+ * Free connections closed during event batch. Connections still on the
+ * ready list stay on closed list until they have been taken off it.
+ */
+static void
+ev_reap(struct event_loop *loop)
+{
+	struct tap_conn *conn;
+	struct tap_conn *next;
+	struct tap_conn *keep;
+	int reaped;
+
+	reaped = 0;
+	keep = 0;
+	for (conn = loop->closed; conn; conn = next) {
+		next = conn->next_closed;
+		if (conn->queued) {
+			conn->next_closed = keep;
+			keep = conn;
+			continue;
+		}
+		ev_conn_free(conn);
+		reaped = 1;
+	}
+	loop->closed = keep;
+	upstream_pool_reap(loop);
+	udp_relay_reap(loop);
+	if (reaped && loop->accept_paused) {
+		on_listener(loop);
+	}
+}
+
+/*
+ * Release bytes held back for cfg.hold_ms or more, and forget
+ * connections not holding anything anymore.
+ */
+static void
+ev_release_held(struct event_loop *loop)
+{
+	struct tap_conn *conn;
+	struct tap_conn *next;
+	struct relay_dir *d;
+	uint64_t now;
+	int released;
+	int i;
+
+	now = ev_now_ms();
+	for (conn = loop->held; conn; conn = next) {
+		next = conn->next_held;
+		released = 0;
+		for (i = 0; i < 2; i++) {
+			d = &conn->dir[i];
+			if (d->match.held && (now - d->held_since >=
+						(uint64_t)loop->cfg.hold_ms)) {
+				stream_release(&d->match);
+				released = 1;
+			}
+		}
+		if (!conn->dir[DIR_C2U].match.held &&
+				!conn->dir[DIR_U2C].match.held) {
+			conn_unhold(loop, conn);
+		}
+		if (released) {
+			/* May close connection, which is fine for next */
+			conn_pump(loop, conn);
+		}
+	}
+}
+
+/*
+ * Pump connections that ran out of budget on last round
+ */
+static void
+ev_run_ready(struct event_loop *loop)
+{
+	struct tap_conn *conn;
+	struct tap_conn *next;
+
+	conn = loop->ready;
+	loop->ready = 0;
+	for (; conn; conn = next) {
+		next = conn->next_ready;
+		conn->queued = 0;
+		conn_pump(loop, conn);
+	}
+}
+
+/*
+ * Run expired timers
+ */
+static void
+ev_run_timers(struct event_loop *loop)
+{
+	struct ev_timer *t;
+	uint64_t now;
+
+	now = ev_now_ms();
+	while ((t = ev_timer_expired(&loop->timers, now))) {
+		t->fn(loop, t->arg);
+	}
+}
+
+/*
+ * How long epoll_wait() may block
+ *
+ * Returns:
+ * 	timeout in ms, or -1 for no timeout
+ */
+static int
+ev_timeout(struct event_loop *loop)
+{
+	uint64_t next;
+	uint64_t now;
+	int timeout;
+
+	if (loop->ready) {
+		return 0;
+	}
+	timeout = loop->held ? loop->cfg.hold_ms : -1;
+	next = ev_timer_next(&loop->timers);
+	if (next != UINT64_MAX) {
+		now = ev_now_ms();
+		next = (next > now) ? (next - now) : 0;
+		if ((timeout < 0) || (next < (uint64_t)timeout)) {
+			timeout = (int)next;
+		}
+	}
+	return timeout;
+}
+
+/*
+ * Loop won't look at rules anymore, don't hold up reloads
+ */
+static void
+ev_loop_offline(struct event_loop *loop)
+{
+	if (loop->cfg.rules) {
+		rules_domain_offline(loop->cfg.rules, loop->cfg.reader);
+	}
+}
+
+int
+ev_loop_init(struct event_loop *loop, struct relay_cfg *cfg)
+{
+	memset(loop, 0, sizeof(*loop));
+	loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->epfd < 0) {
+		ERR("epoll_create1() errored with errno: %d\n", errno);
+		return -1;
+	}
+	loop->listener.kind = EV_LISTENER;
+	loop->listener.fd = -1;
+	loop->waker.kind = EV_WAKE;
+	loop->waker.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (loop->waker.fd < 0) {
+		ERR("eventfd() errored with errno: %d\n", errno);
+		close(loop->epfd);
+		return -1;
+	}
+	if (ev_add(loop, &loop->waker, EPOLLIN) < 0) {
+		ERR("epoll_ctl() errored with errno: %d\n", errno);
+		close(loop->waker.fd);
+		close(loop->epfd);
+		return -1;
+	}
+	memcpy(&loop->cfg, cfg, sizeof(*cfg));
+	buf_pool_init(&loop->pool, cfg->scrub);
+	if (!loop->cfg.hwm) {
+		loop->cfg.hwm = RELAY_HWM;
+	}
+	if (!loop->cfg.conn_mem) {
+		loop->cfg.conn_mem = RELAY_CONN_MEM;
+	}
+	if (!loop->cfg.hold_ms) {
+		loop->cfg.hold_ms = STREAM_HOLD_MS;
+	}
+	if (!loop->cfg.connect_timeout_ms) {
+		loop->cfg.connect_timeout_ms = CONN_TIMEOUT_MS;
+	}
+	if (!loop->cfg.pool_max) {
+		loop->cfg.pool_max = loop->cfg.pool_min * RELAY_POOL_GROWTH;
+	}
+	if (!loop->cfg.udp_idle_ms) {
+		loop->cfg.udp_idle_ms = UDP_IDLE_MS;
+	}
+	loop->seed = (unsigned int)ev_now_us() ^ (unsigned int)(uintptr_t)loop;
+	loop->cursor.rr = loop->seed;
+	loop->cursor.seed = loop->seed;
+	if (loop->cfg.pool_min && loop->cfg.backends && 
+			(loop->cfg.backends->policy == LB_HASH)) {
+		LOG("Upstream pool is not used with consistent hashing\n");
+		loop->cfg.pool_min = 0;
+		loop->cfg.pool_max = 0;
+	}
+	upstream_pool_init(loop);
+	udp_relay_init(loop);
+	if (tls_cache_init(loop) < 0) {
+		close(loop->waker.fd);
+		close(loop->epfd);
+		return -1;
+	}
+	loop->stop = EV_RUN;
+	loop->backend = BACKEND_EPOLL;
+	if ((cfg->backend == BACKEND_URING) && cfg->udp) {
+		LOG("UDP is relayed with epoll backend only\n");
+	} else if ((cfg->backend == BACKEND_URING) && cfg->tls) {
+		LOG("TLS works with epoll backend only\n");
+	} else if ((cfg->backend == BACKEND_URING) && 
+			(cfg->rules || cfg->filter || cfg->plugin)) {
+		LOG("Rules are applied with epoll backend only\n");
+	} else if ((cfg->backend == BACKEND_URING) && cfg->pool_min) {
+		LOG("Upstream pool works with epoll backend only\n");
+	} else if (cfg->backend == BACKEND_URING) {
+		if (uring_loop_init(loop) < 0) {
+			LOG("io_uring not usable, falling back to epoll\n");
+		} else {
+			loop->backend = BACKEND_URING;
+		}
+	}
+	loop->cfg.backend = loop->backend;
+	return 0;
+}
+
+int
+ev_loop_add_listener(struct event_loop *loop, int lsock)
+{
+	if (set_nonblocking(lsock) < 0) {
+		return -1;
+	}
+	loop->listener.fd = lsock;
+	if (loop->backend == BACKEND_URING) {
+		/* Accepting is armed by uring_loop_run() */
+		return 0;
+	}
+	if (ev_add(loop, &loop->listener, EPOLLIN | EPOLLET) < 0) {
+		ERR("epoll_ctl() errored with errno: %d\n", errno);
+		loop->listener.fd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+int
+ev_loop_run(struct event_loop *loop)
+{
+	struct epoll_event events[EV_MAX_EVENTS];
+	struct ev_source *src;
+	uint64_t val;
+	int timeout;
+	int stop;
+	int nev;
+	int i;
+
+	if (loop->backend == BACKEND_URING) {
+		return uring_loop_run(loop);
+	}
+	upstream_pool_fill(loop);
+	for (;;) {
+		stop = __atomic_load_n(&loop->stop, __ATOMIC_ACQUIRE);
+		if (stop == EV_STOP_NOW) {
+			break;
+		}
+		if (stop == EV_STOP_DRAIN) {
+			/* No new connections, finish the ones we have */
+			if (loop->listener.fd >= 0) {
+				close(loop->listener.fd);
+				loop->listener.fd = -1;
+				loop->accept_paused = 0;
+				/* Nobody is going to need warm ones */
+				loop->cfg.pool_min = 0;
+				upstream_pool_destroy(loop);
+			}
+			/* Datagrams have no end to wait for */
+			if (loop->udp.listener.fd >= 0) {
+				udp_relay_stop(loop);
+			}
+			if (!loop->nconns) {
+				break;
+			}
+		}
+		EV_SYSCALL(loop);
+		timeout = ev_timeout(loop);
+		/* Quiescent point, rules may be swapped while we wait */
+		ev_loop_offline(loop);
+		nev = epoll_wait(loop->epfd, events, EV_MAX_EVENTS, timeout);
+		if (loop->cfg.rules) {
+			rules_domain_online(loop->cfg.rules, loop->cfg.reader);
+		}
+		if (nev < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			ERR("epoll_wait() errored with errno: %d\n", errno);
+			ev_loop_offline(loop);
+			return -1;
+		}
+		for (i = 0; i < nev; i++) {
+			src = (struct ev_source *)events[i].data.ptr;
+			if (src->kind == EV_WAKE) {
+				while (read(src->fd, &val, sizeof(val)) > 0);
+			} else if (src->kind == EV_LISTENER) {
+				if (loop->listener.fd >= 0) {
+					on_listener(loop);
+				}
+			} else if (src->kind == EV_POOL) {
+				upstream_pool_event(loop, src, events[i].events);
+			} else if ((src->kind == EV_UDP) ||
+					(src->kind == EV_UDP_FLOW)) {
+				udp_relay_event(loop, src);
+			} else {
+				on_relay_event(loop, src, events[i].events);
+			}
+		}
+		udp_relay_flush(loop);
+		if (loop->held) {
+			ev_release_held(loop);
+		}
+		ev_run_timers(loop);
+		ev_run_ready(loop);
+		ev_reap(loop);
+	}
+	ev_loop_offline(loop);
+	return 0;
+}
+
+void
+ev_loop_stop(struct event_loop *loop, int how)
+{
+	uint64_t one;
+	ssize_t stat;
+
+	one = 1;
+	__atomic_store_n(&loop->stop, how, __ATOMIC_RELEASE);
+	stat = write(loop->waker.fd, &one, sizeof(one));
+	(void)stat;
+}
+
+void
+ev_loop_destroy(struct event_loop *loop)
+{
+	struct tap_conn *conn;
+	struct tap_conn *next;
+
+	if (loop->backend == BACKEND_URING) {
+		uring_loop_destroy(loop);
+	}
+	for (conn = loop->conns; conn; conn = next) {
+		next = conn->next;
+		conn_close(loop, conn);
+	}
+	for (conn = loop->ready; conn; conn = next) {
+		next = conn->next_ready;
+		conn->queued = 0;
+	}
+	loop->ready = 0;
+	loop->accept_paused = 0;
+	upstream_pool_destroy(loop);
+	udp_relay_destroy(loop);
+	ev_reap(loop);
+	tls_cache_free(loop);
+	ev_timers_free(&loop->timers);
+	free(loop->scratch);
+	loop->scratch = 0;
+	loop->scratch_size = 0;
+	/* Every ring went back to pool with its connection */
+	buf_pool_destroy(&loop->pool);
+	if (loop->listener.fd >= 0) {
+		close(loop->listener.fd);
+		loop->listener.fd = -1;
+	}
+	if (loop->waker.fd >= 0) {
+		close(loop->waker.fd);
+		loop->waker.fd = -1;
+	}
+	if (loop->epfd >= 0) {
+		close(loop->epfd);
+		loop->epfd = -1;
+	}
+}
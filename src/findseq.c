@@ -0,0 +1,239 @@
+/*
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2022, k4m1
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIA LDAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVE RCAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Substring search kernels behind findseq()
+ */
+#include <sys/types.h>
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FINDSEQ_X86 1
+#endif
+
+#include <findseq.h>
+
+findseq_fn findseq_short;
+
+/*
+ * Candidate positions are found with memchr() for the first byte,
+ * last byte is checked before comparing the rest.
+ */
+static void *
+findseq_generic(void *data, void *what, size_t dlen, size_t wlen)
+{
+	unsigned char *d;
+	unsigned char *w;
+	unsigned char *p;
+	unsigned char *end;
+
+	if (dlen < wlen) {
+		return 0;
+	}
+	d = (unsigned char *)data;
+	w = (unsigned char *)what;
+	end = &d[dlen - wlen];
+	for (p = d; p <= end; p++) {
+		p = (unsigned char *)memchr(p, w[0], (size_t)(end - p) + 1);
+		if (!p) {
+			break;
+		}
+		if ((p[wlen - 1] == w[wlen - 1]) &&
+				!memcmp(&p[1], &w[1], wlen - 2)) {
+			return p;
+		}
+	}
+	return 0;
+}
+
+#ifdef FINDSEQ_X86
+
+/*
+ * Check candidates of one block, bit N of mask set means that first
+ * and last byte match at off + N.
+ */
+static inline unsigned char *
+findseq_mask(unsigned char *d, unsigned char *w, size_t off,
+		uint32_t mask, size_t wlen)
+{
+	unsigned int bit;
+
+	while (mask) {
+		bit = (unsigned int)__builtin_ctz(mask);
+		if (!memcmp(&d[off + bit + 1], &w[1], wlen - 2)) {
+			return &d[off + bit];
+		}
+		mask &= mask - 1;
+	}
+	return 0;
+}
+
+__attribute__((target("sse2")))
+static void *
+findseq_sse2(void *data, void *what, size_t dlen, size_t wlen)
+{
+	unsigned char *d;
+	unsigned char *w;
+	unsigned char *found;
+	__m128i first;
+	__m128i last;
+	__m128i bf;
+	__m128i bl;
+	uint32_t mask;
+	size_t off;
+
+	d = (unsigned char *)data;
+	w = (unsigned char *)what;
+	first = _mm_set1_epi8((char)w[0]);
+	last = _mm_set1_epi8((char)w[wlen - 1]);
+	for (off = 0; off + wlen - 1 + 16 <= dlen; off += 16) {
+		bf = _mm_loadu_si128((const __m128i *)&d[off]);
+		bl = _mm_loadu_si128((const __m128i *)&d[off + wlen - 1]);
+		mask = (uint32_t)_mm_movemask_epi8(_mm_and_si128(
+					_mm_cmpeq_epi8(bf, first),
+					_mm_cmpeq_epi8(bl, last)));
+		found = findseq_mask(d, w, off, mask, wlen);
+		if (found) {
+			return found;
+		}
+	}
+	/* Less than a block of positions left */
+	found = findseq_generic(&d[off], w, dlen - off, wlen);
+	return found;
+}
+
+__attribute__((target("avx2")))
+static void *
+findseq_avx2(void *data, void *what, size_t dlen, size_t wlen)
+{
+	unsigned char *d;
+	unsigned char *w;
+	unsigned char *found;
+	__m256i first;
+	__m256i last;
+	__m256i bf;
+	__m256i bl;
+	uint32_t mask;
+	size_t off;
+
+	d = (unsigned char *)data;
+	w = (unsigned char *)what;
+	first = _mm256_set1_epi8((char)w[0]);
+	last = _mm256_set1_epi8((char)w[wlen - 1]);
+	for (off = 0; off + wlen - 1 + 32 <= dlen; off += 32) {
+		bf = _mm256_loadu_si256((const __m256i *)&d[off]);
+		bl = _mm256_loadu_si256((const __m256i *)&d[off + wlen - 1]);
+		mask = (uint32_t)_mm256_movemask_epi8(_mm256_and_si256(
+					_mm256_cmpeq_epi8(bf, first),
+					_mm256_cmpeq_epi8(bl, last)));
+		found = findseq_mask(d, w, off, mask, wlen);
+		if (found) {
+			return found;
+		}
+	}
+	/* Less than a block of positions left, finish with 16 bytes */
+	found = findseq_sse2(&d[off], w, dlen - off, wlen);
+	return found;
+}
+
+#endif /* FINDSEQ_X86 */
+
+findseq_fn
+findseq_kernel(int kind)
+{
+	switch (kind) {
+	case (FINDSEQ_GENERIC):
+		return &findseq_generic;
+#ifdef FINDSEQ_X86
+	case (FINDSEQ_SSE2):
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("sse2")) {
+			return &findseq_sse2;
+		}
+		break;
+	case (FINDSEQ_AVX2):
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2")) {
+			return &findseq_avx2;
+		}
+		break;
+#endif /* FINDSEQ_X86 */
+	default:
+		break;
+	}
+	return 0;
+}
+
+/* Pick the widest kernel cpu can run before any thread may search */
+__attribute__((constructor))
+static void
+findseq_init(void)
+{
+	int kind;
+
+	for (kind = FINDSEQ_AVX2; kind >= FINDSEQ_GENERIC; kind--) {
+		findseq_short = findseq_kernel(kind);
+		if (findseq_short) {
+			break;
+		}
+	}
+}
+
+void *
+findseq_horspool(void *data, void *what, size_t dlen, size_t wlen)
+{
+	size_t shift[256];
+	unsigned char *d;
+	unsigned char *w;
+	unsigned char last;
+	size_t off;
+	size_t i;
+
+	d = (unsigned char *)data;
+	w = (unsigned char *)what;
+	for (i = 0; i < 256; i++) {
+		shift[i] = wlen;
+	}
+	for (i = 0; i < wlen - 1; i++) {
+		shift[w[i]] = wlen - 1 - i;
+	}
+	last = w[wlen - 1];
+	for (off = 0; off + wlen <= dlen; off += shift[d[off + wlen - 1]]) {
+		if ((d[off + wlen - 1] == last) &&
+				!memcmp(&d[off], w, wlen - 1)) {
+			return &d[off];
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,94 @@
+/*
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2022, k4m1
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIA LDAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVE RCAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Log-linear latency histograms
+ */
+#include <stdint.h>
+
+#include <hist.h>
+
+uint64_t
+hist_bucket_end(int b)
+{
+	int e;
+
+	if (b < HIST_SUB) {
+		return (uint64_t)b + 1;
+	}
+	e = (b >> HIST_SUB_BITS) - 1 + HIST_SUB_BITS;
+	return (uint64_t)(HIST_SUB + (b & (HIST_SUB - 1)) + 1) << 
+		(e - HIST_SUB_BITS);
+}
+
+void
+hist_merge(struct hist *dst, struct hist *src)
+{
+	uint64_t max;
+	int b;
+
+	for (b = 0; b < HIST_BUCKETS; b++) {
+		dst->b[b] += __atomic_load_n(&src->b[b], __ATOMIC_RELAXED);
+	}
+	/* Not a snapshot, count may lag or lead buckets by a few */
+	dst->count += __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+	dst->sum += __atomic_load_n(&src->sum, __ATOMIC_RELAXED);
+	max = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+	if (max > dst->max) {
+		dst->max = max;
+	}
+}
+
+uint64_t
+hist_percentile(struct hist *h, int pct)
+{
+	uint64_t total;
+	uint64_t want;
+	uint64_t seen;
+	int b;
+
+	total = 0;
+	for (b = 0; b < HIST_BUCKETS; b++) {
+		total += h->b[b];
+	}
+	if (!total) {
+		return 0;
+	}
+	want = (total * (uint64_t)pct + 99) / 100;
+	seen = 0;
+	for (b = 0; b < HIST_BUCKETS - 1; b++) {
+		seen += h->b[b];
+		if (seen >= want) {
+			break;
+		}
+	}
+	return hist_bucket_end(b);
+}
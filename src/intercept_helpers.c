@@ -36,6 +36,7 @@
 
 
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -43,13 +44,15 @@
 
 #include <unistd.h>
 
+#include <findseq.h>
 #include <intercept_helpers.h>
 
 /* Helpers for modding data that's passed through */
 
 /*
  * Find 1st occurance of byte sequence in data being processed.
- * Works with 0-bytes within the data unlike strstr.
+ * Works with 0-bytes within the data unlike strstr. Short sequences
+ * are searched with the widest SIMD kernel cpu has, see findseq.h.
  *
  * Requires:
  * 	void 	*data, 	data being processed
@@ -63,23 +66,19 @@
 void *
 findseq(void *data, void *what, size_t dlen, size_t wlen)
 {
-	size_t off;
-	size_t maxlen;
-	int stat;
-	void *current;
-
-	maxlen = (dlen - wlen);
-	current = data;
-	for (off = 0; off <= maxlen; off++) {
-		stat = memcmp(current, what, wlen);
-		if (!stat) {
-			goto found;
-		}
-		current = (void *)((size_t)current + 1);
+	if (wlen > dlen) {
+		return 0;
+	}
+	if (!wlen) {
+		return data;
+	}
+	if (wlen == 1) {
+		return memchr(data, *(unsigned char *)what, dlen);
 	}
-	current = 0;
-found:
-	return current;
+	if (wlen > FINDSEQ_SHORT_MAX) {
+		return findseq_horspool(data, what, dlen, wlen);
+	}
+	return findseq_short(data, what, dlen, wlen);
 }
 
 /*
@@ -130,21 +129,173 @@ replace_str_of_equal_size(unsigned char *data, size_t dlen, size_t count,
  	unsigned char *where;
 	size_t off;
 
+	/* Continue after each replaced string, never rescan it */
 	off = 0;
 	do {
-		where = findseq(data, what, dlen, count);
+		where = findseq(&data[off], what, dlen - off, count);
 		if (!where) {
 			break;
 		}
 		memcpy(where, with, count);
-	       	off += (size_t)(where - data);
+		off = (size_t)(where - data) + count;
 	} while (off < dlen);
 }
 
+/* State of replace_patterns_of_equal_size() */
+struct replace_ctx {
+	unsigned char *data;
+	struct ac_automaton *ac;
+	unsigned char **with;
+	size_t done; 		/* data before this is replaced already */
+	size_t cnt;
+};
+
+static int
+replace_match(void *arg, uint32_t pattern, size_t end)
+{
+	struct replace_ctx *ctx;
+	size_t len;
+
+	ctx = (struct replace_ctx *)arg;
+	len = ctx->ac->plen[pattern];
+	/* Overlaps with what we just replaced */
+	if (end - len < ctx->done) {
+		return 0;
+	}
+	memcpy(&ctx->data[end - len], ctx->with[pattern], len);
+	ctx->done = end;
+	ctx->cnt++;
+	return 0;
+}
+
+/*
+ * Replace every pattern of automaton with equal-length string from data
+ * that is being passed through, in a single pass. When matches overlap
+ * the one ending first is replaced, longest one if many end there.
+ *
+ * Requires:
+ * 	unsigned char 		*data, 	pointer to data to operate with
+ * 	size_t 			dlen, 	size of data
+ * 	struct ac_automaton 	*ac, 	patterns to replace
+ * 	unsigned char 		**with, with[N] replaces pattern N
+ * Returns:
+ * 	amount of strings replaced
+ */
+size_t
+replace_patterns_of_equal_size(unsigned char *data, size_t dlen,
+		struct ac_automaton *ac, unsigned char **with)
+{
+	struct replace_ctx ctx;
+	uint32_t state;
+
+	/* 
+	 * Automaton follows bytes as they were received, so replacing
+	 * behind the scan position doesn't change what matches.
+	 */
+	ctx.data = data;
+	ctx.ac = ac;
+	ctx.with = with;
+	ctx.done = 0;
+	ctx.cnt = 0;
+	state = AC_START;
+	ac_scan(ac, &state, data, dlen, &replace_match, &ctx);
+	return ctx.cnt;
+}
+
+/* State of replace_patterns_to_iov() */
+struct iov_ctx {
+	unsigned char *data;
+	struct ac_automaton *ac;
+	unsigned char **with;
+	size_t *wlens;
+	struct iovec *iov;
+	int iovmax;
+	int cnt;
+	size_t done; 		/* data before this is described already */
+};
+
+static int
+iov_add(struct iov_ctx *ctx, void *base, size_t len)
+{
+	if (!len) {
+		return 0;
+	}
+	if (ctx->cnt == ctx->iovmax) {
+		return -1;
+	}
+	ctx->iov[ctx->cnt].iov_base = base;
+	ctx->iov[ctx->cnt].iov_len = len;
+	ctx->cnt++;
+	return 0;
+}
+
+static int
+iov_match(void *arg, uint32_t pattern, size_t end)
+{
+	struct iov_ctx *ctx;
+	size_t start;
+
+	ctx = (struct iov_ctx *)arg;
+	start = end - ctx->ac->plen[pattern];
+	if (start < ctx->done) {
+		return 0;
+	}
+	if ((iov_add(ctx, &ctx->data[ctx->done], start - ctx->done) < 0) ||
+	    (iov_add(ctx, ctx->with[pattern], ctx->wlens[pattern]) < 0)) {
+		return -1;
+	}
+	ctx->done = end;
+	return 0;
+}
+
+/*
+ * Describe data with every pattern of automaton replaced as iovecs,
+ * unchanged slices of data interleaved with replacements of any length,
+ * to be sent with writev() or sendmsg(). Data isn't modified. Overlaps
+ * are resolved like in replace_patterns_of_equal_size().
+ *
+ * Requires:
+ * 	unsigned char 		*data, 	 data to operate with
+ * 	size_t 			dlen, 	 size of data
+ * 	struct ac_automaton 	*ac, 	 patterns to replace
+ * 	unsigned char 		**with,  with[N] replaces pattern N
+ * 	size_t 			*wlens,  length of with[N], may be 0
+ * 	struct iovec 		*iov, 	 where to describe output to
+ * 	int 			iovmax,  size of iov
+ * Returns:
+ * 	amount of iovecs filled in or -1 if iov is too small
+ */
+int
+replace_patterns_to_iov(unsigned char *data, size_t dlen,
+		struct ac_automaton *ac, unsigned char **with, size_t *wlens,
+		struct iovec *iov, int iovmax)
+{
+	struct iov_ctx ctx;
+	uint32_t state;
+
+	ctx.data = data;
+	ctx.ac = ac;
+	ctx.with = with;
+	ctx.wlens = wlens;
+	ctx.iov = iov;
+	ctx.iovmax = iovmax;
+	ctx.cnt = 0;
+	ctx.done = 0;
+	state = AC_START;
+	if (ac_scan(ac, &state, data, dlen, &iov_match, &ctx)) {
+		return -1;
+	}
+	if (iov_add(&ctx, &data[ctx.done], dlen - ctx.done) < 0) {
+		return -1;
+	}
+	return ctx.cnt;
+}
+
 /*
  * Replace string with shorter string from data that is being
  * passed through, pad the remaining data right after the replaced string
- * or at the end of data.
+ * or at the end of data. See replace_patterns_to_iov() for replacing
+ * with strings of any length.
  *
  * Requires:
  * 	unsigned char 	*data, 	pointer to data to operate with
@@ -161,45 +312,41 @@ replace_str_with_pad(unsigned char *data, size_t dlen, size_t rlen,
 		size_t wlen, unsigned char *what, unsigned char *with, 
 		unsigned char pad, int padloc)
 {
-	/* Variables with s_ prefix are used for shift_bytes() */
-	size_t off;
-	size_t s_cnt;
-	size_t s_off;
-	size_t pad_size;
 	unsigned char *where;
-	unsigned char *padptr;
+	size_t pad_size;
+	size_t tail;
+	size_t off;
 
+	/* Replacement must fit in what it replaces */
+	if (!rlen || (wlen > rlen)) {
+		return;
+	}
+	pad_size = rlen - wlen;
+	off = 0;
 	do {
-		where = (unsigned char *)findseq(data, what, dlen, rlen);
+		where = (unsigned char *)findseq(&data[off], what, dlen - off, 
+				rlen);
 		if (!where) {
 			break;
 		}
+		/* Only wlen bytes of with are there to copy */
+		memcpy(where, with, wlen);
 		if (padloc == PAD_HERE) {
-			/* 
-			 * If we pad data to equal lenght, just perform
-			 * replacing stuff immediately, no biggies. 
-			 * First add padding, then replace
-			 */
-			memset(where, pad, wlen);
-			memcpy(where, with, rlen);
+			/* Pad the rest of the replaced string */
+			memset(&where[wlen], pad, pad_size);
+			off = (size_t)(where - data) + rlen;
 		} else {
 			/*
-			 * If padding is to be added at the end of the
-			 * packet, then we first replace what/with, then
-			 * shift left, and finally pad at the end
+			 * Move data after the replaced string left over the
+			 * rest of it, and pad the end. Padding isn't
+			 * searched again.
 			 */
-			memcpy(where, with, rlen);
-			s_cnt = (rlen - wlen);
-			s_off = (size_t)((size_t)where - (size_t)data);
-			shift_bytes(data, s_cnt, s_off, SHIFT_LEFT);
-			
-			/* calculate where to pad + pad size */
-			pad_size = (rlen - wlen);
-			padptr = (unsigned char *)((size_t)data + \
-					(dlen - pad_size));
-			memset(padptr, pad, pad_size);
+			tail = dlen - (size_t)(where - data) - rlen;
+			memmove(&where[wlen], &where[rlen], tail);
+			dlen -= pad_size;
+			memset(&data[dlen], pad, pad_size);
+			off = (size_t)(where - data) + wlen;
 		}
-	       	off += (size_t)(where - data);
 	} while (off < dlen);
 }
 
@@ -33,12 +33,487 @@
  * This file parses interception ruleset.
  *
  */
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <yaml.h>
 
+#include <intercept_parser.h>
+#include <log.h>
+#include <stream_match.h>
+
+/* State of one ruleset_parse() call */
+struct ruleset_ctx {
+	yaml_document_t *doc;
+	char *name;
+	unsigned char *arena; 	/* decoded hex strings */
+	size_t arena_used;
+	size_t arena_size;
+};
+
+#define RULE_ERR(rc, node, msg, ...) \
+	ERR("%s:%zu: " msg "\n", (rc)->name, \
+			(size_t)(node)->start_mark.line + 1, ##__VA_ARGS__)
+
+/*
+ * Compare scalar node to string
+ *
+ * Returns:
+ * 	1 if node is scalar equal to str, else 0
+ */
+static int
+scalar_is(yaml_node_t *node, const char *str)
+{
+	size_t len;
+
+	if (node->type != YAML_SCALAR_NODE) {
+		return 0;
+	}
+	len = strlen(str);
+	return node->data.scalar.length == len &&
+		!memcmp(node->data.scalar.value, str, len);
+}
+
+/*
+ * Get scalar node as bytes
+ *
+ * Returns:
+ * 	0 on success or -1 if node isn't a scalar
+ */
+static int
+rule_bytes(struct ruleset_ctx *rc, yaml_node_t *node, unsigned char **out,
+		size_t *len)
+{
+	if (node->type != YAML_SCALAR_NODE) {
+		RULE_ERR(rc, node, "Expected a string");
+		return -1;
+	}
+	*out = node->data.scalar.value;
+	*len = node->data.scalar.length;
+	return 0;
+}
+
+static int
+hex_nibble(unsigned char c)
+{
+	if (c >= '0' && c <= '9') {
+		return c - '0';
+	}
+	c |= 0x20;
+	if (c >= 'a' && c <= 'f') {
+		return c - 'a' + 10;
+	}
+	return -1;
+}
+
+/*
+ * Decode hex string node to arena, whitespace between bytes is allowed
+ *
+ * Returns:
+ * 	0 on success or -1 if node isn't valid hex
+ */
+static int
+rule_hex(struct ruleset_ctx *rc, yaml_node_t *node, unsigned char **out,
+		size_t *len)
+{
+	unsigned char *s;
+	unsigned char *dst;
+	size_t slen;
+	size_t i;
+	int hi;
+	int lo;
+
+	if (node->type != YAML_SCALAR_NODE) {
+		RULE_ERR(rc, node, "Expected a hex string");
+		return -1;
+	}
+	s = node->data.scalar.value;
+	slen = node->data.scalar.length;
+	/* Aliases may decode the same node again */
+	if (slen / 2 > rc->arena_size - rc->arena_used) {
+		RULE_ERR(rc, node, "Too much hex in ruleset");
+		return -1;
+	}
+	dst = &rc->arena[rc->arena_used];
+	*out = dst;
+	for (i = 0; i < slen; ) {
+		if (s[i] == ' ' || s[i] == '\t' || s[i] == '\n' ||
+				s[i] == ':') {
+			i++;
+			continue;
+		}
+		if (i + 1 >= slen) {
+			RULE_ERR(rc, node, "Odd amount of hex digits");
+			return -1;
+		}
+		hi = hex_nibble(s[i]);
+		lo = hex_nibble(s[i + 1]);
+		if (hi < 0 || lo < 0) {
+			RULE_ERR(rc, node, "Invalid hex digit");
+			return -1;
+		}
+		*dst++ = (unsigned char)((hi << 4) | lo);
+		i += 2;
+	}
+	*len = (size_t)(dst - *out);
+	rc->arena_used += *len;
+	return 0;
+}
+
+/*
+ * Get scalar node as unsigned number
+ *
+ * Returns:
+ * 	0 on success or -1 if node isn't a number up to max
+ */
+static int
+rule_num(struct ruleset_ctx *rc, yaml_node_t *node, uint64_t max,
+		uint64_t *out)
+{
+	char buf[32];
+	char *end;
+	size_t len;
+
+	if (node->type != YAML_SCALAR_NODE) {
+		RULE_ERR(rc, node, "Expected a number");
+		return -1;
+	}
+	len = node->data.scalar.length;
+	if (!len || len >= sizeof(buf) ||
+			node->data.scalar.value[0] == '-') {
+		RULE_ERR(rc, node, "Invalid number");
+		return -1;
+	}
+	memcpy(buf, node->data.scalar.value, len);
+	buf[len] = 0;
+	errno = 0;
+	*out = strtoull(buf, &end, 0);
+	if (errno || *end || *out > max) {
+		RULE_ERR(rc, node, "Invalid number %s", buf);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Parse scope mapping of a rule
+ *
+ * Returns:
+ * 	0 on success or -1 on error
+ */
+static int
+rule_scope(struct ruleset_ctx *rc, yaml_node_t *node,
+		struct stream_rule_def *def)
+{
+	yaml_node_pair_t *pair;
+	yaml_node_t *key;
+	yaml_node_t *val;
+
+	if (node->type != YAML_MAPPING_NODE) {
+		RULE_ERR(rc, node, "Expected scope to be a mapping");
+		return -1;
+	}
+	for (pair = node->data.mapping.pairs.start;
+			pair < node->data.mapping.pairs.top; pair++) {
+		key = yaml_document_get_node(rc->doc, pair->key);
+		val = yaml_document_get_node(rc->doc, pair->value);
+		if (scalar_is(key, "offset")) {
+			if (rule_num(rc, val, UINT64_MAX,
+						&def->scope_off) < 0) {
+				return -1;
+			}
+		} else if (scalar_is(key, "length")) {
+			if (rule_num(rc, val, UINT64_MAX,
+						&def->scope_len) < 0) {
+				return -1;
+			}
+		} else {
+			RULE_ERR(rc, key, "Unknown scope key");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Parse one rule mapping
+ *
+ * Returns:
+ * 	0 on success or -1 on error
+ */
+static int
+rule_parse(struct ruleset_ctx *rc, yaml_node_t *node,
+		struct stream_rule_def *def)
+{
+	yaml_node_pair_t *pair;
+	yaml_node_t *key;
+	yaml_node_t *val;
+	uint64_t limit;
+	int have_what;
+	int have_with;
+	int stat;
+
+	if (node->type != YAML_MAPPING_NODE) {
+		RULE_ERR(rc, node, "Expected rule to be a mapping");
+		return -1;
+	}
+	memset(def, 0, sizeof(*def));
+	def->dirs = STREAM_BOTH;
+	have_what = 0;
+	have_with = 0;
+	for (pair = node->data.mapping.pairs.start;
+			pair < node->data.mapping.pairs.top; pair++) {
+		key = yaml_document_get_node(rc->doc, pair->key);
+		val = yaml_document_get_node(rc->doc, pair->value);
+		if (scalar_is(key, "match") || scalar_is(key, "match_hex")) {
+			if (have_what++) {
+				RULE_ERR(rc, key, "Rule has more than one match");
+				return -1;
+			}
+			if (scalar_is(key, "match")) {
+				stat = rule_bytes(rc, val, &def->what,
+						&def->what_len);
+			} else {
+				stat = rule_hex(rc, val, &def->what,
+						&def->what_len);
+			}
+			if (stat < 0) {
+				return -1;
+			}
+			if (!def->what_len) {
+				RULE_ERR(rc, val, "Empty match");
+				return -1;
+			}
+		} else if (scalar_is(key, "replace") ||
+				scalar_is(key, "replace_hex")) {
+			if (have_with++) {
+				RULE_ERR(rc, key, "Rule has more than one replace");
+				return -1;
+			}
+			if (scalar_is(key, "replace")) {
+				stat = rule_bytes(rc, val, &def->with,
+						&def->with_len);
+			} else {
+				stat = rule_hex(rc, val, &def->with,
+						&def->with_len);
+			}
+			if (stat < 0) {
+				return -1;
+			}
+		} else if (scalar_is(key, "direction")) {
+			if (scalar_is(val, "c2u")) {
+				def->dirs = STREAM_C2U;
+			} else if (scalar_is(val, "u2c")) {
+				def->dirs = STREAM_U2C;
+			} else if (scalar_is(val, "both")) {
+				def->dirs = STREAM_BOTH;
+			} else {
+				RULE_ERR(rc, val, "Direction must be c2u, u2c or both");
+				return -1;
+			}
+		} else if (scalar_is(key, "scope")) {
+			if (rule_scope(rc, val, def) < 0) {
+				return -1;
+			}
+		} else if (scalar_is(key, "limit")) {
+			if (rule_num(rc, val, UINT32_MAX, &limit) < 0) {
+				return -1;
+			}
+			def->limit = (uint32_t)limit;
+		} else {
+			RULE_ERR(rc, key, "Unknown rule key");
+			return -1;
+		}
+	}
+	if (!have_what) {
+		RULE_ERR(rc, node, "Rule has no match");
+		return -1;
+	}
+	if (!have_with) {
+		RULE_ERR(rc, node, "Rule has no replace");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Find rules sequence from root of document
+ *
+ * Returns:
+ * 	pointer to sequence node or 0 on error
+ */
+static yaml_node_t *
+ruleset_root(struct ruleset_ctx *rc)
+{
+	yaml_node_pair_t *pair;
+	yaml_node_t *root;
+	yaml_node_t *key;
+	yaml_node_t *val;
+
+	root = yaml_document_get_root_node(rc->doc);
+	if (!root) {
+		ERR("%s: Empty ruleset\n", rc->name);
+		return 0;
+	}
+	if (root->type != YAML_MAPPING_NODE) {
+		RULE_ERR(rc, root, "Expected a mapping with rules");
+		return 0;
+	}
+	for (pair = root->data.mapping.pairs.start;
+			pair < root->data.mapping.pairs.top; pair++) {
+		key = yaml_document_get_node(rc->doc, pair->key);
+		val = yaml_document_get_node(rc->doc, pair->value);
+		if (!scalar_is(key, "rules")) {
+			RULE_ERR(rc, key, "Unknown key");
+			return 0;
+		}
+		if (val->type != YAML_SEQUENCE_NODE) {
+			RULE_ERR(rc, val, "Expected rules to be a sequence");
+			return 0;
+		}
+		return val;
+	}
+	RULE_ERR(rc, root, "No rules");
+	return 0;
+}
+
+int
+ruleset_parse(struct stream_rules *rules, const unsigned char *buf,
+		size_t len, char *name)
+{
+	struct stream_rule_def *defs;
+	struct ruleset_ctx rc;
+	yaml_parser_t parser;
+	yaml_document_t doc;
+	yaml_node_item_t *item;
+	yaml_node_t *seq;
+	uint32_t cnt;
+	int stat;
+
+	if (!yaml_parser_initialize(&parser)) {
+		ERR("Failed to initialize YAML parser\n");
+		return -1;
+	}
+	yaml_parser_set_input_string(&parser, buf, len);
+	if (!yaml_parser_load(&parser, &doc)) {
+		ERR("%s:%zu: %s\n", name, parser.problem_mark.line + 1,
+				parser.problem ? parser.problem : "Invalid YAML");
+		yaml_parser_delete(&parser);
+		return -1;
+	}
+	yaml_parser_delete(&parser);
 
+	stat = -1;
+	defs = 0;
+	memset(&rc, 0, sizeof(rc));
+	rc.doc = &doc;
+	rc.name = name;
+	/* Decoded hex is never longer than the input it came from */
+	rc.arena_size = len / 2 + 1;
+	rc.arena = malloc(rc.arena_size);
+	if (!rc.arena) {
+		ERR("Out of memory\n");
+		goto out;
+	}
+	seq = ruleset_root(&rc);
+	if (!seq) {
+		goto out;
+	}
+	cnt = (uint32_t)(seq->data.sequence.items.top -
+			seq->data.sequence.items.start);
+	if (!cnt) {
+		RULE_ERR(&rc, seq, "No rules");
+		goto out;
+	}
+	defs = calloc(cnt, sizeof(*defs));
+	if (!defs) {
+		ERR("Out of memory\n");
+		goto out;
+	}
+	for (item = seq->data.sequence.items.start;
+			item < seq->data.sequence.items.top; item++) {
+		if (rule_parse(&rc, yaml_document_get_node(&doc, *item),
+				&defs[item - seq->data.sequence.items.start]) < 0) {
+			goto out;
+		}
+	}
+	/* Patterns and replacements are copied, document can go after */
+	stat = stream_rules_build(rules, defs, cnt);
+out:
+	free(defs);
+	free(rc.arena);
+	yaml_document_delete(&doc);
+	return stat;
+}
 
+int
+ruleset_load(struct stream_rules *rules, char *path)
+{
+	struct stat st;
+	unsigned char *buf;
+	ssize_t got;
+	size_t len;
+	int stat;
+	int fd;
 
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		ERR("Failed to open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	if (fstat(fd, &st) < 0) {
+		ERR("Failed to stat %s: %s\n", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	if (!st.st_size) {
+		ERR("%s: Empty ruleset\n", path);
+		close(fd);
+		return -1;
+	}
+	/* 
+	 * Read, not map: file may be truncated or rewritten in place while
+	 * we reload, which would be SIGBUS for a mapping. We parse what
+	 * we got, a file that changed under us may fail to parse.
+	 */
+	buf = (unsigned char *)malloc((size_t)st.st_size);
+	if (!buf) {
+		ERR("malloc(%zu) failed\n", (size_t)st.st_size);
+		close(fd);
+		return -1;
+	}
+	len = 0;
+	while (len < (size_t)st.st_size) {
+		got = read(fd, buf + len, (size_t)st.st_size - len);
+		if (got < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			ERR("Failed to read %s: %s\n", path, strerror(errno));
+			free(buf);
+			close(fd);
+			return -1;
+		}
+		if (!got) {
+			break;
+		}
+		len += (size_t)got;
+	}
+	close(fd);
+	if (!len) {
+		ERR("%s: Empty ruleset\n", path);
+		free(buf);
+		return -1;
+	}
+	stat = ruleset_parse(rules, buf, len, path);
+	free(buf);
+	return stat;
+}
@@ -0,0 +1,841 @@
+/*
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2022, k4m1
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIA LDAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVE RCAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ * Asynchronous logging. Each thread gets a single producer, single
+ * consumer ring of its own on its first message, records carry the call
+ * site, format string (which is static) and the arguments encoded in 8
+ * byte slots. Only the log thread formats them, the caller never blocks:
+ * if its ring is full the message is counted as dropped.
+ */
+#include <sys/types.h>
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+
+#include <log.h>
+
+/*
+ * Record header, followed by the arguments. Records are 8 byte aligned
+ * and a record with no site pads the rest of the ring at wrap.
+ */
+struct log_rec {
+	uint32_t len;
+	uint32_t suppressed; 	/* messages of site rate limited before */
+	uint64_t ns; 		/* CLOCK_REALTIME */
+	struct log_site *site;
+	const char *fmt;
+};
+
+struct log_ring {
+	uint64_t head __attribute__((aligned(64))); 	/* written by owner */
+	uint64_t tail __attribute__((aligned(64))); 	/* by log thread */
+	uint64_t dropped __attribute__((aligned(64)));
+	unsigned char *data;
+	struct log_ring *next;
+};
+
+/* Length modifiers of conversions */
+enum {
+	LEN_NONE,
+	LEN_HH,
+	LEN_H,
+	LEN_L,
+	LEN_LL,
+	LEN_Z,
+	LEN_J,
+	LEN_T,
+	LEN_LD,
+};
+
+/*
+ * Conversion of a format string
+ */
+struct log_spec {
+	const char *start; 	/* '%' */
+	const char *end; 	/* past conversion character */
+	int stars; 		/* '*' width and precision */
+	int prec; 		/* precision, -1 if none, -2 if '*' */
+	int len; 		/* LEN_* */
+	char conv;
+};
+
+int log_level = LOG_LVL_INFO;
+
+static struct log_ring *rings;
+static __thread struct log_ring *own_ring;
+
+static int running;
+static int stopping;
+static pthread_t log_thread;
+static uint64_t suppressed_total;
+static uint64_t dropped_reported;
+
+static uint64_t
+log_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ull) + (uint64_t)ts.tv_nsec;
+}
+
+/*
+ * Parse conversion at p
+ *
+ * Requires:
+ * 	const char *p 		- '%' of the format string
+ * 	struct log_spec *s 	- where to parse to
+ * Returns:
+ * 	0 if spec was filled, -1 if p was "%%" or the format ended
+ */
+static int
+log_spec_parse(const char *p, struct log_spec *s)
+{
+	s->start = p++;
+	s->stars = 0;
+	s->len = LEN_NONE;
+	s->prec = -1;
+	if ((*p == '%') || !*p) {
+		return -1;
+	}
+	while (*p && strchr("-+ #0'", *p)) {
+		p++;
+	}
+	if (*p == '*') {
+		s->stars++;
+		p++;
+	}
+	while ((*p >= '0') && (*p <= '9')) {
+		p++;
+	}
+	if (*p == '.') {
+		p++;
+		s->prec = 0;
+		if (*p == '*') {
+			s->stars++;
+			s->prec = -2;
+			p++;
+		}
+		while ((*p >= '0') && (*p <= '9')) {
+			s->prec = (s->prec * 10) + (*p++ - '0');
+		}
+	}
+	switch (*p) {
+	case ('h'):
+		s->len = (p[1] == 'h') ? LEN_HH : LEN_H;
+		p += (p[1] == 'h') ? 2 : 1;
+		break;
+	case ('l'):
+		s->len = (p[1] == 'l') ? LEN_LL : LEN_L;
+		p += (p[1] == 'l') ? 2 : 1;
+		break;
+	case ('q'):
+		s->len = LEN_LL;
+		p++;
+		break;
+	case ('z'):
+		s->len = LEN_Z;
+		p++;
+		break;
+	case ('j'):
+		s->len = LEN_J;
+		p++;
+		break;
+	case ('t'):
+		s->len = LEN_T;
+		p++;
+		break;
+	case ('L'):
+		s->len = LEN_LD;
+		p++;
+		break;
+	}
+	if (!*p) {
+		return -1;
+	}
+	s->conv = *p;
+	s->end = p + 1;
+	return 0;
+}
+
+/*
+ * Append argument to record, in slots of 8 bytes
+ *
+ * Returns:
+ * 	0 on success or -1 if it doesn't fit
+ */
+static int
+log_put(unsigned char *rec, size_t *off, const void *v, size_t len)
+{
+	size_t need;
+
+	need = (len + 7) & ~(size_t)7;
+	if (*off + need > LOG_REC_MAX) {
+		return -1;
+	}
+	memcpy(rec + *off, v, len);
+	*off += need;
+	return 0;
+}
+
+/*
+ * Encode arguments of fmt after the record header
+ *
+ * Returns:
+ * 	record length, arguments which didn't fit are left out
+ */
+static size_t
+log_encode(unsigned char *rec, const char *fmt, va_list ap)
+{
+	struct log_spec s;
+	const char *str;
+	const char *p;
+	uint32_t slen;
+	size_t off;
+	int64_t i;
+	uint64_t u;
+	double d;
+	void *ptr;
+	int prec;
+	int n;
+
+	off = sizeof(struct log_rec);
+	for (p = fmt; (p = strchr(p, '%')); ) {
+		if (log_spec_parse(p, &s) < 0) {
+			p += (p[1] == '%') ? 2 : 1;
+			continue;
+		}
+		p = s.end;
+		prec = s.prec;
+		for (n = 0; n < s.stars; n++) {
+			i = va_arg(ap, int);
+			prec = (int)i;
+			if (log_put(rec, &off, &i, sizeof(i)) < 0) {
+				return off;
+			}
+		}
+		switch (s.conv) {
+		case ('d'):
+		case ('i'):
+			switch (s.len) {
+			case (LEN_L):
+				i = va_arg(ap, long);
+				break;
+			case (LEN_LL):
+				i = va_arg(ap, long long);
+				break;
+			case (LEN_Z):
+				i = va_arg(ap, ssize_t);
+				break;
+			case (LEN_J):
+				i = va_arg(ap, intmax_t);
+				break;
+			case (LEN_T):
+				i = va_arg(ap, ptrdiff_t);
+				break;
+			default:
+				i = va_arg(ap, int);
+				break;
+			}
+			if (log_put(rec, &off, &i, sizeof(i)) < 0) {
+				return off;
+			}
+			break;
+		case ('u'):
+		case ('o'):
+		case ('x'):
+		case ('X'):
+		case ('c'):
+			switch (s.len) {
+			case (LEN_L):
+				u = va_arg(ap, unsigned long);
+				break;
+			case (LEN_LL):
+				u = va_arg(ap, unsigned long long);
+				break;
+			case (LEN_Z):
+				u = va_arg(ap, size_t);
+				break;
+			case (LEN_J):
+				u = va_arg(ap, uintmax_t);
+				break;
+			case (LEN_T):
+				u = va_arg(ap, ptrdiff_t);
+				break;
+			default:
+				u = va_arg(ap, unsigned int);
+				break;
+			}
+			if (log_put(rec, &off, &u, sizeof(u)) < 0) {
+				return off;
+			}
+			break;
+		case ('e'):
+		case ('E'):
+		case ('f'):
+		case ('F'):
+		case ('g'):
+		case ('G'):
+		case ('a'):
+		case ('A'):
+			if (s.len == LEN_LD) {
+				d = (double)va_arg(ap, long double);
+			} else {
+				d = va_arg(ap, double);
+			}
+			if (log_put(rec, &off, &d, sizeof(d)) < 0) {
+				return off;
+			}
+			break;
+		case ('s'):
+			str = va_arg(ap, const char *);
+			if (!str) {
+				str = "(null)";
+			}
+			/* With precision the string needn't be terminated */
+			slen = (prec >= 0) ? strnlen(str, prec) : strlen(str);
+			if (off + 8 + slen > LOG_REC_MAX) {
+				if (off + 8 >= LOG_REC_MAX) {
+					return off;
+				}
+				slen = LOG_REC_MAX - off - 8;
+			}
+			log_put(rec, &off, &slen, sizeof(slen));
+			log_put(rec, &off, str, slen);
+			break;
+		case ('p'):
+			ptr = va_arg(ap, void *);
+			if (log_put(rec, &off, &ptr, sizeof(ptr)) < 0) {
+				return off;
+			}
+			break;
+		case ('n'):
+			(void)va_arg(ap, void *);
+			break;
+		default:
+			return off;
+		}
+	}
+	return off;
+}
+
+/*
+ * Format one conversion with its '*' arguments
+ */
+#define LOG_OUT(v) \
+	do { \
+		if (s.stars == 0) { \
+			n = snprintf(out + o, size - o, spec, v); \
+		} else if (s.stars == 1) { \
+			n = snprintf(out + o, size - o, spec, star[0], v); \
+		} else { \
+			n = snprintf(out + o, size - o, spec, star[0], \
+					star[1], v); \
+		} \
+	} while (0)
+
+/*
+ * Format record into out
+ *
+ * Returns:
+ * 	length of message, cut to size - 1
+ */
+static size_t
+log_decode(const struct log_rec *rec, char *out, size_t size)
+{
+	const unsigned char *end;
+	const unsigned char *a;
+	struct log_spec s;
+	const char *lit;
+	const char *p;
+	char str[LOG_REC_MAX];
+	char spec[32];
+	int star[2];
+	uint32_t slen;
+	int64_t i;
+	uint64_t u;
+	double d;
+	void *ptr;
+	size_t o;
+	int n;
+
+	a = (const unsigned char *)(rec + 1);
+	end = (const unsigned char *)rec + rec->len;
+	p = rec->fmt;
+	o = 0;
+	star[0] = 0;
+	star[1] = 0;
+	while (*p && (o < size - 1)) {
+		lit = strchr(p, '%');
+		if (!lit) {
+			lit = p + strlen(p);
+		}
+		n = lit - p;
+		if ((size_t)n > size - 1 - o) {
+			n = size - 1 - o;
+		}
+		memcpy(out + o, p, n);
+		o += n;
+		p = lit;
+		if (!*p) {
+			break;
+		}
+		if (log_spec_parse(p, &s) < 0) {
+			if ((p[1] == '%') && (o < size - 1)) {
+				out[o++] = '%';
+			}
+			p += (p[1] == '%') ? 2 : 1;
+			continue;
+		}
+		if ((a + 8 * (s.stars + (s.conv != 'n')) > end) ||
+				((size_t)(s.end - s.start) >= sizeof(spec))) {
+			break;
+		}
+		for (n = 0; n < s.stars; n++) {
+			memcpy(&i, a, sizeof(i));
+			star[n] = (int)i;
+			a += 8;
+		}
+		memcpy(spec, s.start, s.end - s.start);
+		spec[s.end - s.start] = 0;
+		p = s.end;
+
+		n = 0;
+		switch (s.conv) {
+		case ('d'):
+		case ('i'):
+			memcpy(&i, a, sizeof(i));
+			a += 8;
+			switch (s.len) {
+			case (LEN_L):
+				LOG_OUT((long)i);
+				break;
+			case (LEN_LL):
+				LOG_OUT((long long)i);
+				break;
+			case (LEN_Z):
+				LOG_OUT((ssize_t)i);
+				break;
+			case (LEN_J):
+				LOG_OUT((intmax_t)i);
+				break;
+			case (LEN_T):
+				LOG_OUT((ptrdiff_t)i);
+				break;
+			default:
+				LOG_OUT((int)i);
+				break;
+			}
+			break;
+		case ('u'):
+		case ('o'):
+		case ('x'):
+		case ('X'):
+		case ('c'):
+			memcpy(&u, a, sizeof(u));
+			a += 8;
+			switch (s.len) {
+			case (LEN_L):
+				LOG_OUT((unsigned long)u);
+				break;
+			case (LEN_LL):
+				LOG_OUT((unsigned long long)u);
+				break;
+			case (LEN_Z):
+				LOG_OUT((size_t)u);
+				break;
+			case (LEN_J):
+				LOG_OUT((uintmax_t)u);
+				break;
+			case (LEN_T):
+				LOG_OUT((ptrdiff_t)u);
+				break;
+			default:
+				LOG_OUT((unsigned int)u);
+				break;
+			}
+			break;
+		case ('e'):
+		case ('E'):
+		case ('f'):
+		case ('F'):
+		case ('g'):
+		case ('G'):
+		case ('a'):
+		case ('A'):
+			memcpy(&d, a, sizeof(d));
+			a += 8;
+			if (s.len == LEN_LD) {
+				LOG_OUT((long double)d);
+			} else {
+				LOG_OUT(d);
+			}
+			break;
+		case ('s'):
+			memcpy(&slen, a, sizeof(slen));
+			a += 8;
+			if (a + slen > end) {
+				slen = end - a;
+			}
+			memcpy(str, a, slen);
+			str[slen] = 0;
+			a += (slen + 7) & ~(uint32_t)7;
+			LOG_OUT(str);
+			break;
+		case ('p'):
+			memcpy(&ptr, a, sizeof(ptr));
+			a += 8;
+			LOG_OUT(ptr);
+			break;
+		case ('n'):
+			break;
+		}
+		if (n > 0) {
+			o += ((size_t)n < size - o) ? (size_t)n : (size - 1 - o);
+		}
+	}
+	out[o] = 0;
+	return o;
+}
+
+#undef LOG_OUT
+
+/*
+ * Format record as a line of log, prefixed with its time and with
+ * DEBUG, where it came from
+ *
+ * Returns:
+ * 	length of line
+ */
+static size_t
+log_format(const struct log_rec *rec, char *line, size_t size)
+{
+	struct tm tm;
+	time_t sec;
+	size_t o;
+
+	sec = (time_t)(rec->ns / 1000000000ull);
+	localtime_r(&sec, &tm);
+	o = strftime(line, size, "%Y-%m-%d %H:%M:%S", &tm);
+	o += snprintf(line + o, size - o, ".%03u ",
+			(unsigned)((rec->ns / 1000000) % 1000));
+	if (rec->suppressed) {
+		o += snprintf(line + o, size - o,
+				"(%u similar messages suppressed) ",
+				rec->suppressed);
+	}
+#ifdef DEBUG
+	o += snprintf(line + o, size - o, "%s%s: %d: ",
+			(rec->site->level == LOG_LVL_ERR) ? "Error: " : "",
+			rec->site->file, rec->site->line);
+#endif
+	if (o >= size) {
+		o = size - 1;
+	}
+	return o + log_decode(rec, line + o, size - o);
+}
+
+static FILE *
+log_stream(const struct log_rec *rec)
+{
+	return (rec->site->level == LOG_LVL_ERR) ? stderr : stdout;
+}
+
+/*
+ * Count message to rate limit of its call site
+ *
+ * Returns:
+ * 	1 if message is over limit and not to be logged, 0 if it is
+ */
+static int
+log_limited(struct log_site *site, uint64_t sec, uint32_t *suppressed)
+{
+	uint64_t window;
+
+	window = __atomic_load_n(&site->window, __ATOMIC_RELAXED);
+	if ((window != sec) && __atomic_compare_exchange_n(&site->window,
+				&window, sec, 0, __ATOMIC_RELAXED,
+				__ATOMIC_RELAXED)) {
+		__atomic_store_n(&site->count, 0, __ATOMIC_RELAXED);
+		*suppressed = __atomic_exchange_n(&site->suppressed, 0,
+				__ATOMIC_RELAXED);
+	}
+	if (__atomic_add_fetch(&site->count, 1, __ATOMIC_RELAXED) <=
+			LOG_BURST) {
+		return 0;
+	}
+	__atomic_add_fetch(&site->suppressed, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&suppressed_total, 1, __ATOMIC_RELAXED);
+	return 1;
+}
+
+/*
+ * Ring of calling thread, set up on its first message. Rings stay
+ * around after their threads exit, the log thread may still be reading.
+ *
+ * Returns:
+ * 	ring, or 0 if allocating memory failed
+ */
+static struct log_ring *
+log_ring_get(void)
+{
+	struct log_ring *r;
+
+	if (own_ring) {
+		return own_ring;
+	}
+	r = (struct log_ring *)aligned_alloc(64, sizeof(*r));
+	if (!r) {
+		return 0;
+	}
+	memset(r, 0, sizeof(*r));
+	r->data = (unsigned char *)malloc(LOG_RING_SIZE);
+	if (!r->data) {
+		free(r);
+		return 0;
+	}
+	do {
+		r->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+	} while (!__atomic_compare_exchange_n(&rings, &r->next, r, 1,
+				__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	own_ring = r;
+	return r;
+}
+
+/*
+ * Copy record to ring, records which would wrap start over at the
+ * beginning of ring and what's left at the end is skipped
+ *
+ * Returns:
+ * 	0 on success or -1 if ring is full
+ */
+static int
+log_ring_push(struct log_ring *r, const struct log_rec *rec)
+{
+	struct log_rec *skip;
+	uint64_t head;
+	uint64_t tail;
+	size_t pos;
+	size_t pad;
+
+	head = r->head;
+	tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+	pos = head & (LOG_RING_SIZE - 1);
+	pad = 0;
+	if (pos + rec->len > LOG_RING_SIZE) {
+		pad = LOG_RING_SIZE - pos;
+	}
+	if (head + pad + rec->len - tail > LOG_RING_SIZE) {
+		__atomic_store_n(&r->dropped, r->dropped + 1,
+				__ATOMIC_RELAXED);
+		return -1;
+	}
+	if (pad >= sizeof(*skip)) {
+		skip = (struct log_rec *)(r->data + pos);
+		skip->len = pad;
+		skip->site = 0;
+	}
+	memcpy(r->data + ((head + pad) & (LOG_RING_SIZE - 1)), rec, rec->len);
+	__atomic_store_n(&r->head, head + pad + rec->len, __ATOMIC_RELEASE);
+	return 0;
+}
+
+void
+log_write(struct log_site *site, const char *fmt, ...)
+{
+	uint64_t buf[LOG_REC_MAX / sizeof(uint64_t)];
+	char line[LOG_REC_MAX * 2];
+	struct log_rec *rec;
+	struct log_ring *r;
+	uint32_t suppressed;
+	va_list ap;
+	size_t len;
+
+	rec = (struct log_rec *)buf;
+	suppressed = 0;
+	rec->ns = log_now_ns();
+	if (log_limited(site, rec->ns / 1000000000ull, &suppressed)) {
+		return;
+	}
+	rec->suppressed = suppressed;
+	rec->site = site;
+	rec->fmt = fmt;
+
+	va_start(ap, fmt);
+	rec->len = log_encode((unsigned char *)buf, fmt, ap);
+	va_end(ap);
+
+	if (__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+		r = log_ring_get();
+		if (r) {
+			log_ring_push(r, rec);
+			return;
+		}
+	}
+	len = log_format(rec, line, sizeof(line));
+	fwrite(line, 1, len, log_stream(rec));
+}
+
+/*
+ * Write out what's waiting in rings
+ *
+ * Returns:
+ * 	amount of records written
+ */
+static size_t
+log_drain(void)
+{
+	static char line[LOG_REC_MAX * 2];
+	struct log_ring *r;
+	struct log_rec *rec;
+	uint64_t dropped;
+	uint64_t head;
+	uint64_t tail;
+	size_t pos;
+	size_t len;
+	size_t n;
+
+	dropped = 0;
+	n = 0;
+	for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+		head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		for (tail = r->tail; tail != head; tail += rec->len) {
+			pos = tail & (LOG_RING_SIZE - 1);
+			rec = (struct log_rec *)(r->data + pos);
+			if (LOG_RING_SIZE - pos < sizeof(*rec)) {
+				tail += LOG_RING_SIZE - pos;
+				if (tail == head) {
+					break;
+				}
+				rec = (struct log_rec *)r->data;
+			}
+			if (!rec->site) {
+				continue;
+			}
+			len = log_format(rec, line, sizeof(line));
+			fwrite(line, 1, len, log_stream(rec));
+			n++;
+		}
+		__atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+		dropped += __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+	}
+	if (dropped != dropped_reported) {
+		fflush(stdout);
+		fprintf(stderr, "Log dropped %llu messages, %llu in total\n",
+				(unsigned long long)(dropped - dropped_reported),
+				(unsigned long long)dropped);
+		dropped_reported = dropped;
+	}
+	if (n) {
+		fflush(stdout);
+		fflush(stderr);
+	}
+	return n;
+}
+
+static void *
+log_main(void *arg)
+{
+	struct timespec idle;
+
+	(void)arg;
+	idle.tv_sec = 0;
+	idle.tv_nsec = LOG_FLUSH_MS * 1000000L;
+	while (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+		if (!log_drain()) {
+			nanosleep(&idle, 0);
+		}
+	}
+	return 0;
+}
+
+int
+log_start(void)
+{
+	int stat;
+
+	if (running) {
+		return 0;
+	}
+	stopping = 0;
+	__atomic_store_n(&running, 1, __ATOMIC_RELEASE);
+	stat = pthread_create(&log_thread, 0, log_main, 0);
+	if (stat) {
+		running = 0;
+		ERR("Failed to start log thread: %s\n", strerror(stat));
+		return -1;
+	}
+	return 0;
+}
+
+void
+log_stop(void)
+{
+	if (!running) {
+		return;
+	}
+	__atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+	pthread_join(log_thread, 0);
+
+	/* Messages of threads which saw running just before it was cleared */
+	log_drain();
+	fflush(stdout);
+	fflush(stderr);
+}
+
+void
+log_set_level(int level)
+{
+	__atomic_store_n(&log_level, level, __ATOMIC_RELAXED);
+}
+
+void
+log_get_stats(struct log_stats *st)
+{
+	struct log_ring *r;
+
+	st->dropped = 0;
+	for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+		st->dropped += __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+	}
+	st->suppressed = __atomic_load_n(&suppressed_total, __ATOMIC_RELAXED);
+}
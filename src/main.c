@@ -0,0 +1,502 @@
+/*
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2022, k4m1
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIA LDAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVE RCAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Command line entrypoint for tap.
+ */
+#include <sys/types.h>
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include <unistd.h>
+
+#include <log.h>
+#include <driver.h>
+#include <backend_set.h>
+#include <intercept_parser.h>
+#include <plugin.h>
+#include <rules_domain.h>
+#include <stream_match.h>
+#include <tls_relay.h>
+#include <udp_relay.h>
+
+/* TESTS HERE */
+
+/*
+ * Patterns replaced for testcases, matched across reads
+ */
+static unsigned char *test_what[] = { (unsigned char *)"TEST" };
+static unsigned char *test_with[] = { (unsigned char *)"LMAO" };
+
+static int
+test_rules(struct stream_rules *rules)
+{
+	struct stream_rule_def def;
+
+	memset(&def, 0, sizeof(def));
+	def.what = test_what[0];
+	def.what_len = strlen((char *)test_what[0]);
+	def.with = test_with[0];
+	def.with_len = strlen((char *)test_with[0]);
+	def.dirs = STREAM_BOTH;
+	return stream_rules_build(rules, &def, 1);
+}
+
+/* TESTS END */
+
+static void
+usage(char *name)
+{
+	printf("Usage: %s [options]\n", name);
+	printf("\t--lhost ADDR     Local address to bind, defaults to 0.0.0.0\n");
+	printf("\t--lport PORT     Local port to bind, defaults to 1337\n");
+	printf("\t--rhost ADDR     Remote address to connect to, defaults to 127.0.0.1\n");
+	printf("\t--rport PORT     Remote port to connect to, defaults to 1338\n");
+	printf("\t--upstream ADDR:PORT  Backend to balance over, repeat for more, in place of --rhost/--rport\n");
+	printf("\t--lb POLICY      rr, leastconn or hash (of client address), defaults to rr\n");
+	printf("\t--health-ms MS   How often backends are probed, 0 to not, defaults to 2000\n");
+	printf("\t--admin ADDR     Serve Prometheus metrics on unix:PATH or 127.0.0.1:PORT\n");
+	printf("\t--ws BYTES       How many bytes to read at once, defaults to 256\n");
+	printf("\t--workers N      Amount of worker threads, defaults to 1\n");
+	printf("\t--pin            Pin each worker to its own cpu\n");
+	printf("\t--drain SECONDS  How long to wait for connections on shutdown\n");
+	printf("\t--backend NAME   I/O backend, epoll or uring, defaults to epoll\n");
+	printf("\t--rules FILE     Interception ruleset, see README.md, reloaded on SIGHUP\n");
+	printf("\t--watch-rules    Reload ruleset when the file changes\n");
+	printf("\t--no-intercept   Pass data through without alterations\n");
+	printf("\t--no-splice      Copy data even when it is not intercepted\n");
+	printf("\t--hwm BYTES      Stop reading once this much is queued, defaults to 64K\n");
+	printf("\t--conn-mem BYTES Max queued bytes per connection, defaults to 256K\n");
+	printf("\t--hold-ms MS     How long to wait for rest of a split pattern, defaults to 100\n");
+	printf("\t--scrub          Zero relay buffers when they're released\n");
+	printf("\t--connect-timeout MS  Give up a connect attempt after, defaults to 3000\n");
+	printf("\t--pool-min N     Warm upstream connections per worker, defaults to 0\n");
+	printf("\t--pool-max N     Most warm connections per worker, defaults to 4 x --pool-min\n");
+	printf("\t--log-level LVL  error or info, defaults to info\n");
+	printf("\t--capture PREFIX Write traffic to PREFIX.WORKER.N.pcapng, before and after rules\n");
+	printf("\t--capture-size BYTES  Size of a capture file, defaults to 64M\n");
+	printf("\t--capture-files N  Capture files kept per worker, defaults to 4\n");
+	printf("\t--proto PROTO    tcp or udp, defaults to tcp\n");
+	printf("\t--udp-idle-ms MS Close UDP flow after this long without datagrams, defaults to 30000\n");
+	printf("\t--tls-cert FILE  Terminate TLS of clients with certificate chain in FILE\n");
+	printf("\t--tls-key FILE   Private key of --tls-cert, defaults to same file\n");
+	printf("\t--tls-upstream   Connect to upstreams with TLS\n");
+	printf("\t--tls-ca FILE    Verify upstreams against CAs in FILE\n");
+	printf("\t--tls-sni NAME   Server name sent to & verified of upstreams\n");
+	printf("\t--no-ktls        Keep TLS records in user space even if kernel could do them\n");
+	printf("\t--plugin FILE    Pass every read to plugin in shared object FILE, see tap_plugin.h\n");
+	printf("\t--plugin-arg ARG Passed to plugin as it is loaded\n");
+}
+
+int
+main(int argc, char **argv)
+{
+	static struct option opts[] = {
+		{ "lhost", 	required_argument, 	0, 'L' },
+		{ "lport", 	required_argument, 	0, 'l' },
+		{ "rhost", 	required_argument, 	0, 'R' },
+		{ "rport", 	required_argument, 	0, 'r' },
+		{ "upstream", 	required_argument, 	0, 'u' },
+		{ "lb", 	required_argument, 	0, 'B' },
+		{ "health-ms", 	required_argument, 	0, 'K' },
+		{ "admin", 	required_argument, 	0, 'A' },
+		{ "ws", 	required_argument, 	0, 's' },
+		{ "workers", 	required_argument, 	0, 'w' },
+		{ "pin", 	no_argument, 		0, 'p' },
+		{ "drain", 	required_argument, 	0, 'd' },
+		{ "backend", 	required_argument, 	0, 'b' },
+		{ "rules", 	required_argument, 	0, 'f' },
+		{ "watch-rules", no_argument, 		0, 'W' },
+		{ "no-intercept", no_argument, 		0, 'n' },
+		{ "no-splice", 	no_argument, 		0, 'S' },
+		{ "hwm", 	required_argument, 	0, 'H' },
+		{ "conn-mem", 	required_argument, 	0, 'M' },
+		{ "hold-ms", 	required_argument, 	0, 'T' },
+		{ "scrub", 	no_argument, 		0, 'z' },
+		{ "connect-timeout", required_argument, 0, 'C' },
+		{ "pool-min", 	required_argument, 	0, 'P' },
+		{ "pool-max", 	required_argument, 	0, 'X' },
+		{ "log-level", 	required_argument, 	0, 'V' },
+		{ "capture", 	required_argument, 	0, 'c' },
+		{ "capture-size", required_argument, 	0, 'Z' },
+		{ "capture-files", required_argument, 	0, 'F' },
+		{ "proto", 	required_argument, 	0, 'o' },
+		{ "udp-idle-ms", required_argument, 	0, 'I' },
+		{ "tls-cert", 	required_argument, 	0, 'e' },
+		{ "tls-key", 	required_argument, 	0, 'k' },
+		{ "tls-upstream", no_argument, 		0, 'U' },
+		{ "tls-ca", 	required_argument, 	0, 'a' },
+		{ "tls-sni", 	required_argument, 	0, 'N' },
+		{ "no-ktls", 	no_argument, 		0, 'y' },
+		{ "plugin", 	required_argument, 	0, 'g' },
+		{ "plugin-arg", required_argument, 	0, 'G' },
+		{ "help", 	no_argument, 		0, 'h' },
+		{ 0, 		0, 			0, 0 }
+	};
+	struct stream_rules rules;
+	struct rules_domain dom;
+	struct backend_set backends;
+	struct tap_config cfg;
+	struct tls_config tls;
+	struct plugin plugin;
+	char *plugin_path;
+	char *plugin_arg;
+	char *tls_cert;
+	char *tls_key;
+	char *tls_ca;
+	char *tls_sni;
+	int tls_upstream;
+	int ktls;
+	char rhost[64];
+	int intercept;
+	int stat;
+	int opt;
+
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.addrin = "0.0.0.0";
+	cfg.lport = 1337;
+	cfg.addrout = "127.0.0.1";
+	cfg.dport = 1338;
+	cfg.tx_size = 256;
+	intercept = 1;
+	cfg.workers = 1;
+	cfg.drain_timeout = DRIVER_DRAIN_TIMEOUT;
+	cfg.splice = 1;
+	cfg.hwm = RELAY_HWM;
+	cfg.conn_mem = RELAY_CONN_MEM;
+	cfg.hold_ms = STREAM_HOLD_MS;
+	cfg.connect_timeout_ms = CONN_TIMEOUT_MS;
+	cfg.health_ms = BACKEND_PROBE_MS;
+	cfg.udp_idle_ms = UDP_IDLE_MS;
+	tls_cert = 0;
+	tls_key = 0;
+	tls_ca = 0;
+	tls_sni = 0;
+	tls_upstream = 0;
+	ktls = 1;
+	plugin_path = 0;
+	plugin_arg = 0;
+	backend_set_init(&backends, LB_ROUND_ROBIN);
+
+	while ((opt = getopt_long(argc, argv, "h", opts, 0)) != -1) {
+		switch (opt) {
+		case ('L'):
+			cfg.addrin = optarg;
+			break;
+		case ('l'):
+			cfg.lport = (short)atoi(optarg);
+			break;
+		case ('R'):
+			cfg.addrout = optarg;
+			break;
+		case ('r'):
+			cfg.dport = (short)atoi(optarg);
+			break;
+		case ('u'):
+			if (backend_set_add(&backends, optarg) < 0) {
+				backend_set_free(&backends);
+				return -1;
+			}
+			break;
+		case ('B'):
+			if (!strcmp(optarg, "rr")) {
+				backends.policy = LB_ROUND_ROBIN;
+			} else if (!strcmp(optarg, "leastconn")) {
+				backends.policy = LB_LEAST_CONN;
+			} else if (!strcmp(optarg, "hash")) {
+				backends.policy = LB_HASH;
+			} else {
+				ERR("Unknown balancing policy %s\n", optarg);
+				backend_set_free(&backends);
+				return -1;
+			}
+			break;
+		case ('K'):
+			cfg.health_ms = atoi(optarg);
+			break;
+		case ('A'):
+			cfg.admin_addr = optarg;
+			break;
+		case ('s'):
+			cfg.tx_size = (size_t)strtoul(optarg, 0, 0);
+			break;
+		case ('w'):
+			cfg.workers = atoi(optarg);
+			break;
+		case ('p'):
+			cfg.pin_cpus = 1;
+			break;
+		case ('d'):
+			cfg.drain_timeout = atoi(optarg);
+			break;
+		case ('b'):
+			if (!strcmp(optarg, "epoll")) {
+				cfg.backend = BACKEND_EPOLL;
+			} else if (!strcmp(optarg, "uring")) {
+				cfg.backend = BACKEND_URING;
+			} else {
+				ERR("Unknown backend %s\n", optarg);
+				return -1;
+			}
+			break;
+		case ('f'):
+			cfg.rules_path = optarg;
+			break;
+		case ('W'):
+			cfg.watch_rules = 1;
+			break;
+		case ('n'):
+			intercept = 0;
+			break;
+		case ('S'):
+			cfg.splice = 0;
+			break;
+		case ('H'):
+			cfg.hwm = (size_t)strtoul(optarg, 0, 0);
+			break;
+		case ('M'):
+			cfg.conn_mem = (size_t)strtoul(optarg, 0, 0);
+			break;
+		case ('T'):
+			cfg.hold_ms = atoi(optarg);
+			break;
+		case ('z'):
+			cfg.scrub = 1;
+			break;
+		case ('C'):
+			cfg.connect_timeout_ms = atoi(optarg);
+			break;
+		case ('P'):
+			cfg.pool_min = atoi(optarg);
+			break;
+		case ('X'):
+			cfg.pool_max = atoi(optarg);
+			break;
+		case ('c'):
+			cfg.capture_prefix = optarg;
+			break;
+		case ('Z'):
+			cfg.capture_size = (size_t)strtoul(optarg, 0, 0);
+			break;
+		case ('F'):
+			cfg.capture_files = atoi(optarg);
+			break;
+		case ('o'):
+			if (!strcasecmp(optarg, "tcp")) {
+				cfg.proto = PROTO_TCP;
+			} else if (!strcasecmp(optarg, "udp")) {
+				cfg.proto = PROTO_UDP;
+			} else {
+				ERR("Unknown protocol %s\n", optarg);
+				return -1;
+			}
+			break;
+		case ('I'):
+			cfg.udp_idle_ms = atoi(optarg);
+			break;
+		case ('e'):
+			tls_cert = optarg;
+			break;
+		case ('k'):
+			tls_key = optarg;
+			break;
+		case ('U'):
+			tls_upstream = 1;
+			break;
+		case ('a'):
+			tls_ca = optarg;
+			break;
+		case ('N'):
+			tls_sni = optarg;
+			break;
+		case ('y'):
+			ktls = 0;
+			break;
+		case ('g'):
+			plugin_path = optarg;
+			break;
+		case ('G'):
+			plugin_arg = optarg;
+			break;
+		case ('V'):
+			if (!strcmp(optarg, "error")) {
+				log_set_level(LOG_LVL_ERR);
+			} else if (!strcmp(optarg, "info")) {
+				log_set_level(LOG_LVL_INFO);
+			} else {
+				ERR("Unknown log level %s\n", optarg);
+				return -1;
+			}
+			break;
+		case ('h'):
+			usage(argv[0]);
+			return 0;
+		default:
+			usage(argv[0]);
+			return -1;
+		}
+	}
+	if (!cfg.tx_size) {
+		ERR("--ws must be more than 0\n");
+		return -1;
+	}
+	if (cfg.hold_ms <= 0) {
+		ERR("--hold-ms must be more than 0\n");
+		return -1;
+	}
+	if (cfg.connect_timeout_ms <= 0) {
+		ERR("--connect-timeout must be more than 0\n");
+		return -1;
+	}
+	if ((cfg.pool_min < 0) || (cfg.pool_max < 0) || 
+			(cfg.pool_max && (cfg.pool_max < cfg.pool_min))) {
+		ERR("--pool-max must be at least --pool-min\n");
+		return -1;
+	}
+	if (cfg.udp_idle_ms <= 0) {
+		ERR("--udp-idle-ms must be more than 0\n");
+		return -1;
+	}
+	if ((cfg.proto == PROTO_UDP) && (cfg.pool_min || cfg.capture_prefix)) {
+		ERR("--pool-min and --capture work with tcp only\n");
+		return -1;
+	}
+	if ((tls_key || tls_ca || tls_sni) && !tls_cert && !tls_upstream) {
+		ERR("--tls-cert or --tls-upstream is needed for TLS\n");
+		return -1;
+	}
+	if ((cfg.proto == PROTO_UDP) && (tls_cert || tls_upstream)) {
+		ERR("TLS works with tcp only\n");
+		return -1;
+	}
+	if ((cfg.backend == BACKEND_URING) && (cfg.rules_path || plugin_path)) {
+		ERR("--rules and --plugin work with epoll backend only\n");
+		return -1;
+	}
+	/* Test rules would only make uring fall back to epoll */
+	if (cfg.backend == BACKEND_URING) {
+		intercept = 0;
+	}
+	if ((cfg.proto == PROTO_UDP) && plugin_path) {
+		ERR("--plugin works with tcp only\n");
+		return -1;
+	}
+	if (plugin_arg && !plugin_path) {
+		ERR("--plugin-arg needs --plugin\n");
+		return -1;
+	}
+	if (cfg.conn_mem < 2 * cfg.hwm) {
+		ERR("--conn-mem must be at least twice --hwm\n");
+		return -1;
+	}
+	if (!backends.n) {
+		snprintf(rhost, sizeof(rhost), "%s:%d", cfg.addrout, cfg.dport);
+		if (backend_set_add(&backends, rhost) < 0) {
+			return -1;
+		}
+	}
+	if (backend_set_build(&backends) < 0) {
+		backend_set_free(&backends);
+		return -1;
+	}
+	cfg.backends = &backends;
+	if (intercept) {
+		stat = cfg.rules_path ? ruleset_load(&rules, cfg.rules_path) :
+			test_rules(&rules);
+		if (stat < 0) {
+			return -1;
+		}
+		/* Metrics read rule counters as the last reader */
+		if (rules_domain_init(&dom, cfg.workers + 1) < 0) {
+			stream_rules_free(&rules);
+			return -1;
+		}
+		if (rules_domain_publish(&dom, &rules) < 0) {
+			rules_domain_destroy(&dom);
+			return -1;
+		}
+		cfg.rules = &dom;
+	}
+	if ((tls_cert || tls_upstream) && (tls_config_init(&tls, tls_cert,
+				tls_key, tls_upstream, tls_ca, tls_sni,
+				ktls) < 0)) {
+		if (intercept) {
+			rules_domain_destroy(&dom);
+		}
+		backend_set_free(&backends);
+		return -1;
+	}
+	if (tls_cert || tls_upstream) {
+		cfg.tls = &tls;
+	}
+	if (log_start() < 0) {
+		if (cfg.tls) {
+			tls_config_free(&tls);
+		}
+		if (intercept) {
+			rules_domain_destroy(&dom);
+		}
+		backend_set_free(&backends);
+		return -1;
+	}
+	if (plugin_path && (plugin_load(&plugin, plugin_path, 
+				plugin_arg) < 0)) {
+		log_stop();
+		if (cfg.tls) {
+			tls_config_free(&tls);
+		}
+		if (intercept) {
+			rules_domain_destroy(&dom);
+		}
+		backend_set_free(&backends);
+		return -1;
+	}
+	if (plugin_path) {
+		cfg.plugin = &plugin;
+	}
+	stat = tap_driver_run(&cfg);
+	if (cfg.plugin) {
+		plugin_unload(&plugin);
+	}
+	log_stop();
+	if (cfg.tls) {
+		tls_config_free(&tls);
+	}
+	if (intercept) {
+		rules_domain_destroy(&dom);
+	}
+	backend_set_free(&backends);
+	return (stat < 0) ? -1 : 0;
+}
@@ -0,0 +1,508 @@
+/*
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2022, k4m1
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIA LDAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVE RCAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Metrics of workers in Prometheus text format. Workers only ever do
+ * plain stores to counters of their own, everything is summed up here
+ * when metrics are read.
+ */
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <backend_set.h>
+#include <buf_pool.h>
+#include <capture.h>
+#include <driver.h>
+#include <event_loop.h>
+#include <hist.h>
+#include <log.h>
+#include <metrics.h>
+#include <rules_domain.h>
+
+static const char *dir_names[2] = { "c2u", "u2c" };
+static const char *side_names[2] = { "client", "upstream" };
+
+/* Metrics with two values, labeled by direction or side of connection */
+#define PER_DIR 	1
+#define PER_SIDE 	2
+
+/*
+ * Counter or gauge of relay_stats, per worker and maybe per direction
+ */
+struct metric_def {
+	const char *name;
+	const char *type;
+	const char *help;
+	size_t off; 		/* of uint64_t in struct relay_stats */
+	int split; 		/* PER_* for two values, or 0 */
+};
+
+static const struct metric_def worker_metrics[] = {
+	{ "tap_connections_accepted_total", "counter", 
+		"Client connections accepted",
+		offsetof(struct relay_stats, accepted), 0 },
+	{ "tap_connections_active", "gauge", 
+		"Client connections open",
+		offsetof(struct relay_stats, active), 0 },
+	{ "tap_connections_closed_total", "counter", 
+		"Client connections closed",
+		offsetof(struct relay_stats, closed), 0 },
+	{ "tap_received_bytes_total", "counter", 
+		"Bytes read from source of direction",
+		offsetof(struct relay_stats, rx_bytes), PER_DIR },
+	{ "tap_sent_bytes_total", "counter", 
+		"Bytes sent to destination of direction, after rewrites",
+		offsetof(struct relay_stats, tx_bytes), PER_DIR },
+	{ "tap_chunks_total", "counter", 
+		"Reads that returned data",
+		offsetof(struct relay_stats, chunks), PER_DIR },
+	{ "tap_connect_retries_total", "counter", 
+		"Upstream connects that failed or timed out",
+		offsetof(struct relay_stats, connect_retries), 0 },
+	{ "tap_connect_timeouts_total", "counter", 
+		"Upstream connects that timed out",
+		offsetof(struct relay_stats, connect_timeouts), 0 },
+	{ "tap_connect_failures_total", "counter", 
+		"Connections closed after every connect attempt failed",
+		offsetof(struct relay_stats, connect_failed), 0 },
+	{ "tap_pool_hits_total", "counter", 
+		"Clients given a warm upstream connection",
+		offsetof(struct relay_stats, pool_hits), 0 },
+	{ "tap_pool_misses_total", "counter", 
+		"Clients that found the warm pool empty",
+		offsetof(struct relay_stats, pool_misses), 0 },
+	{ "tap_pool_idle", "gauge", 
+		"Warm upstream connections",
+		offsetof(struct relay_stats, pool_idle), 0 },
+	{ "tap_udp_flows", "gauge", 
+		"UDP flows open",
+		offsetof(struct relay_stats, udp_flows), 0 },
+	{ "tap_udp_flows_opened_total", "counter", 
+		"UDP flows opened",
+		offsetof(struct relay_stats, udp_flows_opened), 0 },
+	{ "tap_udp_flows_expired_total", "counter", 
+		"UDP flows closed after being idle",
+		offsetof(struct relay_stats, udp_flows_expired), 0 },
+	{ "tap_udp_datagrams_received_total", "counter", 
+		"Datagrams received from source of direction",
+		offsetof(struct relay_stats, udp_dgrams_rx), PER_DIR },
+	{ "tap_udp_datagrams_sent_total", "counter", 
+		"Datagrams sent to destination of direction",
+		offsetof(struct relay_stats, udp_dgrams_tx), PER_DIR },
+	{ "tap_udp_datagrams_dropped_total", "counter", 
+		"Datagrams that could not be relayed",
+		offsetof(struct relay_stats, udp_dropped), 0 },
+	{ "tap_tls_handshakes_total", "counter", 
+		"TLS handshakes completed with each side",
+		offsetof(struct relay_stats, tls_handshakes), PER_SIDE },
+	{ "tap_tls_resumed_total", "counter", 
+		"TLS handshakes that resumed a session",
+		offsetof(struct relay_stats, tls_resumed), PER_SIDE },
+	{ "tap_tls_failures_total", "counter", 
+		"TLS handshakes that failed",
+		offsetof(struct relay_stats, tls_failed), 0 },
+	{ "tap_tls_ktls_sockets_total", "counter", 
+		"TLS sockets the kernel did records for",
+		offsetof(struct relay_stats, tls_ktls), 0 },
+	{ "tap_filtered_total", "counter", 
+		"Reads that matched filter and were passed to its function",
+		offsetof(struct relay_stats, filtered), PER_DIR },
+	{ "tap_plugin_rewrites_total", "counter", 
+		"Reads plugin relayed something else for",
+		offsetof(struct relay_stats, plugin_rewrites), PER_DIR },
+};
+
+void
+mbuf_printf(struct mbuf *m, const char *fmt, ...)
+{
+	va_list ap;
+	size_t cap;
+	char *p;
+	int len;
+
+	if (m->err) {
+		return;
+	}
+	for (;;) {
+		va_start(ap, fmt);
+		len = vsnprintf(m->p ? &m->p[m->len] : 0, m->cap - m->len, 
+				fmt, ap);
+		va_end(ap);
+		if (len < 0) {
+			m->err = 1;
+			return;
+		}
+		if ((size_t)len < m->cap - m->len) {
+			m->len += (size_t)len;
+			return;
+		}
+		cap = m->cap ? m->cap : 4096;
+		while (cap - m->len <= (size_t)len) {
+			cap *= 2;
+		}
+		p = (char *)realloc(m->p, cap);
+		if (!p) {
+			m->err = 1;
+			return;
+		}
+		m->p = p;
+		m->cap = cap;
+	}
+}
+
+void
+mbuf_free(struct mbuf *m)
+{
+	free(m->p);
+	memset(m, 0, sizeof(*m));
+}
+
+static void
+family(struct mbuf *m, const char *name, const char *type, 
+		const char *help)
+{
+	mbuf_printf(m, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/*
+ * Series of histogram family, values are us and exported as seconds
+ */
+static void
+hist_series(struct mbuf *m, const char *name, const char *labels, 
+		struct hist *h)
+{
+	uint64_t cum;
+	int b;
+
+	cum = 0;
+	for (b = 0; b < HIST_BUCKETS - 1; b++) {
+		cum += h->b[b];
+		mbuf_printf(m, "%s_bucket{%s%sle=\"%g\"} %llu\n", name, labels,
+				*labels ? "," : "",
+				(double)hist_bucket_end(b) / 1e6,
+				(unsigned long long)cum);
+	}
+	cum += h->b[b];
+	mbuf_printf(m, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels,
+			*labels ? "," : "", (unsigned long long)cum);
+	mbuf_printf(m, "%s_sum{%s} %g\n", name, labels, 
+			(double)h->sum / 1e6);
+	/* Buckets are read one by one, count must agree with them */
+	mbuf_printf(m, "%s_count{%s} %llu\n", name, labels, 
+			(unsigned long long)cum);
+}
+
+static void
+render_workers(struct mbuf *m, struct metrics_src *src, 
+		struct relay_stats *rs)
+{
+	const struct metric_def *def;
+	uint64_t *v;
+	size_t i;
+	int w;
+	int d;
+
+	for (i = 0; i < sizeof(worker_metrics) / sizeof(*def); i++) {
+		def = &worker_metrics[i];
+		family(m, def->name, def->type, def->help);
+		for (w = 0; w < src->cfg->workers; w++) {
+			if (!src->workers[w].started) {
+				continue;
+			}
+			v = (uint64_t *)((char *)&rs[w] + def->off);
+			if (!def->split) {
+				mbuf_printf(m, "%s{worker=\"%d\"} %llu\n",
+						def->name, w, 
+						(unsigned long long)v[0]);
+				continue;
+			}
+			for (d = 0; d < 2; d++) {
+				mbuf_printf(m, "%s{worker=\"%d\",%s=\"%s\"} %llu\n",
+						def->name, w,
+						(def->split == PER_DIR) ? 
+						"dir" : "side",
+						(def->split == PER_DIR) ?
+						dir_names[d] : side_names[d],
+						(unsigned long long)v[d]);
+			}
+		}
+	}
+}
+
+static void
+render_hists(struct mbuf *m, struct metrics_src *src, 
+		struct relay_stats *rs)
+{
+	struct hist *h;
+	char labels[32];
+	int w;
+	int d;
+
+	h = (struct hist *)calloc(1, sizeof(*h));
+	if (!h) {
+		m->err = 1;
+		return;
+	}
+	family(m, "tap_forward_latency_seconds", "histogram",
+			"Time from a read to having sent all that was read");
+	for (d = 0; d < 2; d++) {
+		memset(h, 0, sizeof(*h));
+		for (w = 0; w < src->cfg->workers; w++) {
+			hist_merge(h, &rs[w].forward[d]);
+		}
+		snprintf(labels, sizeof(labels), "dir=\"%s\"", dir_names[d]);
+		hist_series(m, "tap_forward_latency_seconds", labels, h);
+	}
+	family(m, "tap_connect_latency_seconds", "histogram",
+			"Time taken by upstream connects that succeeded");
+	memset(h, 0, sizeof(*h));
+	for (w = 0; w < src->cfg->workers; w++) {
+		hist_merge(h, &rs[w].connect);
+	}
+	hist_series(m, "tap_connect_latency_seconds", "", h);
+	family(m, "tap_first_byte_latency_seconds", "histogram",
+			"Time from accept to first byte relayed");
+	memset(h, 0, sizeof(*h));
+	for (w = 0; w < src->cfg->workers; w++) {
+		hist_merge(h, &rs[w].ttfb);
+	}
+	hist_series(m, "tap_first_byte_latency_seconds", "", h);
+	free(h);
+}
+
+static void
+render_pools(struct mbuf *m, struct metrics_src *src)
+{
+	struct buf_pool_stats st;
+	int w;
+
+	family(m, "tap_buffer_pool_bytes", "gauge",
+			"Relay buffer memory mapped and in use");
+	for (w = 0; w < src->cfg->workers; w++) {
+		if (!src->workers[w].started) {
+			continue;
+		}
+		buf_pool_stats(&src->workers[w].loop.pool, &st);
+		mbuf_printf(m, "tap_buffer_pool_bytes{worker=\"%d\","
+				"state=\"mapped\"} %zu\n", w, st.mapped_bytes);
+		mbuf_printf(m, "tap_buffer_pool_bytes{worker=\"%d\","
+				"state=\"used\"} %zu\n", w, st.used_bytes);
+	}
+}
+
+/*
+ * Replacements per rule of current ruleset, summed over workers.
+ * Rules are numbered from 0 in the order they were defined.
+ */
+static void
+render_rules(struct mbuf *m, struct metrics_src *src)
+{
+	struct rules_domain *dom;
+	struct rules_gen *gen;
+	struct stream_rule *rule;
+	uint64_t hits;
+	uint32_t r;
+	int w;
+
+	dom = src->cfg->rules;
+	rules_domain_online(dom, src->reader);
+	/* Current generation stays around until we're offline */
+	gen = __atomic_load_n(&dom->cur, __ATOMIC_SEQ_CST);
+	if (gen && gen->hits) {
+		family(m, "tap_rule_hits_total", "counter",
+				"Replacements made by rule");
+		for (r = 0; r < gen->rules.nrules; r++) {
+			hits = 0;
+			for (w = 0; w < src->cfg->workers; w++) {
+				hits += __atomic_load_n(
+					&rules_gen_hits(gen, w)[r],
+					__ATOMIC_RELAXED);
+			}
+			mbuf_printf(m, "tap_rule_hits_total{rule=\"%u\"} %llu\n",
+					r, (unsigned long long)hits);
+		}
+		family(m, "tap_rule_rewrite_bytes_total", "counter",
+				"Bytes sent in place of matches by rule");
+		for (r = 0; r < gen->rules.nrules; r++) {
+			rule = &gen->rules.rules[r];
+			hits = 0;
+			for (w = 0; w < src->cfg->workers; w++) {
+				hits += __atomic_load_n(
+					&rules_gen_hits(gen, w)[r],
+					__ATOMIC_RELAXED);
+			}
+			mbuf_printf(m, "tap_rule_rewrite_bytes_total{rule=\"%u\"}"
+					" %llu\n", r, 
+					(unsigned long long)(hits * 
+					rule->with_len));
+		}
+	}
+	rules_domain_offline(dom, src->reader);
+}
+
+static void
+render_backends(struct mbuf *m, struct backend_set *set)
+{
+	struct backend *b;
+	uint64_t until;
+	int up;
+	int i;
+
+	family(m, "tap_backend_up", "gauge",
+			"Backend is neither down nor ejected");
+	for (i = 0; i < set->n; i++) {
+		b = &set->b[i];
+		until = __atomic_load_n(&b->ejected_until, __ATOMIC_RELAXED);
+		up = !__atomic_load_n(&b->down, __ATOMIC_RELAXED) &&
+			(until <= backend_now_ms());
+		mbuf_printf(m, "tap_backend_up{backend=\"%s\"} %d\n", b->name,
+				up);
+	}
+	family(m, "tap_backend_active", "gauge",
+			"Connections to backend");
+	for (i = 0; i < set->n; i++) {
+		mbuf_printf(m, "tap_backend_active{backend=\"%s\"} %u\n", 
+				set->b[i].name, __atomic_load_n(
+				&set->b[i].active, __ATOMIC_RELAXED));
+	}
+	family(m, "tap_backend_connections_total", "counter",
+			"Connections backend was picked for");
+	for (i = 0; i < set->n; i++) {
+		mbuf_printf(m, "tap_backend_connections_total{backend=\"%s\"} "
+				"%llu\n", set->b[i].name, 
+				(unsigned long long)__atomic_load_n(
+				&set->b[i].conns, __ATOMIC_RELAXED));
+	}
+	family(m, "tap_backend_connect_failures_total", "counter",
+			"Connects to backend that failed");
+	for (i = 0; i < set->n; i++) {
+		mbuf_printf(m, "tap_backend_connect_failures_total{backend="
+				"\"%s\"} %llu\n", set->b[i].name, 
+				(unsigned long long)__atomic_load_n(
+				&set->b[i].failed, __ATOMIC_RELAXED));
+	}
+	family(m, "tap_backend_ejections_total", "counter",
+			"Times backend was ejected for failing connects");
+	for (i = 0; i < set->n; i++) {
+		mbuf_printf(m, "tap_backend_ejections_total{backend=\"%s\"} "
+				"%llu\n", set->b[i].name, 
+				(unsigned long long)__atomic_load_n(
+				&set->b[i].ejections, __ATOMIC_RELAXED));
+	}
+}
+
+/* Counters of capture writers, off is in struct capture_writer */
+static const struct metric_def capture_metrics[] = {
+	{ "tap_capture_packets_total", "counter",
+		"Packets written to capture files",
+		offsetof(struct capture_writer, packets), 0 },
+	{ "tap_capture_bytes_total", "counter",
+		"Payload bytes written to capture files",
+		offsetof(struct capture_writer, bytes), 0 },
+	{ "tap_capture_dropped_total", "counter",
+		"Packets dropped as no capture file was ready",
+		offsetof(struct capture_writer, dropped), 0 },
+};
+
+static void
+render_capture(struct mbuf *m, struct capture *cap)
+{
+	const struct metric_def *def;
+	uint64_t *v;
+	size_t i;
+	int w;
+
+	for (i = 0; i < sizeof(capture_metrics) / sizeof(*def); i++) {
+		def = &capture_metrics[i];
+		family(m, def->name, def->type, def->help);
+		for (w = 0; w < cap->nwriters; w++) {
+			v = (uint64_t *)((char *)&cap->w[w] + def->off);
+			mbuf_printf(m, "%s{worker=\"%d\"} %llu\n", def->name,
+					w, (unsigned long long)__atomic_load_n(
+					v, __ATOMIC_RELAXED));
+		}
+	}
+}
+
+static void
+render_log(struct mbuf *m)
+{
+	struct log_stats st;
+
+	log_get_stats(&st);
+	family(m, "tap_log_dropped_total", "counter",
+			"Log messages dropped as their ring was full");
+	mbuf_printf(m, "tap_log_dropped_total %llu\n",
+			(unsigned long long)st.dropped);
+	family(m, "tap_log_suppressed_total", "counter",
+			"Log messages over rate limit of their call site");
+	mbuf_printf(m, "tap_log_suppressed_total %llu\n",
+			(unsigned long long)st.suppressed);
+}
+
+int
+metrics_render(struct mbuf *m, void *arg)
+{
+	struct metrics_src *src;
+	struct relay_stats *rs;
+	int w;
+
+	src = (struct metrics_src *)arg;
+	rs = (struct relay_stats *)calloc((size_t)src->cfg->workers, 
+			sizeof(*rs));
+	if (!rs) {
+		return -1;
+	}
+	for (w = 0; w < src->cfg->workers; w++) {
+		if (src->workers[w].started) {
+			ev_loop_stats(&src->workers[w].loop, &rs[w]);
+		}
+	}
+	render_workers(m, src, rs);
+	render_hists(m, src, rs);
+	free(rs);
+	render_pools(m, src);
+	if (src->cfg->rules) {
+		render_rules(m, src);
+	}
+	if (src->cfg->backends) {
+		render_backends(m, src->cfg->backends);
+	}
+	if (src->capture) {
+		render_capture(m, src->capture);
+	}
+	render_log(m);
+	return m->err ? -1 : 0;
+}
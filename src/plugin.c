@@ -0,0 +1,111 @@
+/*
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2022, k4m1
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIA LDAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVE RCAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Loading interception plugins. Plugin exports one function that gives
+ * its table of functions, table starts with the ABI version it was
+ * built for and its size, so functions added to the end later don't
+ * break plugins built before them.
+ */
+#include <sys/types.h>
+
+#include <dlfcn.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <log.h>
+#include <plugin.h>
+#include <tap_plugin.h>
+
+/* Smallest table we understand, the one of TAP_PLUGIN_ABI 1 */
+#define PLUGIN_TABLE_MIN (offsetof(struct tap_plugin, data) + \
+		sizeof(((struct tap_plugin *)0)->data))
+
+int
+plugin_load(struct plugin *p, const char *path, const char *arg)
+{
+	tap_plugin_entry_fn entry;
+	const struct tap_plugin *ops;
+	char local[4096];
+
+	memset(p, 0, sizeof(*p));
+	/* dlopen() searches library paths for names without a slash */
+	if (!strchr(path, '/')) {
+		snprintf(local, sizeof(local), "./%s", path);
+		path = local;
+	}
+	p->handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+	if (!p->handle) {
+		ERR("Failed to load plugin: %s\n", dlerror());
+		return -1;
+	}
+	*(void **)&entry = dlsym(p->handle, TAP_PLUGIN_ENTRY);
+	if (!entry) {
+		ERR("Plugin %s has no %s()\n", path, TAP_PLUGIN_ENTRY);
+		dlclose(p->handle);
+		return -1;
+	}
+	ops = entry();
+	if (!ops || !ops->abi || (ops->abi > TAP_PLUGIN_ABI) || 
+			(ops->size < PLUGIN_TABLE_MIN)) {
+		ERR("Plugin %s is not built for ABI %d or older\n", path, 
+				TAP_PLUGIN_ABI);
+		dlclose(p->handle);
+		return -1;
+	}
+	if (!PLUGIN_HAS(ops, data)) {
+		ERR("Plugin %s has no data function\n", path);
+		dlclose(p->handle);
+		return -1;
+	}
+	if (PLUGIN_HAS(ops, init) && (ops->init(arg, &p->global) < 0)) {
+		ERR("Plugin %s failed to initialise\n", path);
+		dlclose(p->handle);
+		return -1;
+	}
+	p->ops = ops;
+	LOG("Loaded plugin %s\n", ops->name ? ops->name : path);
+	return 0;
+}
+
+void
+plugin_unload(struct plugin *p)
+{
+	if (!p->ops) {
+		return;
+	}
+	if (PLUGIN_HAS(p->ops, fini)) {
+		p->ops->fini(p->global);
+	}
+	dlclose(p->handle);
+	memset(p, 0, sizeof(*p));
+}
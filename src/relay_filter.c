@@ -0,0 +1,107 @@
+/*
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2022, k4m1
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIA LDAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVE RCAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Filter deciding which reads the embedder's function sees. Patterns go
+ * through the same automaton as rules, with state kept per direction
+ * the way rules keep theirs.
+ */
+#include <sys/types.h>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <log.h>
+#include <ac_match.h>
+#include <relay_filter.h>
+
+int
+relay_filter_init(struct relay_filter *f, unsigned char **patterns,
+		size_t *lens, int cnt, relay_filter_fn fn, void *arg)
+{
+	int i;
+
+	memset(f, 0, sizeof(*f));
+	f->fn = fn;
+	f->arg = arg;
+	if (!patterns || (cnt <= 0)) {
+		return 0;
+	}
+	for (i = 0; i < cnt; i++) {
+		if (!lens[i]) {
+			ERR("Filter pattern %d is empty\n", i);
+			return -1;
+		}
+	}
+	if (ac_build(&f->ac, patterns, lens, (uint32_t)cnt) < 0) {
+		ERR("Failed to build filter patterns\n");
+		return -1;
+	}
+	f->npatterns = cnt;
+	return 0;
+}
+
+/*
+ * Any match will do. Scan goes on to the end of read anyway, so state
+ * is right for the next one.
+ */
+static int
+filter_hit(void *arg, uint32_t pattern, size_t end)
+{
+	(void)pattern;
+	(void)end;
+	*(int *)arg = 1;
+	return 0;
+}
+
+int
+relay_filter_match(struct relay_filter *f, uint32_t *state, 
+		unsigned char *buf, size_t len)
+{
+	int hit;
+
+	if (!f->npatterns) {
+		return 1;
+	}
+	hit = 0;
+	ac_scan(&f->ac, state, buf, len, &filter_hit, &hit);
+	return hit;
+}
+
+void
+relay_filter_free(struct relay_filter *f)
+{
+	if (f->npatterns) {
+		ac_free(&f->ac);
+	}
+	f->npatterns = 0;
+}
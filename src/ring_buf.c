@@ -0,0 +1,218 @@
+/*
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2022, k4m1
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIA LDAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVE RCAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Byte ring buffer used to queue data waiting for a slow peer.
+ */
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <buf_pool.h>
+#include <ring_buf.h>
+
+#define RING_MIN_SIZE 4096
+
+static unsigned char *
+ring_alloc(struct ring_buf *r, size_t size)
+{
+	if (r->pool) {
+		return (unsigned char *)buf_pool_get(r->pool, size);
+	}
+	return (unsigned char *)malloc(size);
+}
+
+static void
+ring_dealloc(struct ring_buf *r)
+{
+	if (!r->data) {
+		return;
+	}
+	if (r->pool) {
+		buf_pool_put(r->pool, r->data, r->size);
+	} else {
+		free(r->data);
+	}
+}
+
+static size_t
+roundup_pow2(size_t n)
+{
+	size_t p;
+
+	for (p = RING_MIN_SIZE; p < n; p <<= 1);
+	return p;
+}
+
+/*
+ * Move data to new buffer of new_size bytes, starting from offset 0
+ *
+ * Returns:
+ * 	0 on success or -1 on error
+ */
+static int
+ring_resize(struct ring_buf *r, size_t new_size)
+{
+	unsigned char *data;
+	struct iovec iov[2];
+	size_t used;
+	int cnt;
+	int i;
+
+	data = ring_alloc(r, new_size);
+	if (!data) {
+		return -1;
+	}
+	used = 0;
+	cnt = ring_peek_iov(r, iov, ring_used(r));
+	for (i = 0; i < cnt; i++) {
+		memcpy(&data[used], iov[i].iov_base, iov[i].iov_len);
+		used += iov[i].iov_len;
+	}
+	ring_dealloc(r);
+	r->data = data;
+	r->size = new_size;
+	r->head = 0;
+	r->tail = used;
+	return 0;
+}
+
+unsigned char *
+ring_reserve(struct ring_buf *r, size_t want, size_t max_size, size_t *len)
+{
+	size_t free_bytes;
+	size_t new_size;
+	size_t off;
+	size_t contig;
+
+	if (!r->data) {
+		if (ring_resize(r, roundup_pow2(want)) < 0) {
+			return 0;
+		}
+	}
+	free_bytes = r->size - ring_used(r);
+	if ((free_bytes < want) && ((r->size << 1) <= max_size)) {
+		new_size = r->size << 1;
+		while ((new_size < (ring_used(r) + want)) && 
+				((new_size << 1) <= max_size)) {
+			new_size <<= 1;
+		}
+		if (ring_resize(r, new_size) < 0) {
+			return 0;
+		}
+		free_bytes = r->size - ring_used(r);
+	}
+	if (!free_bytes) {
+		return 0;
+	}
+	if (!ring_used(r)) {
+		/* Start from beginning to get the biggest region */
+		r->head = 0;
+		r->tail = 0;
+	}
+	off = r->tail & (r->size - 1);
+	contig = r->size - off;
+	if (contig > free_bytes) {
+		contig = free_bytes;
+	}
+	*len = (contig < want) ? contig : want;
+	return &r->data[off];
+}
+
+void
+ring_commit(struct ring_buf *r, size_t len)
+{
+	r->tail += len;
+}
+
+size_t
+ring_push(struct ring_buf *r, const void *src, size_t len, size_t max_size)
+{
+	unsigned char *dst;
+	size_t done;
+	size_t n;
+
+	for (done = 0; done < len; done += n) {
+		dst = ring_reserve(r, len - done, max_size, &n);
+		if (!dst) {
+			break;
+		}
+		memcpy(dst, (const unsigned char *)src + done, n);
+		ring_commit(r, n);
+	}
+	return done;
+}
+
+int
+ring_peek_iov(struct ring_buf *r, struct iovec iov[2], size_t max)
+{
+	size_t used;
+	size_t off;
+	size_t first;
+
+	used = ring_used(r);
+	if (used > max) {
+		used = max;
+	}
+	if (!used) {
+		return 0;
+	}
+	off = r->head & (r->size - 1);
+	first = r->size - off;
+	if (first >= used) {
+		iov[0].iov_base = &r->data[off];
+		iov[0].iov_len = used;
+		return 1;
+	}
+	iov[0].iov_base = &r->data[off];
+	iov[0].iov_len = first;
+	iov[1].iov_base = r->data;
+	iov[1].iov_len = used - first;
+	return 2;
+}
+
+void
+ring_consume(struct ring_buf *r, size_t len)
+{
+	r->head += len;
+}
+
+void
+ring_free(struct ring_buf *r)
+{
+	ring_dealloc(r);
+	r->data = 0;
+	r->size = 0;
+	r->head = 0;
+	r->tail = 0;
+}
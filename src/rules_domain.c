@@ -0,0 +1,195 @@
+/*
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2022, k4m1
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIA LDAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVE RCAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Published ruleset that can be replaced while workers run.
+ *
+ * Readers (event loops) pin the current generation with an atomic
+ * reference when they accept a connection, and announce a quiescent
+ * point once per loop iteration. The writer swaps the pointer, and drops
+ * the reference the domain holds on the old generation only after every
+ * reader has announced a quiescent point with an epoch from after the
+ * swap, or is offline. Relaying itself only follows the pinned pointer.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <log.h>
+#include <rules_domain.h>
+#include <stream_match.h>
+
+int
+rules_domain_init(struct rules_domain *dom, int nreaders)
+{
+	int i;
+
+	memset(dom, 0, sizeof(*dom));
+	dom->readers = (struct rules_reader *)aligned_alloc(
+			sizeof(*dom->readers),
+			(size_t)nreaders * sizeof(*dom->readers));
+	if (!dom->readers) {
+		ERR("Out of memory\n");
+		return -1;
+	}
+	for (i = 0; i < nreaders; i++) {
+		dom->readers[i].seen = RULES_OFFLINE;
+	}
+	dom->nreaders = nreaders;
+	return 0;
+}
+
+void
+rules_gen_put(struct rules_gen *gen)
+{
+	if (__atomic_sub_fetch(&gen->refs, 1, __ATOMIC_ACQ_REL)) {
+		return;
+	}
+	stream_rules_free(&gen->rules);
+	free(gen->hits);
+	free(gen);
+}
+
+struct rules_gen *
+rules_domain_get(struct rules_domain *dom)
+{
+	struct rules_gen *gen;
+
+	/* Grace period of an old gen can't end before we're offline */
+	gen = __atomic_load_n(&dom->cur, __ATOMIC_SEQ_CST);
+	if (gen) {
+		__atomic_add_fetch(&gen->refs, 1, __ATOMIC_RELAXED);
+	}
+	return gen;
+}
+
+int
+rules_domain_publish(struct rules_domain *dom, struct stream_rules *rules)
+{
+	struct rules_gen *gen;
+	struct rules_gen *old;
+
+	gen = (struct rules_gen *)calloc(1, sizeof(*gen));
+	if (!gen) {
+		ERR("Out of memory\n");
+		stream_rules_free(rules);
+		return -1;
+	}
+	gen->rules = *rules;
+	gen->refs = 1;
+	/* Counters of readers don't share cache lines */
+	gen->stride = ((size_t)rules->nrules + 7) & ~(size_t)7;
+	if (gen->stride) {
+		gen->hits = (uint64_t *)aligned_alloc(64, gen->stride * 
+				(size_t)dom->nreaders * sizeof(uint64_t));
+		if (!gen->hits) {
+			ERR("Out of memory\n");
+			stream_rules_free(rules);
+			free(gen);
+			return -1;
+		}
+		memset(gen->hits, 0, gen->stride * (size_t)dom->nreaders * 
+				sizeof(uint64_t));
+	}
+	old = __atomic_exchange_n(&dom->cur, gen, __ATOMIC_SEQ_CST);
+	if (old) {
+		old->retired_at = __atomic_add_fetch(&dom->epoch, 1,
+				__ATOMIC_SEQ_CST);
+		old->next = dom->retired;
+		dom->retired = old;
+	}
+	return 0;
+}
+
+/*
+ * Returns:
+ * 	oldest epoch a reader may still be using
+ */
+static uint64_t
+rules_domain_min_seen(struct rules_domain *dom)
+{
+	uint64_t min;
+	uint64_t seen;
+	int i;
+
+	min = RULES_OFFLINE;
+	for (i = 0; i < dom->nreaders; i++) {
+		seen = __atomic_load_n(&dom->readers[i].seen,
+				__ATOMIC_SEQ_CST);
+		if (seen < min) {
+			min = seen;
+		}
+	}
+	return min;
+}
+
+int
+rules_domain_reclaim(struct rules_domain *dom)
+{
+	struct rules_gen **pp;
+	struct rules_gen *gen;
+	uint64_t min;
+	int waiting;
+
+	if (!dom->retired) {
+		return 0;
+	}
+	min = rules_domain_min_seen(dom);
+	waiting = 0;
+	pp = &dom->retired;
+	while (*pp) {
+		gen = *pp;
+		if (gen->retired_at > min) {
+			pp = &gen->next;
+			waiting++;
+			continue;
+		}
+		*pp = gen->next;
+		rules_gen_put(gen);
+	}
+	return waiting;
+}
+
+void
+rules_domain_destroy(struct rules_domain *dom)
+{
+	struct rules_gen *gen;
+
+	while ((gen = dom->retired)) {
+		dom->retired = gen->next;
+		rules_gen_put(gen);
+	}
+	if (dom->cur) {
+		rules_gen_put(dom->cur);
+	}
+	free(dom->readers);
+	memset(dom, 0, sizeof(*dom));
+}
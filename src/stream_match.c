@@ -0,0 +1,656 @@
+/*
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2022, k4m1
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIA LDAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVE RCAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Streaming pattern replacement over data queued to a ring buffer
+ */
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <log.h>
+#include <stream_match.h>
+
+#define STREAM_EDITS_MIN 16
+
+/* State of one stream_scan() call */
+struct scan_ctx {
+	struct stream_rules *rules;
+	struct stream_ctx *ctx;
+	struct ring_buf *r;
+	int dir;
+	uint64_t base; 		/* stream offset of segment being scanned */
+	int err;
+};
+
+/* State of one stream_scan_datagram() call */
+struct dgram_ctx {
+	struct stream_rules *rules;
+	struct stream_ctx *ctx;
+	int dir;
+	unsigned char *data;
+	struct iovec *iov;
+	int max;
+	int cnt;
+	size_t sent; 		/* data before this is described already */
+	int err;
+};
+
+/*
+ * Identity of rule, FNV-1a over lengths & bytes of pattern and
+ * replacement
+ */
+static uint64_t
+rule_id(struct stream_rule_def *def)
+{
+	uint64_t parts[2];
+	unsigned char *p;
+	uint64_t h;
+	size_t len;
+	size_t i;
+	int n;
+
+	parts[0] = def->what_len;
+	parts[1] = def->with_len;
+	h = 0xcbf29ce484222325ull;
+	for (n = 0; n < 2; n++) {
+		p = (unsigned char *)&parts[n];
+		for (i = 0; i < sizeof(parts[n]); i++) {
+			h = (h ^ p[i]) * 0x100000001b3ull;
+		}
+		p = n ? def->with : def->what;
+		len = n ? def->with_len : def->what_len;
+		for (i = 0; i < len; i++) {
+			h = (h ^ p[i]) * 0x100000001b3ull;
+		}
+	}
+	return h;
+}
+
+static int
+counter_cmp(const void *a, const void *b)
+{
+	uint64_t x;
+	uint64_t y;
+
+	x = ((const struct stream_counter *)a)->id;
+	y = ((const struct stream_counter *)b)->id;
+	return (x > y) - (x < y);
+}
+
+/*
+ * Build automaton of rules of one direction
+ *
+ * Returns:
+ * 	0 on success or -1 on error
+ */
+static int
+stream_rules_dir(struct stream_rules *rules, struct stream_rule_def *defs,
+		uint32_t cnt, int dir, unsigned char **pats, size_t *lens)
+{
+	uint32_t i;
+	uint32_t n;
+
+	n = 0;
+	for (i = 0; i < cnt; i++) {
+		if (!(defs[i].dirs & (1 << dir))) {
+			continue;
+		}
+		rules->rule_of[dir][n] = i;
+		pats[n] = defs[i].what;
+		lens[n] = defs[i].what_len;
+		n++;
+	}
+	return ac_build(&rules->ac[dir], pats, lens, n);
+}
+
+int
+stream_rules_build(struct stream_rules *rules, struct stream_rule_def *defs,
+		uint32_t cnt)
+{
+	struct stream_rule *rule;
+	unsigned char **pats;
+	size_t with_total;
+	size_t ndir[2];
+	size_t *lens;
+	size_t size;
+	uint32_t i;
+	int dir;
+	int stat;
+
+	memset(rules, 0, sizeof(*rules));
+	with_total = 0;
+	ndir[0] = 0;
+	ndir[1] = 0;
+	for (i = 0; i < cnt; i++) {
+		with_total += defs[i].with_len;
+		for (dir = 0; dir < 2; dir++) {
+			if (defs[i].dirs & (1 << dir)) {
+				ndir[dir]++;
+			}
+		}
+	}
+	/* Rules, then pattern maps of both directions, then replacements */
+	size = (cnt * sizeof(*rules->rules)) +
+		((ndir[0] + ndir[1]) * sizeof(uint32_t)) + with_total;
+	rules->rules = (struct stream_rule *)malloc(size ? size : 1);
+	pats = (unsigned char **)malloc((cnt ? cnt : 1) * sizeof(*pats));
+	lens = (size_t *)malloc((cnt ? cnt : 1) * sizeof(*lens));
+	stat = -1;
+	if (!rules->rules || !pats || !lens) {
+		ERR("stream_rules_build: out of memory\n");
+		goto out;
+	}
+	rules->nrules = cnt;
+	rules->rule_of[0] = (uint32_t *)&rules->rules[cnt];
+	rules->rule_of[1] = &rules->rule_of[0][ndir[0]];
+	rules->with = (unsigned char *)&rules->rule_of[1][ndir[1]];
+
+	with_total = 0;
+	for (i = 0; i < cnt; i++) {
+		rule = &rules->rules[i];
+		if (defs[i].with_len) {
+			memcpy(&rules->with[with_total], defs[i].with,
+					defs[i].with_len);
+		}
+		rule->with_off = with_total;
+		rule->with_len = defs[i].with_len;
+		with_total += defs[i].with_len;
+		rule->scope_start = defs[i].scope_off;
+		rule->scope_end = UINT64_MAX;
+		if (defs[i].scope_len) {
+			rule->scope_end = defs[i].scope_off + defs[i].scope_len;
+		}
+		rule->limit = defs[i].limit;
+		rule->counter = defs[i].limit ? rules->ncounters++ : 0;
+		rule->id = rule_id(&defs[i]);
+	}
+	if (rules->ncounters) {
+		rules->counters = (struct stream_counter *)malloc(
+				rules->ncounters * sizeof(*rules->counters));
+		if (!rules->counters) {
+			ERR("stream_rules_build: out of memory\n");
+			goto out;
+		}
+		for (i = 0; i < cnt; i++) {
+			rule = &rules->rules[i];
+			if (rule->limit) {
+				rules->counters[rule->counter].id = rule->id;
+				rules->counters[rule->counter].counter =
+					rule->counter;
+			}
+		}
+		qsort(rules->counters, rules->ncounters,
+				sizeof(*rules->counters), &counter_cmp);
+	}
+	for (dir = 0; dir < 2; dir++) {
+		if (stream_rules_dir(rules, defs, cnt, dir, pats, lens) < 0) {
+			goto out;
+		}
+	}
+	stat = 0;
+out:
+	free(pats);
+	free(lens);
+	if (stat < 0) {
+		stream_rules_free(rules);
+	}
+	return stat;
+}
+
+void
+stream_rules_free(struct stream_rules *rules)
+{
+	ac_free(&rules->ac[0]);
+	ac_free(&rules->ac[1]);
+	free(rules->rules);
+	free(rules->counters);
+	memset(rules, 0, sizeof(*rules));
+}
+
+/*
+ * Queue edit to end of ctx->edits
+ *
+ * Returns:
+ * 	0 on success or -1 on error
+ */
+static int
+stream_edit_add(struct stream_ctx *ctx, uint64_t start, size_t olen,
+		unsigned char *with, size_t wlen)
+{
+	struct stream_edit *edits;
+	size_t cap;
+
+	if (ctx->nedits == ctx->cap) {
+		if (ctx->first) {
+			/* Reuse room of edits sent already */
+			memmove(ctx->edits, &ctx->edits[ctx->first],
+					(ctx->nedits - ctx->first) *
+					sizeof(*ctx->edits));
+			ctx->nedits -= ctx->first;
+			ctx->first = 0;
+		} else {
+			cap = ctx->cap ? (ctx->cap << 1) : STREAM_EDITS_MIN;
+			edits = (struct stream_edit *)realloc(ctx->edits,
+					cap * sizeof(*edits));
+			if (!edits) {
+				return -1;
+			}
+			ctx->edits = edits;
+			ctx->cap = cap;
+		}
+	}
+	ctx->edits[ctx->nedits].start = start;
+	ctx->edits[ctx->nedits].olen = olen;
+	ctx->edits[ctx->nedits].with = with;
+	ctx->edits[ctx->nedits].wlen = wlen;
+	ctx->nedits++;
+	return 0;
+}
+
+/*
+ * Check if match of rule from stream offset start to end is replaced,
+ * and count it if it is.
+ *
+ * Returns:
+ * 	1 if it's replaced, 0 if not, -1 if out of memory
+ */
+static int
+rule_take(struct stream_rules *rules, struct stream_ctx *ctx,
+		struct stream_rule *rule, uint64_t start, uint64_t end)
+{
+	uint64_t *hits;
+
+	/* Overlaps with what we replaced already */
+	if (start < ctx->done) {
+		return 0;
+	}
+	if ((start < rule->scope_start) || (end > rule->scope_end)) {
+		return 0;
+	}
+	if (rule->limit) {
+		/* Only connections that hit limited rules need counters */
+		if (!ctx->counts) {
+			ctx->counts = (uint32_t *)calloc(rules->ncounters,
+					sizeof(uint32_t));
+			if (!ctx->counts) {
+				return -1;
+			}
+		}
+		if (ctx->counts[rule->counter] >= rule->limit) {
+			return 0;
+		}
+		ctx->counts[rule->counter]++;
+	}
+	hits = ctx->hits;
+	if (hits) {
+		/* Only this thread writes, others may read */
+		hits += rule - rules->rules;
+		__atomic_store_n(hits, *hits + 1, __ATOMIC_RELAXED);
+	}
+	ctx->done = end;
+	return 1;
+}
+
+static int
+scan_match(void *arg, uint32_t pattern, size_t end)
+{
+	struct stream_rule *rule;
+	struct scan_ctx *sc;
+	unsigned char *with;
+	uint64_t start;
+	size_t wlen;
+	size_t len;
+	size_t pos;
+	size_t i;
+	int stat;
+
+	sc = (struct scan_ctx *)arg;
+	rule = &sc->rules->rules[sc->rules->rule_of[sc->dir][pattern]];
+	len = sc->rules->ac[sc->dir].plen[pattern];
+	start = sc->base + end - len;
+	stat = rule_take(sc->rules, sc->ctx, rule, start, sc->base + end);
+	if (stat <= 0) {
+		sc->err = (stat < 0);
+		return stat;
+	}
+	with = &sc->rules->with[rule->with_off];
+	wlen = rule->with_len;
+	if (wlen != len) {
+		if (stream_edit_add(sc->ctx, start, len, with, wlen) < 0) {
+			sc->err = 1;
+			return -1;
+		}
+		return 0;
+	}
+	/* Ring position of stream offset, what's not sent is still there */
+	pos = sc->r->tail - (size_t)(sc->ctx->pos - start);
+	for (i = 0; i < len; i++) {
+		sc->r->data[(pos + i) & (sc->r->size - 1)] = with[i];
+	}
+	return 0;
+}
+
+int
+stream_scan(struct stream_rules *rules, struct stream_ctx *ctx, int dir,
+		struct ring_buf *r, size_t len)
+{
+	struct scan_ctx sc;
+	size_t pos;
+	size_t off;
+	size_t seg;
+
+	if (!rules->ac[dir].npatterns) {
+		/* Nothing to match, only keep count for stream_peek_iov() */
+		ctx->pos += len;
+		return 0;
+	}
+	sc.rules = rules;
+	sc.ctx = ctx;
+	sc.r = r;
+	sc.dir = dir;
+	sc.err = 0;
+	/* Stream offsets are counted to the end before scanning */
+	sc.base = ctx->pos;
+	ctx->pos += len;
+	pos = r->tail - len;
+	while (len) {
+		off = pos & (r->size - 1);
+		seg = r->size - off;
+		if (seg > len) {
+			seg = len;
+		}
+		ac_scan(&rules->ac[dir], &ctx->state, &r->data[off], seg,
+				&scan_match, &sc);
+		if (sc.err) {
+			ERR("stream_scan: out of memory\n");
+			return -1;
+		}
+		sc.base += seg;
+		pos += seg;
+		len -= seg;
+	}
+	ctx->held = ac_hold(&rules->ac[dir], ctx->state);
+	return 0;
+}
+
+static int
+dgram_add(struct dgram_ctx *dc, void *base, size_t len)
+{
+	if (!len) {
+		return 0;
+	}
+	if (dc->cnt == dc->max) {
+		return -1;
+	}
+	dc->iov[dc->cnt].iov_base = base;
+	dc->iov[dc->cnt].iov_len = len;
+	dc->cnt++;
+	return 0;
+}
+
+static int
+dgram_match(void *arg, uint32_t pattern, size_t end)
+{
+	struct stream_rule *rule;
+	struct dgram_ctx *dc;
+	size_t len;
+	int stat;
+
+	dc = (struct dgram_ctx *)arg;
+	rule = &dc->rules->rules[dc->rules->rule_of[dc->dir][pattern]];
+	len = dc->rules->ac[dc->dir].plen[pattern];
+	stat = rule_take(dc->rules, dc->ctx, rule, end - len, end);
+	if (stat <= 0) {
+		dc->err = (stat < 0);
+		return stat;
+	}
+	if ((dgram_add(dc, &dc->data[dc->sent], end - len - dc->sent) < 0) ||
+			(dgram_add(dc, &dc->rules->with[rule->with_off],
+				   rule->with_len) < 0)) {
+		dc->err = 1;
+		return -1;
+	}
+	dc->sent = end;
+	return 0;
+}
+
+int
+stream_scan_datagram(struct stream_rules *rules, struct stream_ctx *ctx,
+		int dir, unsigned char *data, size_t len, struct iovec *iov,
+		int max)
+{
+	struct dgram_ctx dc;
+	uint32_t state;
+
+	dc.rules = rules;
+	dc.ctx = ctx;
+	dc.dir = dir;
+	dc.data = data;
+	dc.iov = iov;
+	dc.max = max;
+	dc.cnt = 0;
+	dc.sent = 0;
+	dc.err = 0;
+	/* Scopes are offsets of datagram, nothing continues from last one */
+	ctx->done = 0;
+	state = AC_START;
+	if (rules->ac[dir].npatterns) {
+		ac_scan(&rules->ac[dir], &state, data, len, &dgram_match, &dc);
+	}
+	if (dc.err || (dgram_add(&dc, &data[dc.sent], len - dc.sent) < 0)) {
+		return -1;
+	}
+	return dc.cnt;
+}
+
+/*
+ * Describe len bytes from off bytes after start of ring
+ *
+ * Returns:
+ * 	amount of iovecs filled in, 1 or 2
+ */
+static int
+ring_slice(struct ring_buf *r, size_t off, size_t len, struct iovec *iov)
+{
+	size_t pos;
+	size_t first;
+
+	pos = (r->head + off) & (r->size - 1);
+	first = r->size - pos;
+	iov[0].iov_base = &r->data[pos];
+	if (first >= len) {
+		iov[0].iov_len = len;
+		return 1;
+	}
+	iov[0].iov_len = first;
+	iov[1].iov_base = r->data;
+	iov[1].iov_len = len - first;
+	return 2;
+}
+
+int
+stream_peek_iov(struct stream_ctx *ctx, struct ring_buf *r,
+		struct iovec *iov, int max)
+{
+	struct stream_edit *e;
+	uint64_t head;
+	uint64_t limit;
+	uint64_t pos;
+	uint64_t next;
+	size_t skip;
+	size_t i;
+	int cnt;
+
+	head = ctx->pos - ring_used(r);
+	limit = ctx->pos - ctx->held;
+	pos = head;
+	i = ctx->first;
+	cnt = 0;
+	/* A slice of ring may take 2 */
+	while (cnt + 2 <= max) {
+		if ((i < ctx->nedits) && (ctx->edits[i].start == pos)) {
+			e = &ctx->edits[i];
+			/* Original bytes must not be held back anymore */
+			if (e->start + e->olen > limit) {
+				break;
+			}
+			skip = (i == ctx->first) ? ctx->partial : 0;
+			if (e->wlen > skip) {
+				iov[cnt].iov_base = &e->with[skip];
+				iov[cnt].iov_len = e->wlen - skip;
+				cnt++;
+			}
+			pos += e->olen;
+			i++;
+			continue;
+		}
+		next = limit;
+		if ((i < ctx->nedits) && (ctx->edits[i].start < next)) {
+			next = ctx->edits[i].start;
+		}
+		if (next <= pos) {
+			break;
+		}
+		cnt += ring_slice(r, (size_t)(pos - head), (size_t)(next - pos),
+				&iov[cnt]);
+		pos = next;
+	}
+	return cnt;
+}
+
+void
+stream_consume(struct stream_ctx *ctx, struct ring_buf *r, size_t len)
+{
+	struct stream_edit *e;
+	uint64_t head;
+	uint64_t limit;
+	uint64_t next;
+	size_t take;
+
+	limit = ctx->pos - ctx->held;
+	for (;;) {
+		head = ctx->pos - ring_used(r);
+		if ((ctx->first < ctx->nedits) &&
+				(ctx->edits[ctx->first].start == head)) {
+			e = &ctx->edits[ctx->first];
+			if (e->start + e->olen > limit) {
+				break;
+			}
+			take = e->wlen - ctx->partial;
+			if (take > len) {
+				take = len;
+			}
+			ctx->partial += take;
+			len -= take;
+			if (ctx->partial < e->wlen) {
+				break;
+			}
+			/* Replacement is out, drop what it replaced */
+			ring_consume(r, e->olen);
+			ctx->partial = 0;
+			ctx->first++;
+			continue;
+		}
+		next = limit;
+		if ((ctx->first < ctx->nedits) &&
+				(ctx->edits[ctx->first].start < next)) {
+			next = ctx->edits[ctx->first].start;
+		}
+		take = (next > head) ? (size_t)(next - head) : 0;
+		if (take > len) {
+			take = len;
+		}
+		if (!take) {
+			break;
+		}
+		ring_consume(r, take);
+		len -= take;
+	}
+	if (ctx->first == ctx->nedits) {
+		ctx->first = 0;
+		ctx->nedits = 0;
+	}
+}
+
+void
+stream_release(struct stream_ctx *ctx)
+{
+	ctx->state = AC_START;
+	ctx->held = 0;
+}
+
+int
+stream_ctx_rebind(struct stream_ctx *ctx, struct stream_rules *from,
+		struct stream_rules *to)
+{
+	struct stream_counter *found;
+	struct stream_counter *c;
+	uint32_t *counts;
+	uint32_t i;
+
+	/* Only directions that hit limited rules have counters */
+	if (!ctx->counts) {
+		return 0;
+	}
+	counts = 0;
+	if (to->ncounters) {
+		counts = (uint32_t *)calloc(to->ncounters, sizeof(uint32_t));
+		if (!counts) {
+			return -1;
+		}
+	}
+	for (i = 0; counts && (i < from->ncounters); i++) {
+		c = &from->counters[i];
+		if (!ctx->counts[c->counter]) {
+			continue;
+		}
+		found = (struct stream_counter *)bsearch(c, to->counters,
+				to->ncounters, sizeof(*c), &counter_cmp);
+		if (found) {
+			counts[found->counter] = ctx->counts[c->counter];
+		}
+	}
+	free(ctx->counts);
+	ctx->counts = counts;
+	return 0;
+}
+
+void
+stream_ctx_free(struct stream_ctx *ctx)
+{
+	free(ctx->edits);
+	free(ctx->counts);
+	memset(ctx, 0, sizeof(*ctx));
+}
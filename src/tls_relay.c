@@ -0,0 +1,461 @@
+/*
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2022, k4m1
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIA LDAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVE RCAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * TLS termination & origination. Clients handshake with tap using the
+ * certificate it was given, and tap handshakes with upstream on its
+ * own, so rules see plaintext both ways. Both run non-blocking on the
+ * sockets of the connection, driven by the same edge-triggered events
+ * as plain ones, and relaying starts once both are done.
+ *
+ * Handshakes are most of the cost of short connections, so sessions
+ * are resumed on both sides. Clients get stateless tickets, and as all
+ * workers share the contexts, a ticket works on any of them. Toward
+ * upstream every worker keeps the latest session each backend gave it,
+ * and offers it when connecting there again.
+ *
+ * With kernel TLS, OpenSSL hands the record layer of a socket to the
+ * kernel after handshake. A socket kernel encrypts is written to as a
+ * plain socket, and once both ends of a direction are plain to us,
+ * passthrough splices it like any other.
+ */
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#include <log.h>
+#include <event_loop.h>
+#include <tls_relay.h>
+
+/* Where SSL of an upstream connection finds its session slot */
+static int tls_slot_idx = -1;
+
+static const char *side_names[2] = { "client", "upstream" };
+
+/*
+ * Log and clear errors OpenSSL queued on this thread
+ */
+static void
+tls_errors(const char *what)
+{
+	char buf[256];
+	unsigned long e;
+
+	while ((e = ERR_get_error())) {
+		ERR_error_string_n(e, buf, sizeof(buf));
+		ERR("%s: %s\n", what, buf);
+	}
+}
+
+/*
+ * Keep latest session backend gave, for next connection to it
+ *
+ * Returns:
+ * 	1 if we kept reference to sess, 0 if not
+ */
+static int
+tls_new_session(SSL *ssl, SSL_SESSION *sess)
+{
+	SSL_SESSION **slot;
+
+	slot = (SSL_SESSION **)SSL_get_ex_data(ssl, tls_slot_idx);
+	if (!slot) {
+		return 0;
+	}
+	if (*slot) {
+		SSL_SESSION_free(*slot);
+	}
+	*slot = sess;
+	return 1;
+}
+
+static SSL_CTX *
+tls_ctx_new(const SSL_METHOD *method, int ktls)
+{
+	uint64_t opts;
+	SSL_CTX *ctx;
+
+	ctx = SSL_CTX_new(method);
+	if (!ctx) {
+		return 0;
+	}
+	SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+	opts = SSL_OP_IGNORE_UNEXPECTED_EOF | SSL_OP_NO_RENEGOTIATION;
+	if (ktls) {
+		opts |= SSL_OP_ENABLE_KTLS;
+	}
+	SSL_CTX_set_options(ctx, opts);
+	/* Ring may have more by the time a write is tried again */
+	SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+			SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+			SSL_MODE_RELEASE_BUFFERS);
+	return ctx;
+}
+
+int
+tls_config_init(struct tls_config *tc, char *cert, char *key, int upstream,
+		char *ca, char *sni, int ktls)
+{
+	memset(tc, 0, sizeof(*tc));
+	tc->sni = sni;
+	if (tls_slot_idx < 0) {
+		tls_slot_idx = SSL_get_ex_new_index(0, 0, 0, 0, 0);
+		if (tls_slot_idx < 0) {
+			tls_errors("SSL_get_ex_new_index()");
+			return -1;
+		}
+	}
+	if (cert) {
+		tc->server = tls_ctx_new(TLS_server_method(), ktls);
+		if (!tc->server ||
+			(SSL_CTX_use_certificate_chain_file(tc->server,
+				cert) != 1) ||
+			(SSL_CTX_use_PrivateKey_file(tc->server,
+				key ? key : cert, SSL_FILETYPE_PEM) != 1) ||
+			(SSL_CTX_check_private_key(tc->server) != 1)) {
+			tls_errors(cert);
+			tls_config_free(tc);
+			return -1;
+		}
+		SSL_CTX_set_session_id_context(tc->server,
+				(const unsigned char *)"tap", 3);
+		SSL_CTX_set_num_tickets(tc->server, TLS_TICKETS);
+	}
+	if (upstream) {
+		tc->client = tls_ctx_new(TLS_client_method(), ktls);
+		if (!tc->client) {
+			tls_errors("SSL_CTX_new()");
+			tls_config_free(tc);
+			return -1;
+		}
+		if (ca) {
+			if (SSL_CTX_load_verify_locations(tc->client, ca,
+						0) != 1) {
+				tls_errors(ca);
+				tls_config_free(tc);
+				return -1;
+			}
+			SSL_CTX_set_verify(tc->client, SSL_VERIFY_PEER, 0);
+		}
+		/* Sessions are kept per worker, see tls_new_session() */
+		SSL_CTX_set_session_cache_mode(tc->client,
+				SSL_SESS_CACHE_CLIENT |
+				SSL_SESS_CACHE_NO_INTERNAL_STORE);
+		SSL_CTX_sess_set_new_cb(tc->client, tls_new_session);
+	}
+	return 0;
+}
+
+void
+tls_config_free(struct tls_config *tc)
+{
+	if (tc->server) {
+		SSL_CTX_free(tc->server);
+		tc->server = 0;
+	}
+	if (tc->client) {
+		SSL_CTX_free(tc->client);
+		tc->client = 0;
+	}
+}
+
+int
+tls_cache_init(struct event_loop *loop)
+{
+	struct tls_cache *c;
+
+	c = &loop->tls;
+	if (!loop->cfg.tls || !loop->cfg.tls->client) {
+		return 0;
+	}
+	c->n = loop->cfg.backends ? loop->cfg.backends->n : 1;
+	c->sessions = (SSL_SESSION **)calloc((size_t)c->n,
+			sizeof(*c->sessions));
+	if (!c->sessions) {
+		ERR("calloc() failed\n");
+		c->n = 0;
+		return -1;
+	}
+	return 0;
+}
+
+void
+tls_cache_free(struct event_loop *loop)
+{
+	struct tls_cache *c;
+	int i;
+
+	c = &loop->tls;
+	for (i = 0; i < c->n; i++) {
+		if (c->sessions[i]) {
+			SSL_SESSION_free(c->sessions[i]);
+		}
+	}
+	free(c->sessions);
+	c->sessions = 0;
+	c->n = 0;
+}
+
+/*
+ * Returns:
+ * 	SSL set to socket of src, or 0 on error
+ */
+static SSL *
+tls_new(SSL_CTX *ctx, struct ev_source *src)
+{
+	SSL *ssl;
+
+	ssl = SSL_new(ctx);
+	if (!ssl) {
+		tls_errors("SSL_new()");
+		return 0;
+	}
+	if (SSL_set_fd(ssl, src->fd) != 1) {
+		tls_errors("SSL_set_fd()");
+		SSL_free(ssl);
+		return 0;
+	}
+	src->ssl = ssl;
+	src->ktls = 0;
+	return ssl;
+}
+
+int
+tls_conn_accept(struct event_loop *loop, struct tap_conn *conn)
+{
+	SSL *ssl;
+
+	ssl = tls_new(loop->cfg.tls->server, &conn->client);
+	if (!ssl) {
+		return -1;
+	}
+	SSL_set_accept_state(ssl);
+	conn->handshaking |= TLS_HS_CLIENT;
+	return 0;
+}
+
+int
+tls_conn_connect(struct event_loop *loop, struct tap_conn *conn)
+{
+	SSL_SESSION **slot;
+	SSL *ssl;
+	int idx;
+
+	ssl = tls_new(loop->cfg.tls->client, &conn->upstream);
+	if (!ssl) {
+		return -1;
+	}
+	SSL_set_connect_state(ssl);
+	if (loop->cfg.tls->sni) {
+		SSL_set_tlsext_host_name(ssl, loop->cfg.tls->sni);
+		SSL_set1_host(ssl, loop->cfg.tls->sni);
+	}
+	if (loop->tls.sessions) {
+		idx = 0;
+		if (conn->backend && loop->cfg.backends) {
+			idx = (int)(conn->backend - loop->cfg.backends->b);
+		}
+		slot = &loop->tls.sessions[idx];
+		SSL_set_ex_data(ssl, tls_slot_idx, slot);
+		if (*slot) {
+			SSL_set_session(ssl, *slot);
+		}
+	}
+	conn->handshaking |= TLS_HS_UPSTREAM;
+	return 0;
+}
+
+int
+tls_handshake(struct event_loop *loop, struct tap_conn *conn)
+{
+	struct ev_source *src;
+	unsigned long e;
+	int side;
+	int stat;
+	int err;
+
+	for (side = TLS_CLIENT; side <= TLS_UPSTREAM; side++) {
+		src = (side == TLS_CLIENT) ? &conn->client : &conn->upstream;
+		if (!(conn->handshaking & (1 << side))) {
+			continue;
+		}
+		EV_SYSCALL(loop);
+		stat = SSL_do_handshake(src->ssl);
+		if (stat != 1) {
+			err = SSL_get_error(src->ssl, stat);
+			if ((err == SSL_ERROR_WANT_READ) ||
+					(err == SSL_ERROR_WANT_WRITE)) {
+				continue;
+			}
+			e = ERR_peek_error();
+			LOG("TLS handshake with %s failed: %s\n",
+					side_names[side], e ?
+					ERR_reason_error_string(e) :
+					"connection closed");
+			ERR_clear_error();
+			EV_STAT_ADD(loop, tls_failed, 1);
+			return -1;
+		}
+		conn->handshaking &= ~(1 << side);
+		EV_STAT_ADD(loop, tls_handshakes[side], 1);
+		if (SSL_session_reused(src->ssl)) {
+			EV_STAT_ADD(loop, tls_resumed[side], 1);
+		}
+		if (BIO_get_ktls_send(SSL_get_wbio(src->ssl))) {
+			src->ktls |= TLS_KTLS_TX;
+		}
+		if (BIO_get_ktls_recv(SSL_get_rbio(src->ssl))) {
+			src->ktls |= TLS_KTLS_RX;
+		}
+		if (src->ktls) {
+			EV_STAT_ADD(loop, tls_ktls, 1);
+		}
+	}
+	return 0;
+}
+
+/*
+ * Turn error of SSL I/O to errno
+ *
+ * Returns:
+ * 	0 on orderly eof, or -1 with errno set
+ */
+static ssize_t
+tls_error(SSL *ssl)
+{
+	int err;
+
+	err = SSL_get_error(ssl, 0);
+	switch (err) {
+	case (SSL_ERROR_ZERO_RETURN):
+		return 0;
+	case (SSL_ERROR_WANT_READ):
+	case (SSL_ERROR_WANT_WRITE):
+		errno = EAGAIN;
+		break;
+	case (SSL_ERROR_SYSCALL):
+		if (!errno) {
+			errno = EPIPE;
+		}
+		break;
+	default:
+		errno = EPROTO;
+		break;
+	}
+	ERR_clear_error();
+	return -1;
+}
+
+ssize_t
+tls_recv(struct event_loop *loop, struct ev_source *src, void *buf,
+		size_t len)
+{
+	size_t got;
+
+	EV_SYSCALL(loop);
+	if (SSL_read_ex(src->ssl, buf, len, &got) == 1) {
+		return (ssize_t)got;
+	}
+	return tls_error(src->ssl);
+}
+
+ssize_t
+tls_sendv(struct event_loop *loop, struct ev_source *dst,
+		struct iovec *iov, size_t cnt)
+{
+	size_t total;
+	size_t done;
+	size_t i;
+
+	total = 0;
+	for (i = 0; i < cnt; i++) {
+		if (!iov[i].iov_len) {
+			continue;
+		}
+		EV_SYSCALL(loop);
+		if (SSL_write_ex(dst->ssl, iov[i].iov_base, iov[i].iov_len,
+					&done) != 1) {
+			/* Write that failed is tried again from same data */
+			if (total) {
+				ERR_clear_error();
+				break;
+			}
+			if (!tls_error(dst->ssl)) {
+				errno = EPIPE;
+			}
+			return -1;
+		}
+		total += done;
+		if (done < iov[i].iov_len) {
+			break;
+		}
+	}
+	return (ssize_t)total;
+}
+
+void
+tls_shutdown(struct event_loop *loop, struct ev_source *dst)
+{
+	EV_SYSCALL(loop);
+	SSL_shutdown(dst->ssl);
+	ERR_clear_error();
+}
+
+int
+tls_plain(struct ev_source *src, struct ev_source *dst)
+{
+	/* What OpenSSL read already has to come out of it */
+	if (src->ssl && (!(src->ktls & TLS_KTLS_RX) ||
+				SSL_has_pending(src->ssl))) {
+		return 0;
+	}
+	return !dst->ssl || (dst->ktls & TLS_KTLS_TX);
+}
+
+void
+tls_conn_free(struct tap_conn *conn)
+{
+	if (conn->client.ssl) {
+		SSL_free(conn->client.ssl);
+		conn->client.ssl = 0;
+	}
+	if (conn->upstream.ssl) {
+		SSL_free(conn->upstream.ssl);
+		conn->upstream.ssl = 0;
+	}
+}
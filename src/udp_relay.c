@@ -0,0 +1,1050 @@
+/*
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2022, k4m1
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIA LDAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVE RCAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * UDP relaying. Every worker binds its own SO_REUSEPORT socket, so the
+ * kernel hashes each client to one worker and workers share no flows.
+ * A flow is the client address & port and the local address it sent
+ * to (IP_PKTINFO), local port is the same for all of them. Each flow
+ * has its own socket connected to the upstream picked for it, so the
+ * kernel sorts replies to flows, and they're sent back to the client
+ * from the address it sent to.
+ *
+ * Flows are found from an open addressing table with linear probing.
+ * Removing a flow moves the following entries of its run back, so no
+ * tombstones pile up. Flows are also kept in order of activity, and
+ * the least recently active ones are closed after cfg.udp_idle_ms.
+ *
+ * Datagrams are received UDP_BATCH at a time with recvmmsg(), and with
+ * GRO the kernel may pass many of same size in one buffer. Every one of
+ * them is passed to callback & rules alone, patterns don't continue
+ * from one datagram to next. Output refers to the receive buffers and
+ * replacements with iovecs, and is sent with a sendmmsg() per socket
+ * at end of event batch, or once receive buffers run low. Consecutive
+ * datagrams of equal size to same peer are sent as one with GSO
+ * (UDP_SEGMENT) while the kernel takes it.
+ *
+ * There's no backpressure, datagrams a socket doesn't take right away
+ * are dropped and counted, as the network would.
+ */
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <netinet/in.h>
+#include <netinet/udp.h>
+
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+
+#include <log.h>
+#include <net_io.h>
+#include <event_loop.h>
+#include <ev_timer.h>
+#include <rules_domain.h>
+#include <stream_match.h>
+#include <udp_relay.h>
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+/* Most payload of one IPv4 UDP datagram, GSO sends can't exceed it */
+#define UDP_GSO_BYTES (65535 - 20 - 8)
+
+/* Room for IP_PKTINFO and UDP_GRO/UDP_SEGMENT of one message */
+#define UDP_CTL_SIZE (CMSG_SPACE(sizeof(struct in_pktinfo)) + \
+		CMSG_SPACE(sizeof(int)))
+
+/*
+ * Datagram waiting to be sent
+ */
+struct udp_out {
+	struct udp_flow *flow;
+	int iov; 		/* first iovec in batch */
+	int niov;
+	size_t len;
+	int next; 		/* next one to same socket, or -1 */
+};
+
+/*
+ * Datagrams in flight. Received datagrams stay in their buffer until
+ * they've been sent.
+ */
+struct udp_batch {
+	unsigned char *bufs; 		/* UDP_BATCH of UDP_BUF_SIZE */
+	int slot; 			/* first free buffer */
+	struct mmsghdr rx[UDP_BATCH];
+	struct iovec rx_iov[UDP_BATCH];
+	struct sockaddr_in rx_addr[UDP_BATCH];
+	char rx_ctl[UDP_BATCH][UDP_CTL_SIZE] __attribute__((aligned(8)));
+	struct udp_out out[UDP_OUT_MAX];
+	int nout;
+	int u2c; 			/* first datagram to clients, or -1 */
+	int u2c_tail;
+	struct udp_flow *queued; 	/* flows with datagrams to upstream */
+	struct iovec iov[UDP_IOV_MAX]; 	/* of datagrams in out */
+	int niov;
+	struct mmsghdr tx[UDP_BATCH];
+	int tx_out[UDP_BATCH]; 		/* first datagram of message */
+	int tx_segs[UDP_BATCH]; 	/* datagrams in message */
+	struct iovec tx_iov[UDP_IOV_MAX];
+	char tx_ctl[UDP_BATCH][UDP_CTL_SIZE] __attribute__((aligned(8)));
+};
+
+static uint32_t
+flow_hash(const struct sockaddr_in *client, struct in_addr local)
+{
+	uint64_t h;
+
+	h = ((uint64_t)client->sin_addr.s_addr << 32) | client->sin_port;
+	h ^= (uint64_t)local.s_addr * 0x9e3779b97f4a7c15ULL;
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return (uint32_t)h;
+}
+
+static struct udp_flow *
+flow_find(struct udp_relay *u, const struct sockaddr_in *client,
+		struct in_addr local, uint32_t hash)
+{
+	struct udp_flow *f;
+	size_t mask;
+	size_t i;
+
+	if (!u->size) {
+		return 0;
+	}
+	mask = u->size - 1;
+	for (i = hash & mask; (f = u->flows[i]); i = (i + 1) & mask) {
+		if ((f->hash == hash) &&
+				(f->client.sin_addr.s_addr == 
+				 client->sin_addr.s_addr) &&
+				(f->client.sin_port == client->sin_port) &&
+				(f->local.s_addr == local.s_addr)) {
+			return f;
+		}
+	}
+	return 0;
+}
+
+static void
+flow_place(struct udp_flow **flows, size_t size, struct udp_flow *f)
+{
+	size_t i;
+
+	for (i = f->hash & (size - 1); flows[i]; i = (i + 1) & (size - 1));
+	flows[i] = f;
+}
+
+/*
+ * Double size of flow table
+ *
+ * Returns:
+ * 	0 on success or -1 if out of memory
+ */
+static int
+flows_grow(struct udp_relay *u)
+{
+	struct udp_flow **flows;
+	size_t size;
+	size_t i;
+
+	size = u->size ? (u->size * 2) : UDP_FLOWS_MIN;
+	flows = (struct udp_flow **)calloc(size, sizeof(*flows));
+	if (!flows) {
+		ERR("calloc(%zu) failed\n", size * sizeof(*flows));
+		return -1;
+	}
+	for (i = 0; i < u->size; i++) {
+		if (u->flows[i]) {
+			flow_place(flows, size, u->flows[i]);
+		}
+	}
+	free(u->flows);
+	u->flows = flows;
+	u->size = size;
+	return 0;
+}
+
+/*
+ * Take flow out of table. Entries after it in the same run move back
+ * to the hole when lookups would start at or before it.
+ */
+static void
+flow_remove(struct udp_relay *u, struct udp_flow *f)
+{
+	struct udp_flow *g;
+	size_t mask;
+	size_t i;
+	size_t j;
+
+	mask = u->size - 1;
+	for (i = f->hash & mask; u->flows[i] != f; i = (i + 1) & mask);
+	for (j = (i + 1) & mask; (g = u->flows[j]); j = (j + 1) & mask) {
+		if (((j - g->hash) & mask) >= ((j - i) & mask)) {
+			u->flows[i] = g;
+			i = j;
+		}
+	}
+	u->flows[i] = 0;
+	u->nflows--;
+}
+
+static void
+lru_unlink(struct udp_relay *u, struct udp_flow *f)
+{
+	if (f->prev) {
+		f->prev->next = f->next;
+	} else {
+		u->lru = f->next;
+	}
+	if (f->next) {
+		f->next->prev = f->prev;
+	} else {
+		u->lru_tail = f->prev;
+	}
+	f->prev = 0;
+	f->next = 0;
+}
+
+static void
+lru_push(struct udp_relay *u, struct udp_flow *f)
+{
+	f->prev = 0;
+	f->next = u->lru;
+	if (u->lru) {
+		u->lru->prev = f;
+	} else {
+		u->lru_tail = f;
+	}
+	u->lru = f;
+}
+
+static void
+flow_touch(struct udp_relay *u, struct udp_flow *f, uint64_t now)
+{
+	f->last_ms = now;
+	if (u->lru != f) {
+		lru_unlink(u, f);
+		lru_push(u, f);
+	}
+}
+
+/* Sweep when least recently active flow would expire */
+static void
+udp_sweep_arm(struct event_loop *loop)
+{
+	struct udp_relay *u;
+
+	u = &loop->udp;
+	if (u->lru_tail) {
+		ev_timer_arm(&loop->timers, &u->sweep, u->lru_tail->last_ms +
+				(uint64_t)loop->cfg.udp_idle_ms);
+	}
+}
+
+/*
+ * Take flow out of table and close its socket. Memory is released
+ * only after the current event batch, as events and datagrams queued
+ * to its client may still point to it.
+ */
+static void
+flow_close(struct event_loop *loop, struct udp_flow *f)
+{
+	struct udp_relay *u;
+
+	u = &loop->udp;
+	flow_remove(u, f);
+	lru_unlink(u, f);
+	EV_SYSCALL(loop);
+	close(f->src.fd);
+	f->src.fd = -1;
+	f->next_dead = u->dead;
+	u->dead = f;
+	EV_STAT_SET(loop, udp_flows, u->nflows);
+}
+
+static void
+flow_free(struct udp_flow *f)
+{
+	stream_ctx_free(&f->match[DIR_C2U]);
+	stream_ctx_free(&f->match[DIR_U2C]);
+	if (f->rules_gen) {
+		rules_gen_put(f->rules_gen);
+	}
+	if (f->backend) {
+		backend_release(f->backend);
+	}
+	free(f);
+}
+
+static void
+on_udp_sweep(void *arg, void *unused)
+{
+	struct event_loop *loop;
+	struct udp_flow *f;
+	uint64_t now;
+
+	(void)unused;
+	loop = (struct event_loop *)arg;
+	now = ev_now_ms();
+	while ((f = loop->udp.lru_tail) &&
+			(now - f->last_ms >= (uint64_t)loop->cfg.udp_idle_ms)) {
+		EV_STAT_ADD(loop, udp_flows_expired, 1);
+		flow_close(loop, f);
+	}
+	udp_sweep_arm(loop);
+}
+
+/*
+ * Open flow for client, with its own socket to upstream
+ *
+ * Returns:
+ * 	pointer to flow or 0 on error
+ */
+static struct udp_flow *
+flow_open(struct event_loop *loop, const struct sockaddr_in *client,
+		struct in_addr local, uint32_t hash, uint64_t now)
+{
+	struct sockaddr_in saddr;
+	struct udp_relay *u;
+	struct udp_flow *f;
+	uint32_t lb_hash;
+	int one;
+	int i;
+
+	u = &loop->udp;
+	if (((u->nflows + 1) * 2 > u->size) && (flows_grow(u) < 0)) {
+		return 0;
+	}
+	f = (struct udp_flow *)calloc(1, sizeof(*f));
+	if (!f) {
+		ERR("calloc(%zu) failed\n", sizeof(*f));
+		return 0;
+	}
+	f->src.kind = EV_UDP_FLOW;
+	f->client = *client;
+	f->local = local;
+	f->hash = hash;
+	f->queued = -1;
+	f->queued_tail = -1;
+	lb_hash = 0;
+	if (loop->cfg.backends && (loop->cfg.backends->policy == LB_HASH)) {
+		lb_hash = backend_hash(client);
+	}
+	ev_pick_upstream(loop, &f->backend, lb_hash, &saddr);
+	loop->nsyscalls += 2;
+	f->src.fd = sock_connect_dgram(&saddr);
+	if (f->src.fd < 0) {
+		if (f->backend) {
+			backend_release(f->backend);
+		}
+		free(f);
+		return 0;
+	}
+	one = 1;
+	EV_SYSCALL(loop);
+	setsockopt(f->src.fd, SOL_UDP, UDP_GRO, &one, sizeof(one));
+	if (ev_add(loop, &f->src, EPOLLIN) < 0) {
+		close(f->src.fd);
+		if (f->backend) {
+			backend_release(f->backend);
+		}
+		free(f);
+		return 0;
+	}
+	/* Rules reloaded later apply to flows opened after */
+	if (loop->cfg.rules) {
+		f->rules_gen = rules_domain_get(loop->cfg.rules);
+	}
+	if (f->rules_gen) {
+		for (i = 0; i < 2; i++) {
+			f->match[i].hits = rules_gen_hits(f->rules_gen,
+					loop->cfg.reader);
+		}
+	}
+	flow_place(u->flows, u->size, f);
+	u->nflows++;
+	f->last_ms = now;
+	lru_push(u, f);
+	EV_STAT_SET(loop, udp_flows, u->nflows);
+	EV_STAT_ADD(loop, udp_flows_opened, 1);
+	if (u->sweep.idx == EV_TIMER_IDLE) {
+		udp_sweep_arm(loop);
+	}
+	return f;
+}
+
+/*
+ * Fill in control messages of message to client of flow, or to its
+ * upstream. seg is size of datagrams for GSO, or 0 for one datagram.
+ */
+static void
+udp_tx_ctl(struct msghdr *m, char *ctl, struct udp_flow *f, int dir,
+		size_t seg)
+{
+	struct in_pktinfo pi;
+	struct cmsghdr *c;
+	uint16_t val;
+	int pktinfo;
+
+	/* Reply from address client sent to, we may be bound to any */
+	pktinfo = (dir == DIR_U2C) && f->local.s_addr;
+	m->msg_controllen = 0;
+	if (pktinfo) {
+		m->msg_controllen += CMSG_SPACE(sizeof(pi));
+	}
+	if (seg) {
+		m->msg_controllen += CMSG_SPACE(sizeof(val));
+	}
+	if (!m->msg_controllen) {
+		m->msg_control = 0;
+		return;
+	}
+	memset(ctl, 0, m->msg_controllen);
+	m->msg_control = ctl;
+	c = (struct cmsghdr *)ctl;
+	if (pktinfo) {
+		memset(&pi, 0, sizeof(pi));
+		pi.ipi_spec_dst = f->local;
+		c->cmsg_level = IPPROTO_IP;
+		c->cmsg_type = IP_PKTINFO;
+		c->cmsg_len = CMSG_LEN(sizeof(pi));
+		memcpy(CMSG_DATA(c), &pi, sizeof(pi));
+		c = (struct cmsghdr *)&ctl[CMSG_SPACE(sizeof(pi))];
+	}
+	if (seg) {
+		val = (uint16_t)seg;
+		c->cmsg_level = SOL_UDP;
+		c->cmsg_type = UDP_SEGMENT;
+		c->cmsg_len = CMSG_LEN(sizeof(val));
+		memcpy(CMSG_DATA(c), &val, sizeof(val));
+	}
+}
+
+static void
+udp_sent(struct event_loop *loop, int dir, size_t len, int segs)
+{
+	EV_STAT_ADD(loop, tx_bytes[dir], len);
+	EV_STAT_ADD(loop, udp_dgrams_tx[dir], segs);
+}
+
+/*
+ * Send datagrams of GSO message n one by one
+ */
+static void
+udp_send_each(struct event_loop *loop, int fd, int dir, int n)
+{
+	struct udp_batch *b;
+	struct udp_out *o;
+	struct msghdr m;
+	ssize_t stat;
+	int i;
+	int k;
+
+	b = loop->udp.batch;
+	i = b->tx_out[n];
+	for (k = 0; k < b->tx_segs[n]; k++, i = o->next) {
+		o = &b->out[i];
+		memset(&m, 0, sizeof(m));
+		m.msg_name = b->tx[n].msg_hdr.msg_name;
+		m.msg_namelen = b->tx[n].msg_hdr.msg_namelen;
+		m.msg_iov = &b->iov[o->iov];
+		m.msg_iovlen = o->niov;
+		udp_tx_ctl(&m, b->tx_ctl[n], o->flow, dir, 0);
+		do {
+			EV_SYSCALL(loop);
+			stat = sendmsg(fd, &m, MSG_DONTWAIT);
+		} while ((stat < 0) && (errno == EINTR));
+		if (stat < 0) {
+			EV_STAT_ADD(loop, udp_dropped, 1);
+		} else {
+			udp_sent(loop, dir, (size_t)stat, 1);
+		}
+	}
+}
+
+/*
+ * Send first cnt messages of tx, dropping what socket doesn't take
+ */
+static void
+udp_send(struct event_loop *loop, int fd, int dir, int cnt)
+{
+	struct udp_batch *b;
+	int i;
+	int j;
+	int n;
+
+	b = loop->udp.batch;
+	i = 0;
+	while (i < cnt) {
+		EV_SYSCALL(loop);
+		n = sendmmsg(fd, &b->tx[i], (unsigned int)(cnt - i), 
+				MSG_DONTWAIT);
+		if (n > 0) {
+			for (j = i; j < i + n; j++) {
+				udp_sent(loop, dir, b->tx[j].msg_len, 
+						b->tx_segs[j]);
+			}
+			i += n;
+			continue;
+		}
+		if (errno == EINTR) {
+			continue;
+		}
+		/* Device can't segment, or datagrams are over MTU */
+		if ((b->tx_segs[i] > 1) && ((errno == EIO) || 
+				(errno == EINVAL) || (errno == EOPNOTSUPP))) {
+			if ((errno != EINVAL) && loop->udp.gso) {
+				LOG("UDP GSO not usable, errno: %d\n", errno);
+				loop->udp.gso = 0;
+			}
+			udp_send_each(loop, fd, dir, i);
+		} else {
+			EV_STAT_ADD(loop, udp_dropped, b->tx_segs[i]);
+		}
+		i++;
+	}
+}
+
+/*
+ * Send datagrams queued to fd, from out index first onwards
+ */
+static void
+udp_send_queue(struct event_loop *loop, int fd, int dir, int first)
+{
+	struct udp_batch *b;
+	struct udp_out *o;
+	struct udp_out *p;
+	struct msghdr *m;
+	size_t total;
+	int ntx;
+	int niov;
+	int segs;
+	int next;
+	int cnt;
+	int i;
+	int j;
+	int k;
+
+	b = loop->udp.batch;
+	cnt = 0;
+	ntx = 0;
+	for (i = first; i >= 0; i = next) {
+		o = &b->out[i];
+		segs = 1;
+		total = o->len;
+		niov = o->niov;
+		next = o->next;
+		/* Equal sized ones go with this, last one may be smaller */
+		while (loop->udp.gso && o->len && (next >= 0) &&
+				(segs < UDP_GSO_SEGS)) {
+			p = &b->out[next];
+			if ((p->flow != o->flow) || !p->len ||
+					(p->len > o->len) ||
+					(total + p->len > UDP_GSO_BYTES) ||
+					(niov + p->niov > IOV_MAX)) {
+				break;
+			}
+			segs++;
+			total += p->len;
+			niov += p->niov;
+			next = p->next;
+			if (p->len < o->len) {
+				break;
+			}
+		}
+		if ((cnt == UDP_BATCH) || (ntx + niov > UDP_IOV_MAX)) {
+			udp_send(loop, fd, dir, cnt);
+			cnt = 0;
+			ntx = 0;
+		}
+		m = &b->tx[cnt].msg_hdr;
+		memset(m, 0, sizeof(*m));
+		if (dir == DIR_U2C) {
+			m->msg_name = &o->flow->client;
+			m->msg_namelen = sizeof(o->flow->client);
+		}
+		m->msg_iov = &b->tx_iov[ntx];
+		m->msg_iovlen = (size_t)niov;
+		for (j = i, k = 0; k < segs; j = b->out[j].next, k++) {
+			p = &b->out[j];
+			memcpy(&b->tx_iov[ntx], &b->iov[p->iov],
+					(size_t)p->niov * sizeof(struct iovec));
+			ntx += p->niov;
+		}
+		udp_tx_ctl(m, b->tx_ctl[cnt], o->flow, dir,
+				(segs > 1) ? o->len : 0);
+		b->tx_out[cnt] = i;
+		b->tx_segs[cnt] = segs;
+		cnt++;
+	}
+	if (cnt) {
+		udp_send(loop, fd, dir, cnt);
+	}
+}
+
+/*
+ * Send every queued datagram, receive buffers stay in use
+ */
+static void
+udp_send_all(struct event_loop *loop)
+{
+	struct udp_flow *next;
+	struct udp_flow *f;
+	struct udp_batch *b;
+	int i;
+
+	b = loop->udp.batch;
+	for (f = b->queued; f; f = next) {
+		next = f->next_queued;
+		if (f->src.fd >= 0) {
+			udp_send_queue(loop, f->src.fd, DIR_C2U, f->queued);
+		} else {
+			/* Upstream went away after these were received */
+			for (i = f->queued; i >= 0; i = b->out[i].next) {
+				EV_STAT_ADD(loop, udp_dropped, 1);
+			}
+		}
+		f->queued = -1;
+		f->queued_tail = -1;
+		f->next_queued = 0;
+	}
+	b->queued = 0;
+	if (b->u2c >= 0) {
+		udp_send_queue(loop, loop->udp.listener.fd, DIR_U2C, b->u2c);
+	}
+	b->u2c = -1;
+	b->u2c_tail = -1;
+	b->nout = 0;
+	b->niov = 0;
+}
+
+/*
+ * Pass datagram through callback & rules, and queue it for sending
+ */
+static void
+udp_dgram(struct event_loop *loop, struct udp_flow *f, int dir,
+		unsigned char *data, size_t len)
+{
+	struct stream_rules *rules;
+	struct udp_batch *b;
+	struct udp_out *o;
+	int idx;
+	int n;
+	int i;
+
+	b = loop->udp.batch;
+	EV_STAT_ADD(loop, rx_bytes[dir], len);
+	EV_STAT_ADD(loop, udp_dgrams_rx[dir], 1);
+	if ((b->nout == UDP_OUT_MAX) ||
+			(b->niov + UDP_DGRAM_IOV > UDP_IOV_MAX)) {
+		udp_send_all(loop);
+	}
+	if (loop->cfg.cb != 0) {
+		loop->cfg.cb(data, len);
+	}
+	rules = f->rules_gen ? &f->rules_gen->rules : 0;
+	if (rules && rules->ac[dir].npatterns) {
+		n = stream_scan_datagram(rules, &f->match[dir], dir, data, len,
+				&b->iov[b->niov], UDP_DGRAM_IOV);
+		if (n < 0) {
+			EV_STAT_ADD(loop, udp_dropped, 1);
+			return;
+		}
+	} else {
+		b->iov[b->niov].iov_base = data;
+		b->iov[b->niov].iov_len = len;
+		n = 1;
+	}
+	idx = b->nout++;
+	o = &b->out[idx];
+	o->flow = f;
+	o->iov = b->niov;
+	o->niov = n;
+	o->len = 0;
+	o->next = -1;
+	for (i = 0; i < n; i++) {
+		o->len += b->iov[b->niov + i].iov_len;
+	}
+	b->niov += n;
+	if (dir == DIR_C2U) {
+		if (f->queued < 0) {
+			f->queued = idx;
+			f->next_queued = b->queued;
+			b->queued = f;
+		} else {
+			b->out[f->queued_tail].next = idx;
+		}
+		f->queued_tail = idx;
+	} else {
+		if (b->u2c < 0) {
+			b->u2c = idx;
+		} else {
+			b->out[b->u2c_tail].next = idx;
+		}
+		b->u2c_tail = idx;
+	}
+}
+
+/*
+ * Split what GRO merged back to datagrams of seg bytes, and pass each
+ * one on. Without GRO seg is len.
+ */
+static void
+udp_split(struct event_loop *loop, struct udp_flow *f, int dir,
+		unsigned char *data, size_t len, size_t seg)
+{
+	size_t n;
+
+	if (!seg || (seg > len)) {
+		seg = len;
+	}
+	do {
+		n = (len < seg) ? len : seg;
+		udp_dgram(loop, f, dir, data, n);
+		data += n;
+		len -= n;
+	} while (len);
+}
+
+/*
+ * Find GRO segment size and address datagram was sent to
+ */
+static void
+udp_rx_ctl(struct msghdr *m, size_t *seg, struct in_addr *local)
+{
+	struct in_pktinfo pi;
+	struct cmsghdr *c;
+	int gro;
+
+	for (c = CMSG_FIRSTHDR(m); c; c = CMSG_NXTHDR(m, c)) {
+		if ((c->cmsg_level == SOL_UDP) && (c->cmsg_type == UDP_GRO)) {
+			memcpy(&gro, CMSG_DATA(c), sizeof(gro));
+			*seg = (size_t)gro;
+		} else if ((c->cmsg_level == IPPROTO_IP) &&
+				(c->cmsg_type == IP_PKTINFO)) {
+			memcpy(&pi, CMSG_DATA(c), sizeof(pi));
+			*local = pi.ipi_addr;
+		}
+	}
+}
+
+/*
+ * Receive to free buffers, flushing first if there are too few
+ *
+ * Returns:
+ * 	amount of messages received or -1 on error
+ */
+static int
+udp_recv(struct event_loop *loop, int fd, int named)
+{
+	struct udp_batch *b;
+	struct msghdr *m;
+	int stat;
+	int n;
+	int i;
+
+	b = loop->udp.batch;
+	if (!b->nout) {
+		b->slot = 0;
+	} else if (UDP_BATCH - b->slot < UDP_BATCH / 4) {
+		udp_send_all(loop);
+		b->slot = 0;
+	}
+	n = UDP_BATCH - b->slot;
+	for (i = 0; i < n; i++) {
+		b->rx_iov[i].iov_base = &b->bufs[(size_t)(b->slot + i) *
+			UDP_BUF_SIZE];
+		b->rx_iov[i].iov_len = UDP_BUF_SIZE;
+		m = &b->rx[i].msg_hdr;
+		m->msg_name = named ? &b->rx_addr[i] : 0;
+		m->msg_namelen = named ? sizeof(b->rx_addr[i]) : 0;
+		m->msg_iov = &b->rx_iov[i];
+		m->msg_iovlen = 1;
+		m->msg_control = b->rx_ctl[i];
+		m->msg_controllen = UDP_CTL_SIZE;
+		m->msg_flags = 0;
+	}
+	EV_SYSCALL(loop);
+	stat = recvmmsg(fd, b->rx, (unsigned int)n, MSG_DONTWAIT, 0);
+	if (stat > 0) {
+		/* Buffers are in use until the datagrams are sent */
+		b->slot += stat;
+	}
+	return stat;
+}
+
+/*
+ * Relay datagrams clients sent
+ */
+static void
+on_udp_client(struct event_loop *loop)
+{
+	struct udp_batch *b;
+	struct udp_relay *u;
+	struct udp_flow *f;
+	struct in_addr local;
+	uint32_t hash;
+	uint64_t now;
+	size_t seg;
+	size_t len;
+	int budget;
+	int n;
+	int i;
+
+	u = &loop->udp;
+	b = u->batch;
+	for (budget = 0; budget < RELAY_BUDGET; budget++) {
+		n = udp_recv(loop, u->listener.fd, 1);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+				ERR("recvmmsg() errored with errno: %d\n", errno);
+			}
+			return;
+		}
+		now = ev_now_ms();
+		for (i = 0; i < n; i++) {
+			len = b->rx[i].msg_len;
+			seg = len;
+			local.s_addr = 0;
+			udp_rx_ctl(&b->rx[i].msg_hdr, &seg, &local);
+			hash = flow_hash(&b->rx_addr[i], local);
+			f = flow_find(u, &b->rx_addr[i], local, hash);
+			if (!f) {
+				f = flow_open(loop, &b->rx_addr[i], local, hash,
+						now);
+			}
+			if (!f) {
+				EV_STAT_ADD(loop, udp_dropped, (seg && len) ?
+						(len + seg - 1) / seg : 1);
+				continue;
+			}
+			flow_touch(u, f, now);
+			udp_split(loop, f, DIR_C2U, 
+					(unsigned char *)b->rx_iov[i].iov_base,
+					len, seg);
+		}
+	}
+}
+
+/*
+ * Relay datagrams upstream of flow sent
+ */
+static void
+on_udp_upstream(struct event_loop *loop, struct udp_flow *f)
+{
+	struct udp_batch *b;
+	struct in_addr local;
+	size_t seg;
+	size_t len;
+	int budget;
+	int n;
+	int i;
+
+	b = loop->udp.batch;
+	for (budget = 0; budget < RELAY_BUDGET; budget++) {
+		n = udp_recv(loop, f->src.fd, 0);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+				return;
+			}
+			/* Port unreachable, next datagram opens a new flow */
+			if ((errno == ECONNREFUSED) && f->backend) {
+				backend_failed(f->backend);
+			}
+			flow_close(loop, f);
+			return;
+		}
+		if (f->backend) {
+			backend_connected(f->backend);
+		}
+		flow_touch(&loop->udp, f, ev_now_ms());
+		for (i = 0; i < n; i++) {
+			len = b->rx[i].msg_len;
+			seg = len;
+			udp_rx_ctl(&b->rx[i].msg_hdr, &seg, &local);
+			udp_split(loop, f, DIR_U2C,
+					(unsigned char *)b->rx_iov[i].iov_base,
+					len, seg);
+		}
+	}
+}
+
+void
+udp_relay_init(struct event_loop *loop)
+{
+	struct udp_relay *u;
+
+	u = &loop->udp;
+	memset(u, 0, sizeof(*u));
+	u->listener.kind = EV_UDP;
+	u->listener.fd = -1;
+	ev_timer_init(&u->sweep, on_udp_sweep, 0);
+}
+
+int
+udp_relay_add_listener(struct event_loop *loop, int sock)
+{
+	struct udp_batch *b;
+	struct udp_relay *u;
+	int one;
+
+	u = &loop->udp;
+	if (set_nonblocking(sock) < 0) {
+		return -1;
+	}
+	one = 1;
+	if (setsockopt(sock, IPPROTO_IP, IP_PKTINFO, &one, sizeof(one)) < 0) {
+		ERR("setsockopt(IP_PKTINFO) errored with errno: %d\n", errno);
+		return -1;
+	}
+	/* Without GRO every datagram takes a buffer of its own */
+	setsockopt(sock, SOL_UDP, UDP_GRO, &one, sizeof(one));
+	b = (struct udp_batch *)calloc(1, sizeof(*b));
+	if (!b) {
+		ERR("calloc(%zu) failed\n", sizeof(*b));
+		return -1;
+	}
+	b->bufs = (unsigned char *)malloc((size_t)UDP_BATCH * UDP_BUF_SIZE);
+	if (!b->bufs) {
+		ERR("malloc(%zu) failed\n", (size_t)UDP_BATCH * UDP_BUF_SIZE);
+		free(b);
+		return -1;
+	}
+	b->u2c = -1;
+	b->u2c_tail = -1;
+	u->listener.fd = sock;
+	if (ev_add(loop, &u->listener, EPOLLIN) < 0) {
+		ERR("epoll_ctl() errored with errno: %d\n", errno);
+		u->listener.fd = -1;
+		free(b->bufs);
+		free(b);
+		return -1;
+	}
+	u->batch = b;
+	u->gso = 1;
+	return 0;
+}
+
+void
+udp_relay_event(struct event_loop *loop, struct ev_source *src)
+{
+	if (src->fd < 0) {
+		/* Closed earlier in this batch */
+		return;
+	}
+	if (src->kind == EV_UDP) {
+		on_udp_client(loop);
+	} else {
+		on_udp_upstream(loop, (struct udp_flow *)src);
+	}
+}
+
+void
+udp_relay_flush(struct event_loop *loop)
+{
+	struct udp_batch *b;
+
+	b = loop->udp.batch;
+	if (!b) {
+		return;
+	}
+	if (b->nout) {
+		udp_send_all(loop);
+	}
+	b->slot = 0;
+}
+
+void
+udp_relay_reap(struct event_loop *loop)
+{
+	struct udp_flow *f;
+
+	while ((f = loop->udp.dead)) {
+		loop->udp.dead = f->next_dead;
+		flow_free(f);
+	}
+}
+
+void
+udp_relay_stop(struct event_loop *loop)
+{
+	struct udp_relay *u;
+
+	u = &loop->udp;
+	udp_relay_flush(loop);
+	ev_timer_cancel(&loop->timers, &u->sweep);
+	while (u->lru) {
+		flow_close(loop, u->lru);
+	}
+	if (u->listener.fd >= 0) {
+		close(u->listener.fd);
+		u->listener.fd = -1;
+	}
+}
+
+void
+udp_relay_destroy(struct event_loop *loop)
+{
+	struct udp_relay *u;
+
+	u = &loop->udp;
+	udp_relay_stop(loop);
+	udp_relay_reap(loop);
+	free(u->flows);
+	u->flows = 0;
+	u->size = 0;
+	if (u->batch) {
+		free(u->batch->bufs);
+		free(u->batch);
+		u->batch = 0;
+	}
+}
@@ -0,0 +1,369 @@
+/*
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2022, k4m1
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIA LDAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVE RCAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Warm pool of connections to upstream. Every event loop keeps
+ * cfg.pool_min connections to upstream open and idle, so an accepted
+ * client can start relaying right away instead of waiting for connect.
+ * When clients find the pool empty, it grows toward cfg.pool_max, and
+ * shrinks back after POOL_DECAY_MS without misses.
+ *
+ * Failed or timed out connects, and idle connections upstream drops,
+ * stop refilling for an exponentially growing, jittered while.
+ */
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+
+#include <log.h>
+#include <net_io.h>
+#include <event_loop.h>
+#include <ev_timer.h>
+#include <upstream_pool.h>
+
+#define POOL_EVENTS (EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET)
+
+static void
+warm_link(struct warm_conn **head, struct warm_conn *w)
+{
+	w->prev = 0;
+	w->next = *head;
+	if (*head) {
+		(*head)->prev = w;
+	}
+	*head = w;
+}
+
+static void
+warm_unlink(struct warm_conn **head, struct warm_conn *w)
+{
+	if (w->prev) {
+		w->prev->next = w->next;
+	} else {
+		*head = w->next;
+	}
+	if (w->next) {
+		w->next->prev = w->prev;
+	}
+	w->prev = 0;
+	w->next = 0;
+}
+
+static void
+pool_set_idle(struct event_loop *loop, size_t nidle)
+{
+	loop->upstreams.nidle = nidle;
+	EV_STAT_SET(loop, pool_idle, nidle);
+}
+
+/*
+ * Take warm connection off its list and close it. Memory is released
+ * only after the current event batch, as events may still point to it.
+ */
+static void
+warm_drop(struct event_loop *loop, struct warm_conn *w)
+{
+	struct upstream_pool *p;
+
+	p = &loop->upstreams;
+	ev_timer_cancel(&loop->timers, &w->timer);
+	if (w->connected) {
+		warm_unlink(&p->idle, w);
+		pool_set_idle(loop, p->nidle - 1);
+	} else {
+		warm_unlink(&p->connecting, w);
+		p->nconnecting--;
+	}
+	if (w->src.fd >= 0) {
+		EV_SYSCALL(loop);
+		close(w->src.fd);
+		w->src.fd = -1;
+	}
+	if (w->backend) {
+		backend_release(w->backend);
+		w->backend = 0;
+	}
+	warm_link(&p->dead, w);
+}
+
+/* Something went wrong, don't try again for a while */
+static void
+pool_backoff(struct event_loop *loop)
+{
+	struct upstream_pool *p;
+
+	p = &loop->upstreams;
+	if (p->failures < CONN_RETRIES) {
+		p->failures++;
+	}
+	ev_timer_arm(&loop->timers, &p->retry,
+			ev_now_ms() + ev_backoff_ms(loop, p->failures));
+}
+
+static void
+on_warm_timeout(void *loop, void *arg)
+{
+	struct warm_conn *w;
+
+	w = (struct warm_conn *)arg;
+	EV_STAT_ADD((struct event_loop *)loop, connect_timeouts, 1);
+	if (w->backend) {
+		backend_failed(w->backend);
+	}
+	warm_drop(loop, w);
+	pool_backoff(loop);
+}
+
+static void
+on_pool_retry(void *loop, void *arg)
+{
+	(void)arg;
+	upstream_pool_fill(loop);
+}
+
+/*
+ * Start connecting a warm connection
+ *
+ * Returns:
+ * 	0 if connect is in progress or -1 on error
+ */
+static int
+warm_connect(struct event_loop *loop)
+{
+	struct sockaddr_in saddr;
+	struct upstream_pool *p;
+	struct warm_conn *w;
+	int one;
+
+	p = &loop->upstreams;
+	w = (struct warm_conn *)calloc(1, sizeof(*w));
+	if (!w) {
+		return -1;
+	}
+	ev_pick_upstream(loop, &w->backend, 0, &saddr);
+	loop->nsyscalls += 2;
+	w->src.kind = EV_POOL;
+	w->src.fd = sock_connect_nb(&saddr);
+	if (w->src.fd < 0) {
+		if (w->backend) {
+			backend_release(w->backend);
+		}
+		free(w);
+		return -1;
+	}
+	one = 1;
+	EV_SYSCALL(loop);
+	setsockopt(w->src.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	ev_timer_init(&w->timer, on_warm_timeout, w);
+	warm_link(&p->connecting, w);
+	p->nconnecting++;
+	if ((ev_add(loop, &w->src, POOL_EVENTS) < 0) ||
+			(ev_timer_arm(&loop->timers, &w->timer, ev_now_ms() +
+				      (uint64_t)loop->cfg.connect_timeout_ms) < 0)) {
+		warm_drop(loop, w);
+		return -1;
+	}
+	return 0;
+}
+
+void
+upstream_pool_init(struct event_loop *loop)
+{
+	struct upstream_pool *p;
+
+	p = &loop->upstreams;
+	memset(p, 0, sizeof(*p));
+	p->target = (size_t)loop->cfg.pool_min;
+	ev_timer_init(&p->retry, on_pool_retry, 0);
+}
+
+void
+upstream_pool_fill(struct event_loop *loop)
+{
+	struct upstream_pool *p;
+	uint64_t now;
+
+	p = &loop->upstreams;
+	if (!loop->cfg.pool_min || (p->retry.idx != EV_TIMER_IDLE)) {
+		return;
+	}
+	now = ev_now_ms();
+	if ((p->target > (size_t)loop->cfg.pool_min) &&
+			(now - p->last_miss >= POOL_DECAY_MS)) {
+		p->target /= 2;
+		if (p->target < (size_t)loop->cfg.pool_min) {
+			p->target = (size_t)loop->cfg.pool_min;
+		}
+		p->last_miss = now;
+	}
+	while (p->nidle > p->target) {
+		warm_drop(loop, p->idle);
+	}
+	while (p->nidle + p->nconnecting < p->target) {
+		if (warm_connect(loop) < 0) {
+			pool_backoff(loop);
+			return;
+		}
+	}
+}
+
+int
+upstream_pool_take(struct event_loop *loop, struct ev_source *src)
+{
+	struct upstream_pool *p;
+	struct warm_conn *w;
+	unsigned char c;
+	ssize_t stat;
+	int fd;
+
+	p = &loop->upstreams;
+	if (!loop->cfg.pool_min) {
+		return -1;
+	}
+	while ((w = p->idle)) {
+		/* Upstream may have closed it, and we haven't heard yet */
+		EV_SYSCALL(loop);
+		stat = recv(w->src.fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+		if ((stat == 0) || ((stat < 0) && (errno != EAGAIN) &&
+					(errno != EWOULDBLOCK))) {
+			warm_drop(loop, w);
+			continue;
+		}
+		fd = w->src.fd;
+		src->fd = fd;
+		if (ev_mod(loop, src, POOL_EVENTS) < 0) {
+			src->fd = -1;
+			warm_drop(loop, w);
+			continue;
+		}
+		/* Socket and backend belong to connection of src now */
+		w->src.fd = -1;
+		src->conn->backend = w->backend;
+		w->backend = 0;
+		warm_drop(loop, w);
+		p->failures = 0;
+		EV_STAT_ADD(loop, pool_hits, 1);
+		upstream_pool_fill(loop);
+		return 0;
+	}
+	EV_STAT_ADD(loop, pool_misses, 1);
+	p->last_miss = ev_now_ms();
+	if (p->target < (size_t)loop->cfg.pool_max) {
+		p->target *= 2;
+		if (p->target > (size_t)loop->cfg.pool_max) {
+			p->target = (size_t)loop->cfg.pool_max;
+		}
+	}
+	upstream_pool_fill(loop);
+	return -1;
+}
+
+void
+upstream_pool_event(struct event_loop *loop, struct ev_source *src,
+		uint32_t events)
+{
+	struct warm_conn *w;
+	int stat;
+
+	w = (struct warm_conn *)src;
+	if (w->src.fd < 0) {
+		/* Dropped earlier in this batch */
+		return;
+	}
+	if (w->connected) {
+		/* Data is fine, client gets it once it takes this one */
+		if (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+			warm_drop(loop, w);
+			pool_backoff(loop);
+		}
+		return;
+	}
+	loop->nsyscalls += 2;
+	stat = ev_connect_result(w->src.fd);
+	if (stat == 0) {
+		return;
+	}
+	if (stat < 0) {
+		EV_STAT_ADD(loop, connect_retries, 1);
+		if (w->backend) {
+			backend_failed(w->backend);
+		}
+		warm_drop(loop, w);
+		pool_backoff(loop);
+		return;
+	}
+	ev_timer_cancel(&loop->timers, &w->timer);
+	if (w->backend) {
+		backend_connected(w->backend);
+	}
+	warm_unlink(&loop->upstreams.connecting, w);
+	loop->upstreams.nconnecting--;
+	w->connected = 1;
+	warm_link(&loop->upstreams.idle, w);
+	pool_set_idle(loop, loop->upstreams.nidle + 1);
+}
+
+void
+upstream_pool_reap(struct event_loop *loop)
+{
+	struct warm_conn *w;
+
+	while ((w = loop->upstreams.dead)) {
+		loop->upstreams.dead = w->next;
+		free(w);
+	}
+}
+
+void
+upstream_pool_destroy(struct event_loop *loop)
+{
+	struct upstream_pool *p;
+
+	p = &loop->upstreams;
+	ev_timer_cancel(&loop->timers, &p->retry);
+	while (p->idle) {
+		warm_drop(loop, p->idle);
+	}
+	while (p->connecting) {
+		warm_drop(loop, p->connecting);
+	}
+	upstream_pool_reap(loop);
+}
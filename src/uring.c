@@ -0,0 +1,326 @@
+/*
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2022, k4m1
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIA LDAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVE RCAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Minimal io_uring helpers on top of the raw system calls.
+ */
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <linux/io_uring.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+
+#include <uring.h>
+
+static int
+sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+		unsigned flags)
+{
+	return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+			flags, 0, 0);
+}
+
+static int
+sys_io_uring_register(int fd, unsigned op, void *arg, unsigned nr_args)
+{
+	return (int)syscall(__NR_io_uring_register, fd, op, arg, nr_args);
+}
+
+int
+uring_init(struct uring *r, unsigned entries)
+{
+	struct io_uring_params p;
+	unsigned flags;
+	unsigned i;
+	int stat;
+
+	memset(r, 0, sizeof(*r));
+	/* 
+	 * Newer flags first, older kernels reject what they don't know.
+	 * No SINGLE_ISSUER, rings are set up by another thread than the
+	 * one submitting.
+	 */
+	flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+	for (;;) {
+		memset(&p, 0, sizeof(p));
+		p.flags = flags;
+		r->fd = sys_io_uring_setup(entries, &p);
+		if (r->fd >= 0) {
+			break;
+		}
+		if ((errno != EINVAL) || !flags) {
+			return -errno;
+		}
+		flags = 0;
+	}
+	r->features = p.features;
+	r->sq_entries = p.sq_entries;
+	r->cq_entries = p.cq_entries;
+
+	r->sq_ring_size = p.sq_off.array + (p.sq_entries * sizeof(unsigned));
+	r->cq_ring_size = p.cq_off.cqes + 
+		(p.cq_entries * sizeof(struct io_uring_cqe));
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (r->cq_ring_size > r->sq_ring_size) {
+			r->sq_ring_size = r->cq_ring_size;
+		}
+		r->cq_ring_size = r->sq_ring_size;
+	}
+	r->sq_ring = mmap(0, r->sq_ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_ring == MAP_FAILED) {
+		stat = -errno;
+		goto err_close;
+	}
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		r->cq_ring = r->sq_ring;
+	} else {
+		r->cq_ring = mmap(0, r->cq_ring_size, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, r->fd, 
+				IORING_OFF_CQ_RING);
+		if (r->cq_ring == MAP_FAILED) {
+			stat = -errno;
+			goto err_sq;
+		}
+	}
+	r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = (struct io_uring_sqe *)mmap(0, r->sqes_size, 
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, 
+			r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED) {
+		stat = -errno;
+		goto err_cq;
+	}
+
+	r->sq_head  = (unsigned *)((char *)r->sq_ring + p.sq_off.head);
+	r->sq_tail  = (unsigned *)((char *)r->sq_ring + p.sq_off.tail);
+	r->sq_mask  = (unsigned *)((char *)r->sq_ring + p.sq_off.ring_mask);
+	r->sq_array = (unsigned *)((char *)r->sq_ring + p.sq_off.array);
+	r->cq_head  = (unsigned *)((char *)r->cq_ring + p.cq_off.head);
+	r->cq_tail  = (unsigned *)((char *)r->cq_ring + p.cq_off.tail);
+	r->cq_mask  = (unsigned *)((char *)r->cq_ring + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)((char *)r->cq_ring + p.cq_off.cqes);
+
+	/* sqes are always used in order, so array is 1:1 */
+	for (i = 0; i < r->sq_entries; i++) {
+		r->sq_array[i] = i;
+	}
+	r->sqe_tail = *r->sq_tail;
+	return 0;
+
+err_cq:
+	if (r->cq_ring != r->sq_ring) {
+		munmap(r->cq_ring, r->cq_ring_size);
+	}
+err_sq:
+	munmap(r->sq_ring, r->sq_ring_size);
+err_close:
+	close(r->fd);
+	r->fd = -1;
+	return stat;
+}
+
+void
+uring_exit(struct uring *r)
+{
+	if (r->fd < 0) {
+		return;
+	}
+	munmap(r->sqes, r->sqes_size);
+	if (r->cq_ring != r->sq_ring) {
+		munmap(r->cq_ring, r->cq_ring_size);
+	}
+	munmap(r->sq_ring, r->sq_ring_size);
+	close(r->fd);
+	r->fd = -1;
+}
+
+int
+uring_op_supported(struct uring *r, int op)
+{
+	struct io_uring_probe *probe;
+	size_t size;
+	int ret;
+
+	size = sizeof(*probe) + (256 * sizeof(struct io_uring_probe_op));
+	probe = (struct io_uring_probe *)calloc(1, size);
+	if (!probe) {
+		return 0;
+	}
+	ret = 0;
+	if ((sys_io_uring_register(r->fd, IORING_REGISTER_PROBE, probe, 
+					256) == 0) && (op <= probe->last_op)) {
+		ret = !!(probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+	}
+	free(probe);
+	return ret;
+}
+
+struct io_uring_sqe *
+uring_get_sqe(struct uring *r)
+{
+	struct io_uring_sqe *sqe;
+	unsigned head;
+
+	head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+	if ((r->sqe_tail - head) >= r->sq_entries) {
+		return 0;
+	}
+	sqe = &r->sqes[r->sqe_tail & *r->sq_mask];
+	r->sqe_tail++;
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+int
+uring_submit(struct uring *r, unsigned wait_nr)
+{
+	unsigned to_submit;
+	unsigned flags;
+	int stat;
+
+	__atomic_store_n(r->sq_tail, r->sqe_tail, __ATOMIC_RELEASE);
+	to_submit = r->sqe_tail - __atomic_load_n(r->sq_head, 
+			__ATOMIC_ACQUIRE);
+	flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+	stat = sys_io_uring_enter(r->fd, to_submit, wait_nr, flags);
+	if (stat < 0) {
+		return -errno;
+	}
+	return stat;
+}
+
+struct io_uring_cqe *
+uring_peek_cqe(struct uring *r)
+{
+	unsigned head;
+
+	head = *r->cq_head;
+	if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+		return 0;
+	}
+	return &r->cqes[head & *r->cq_mask];
+}
+
+void
+uring_cqe_seen(struct uring *r)
+{
+	__atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+int
+uring_buf_ring_init(struct uring *r, struct uring_buf_ring *br,
+		unsigned entries, size_t buf_size, unsigned short bgid)
+{
+	struct io_uring_buf_reg reg;
+	unsigned i;
+	int stat;
+
+	memset(br, 0, sizeof(*br));
+	br->entries = entries;
+	br->buf_size = buf_size;
+	br->bgid = bgid;
+	br->ring_size = entries * sizeof(struct io_uring_buf);
+	br->ring = (struct io_uring_buf_ring *)mmap(0, br->ring_size, 
+			PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, 
+			-1, 0);
+	if (br->ring == MAP_FAILED) {
+		br->ring = 0;
+		return -errno;
+	}
+	br->bufs = (unsigned char *)malloc(entries * buf_size);
+	if (!br->bufs) {
+		munmap(br->ring, br->ring_size);
+		br->ring = 0;
+		return -ENOMEM;
+	}
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t)(uintptr_t)br->ring;
+	reg.ring_entries = entries;
+	reg.bgid = bgid;
+	if (sys_io_uring_register(r->fd, IORING_REGISTER_PBUF_RING, 
+				&reg, 1) < 0) {
+		stat = -errno;
+		free(br->bufs);
+		munmap(br->ring, br->ring_size);
+		br->ring = 0;
+		br->bufs = 0;
+		return stat;
+	}
+	for (i = 0; i < entries; i++) {
+		uring_buf_ring_put(br, i);
+	}
+	return 0;
+}
+
+void
+uring_buf_ring_free(struct uring *r, struct uring_buf_ring *br)
+{
+	struct io_uring_buf_reg reg;
+
+	if (!br->ring) {
+		return;
+	}
+	memset(&reg, 0, sizeof(reg));
+	reg.bgid = br->bgid;
+	sys_io_uring_register(r->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+	munmap(br->ring, br->ring_size);
+	free(br->bufs);
+	br->ring = 0;
+	br->bufs = 0;
+}
+
+void
+uring_buf_ring_put(struct uring_buf_ring *br, unsigned bid)
+{
+	struct io_uring_buf *buf;
+
+	buf = &br->ring->bufs[br->tail & (br->entries - 1)];
+	buf->addr = (uint64_t)(uintptr_t)uring_buf(br, bid);
+	buf->len = (uint32_t)br->buf_size;
+	buf->bid = (uint16_t)bid;
+	br->tail++;
+	__atomic_store_n(&br->ring->tail, br->tail, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,806 @@
+/*
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2022, k4m1
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIA LDAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVE RCAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * io_uring backend for the event loop.
+ *
+ * Listener has a multishot accept armed, so one request keeps giving
+ * us new clients. Receives pick their buffer from a ring of buffers
+ * provided to the kernel, and once a chunk has been intercepted its
+ * send is linked with the next receive of same direction: the receive
+ * only starts after the send has completed, which keeps each direction
+ * in order and gives us backpressure for free. Everything queued while
+ * handling a batch of completions is submitted with one io_uring_enter()
+ * that also waits for the next batch.
+ *
+ * Connections are freed only once every request referring to them has
+ * completed, closing cancels whatever is still pending.
+ */
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <linux/io_uring.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+
+#include <log.h>
+#include <net_io.h>
+#include <event_loop.h>
+#include <uring.h>
+#include <uring_loop.h>
+
+/* 
+ * user_data is pointer to loop or connection, with type of request in
+ * the low bits. Both come from malloc() so are 16 byte aligned.
+ */
+#define UD_ACCEPT 	0 	/* loop */
+#define UD_WAKE 	1 	/* loop */
+#define UD_CONNECT 	2 	/* conn */
+#define UD_RECV 	3 	/* conn, + direction */
+#define UD_SEND 	5 	/* conn, + direction */
+#define UD_CANCEL 	7 	/* conn */
+#define UD_TIMEOUT 	8 	/* conn, linked to connect */
+#define UD_BACKOFF 	9 	/* conn, wait before next connect */
+#define UD_MASK 	15
+
+#define UD(ptr, tag) ((uint64_t)(uintptr_t)(ptr) | (tag))
+#define UD_PTR(ud) ((void *)(uintptr_t)((ud) & ~(uint64_t)UD_MASK))
+#define UD_TAG(ud) ((int)((ud) & UD_MASK))
+
+#define URING_BGID 0
+
+struct uring_loop {
+	struct uring ring;
+	struct uring_buf_ring br;
+	uint64_t wakebuf;
+	int accepting; 		/* multishot accept is armed */
+	int returned; 		/* buffers were given back this round */
+};
+
+static void ur_conn_close(struct event_loop *loop, struct tap_conn *conn);
+
+/*
+ * Make sure there's room for n sqes, submits queued ones if needed.
+ *
+ * Returns:
+ * 	0 on success or -1 if ring is stuck
+ */
+static int
+ur_reserve(struct event_loop *loop, unsigned n)
+{
+	struct uring *r;
+	unsigned used;
+
+	r = &loop->uring->ring;
+	used = r->sqe_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+	if ((r->sq_entries - used) >= n) {
+		return 0;
+	}
+	EV_SYSCALL(loop);
+	if (uring_submit(r, 0) < 0) {
+		return -1;
+	}
+	used = r->sqe_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+	return ((r->sq_entries - used) >= n) ? 0 : -1;
+}
+
+static struct io_uring_sqe *
+ur_sqe(struct event_loop *loop)
+{
+	if (ur_reserve(loop, 1) < 0) {
+		ERR("io_uring submission queue stuck\n");
+		return 0;
+	}
+	return uring_get_sqe(&loop->uring->ring);
+}
+
+static int
+ur_arm_accept(struct event_loop *loop)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = ur_sqe(loop);
+	if (!sqe) {
+		return -1;
+	}
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = loop->listener.fd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_CLOEXEC;
+	sqe->user_data = UD(loop, UD_ACCEPT);
+	loop->uring->accepting = 1;
+	return 0;
+}
+
+static int
+ur_arm_wake(struct event_loop *loop)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = ur_sqe(loop);
+	if (!sqe) {
+		return -1;
+	}
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = loop->waker.fd;
+	sqe->addr = (uint64_t)(uintptr_t)&loop->uring->wakebuf;
+	sqe->len = sizeof(loop->uring->wakebuf);
+	sqe->user_data = UD(loop, UD_WAKE);
+	return 0;
+}
+
+/*
+ * Cancel every request on fd, completion is ignored if conn is 0
+ */
+static int
+ur_cancel_fd(struct event_loop *loop, struct tap_conn *conn, int fd)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = ur_sqe(loop);
+	if (!sqe) {
+		return -1;
+	}
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = fd;
+	sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+	sqe->user_data = UD(conn, UD_CANCEL);
+	if (conn) {
+		conn->inflight++;
+	}
+	return 0;
+}
+
+static struct io_uring_sqe *
+ur_prep_recv(struct event_loop *loop, struct tap_conn *conn, int dir)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_get_sqe(&loop->uring->ring);
+	if (!sqe) {
+		return 0;
+	}
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = conn->dir[dir].src->fd;
+	sqe->len = (uint32_t)loop->uring->br.buf_size;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BGID;
+	sqe->user_data = UD(conn, UD_RECV + dir);
+	conn->inflight++;
+	return sqe;
+}
+
+static int
+ur_arm_recv(struct event_loop *loop, struct tap_conn *conn, int dir)
+{
+	if ((ur_reserve(loop, 1) < 0) || !ur_prep_recv(loop, conn, dir)) {
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Send len bytes of buf, and receive more for same direction once
+ * that's done.
+ */
+static int
+ur_send_then_recv(struct event_loop *loop, struct tap_conn *conn, int dir,
+		unsigned char *buf, size_t len)
+{
+	struct io_uring_sqe *sqe;
+
+	/* Both must go in same submission for the link to hold */
+	if (ur_reserve(loop, 2) < 0) {
+		return -1;
+	}
+	sqe = uring_get_sqe(&loop->uring->ring);
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = conn->dir[dir].dst->fd;
+	sqe->addr = (uint64_t)(uintptr_t)buf;
+	sqe->len = (uint32_t)len;
+	sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+	sqe->flags = IOSQE_IO_LINK;
+	sqe->user_data = UD(conn, UD_SEND + dir);
+	conn->inflight++;
+	conn->dir[dir].sending = len;
+	ur_prep_recv(loop, conn, dir);
+	return 0;
+}
+
+static void
+ur_timespec(struct tap_conn *conn, int ms)
+{
+	conn->ts[0] = ms / 1000;
+	conn->ts[1] = (int64_t)(ms % 1000) * 1000000;
+}
+
+/*
+ * Create upstream socket & start connecting it, with a linked timeout
+ * cancelling the connect if it takes too long
+ *
+ * Returns:
+ * 	0 if connect was queued or -1 on error
+ */
+static int
+ur_connect(struct event_loop *loop, struct tap_conn *conn)
+{
+	struct io_uring_sqe *sqe;
+	int sock;
+	int one;
+
+	ev_pick_upstream(loop, &conn->backend, conn->hash, &conn->saddr);
+	conn->connect_us = ev_now_us();
+	EV_SYSCALL(loop);
+	sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock < 0) {
+		ERR("Failed to create socket, errno: %d\n", errno);
+		return -1;
+	}
+	one = 1;
+	EV_SYSCALL(loop);
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	conn->upstream.fd = sock;
+	conn->state = CONN_CONNECTING;
+
+	if (ur_reserve(loop, 2) < 0) {
+		ERR("io_uring submission queue stuck\n");
+		return -1;
+	}
+	sqe = uring_get_sqe(&loop->uring->ring);
+	sqe->opcode = IORING_OP_CONNECT;
+	sqe->fd = sock;
+	sqe->flags = IOSQE_IO_LINK;
+	sqe->addr = (uint64_t)(uintptr_t)&conn->saddr;
+	sqe->off = sizeof(conn->saddr);
+	sqe->user_data = UD(conn, UD_CONNECT);
+	conn->inflight++;
+
+	ur_timespec(conn, loop->cfg.connect_timeout_ms);
+	sqe = uring_get_sqe(&loop->uring->ring);
+	sqe->opcode = IORING_OP_LINK_TIMEOUT;
+	sqe->fd = -1;
+	sqe->addr = (uint64_t)(uintptr_t)conn->ts;
+	sqe->len = 1;
+	sqe->user_data = UD(conn, UD_TIMEOUT);
+	conn->inflight++;
+	return 0;
+}
+
+/*
+ * Connecting failed, wait a while before trying again, unless we've 
+ * already tried CONN_RETRIES times.
+ *
+ * Returns:
+ * 	0 if next attempt is scheduled or -1 if we gave up
+ */
+static int
+ur_conn_retry(struct event_loop *loop, struct tap_conn *conn)
+{
+	struct io_uring_sqe *sqe;
+
+	if (conn->upstream.fd >= 0) {
+		EV_SYSCALL(loop);
+		close(conn->upstream.fd);
+		conn->upstream.fd = -1;
+	}
+	if (conn->backend) {
+		backend_failed(conn->backend);
+	}
+	if (++conn->retries >= CONN_RETRIES) {
+		ERR("Failed to connect to %s\n", loop->cfg.addrout);
+		EV_STAT_ADD(loop, connect_failed, 1);
+		return -1;
+	}
+	EV_STAT_ADD(loop, connect_retries, 1);
+	sqe = ur_sqe(loop);
+	if (!sqe) {
+		return -1;
+	}
+	ur_timespec(conn, ev_backoff_ms(loop, conn->retries));
+	sqe->opcode = IORING_OP_TIMEOUT;
+	sqe->fd = -1;
+	sqe->addr = (uint64_t)(uintptr_t)conn->ts;
+	sqe->len = 1;
+	sqe->user_data = UD(conn, UD_BACKOFF);
+	conn->inflight++;
+	conn->state = CONN_BACKOFF;
+	return 0;
+}
+
+/*
+ * Free connection if nothing refers to it anymore
+ */
+static void
+ur_conn_maybe_free(struct event_loop *loop, struct tap_conn *conn)
+{
+	if ((conn->state != CONN_CLOSED) || conn->inflight || conn->queued) {
+		return;
+	}
+	if (conn->client.fd >= 0) {
+		EV_SYSCALL(loop);
+		close(conn->client.fd);
+	}
+	if (conn->upstream.fd >= 0) {
+		EV_SYSCALL(loop);
+		close(conn->upstream.fd);
+	}
+	ev_conn_unlink(loop, conn);
+	ev_conn_free(conn);
+	if (loop->accept_paused && (loop->listener.fd >= 0)) {
+		loop->accept_paused = 0;
+		ur_arm_accept(loop);
+	}
+}
+
+/*
+ * Close connection, pending requests are cancelled and connection
+ * is freed once they've all completed.
+ */
+static void
+ur_conn_close(struct event_loop *loop, struct tap_conn *conn)
+{
+	if (conn->state == CONN_CLOSED) {
+		return;
+	}
+	conn->state = CONN_CLOSED;
+	if (conn->client.fd >= 0) {
+		EV_SYSCALL(loop);
+		shutdown(conn->client.fd, SHUT_RDWR);
+		ur_cancel_fd(loop, conn, conn->client.fd);
+	}
+	if (conn->upstream.fd >= 0) {
+		EV_SYSCALL(loop);
+		shutdown(conn->upstream.fd, SHUT_RDWR);
+		ur_cancel_fd(loop, conn, conn->upstream.fd);
+	}
+	ur_conn_maybe_free(loop, conn);
+}
+
+static void
+ur_put_buf(struct event_loop *loop, unsigned bid)
+{
+	uring_buf_ring_put(&loop->uring->br, bid);
+	loop->uring->returned = 1;
+}
+
+/*
+ * Queue direction to retry receiving once buffers are available
+ */
+static void
+ur_starve(struct event_loop *loop, struct tap_conn *conn, int dir)
+{
+	conn->dir[dir].starved = 1;
+	if (!conn->queued) {
+		conn->queued = 1;
+		conn->next_ready = loop->ready;
+		loop->ready = conn;
+	}
+}
+
+/*
+ * Retry receives that ran out of buffers
+ */
+static void
+ur_feed_starved(struct event_loop *loop)
+{
+	struct tap_conn *conn;
+	struct tap_conn *next;
+	int dir;
+
+	conn = loop->ready;
+	loop->ready = 0;
+	for (; conn; conn = next) {
+		next = conn->next_ready;
+		conn->queued = 0;
+		for (dir = 0; dir < 2; dir++) {
+			if (!conn->dir[dir].starved) {
+				continue;
+			}
+			conn->dir[dir].starved = 0;
+			if ((conn->state != CONN_CLOSED) &&
+					(ur_arm_recv(loop, conn, dir) < 0)) {
+				ur_conn_close(loop, conn);
+			}
+		}
+		ur_conn_maybe_free(loop, conn);
+	}
+}
+
+static void
+on_accept(struct event_loop *loop, struct io_uring_cqe *cqe)
+{
+	struct tap_conn *conn;
+	int one;
+
+	if (!(cqe->flags & IORING_CQE_F_MORE)) {
+		loop->uring->accepting = 0;
+	}
+	if (cqe->res < 0) {
+		if ((cqe->res == -EMFILE) || (cqe->res == -ENFILE) ||
+			(cqe->res == -ENOBUFS) || (cqe->res == -ENOMEM)) {
+			/* Try again once some connection is gone */
+			loop->accept_paused = 1;
+		} else if ((cqe->res != -ECANCELED) && 
+				(cqe->res != -ECONNABORTED)) {
+			ERR("Failed to accept() from socket, errno: %d\n",
+					-cqe->res);
+		}
+	} else {
+		conn = ev_conn_alloc(loop, cqe->res);
+		if (!conn) {
+			EV_SYSCALL(loop);
+			close(cqe->res);
+		} else {
+			one = 1;
+			EV_SYSCALL(loop);
+			setsockopt(cqe->res, IPPROTO_TCP, TCP_NODELAY, &one,
+					sizeof(one));
+			if ((ur_connect(loop, conn) < 0) && 
+					(ur_conn_retry(loop, conn) < 0)) {
+				ur_conn_close(loop, conn);
+			}
+		}
+	}
+	if (!loop->uring->accepting && !loop->accept_paused && 
+			(loop->listener.fd >= 0)) {
+		ur_arm_accept(loop);
+	}
+}
+
+static void
+on_connect(struct event_loop *loop, struct tap_conn *conn, int res)
+{
+	conn->inflight--;
+	if (conn->state == CONN_CLOSED) {
+		ur_conn_maybe_free(loop, conn);
+		return;
+	}
+	if (res < 0) {
+		if (ur_conn_retry(loop, conn) < 0) {
+			ur_conn_close(loop, conn);
+		}
+		return;
+	}
+	hist_add(&loop->stats.connect, ev_now_us() - conn->connect_us);
+	if (conn->backend) {
+		backend_connected(conn->backend);
+	}
+	conn->state = CONN_RELAY;
+	conn->retries = 0;
+	if ((ur_arm_recv(loop, conn, DIR_C2U) < 0) ||
+			(ur_arm_recv(loop, conn, DIR_U2C) < 0)) {
+		ur_conn_close(loop, conn);
+	}
+}
+
+static void
+on_recv(struct event_loop *loop, struct tap_conn *conn, int dir,
+		struct io_uring_cqe *cqe)
+{
+	struct relay_dir *d;
+	unsigned char *buf;
+	unsigned bid;
+	size_t len;
+
+	conn->inflight--;
+	d = &conn->dir[dir];
+	bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+	if (conn->state == CONN_CLOSED) {
+		if (cqe->flags & IORING_CQE_F_BUFFER) {
+			ur_put_buf(loop, bid);
+		}
+		ur_conn_maybe_free(loop, conn);
+		return;
+	}
+	if (cqe->res == -ENOBUFS) {
+		ur_starve(loop, conn, dir);
+		return;
+	}
+	if (cqe->res == -ECANCELED) {
+		/* Linked send failed, that already closed connection */
+		return;
+	}
+	if (cqe->res < 0) {
+		LOG("Peer disconnected mid transmission?\n");
+		ur_conn_close(loop, conn);
+		return;
+	}
+	if (cqe->res == 0) {
+		if (cqe->flags & IORING_CQE_F_BUFFER) {
+			ur_put_buf(loop, bid);
+		}
+		d->eof = 1;
+		d->shut = 1;
+		EV_SYSCALL(loop);
+		shutdown(d->dst->fd, SHUT_WR);
+		if (conn->dir[DIR_C2U].shut && conn->dir[DIR_U2C].shut) {
+			LOG("Peer disconnected\n");
+			ur_conn_close(loop, conn);
+		}
+		return;
+	}
+	ev_dir_received(loop, d, dir, (size_t)cqe->res);
+	buf = uring_buf(&loop->uring->br, bid);
+	len = relay_intercept(loop, conn, dir, buf, (size_t)cqe->res);
+	if (!len) {
+		ur_put_buf(loop, bid);
+		ev_dir_drained(loop, d, dir);
+		if (ur_arm_recv(loop, conn, dir) < 0) {
+			ur_conn_close(loop, conn);
+		}
+		return;
+	}
+	d->bid = (int)bid;
+	if (ur_send_then_recv(loop, conn, dir, buf, len) < 0) {
+		ur_conn_close(loop, conn);
+	}
+}
+
+static void
+on_send(struct event_loop *loop, struct tap_conn *conn, int dir, int res)
+{
+	struct relay_dir *d;
+	struct iovec iov;
+
+	conn->inflight--;
+	d = &conn->dir[dir];
+	if (conn->flow.open && (res > 0) && (d->bid >= 0)) {
+		iov.iov_base = uring_buf(&loop->uring->br, (unsigned)d->bid);
+		iov.iov_len = (size_t)res;
+		capture_data(loop->cfg.capture, &conn->flow, CAPTURE_IF_TX,
+				dir, &iov, (size_t)res);
+	}
+	if (d->bid >= 0) {
+		ur_put_buf(loop, (unsigned)d->bid);
+		d->bid = -1;
+	}
+	if (res > 0) {
+		loop->nbytes += (size_t)res;
+		ev_conn_relayed(loop, conn, dir, (size_t)res);
+		ev_dir_drained(loop, d, dir);
+	}
+	if ((conn->state != CONN_CLOSED) && 
+			((res < 0) || ((size_t)res != d->sending))) {
+		LOG("Peer disconnected mid transmission?\n");
+		ur_conn_close(loop, conn);
+	}
+	ur_conn_maybe_free(loop, conn);
+}
+
+static void
+on_cqe(struct event_loop *loop, struct io_uring_cqe *cqe)
+{
+	struct tap_conn *conn;
+	int tag;
+
+	tag = UD_TAG(cqe->user_data);
+	conn = (struct tap_conn *)UD_PTR(cqe->user_data);
+	switch (tag) {
+	case (UD_ACCEPT):
+		on_accept(loop, cqe);
+		break;
+	case (UD_WAKE):
+		if (__atomic_load_n(&loop->stop, __ATOMIC_ACQUIRE) != 
+				EV_STOP_NOW) {
+			ur_arm_wake(loop);
+		}
+		break;
+	case (UD_CONNECT):
+		on_connect(loop, conn, cqe->res);
+		break;
+	case (UD_RECV + DIR_C2U):
+	case (UD_RECV + DIR_U2C):
+		on_recv(loop, conn, tag - UD_RECV, cqe);
+		break;
+	case (UD_SEND + DIR_C2U):
+	case (UD_SEND + DIR_U2C):
+		on_send(loop, conn, tag - UD_SEND, cqe->res);
+		break;
+	case (UD_TIMEOUT):
+		/* Connect completes with -ECANCELED if this fired */
+		if (cqe->res == -ETIME) {
+			EV_STAT_ADD(loop, connect_timeouts, 1);
+		}
+		conn->inflight--;
+		ur_conn_maybe_free(loop, conn);
+		break;
+	case (UD_BACKOFF):
+		conn->inflight--;
+		if (conn->state == CONN_CLOSED) {
+			ur_conn_maybe_free(loop, conn);
+		} else if ((ur_connect(loop, conn) < 0) && 
+				(ur_conn_retry(loop, conn) < 0)) {
+			ur_conn_close(loop, conn);
+		}
+		break;
+	case (UD_CANCEL):
+		if (conn) {
+			conn->inflight--;
+			ur_conn_maybe_free(loop, conn);
+		}
+		break;
+	}
+}
+
+/*
+ * Returns:
+ * 	amount of receive buffers to use, power of 2
+ */
+static unsigned
+ur_nbufs(size_t buf_size)
+{
+	unsigned n;
+
+	n = URING_BUFS_MAX;
+	while ((n > URING_BUFS_MIN) && (((size_t)n * buf_size) > URING_BUF_MEM)) {
+		n >>= 1;
+	}
+	return n;
+}
+
+int
+uring_loop_init(struct event_loop *loop)
+{
+	struct uring_loop *ur;
+	int stat;
+
+	ur = (struct uring_loop *)calloc(1, sizeof(*ur));
+	if (!ur) {
+		return -1;
+	}
+	stat = uring_init(&ur->ring, URING_ENTRIES);
+	if (stat < 0) {
+		LOG("io_uring_setup() errored with errno: %d\n", -stat);
+		free(ur);
+		return -1;
+	}
+	if (!uring_op_supported(&ur->ring, IORING_OP_SEND) ||
+	    !uring_op_supported(&ur->ring, IORING_OP_RECV) ||
+	    !uring_op_supported(&ur->ring, IORING_OP_ACCEPT) ||
+	    !uring_op_supported(&ur->ring, IORING_OP_CONNECT) ||
+	    !uring_op_supported(&ur->ring, IORING_OP_ASYNC_CANCEL) ||
+	    !uring_op_supported(&ur->ring, IORING_OP_TIMEOUT) ||
+	    !uring_op_supported(&ur->ring, IORING_OP_LINK_TIMEOUT) ||
+	    !(ur->ring.features & IORING_FEAT_NODROP)) {
+		LOG("io_uring lacks operations we need\n");
+		uring_exit(&ur->ring);
+		free(ur);
+		return -1;
+	}
+	/* 
+	 * Provided buffer rings came with multishot accept (5.19), so 
+	 * this tells us if we have both
+	 */
+	stat = uring_buf_ring_init(&ur->ring, &ur->br, 
+			ur_nbufs(loop->cfg.tx_size), loop->cfg.tx_size,
+			URING_BGID);
+	if (stat < 0) {
+		LOG("io_uring buffer ring not supported, errno: %d\n", -stat);
+		uring_exit(&ur->ring);
+		free(ur);
+		return -1;
+	}
+	loop->uring = ur;
+	return 0;
+}
+
+int
+uring_loop_run(struct event_loop *loop)
+{
+	struct uring_loop *ur;
+	struct io_uring_cqe *cqe;
+	struct io_uring_cqe c;
+	int stop;
+	int stat;
+
+	ur = loop->uring;
+	if (ur_arm_wake(loop) < 0) {
+		return -1;
+	}
+	if ((loop->listener.fd >= 0) && (ur_arm_accept(loop) < 0)) {
+		return -1;
+	}
+	for (;;) {
+		stop = __atomic_load_n(&loop->stop, __ATOMIC_ACQUIRE);
+		if (stop == EV_STOP_NOW) {
+			break;
+		}
+		if (stop == EV_STOP_DRAIN) {
+			if (loop->listener.fd >= 0) {
+				ur_cancel_fd(loop, 0, loop->listener.fd);
+				EV_SYSCALL(loop);
+				close(loop->listener.fd);
+				loop->listener.fd = -1;
+				loop->accept_paused = 0;
+			}
+			if (!loop->nconns) {
+				break;
+			}
+		}
+		EV_SYSCALL(loop);
+		stat = uring_submit(&ur->ring, 1);
+		if ((stat < 0) && (stat != -EINTR) && (stat != -EBUSY) &&
+				(stat != -EAGAIN)) {
+			ERR("io_uring_enter() errored with errno: %d\n", -stat);
+			return -1;
+		}
+		ur->returned = 0;
+		while ((cqe = uring_peek_cqe(&ur->ring)) != 0) {
+			memcpy(&c, cqe, sizeof(c));
+			uring_cqe_seen(&ur->ring);
+			on_cqe(loop, &c);
+		}
+		if (ur->returned && loop->ready) {
+			ur_feed_starved(loop);
+		}
+	}
+	return 0;
+}
+
+void
+uring_loop_destroy(struct event_loop *loop)
+{
+	struct uring_loop *ur;
+	struct tap_conn *conn;
+	struct tap_conn *next;
+
+	ur = loop->uring;
+	if (!ur) {
+		return;
+	}
+	/* Kernel is done with our memory once the ring is gone */
+	uring_buf_ring_free(&ur->ring, &ur->br);
+	uring_exit(&ur->ring);
+
+	for (conn = loop->conns; conn; conn = next) {
+		next = conn->next;
+		if (conn->client.fd >= 0) {
+			close(conn->client.fd);
+		}
+		if (conn->upstream.fd >= 0) {
+			close(conn->upstream.fd);
+		}
+		ev_conn_unlink(loop, conn);
+		ev_conn_free(conn);
+	}
+	loop->ready = 0;
+	free(ur);
+	loop->uring = 0;
+}
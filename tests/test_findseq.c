@@ -0,0 +1,144 @@
+/*
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2022, k4m1
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIA LDAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVE RCAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * findseq() against a search that compares at every offset, with each
+ * short needle kernel the cpu has and with Horspool for long needles.
+ * Text has few different bytes so near misses are common.
+ */
+#include <sys/types.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <findseq.h>
+#include <intercept_helpers.h>
+
+#include "test.h"
+
+#define TEST_DLEN_MAX 1024
+#define TEST_WLEN_MAX (FINDSEQ_SHORT_MAX + 64)
+#define TEST_ROUNDS 20000
+
+static void *
+findseq_naive(void *data, void *what, size_t dlen, size_t wlen)
+{
+	unsigned char *d;
+	size_t off;
+
+	d = (unsigned char *)data;
+	for (off = 0; off + wlen <= dlen; off++) {
+		if (!memcmp(&d[off], what, wlen)) {
+			return &d[off];
+		}
+	}
+	return 0;
+}
+
+static void
+fill(unsigned char *buf, size_t len, int alphabet)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		buf[i] = (unsigned char)('a' + (rand() % alphabet));
+	}
+}
+
+/*
+ * Search needle from data with every kernel that takes it
+ */
+static void
+check_one(unsigned char *data, size_t dlen, unsigned char *what,
+		size_t wlen)
+{
+	findseq_fn fn;
+	void *want;
+	int kind;
+
+	want = findseq_naive(data, what, dlen, wlen);
+	CHECK(findseq(data, what, dlen, wlen) == want);
+	if (wlen <= dlen) {
+		CHECK(findseq_horspool(data, what, dlen, wlen) == want);
+	}
+	if ((wlen < 2) || (wlen > FINDSEQ_SHORT_MAX) || (wlen > dlen)) {
+		return;
+	}
+	for (kind = FINDSEQ_GENERIC; kind <= FINDSEQ_AVX2; kind++) {
+		fn = findseq_kernel(kind);
+		if (fn) {
+			CHECK(fn(data, what, dlen, wlen) == want);
+		}
+	}
+}
+
+int
+main(void)
+{
+	unsigned char data[TEST_DLEN_MAX];
+	unsigned char what[TEST_WLEN_MAX];
+	size_t dlen;
+	size_t wlen;
+	size_t off;
+	int alphabet;
+	int i;
+
+	srand(1337);
+	for (i = 0; i < TEST_ROUNDS; i++) {
+		alphabet = 2 + (rand() % 3);
+		dlen = (size_t)rand() % TEST_DLEN_MAX;
+		wlen = 1 + ((size_t)rand() % (TEST_WLEN_MAX - 1));
+		if (i & 1) {
+			/* Often very short, where blocks end early */
+			dlen %= 80;
+			wlen = 1 + (wlen % 24);
+		}
+		fill(data, dlen, alphabet);
+		fill(what, wlen, alphabet);
+		/* Plant needle half of the time, often at either end */
+		if ((i & 2) && (wlen <= dlen)) {
+			off = (size_t)rand() % (dlen - wlen + 1);
+			if (i & 4) {
+				off = (i & 8) ? 0 : (dlen - wlen);
+			}
+			memcpy(&data[off], what, wlen);
+		}
+		check_one(data, dlen, what, wlen);
+	}
+	/* Zero bytes are data like any other */
+	memset(data, 0, sizeof(data));
+	data[sizeof(data) - 1] = 1;
+	what[0] = 0;
+	what[1] = 1;
+	check_one(data, sizeof(data), what, 2);
+	return test_done("findseq");
+}
@@ -0,0 +1,187 @@
+/*
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2022, k4m1
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIA LDAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVE RCAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * replace_patterns_to_iov() against replacing at every offset: where
+ * matches overlap the one ending first is replaced, the longest of
+ * those ending at the same byte, and matching goes on after it.
+ */
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <ac_match.h>
+#include <intercept_helpers.h>
+
+#include "test.h"
+
+#define TEST_PATTERNS 8
+#define TEST_PLEN_MAX 6
+#define TEST_WLEN_MAX 8
+#define TEST_DLEN_MAX 512
+#define TEST_IOV 1024
+#define TEST_ROUNDS 5000
+
+struct test_set {
+	unsigned char *pats[TEST_PATTERNS];
+	size_t lens[TEST_PATTERNS];
+	unsigned char *with[TEST_PATTERNS];
+	size_t wlens[TEST_PATTERNS];
+	unsigned char pbuf[TEST_PATTERNS][TEST_PLEN_MAX];
+	unsigned char wbuf[TEST_PATTERNS][TEST_WLEN_MAX];
+	int cnt;
+};
+
+/*
+ * Returns:
+ * 	length of output
+ */
+static size_t
+replace_naive(struct test_set *s, unsigned char *data, size_t dlen,
+		unsigned char *out)
+{
+	size_t last;
+	size_t olen;
+	size_t e;
+	int best;
+	int i;
+
+	last = 0;
+	olen = 0;
+	for (e = 1; e <= dlen; e++) {
+		best = -1;
+		for (i = 0; i < s->cnt; i++) {
+			if ((s->lens[i] > e - last) ||
+					memcmp(&data[e - s->lens[i]], s->pats[i],
+						s->lens[i])) {
+				continue;
+			}
+			if ((best < 0) || (s->lens[i] > s->lens[best])) {
+				best = i;
+			}
+		}
+		if (best < 0) {
+			continue;
+		}
+		memcpy(&out[olen], &data[last], e - s->lens[best] - last);
+		olen += e - s->lens[best] - last;
+		memcpy(&out[olen], s->with[best], s->wlens[best]);
+		olen += s->wlens[best];
+		last = e;
+	}
+	memcpy(&out[olen], &data[last], dlen - last);
+	return olen + dlen - last;
+}
+
+static void
+make_set(struct test_set *s, int alphabet)
+{
+	size_t j;
+	int dup;
+	int i;
+	int k;
+
+	s->cnt = 1 + (rand() % TEST_PATTERNS);
+	for (i = 0; i < s->cnt; i++) {
+		do {
+			s->lens[i] = 1 + ((size_t)rand() % TEST_PLEN_MAX);
+			for (j = 0; j < s->lens[i]; j++) {
+				s->pbuf[i][j] = (unsigned char)('a' +
+						(rand() % alphabet));
+			}
+			/* Automaton takes every pattern once */
+			dup = 0;
+			for (k = 0; k < i; k++) {
+				dup |= (s->lens[k] == s->lens[i]) &&
+					!memcmp(s->pbuf[k], s->pbuf[i], 
+							s->lens[i]);
+			}
+		} while (dup);
+		s->pats[i] = s->pbuf[i];
+		s->wlens[i] = (size_t)rand() % (TEST_WLEN_MAX + 1);
+		for (j = 0; j < s->wlens[i]; j++) {
+			s->wbuf[i][j] = (unsigned char)('A' + (rand() % 26));
+		}
+		s->with[i] = s->wbuf[i];
+	}
+}
+
+int
+main(void)
+{
+	static unsigned char want[TEST_DLEN_MAX * TEST_WLEN_MAX];
+	static unsigned char got[TEST_DLEN_MAX * TEST_WLEN_MAX];
+	unsigned char data[TEST_DLEN_MAX];
+	struct iovec iov[TEST_IOV];
+	struct ac_automaton ac;
+	struct test_set s;
+	size_t wlen;
+	size_t glen;
+	size_t dlen;
+	size_t j;
+	int alphabet;
+	int cnt;
+	int i;
+
+	srand(1337);
+	for (i = 0; i < TEST_ROUNDS; i++) {
+		alphabet = 2 + (rand() % 4);
+		make_set(&s, alphabet);
+		if (ac_build(&ac, s.pats, s.lens, (uint32_t)s.cnt) < 0) {
+			CHECK(!"ac_build");
+			continue;
+		}
+		dlen = (size_t)rand() % TEST_DLEN_MAX;
+		for (j = 0; j < dlen; j++) {
+			data[j] = (unsigned char)('a' + (rand() % alphabet));
+		}
+		wlen = replace_naive(&s, data, dlen, want);
+		cnt = replace_patterns_to_iov(data, dlen, &ac, s.with, 
+				s.wlens, iov, TEST_IOV);
+		CHECK(cnt >= 0);
+		glen = 0;
+		for (j = 0; (int)j < cnt; j++) {
+			memcpy(&got[glen], iov[j].iov_base, iov[j].iov_len);
+			glen += iov[j].iov_len;
+		}
+		CHECK((glen == wlen) && !memcmp(got, want, wlen));
+		/* Output that doesn't fit isn't cut short */
+		if ((cnt > 1) && (replace_patterns_to_iov(data, dlen, &ac,
+					s.with, s.wlens, iov, 1) >= 0)) {
+			CHECK(!"iov too small");
+		}
+		ac_free(&ac);
+	}
+	return test_done("replace_iov");
+}
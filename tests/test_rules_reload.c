@@ -0,0 +1,203 @@
+/*
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2022, k4m1
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIA LDAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVE RCAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Reloading rules under a live direction, the way event loop moves a
+ * direction with dir_repin(): a generation it pinned stays valid past
+ * reclaim, and limits already hit carry over to the same rules in the
+ * new generation while changed rules count from 0.
+ */
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <ring_buf.h>
+#include <rules_domain.h>
+#include <stream_match.h>
+
+#include "test.h"
+
+#define TEST_IOV 16
+
+/*
+ * Direction of a connection, as much of it as matching needs
+ */
+struct test_dir {
+	struct rules_gen *gen;
+	struct stream_ctx ctx;
+	struct ring_buf ring;
+};
+
+/*
+ * Pass one read through rules of direction, and compare output to want
+ */
+static void
+pass(struct test_dir *d, const char *in, const char *want)
+{
+	struct iovec iov[TEST_IOV];
+	char out[256];
+	size_t olen;
+	size_t len;
+	int cnt;
+	int i;
+
+	len = strlen(in);
+	if ((ring_push(&d->ring, in, len, SIZE_MAX) != len) || 
+			(stream_scan(&d->gen->rules, &d->ctx, 0, &d->ring, 
+				     len) < 0)) {
+		CHECK(!"stream_scan");
+		return;
+	}
+	/* Reads end with a byte no pattern has, nothing is held */
+	CHECK(!d->ctx.held);
+	olen = 0;
+	while ((cnt = stream_peek_iov(&d->ctx, &d->ring, iov, 
+					TEST_IOV)) > 0) {
+		len = 0;
+		for (i = 0; i < cnt; i++) {
+			if (olen + iov[i].iov_len <= sizeof(out)) {
+				memcpy(&out[olen], iov[i].iov_base, 
+						iov[i].iov_len);
+			}
+			olen += iov[i].iov_len;
+			len += iov[i].iov_len;
+		}
+		stream_consume(&d->ctx, &d->ring, len);
+	}
+	stream_consume(&d->ctx, &d->ring, 0);
+	CHECK((olen == strlen(want)) && !memcmp(out, want, olen));
+}
+
+/*
+ * Build rules from what/with pairs with limit 1, and publish them
+ */
+static int
+publish(struct rules_domain *dom, const char **pairs, int cnt)
+{
+	struct stream_rule_def defs[4];
+	struct stream_rules rules;
+	int i;
+
+	memset(defs, 0, sizeof(defs));
+	for (i = 0; i < cnt; i++) {
+		defs[i].what = (unsigned char *)pairs[2 * i];
+		defs[i].what_len = strlen(pairs[2 * i]);
+		defs[i].with = (unsigned char *)pairs[2 * i + 1];
+		defs[i].with_len = strlen(pairs[2 * i + 1]);
+		defs[i].dirs = STREAM_BOTH;
+		defs[i].limit = 1;
+	}
+	if (stream_rules_build(&rules, defs, (uint32_t)cnt) < 0) {
+		return -1;
+	}
+	return rules_domain_publish(dom, &rules);
+}
+
+/*
+ * Move direction to current generation
+ */
+static void
+repin(struct rules_domain *dom, struct test_dir *d)
+{
+	struct rules_gen *gen;
+
+	gen = rules_domain_get(dom);
+	CHECK(gen && (gen != d->gen));
+	if (!gen) {
+		return;
+	}
+	CHECK(stream_ctx_rebind(&d->ctx, &d->gen->rules, &gen->rules) == 0);
+	rules_gen_put(d->gen);
+	d->gen = gen;
+}
+
+int
+main(void)
+{
+	static const char *first[] = { "AAA", "BBB" };
+	static const char *second[] = { "CCC", "DDD", "AAA", "BBB" };
+	static const char *third[] = { "CCC", "DDD", "AAA", "XYZ" };
+	struct rules_domain dom;
+	struct test_dir d;
+
+	memset(&d, 0, sizeof(d));
+	if (rules_domain_init(&dom, 1) < 0) {
+		CHECK(!"rules_domain_init");
+		return test_done("rules_reload");
+	}
+	rules_domain_online(&dom, 0);
+	CHECK(publish(&dom, first, 1) == 0);
+	d.gen = rules_domain_get(&dom);
+	CHECK(d.gen != 0);
+	if (!d.gen) {
+		rules_domain_destroy(&dom);
+		return test_done("rules_reload");
+	}
+	pass(&d, "AAA.", "BBB.");
+	pass(&d, "AAA.", "AAA.");
+
+	/* Old generation waits for the reader, and then for direction */
+	CHECK(publish(&dom, second, 2) == 0);
+	CHECK(rules_domain_reclaim(&dom) == 1);
+	rules_domain_online(&dom, 0);
+	CHECK(rules_domain_reclaim(&dom) == 0);
+	pass(&d, "AAA CCC.", "AAA CCC.");
+
+	/* Same rule at another index keeps its count, new one has its own */
+	repin(&dom, &d);
+	pass(&d, "AAA CCC.", "AAA DDD.");
+	pass(&d, "AAA CCC.", "AAA CCC.");
+
+	/* Changed replacement is a new rule */
+	CHECK(publish(&dom, third, 2) == 0);
+	repin(&dom, &d);
+	pass(&d, "AAA CCC.", "XYZ CCC.");
+	pass(&d, "AAA CCC.", "AAA CCC.");
+
+	/* Direction without limits hit has no counters to move */
+	stream_ctx_free(&d.ctx);
+	CHECK(publish(&dom, second, 2) == 0);
+	repin(&dom, &d);
+	CHECK(!d.ctx.counts);
+	pass(&d, "CCC AAA.", "DDD BBB.");
+
+	rules_gen_put(d.gen);
+	stream_ctx_free(&d.ctx);
+	ring_free(&d.ring);
+	rules_domain_online(&dom, 0);
+	rules_domain_reclaim(&dom);
+	rules_domain_destroy(&dom);
+	return test_done("rules_reload");
+}
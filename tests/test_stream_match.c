@@ -0,0 +1,254 @@
+/*
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2022, k4m1
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIA LDAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVE RCAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * stream_scan() over data split into reads at random, output has to be
+ * the same as replacing in one buffer however it's split. Rules are
+ * also checked with limits, and with a pattern held back when its rest
+ * never arrives.
+ */
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <ring_buf.h>
+#include <stream_match.h>
+
+#include "test.h"
+
+#define TEST_RULES 6
+#define TEST_PLEN_MAX 12
+#define TEST_WLEN_MAX 16
+#define TEST_DLEN_MAX 2048
+#define TEST_IOV 64
+#define TEST_ROUNDS 3000
+
+struct test_out {
+	unsigned char buf[TEST_DLEN_MAX * TEST_WLEN_MAX];
+	size_t len;
+};
+
+/*
+ * Take what can be sent, as relay would
+ */
+static void
+drain(struct stream_ctx *ctx, struct ring_buf *r, struct test_out *out)
+{
+	struct iovec iov[TEST_IOV];
+	size_t len;
+	int cnt;
+	int i;
+
+	while ((cnt = stream_peek_iov(ctx, r, iov, TEST_IOV)) > 0) {
+		len = 0;
+		for (i = 0; i < cnt; i++) {
+			memcpy(&out->buf[out->len], iov[i].iov_base,
+					iov[i].iov_len);
+			out->len += iov[i].iov_len;
+			len += iov[i].iov_len;
+		}
+		stream_consume(ctx, r, len);
+	}
+	stream_consume(ctx, r, 0);
+}
+
+/*
+ * Pass data through rules in reads of given sizes, 0 ends sizes
+ *
+ * Returns:
+ * 	0 on success or -1 on error
+ */
+static int
+run(struct stream_rules *rules, unsigned char *data, size_t dlen,
+		size_t *reads, struct test_out *out)
+{
+	struct stream_ctx ctx;
+	struct ring_buf r;
+	size_t off;
+	size_t n;
+	int stat;
+	int i;
+
+	memset(&ctx, 0, sizeof(ctx));
+	memset(&r, 0, sizeof(r));
+	out->len = 0;
+	stat = 0;
+	for (i = 0, off = 0; off < dlen; i++, off += n) {
+		n = reads[i] ? reads[i] : (dlen - off);
+		if (n > dlen - off) {
+			n = dlen - off;
+		}
+		if ((ring_push(&r, &data[off], n, SIZE_MAX) != n) ||
+				(stream_scan(rules, &ctx, 0, &r, n) < 0)) {
+			stat = -1;
+			break;
+		}
+		drain(&ctx, &r, out);
+		/* Only bytes that may start a pattern are held */
+		CHECK(ctx.held < TEST_PLEN_MAX);
+	}
+	/* Peer is done, held back bytes go out as they are */
+	stream_release(&ctx);
+	drain(&ctx, &r, out);
+	CHECK(!ring_used(&r));
+	ring_free(&r);
+	stream_ctx_free(&ctx);
+	return stat;
+}
+
+static void
+make_rules(struct stream_rule_def *defs, unsigned char pbuf[][TEST_PLEN_MAX],
+		unsigned char wbuf[][TEST_WLEN_MAX], int cnt, int alphabet)
+{
+	size_t j;
+	int dup;
+	int i;
+	int k;
+
+	memset(defs, 0, (size_t)cnt * sizeof(*defs));
+	for (i = 0; i < cnt; i++) {
+		do {
+			defs[i].what_len = 1 + ((size_t)rand() % TEST_PLEN_MAX);
+			for (j = 0; j < defs[i].what_len; j++) {
+				pbuf[i][j] = (unsigned char)('a' + 
+						(rand() % alphabet));
+			}
+			dup = 0;
+			for (k = 0; k < i; k++) {
+				dup |= (defs[k].what_len == defs[i].what_len) &&
+					!memcmp(pbuf[k], pbuf[i], 
+							defs[i].what_len);
+			}
+		} while (dup);
+		defs[i].what = pbuf[i];
+		defs[i].with_len = (size_t)rand() % (TEST_WLEN_MAX + 1);
+		for (j = 0; j < defs[i].with_len; j++) {
+			wbuf[i][j] = (unsigned char)('A' + (rand() % 26));
+		}
+		defs[i].with = wbuf[i];
+		defs[i].dirs = STREAM_BOTH;
+	}
+}
+
+static void
+test_splits(void)
+{
+	static unsigned char pbuf[TEST_RULES][TEST_PLEN_MAX];
+	static unsigned char wbuf[TEST_RULES][TEST_WLEN_MAX];
+	static struct test_out whole;
+	static struct test_out split;
+	struct stream_rule_def defs[TEST_RULES];
+	unsigned char data[TEST_DLEN_MAX];
+	struct stream_rules rules;
+	size_t reads[TEST_DLEN_MAX + 1];
+	size_t dlen;
+	size_t j;
+	int alphabet;
+	int cnt;
+	int i;
+
+	for (i = 0; i < TEST_ROUNDS; i++) {
+		alphabet = 2 + (rand() % 4);
+		cnt = 1 + (rand() % TEST_RULES);
+		make_rules(defs, pbuf, wbuf, cnt, alphabet);
+		if (stream_rules_build(&rules, defs, (uint32_t)cnt) < 0) {
+			CHECK(!"stream_rules_build");
+			continue;
+		}
+		dlen = (size_t)rand() % TEST_DLEN_MAX;
+		for (j = 0; j < dlen; j++) {
+			data[j] = (unsigned char)('a' + (rand() % alphabet));
+		}
+		reads[0] = 0;
+		CHECK(run(&rules, data, dlen, reads, &whole) == 0);
+		/* Reads of 1 byte up to a couple of patterns long */
+		for (j = 0; j < dlen; j++) {
+			reads[j] = 1 + ((size_t)rand() % 
+					((i & 1) ? 2 : 2 * TEST_PLEN_MAX));
+		}
+		reads[dlen] = 0;
+		CHECK(run(&rules, data, dlen, reads, &split) == 0);
+		CHECK((whole.len == split.len) && 
+				!memcmp(whole.buf, split.buf, whole.len));
+		stream_rules_free(&rules);
+	}
+}
+
+/*
+ * Known output, limits and a pattern that's cut off
+ */
+static void
+test_fixed(void)
+{
+	static struct test_out out;
+	struct stream_rule_def defs[2];
+	struct stream_rules rules;
+	unsigned char *data;
+	size_t reads[8];
+
+	memset(defs, 0, sizeof(defs));
+	defs[0].what = (unsigned char *)"TEST";
+	defs[0].what_len = 4;
+	defs[0].with = (unsigned char *)"LMAO!";
+	defs[0].with_len = 5;
+	defs[0].dirs = STREAM_C2U;
+	defs[0].limit = 2;
+	defs[1].what = (unsigned char *)"drop";
+	defs[1].what_len = 4;
+	defs[1].with_len = 0;
+	defs[1].dirs = STREAM_BOTH;
+	CHECK(stream_rules_build(&rules, defs, 2) == 0);
+
+	/* Bytes left after deleting aren't matched again */
+	data = (unsigned char *)"TESTxTEdropSTyTESTzTESTTE";
+	reads[0] = 1;
+	reads[1] = 6;
+	reads[2] = 3;
+	reads[3] = 2;
+	reads[4] = 0;
+	CHECK(run(&rules, data, strlen((char *)data), reads, &out) == 0);
+	CHECK((out.len == 23) && 
+			!memcmp(out.buf, "LMAO!xTESTyLMAO!zTESTTE", 23));
+	stream_rules_free(&rules);
+}
+
+int
+main(void)
+{
+	srand(1337);
+	test_fixed();
+	test_splits();
+	return test_done("stream_match");
+}
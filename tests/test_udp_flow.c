@@ -0,0 +1,145 @@
+/*
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2022, k4m1
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIA LDAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVE RCAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Flow table of the UDP relay. Flows are added and removed at random
+ * with hashes bunched together, so runs are long and wrap around the
+ * end of table, and every flow left has to be found after each removal.
+ * Table functions are static, so the relay is built into this test.
+ */
+#include <sys/types.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/udp_relay.c"
+
+#include "test.h"
+
+#define TEST_FLOWS 600
+#define TEST_STEPS 20000
+
+/*
+ * Hash of a new flow, mostly a few slots at the start, middle and end
+ * of table whatever its size
+ */
+static uint32_t
+test_hash(void)
+{
+	switch (rand() % 4) {
+	case (0):
+		return UINT32_MAX - (uint32_t)(rand() % 8);
+	case (1):
+		return (uint32_t)(rand() % 8);
+	case (2):
+		return (UINT32_MAX / 2) + (uint32_t)(rand() % 8);
+	default:
+		return (uint32_t)rand();
+	}
+}
+
+/*
+ * Every flow in table is found, and the table has nothing else
+ */
+static void
+check_table(struct udp_relay *u, struct udp_flow **live, size_t nlive)
+{
+	size_t used;
+	size_t i;
+
+	CHECK(u->nflows == nlive);
+	for (i = 0; i < nlive; i++) {
+		CHECK(flow_find(u, &live[i]->client, live[i]->local,
+					live[i]->hash) == live[i]);
+	}
+	used = 0;
+	for (i = 0; i < u->size; i++) {
+		used += !!u->flows[i];
+	}
+	CHECK(used == nlive);
+}
+
+int
+main(void)
+{
+	struct udp_flow *live[TEST_FLOWS];
+	struct udp_flow *f;
+	struct udp_relay u;
+	uint32_t port;
+	size_t nlive;
+	size_t i;
+	int step;
+
+	srand(1337);
+	memset(&u, 0, sizeof(u));
+	nlive = 0;
+	port = 1;
+	for (step = 0; step < TEST_STEPS; step++) {
+		/* Grow to the most flows, then churn */
+		if ((nlive < TEST_FLOWS) && (!nlive || 
+					(rand() % 3) || (step < TEST_FLOWS))) {
+			if (((u.nflows + 1) * 2 > u.size) && 
+					(flows_grow(&u) < 0)) {
+				CHECK(!"flows_grow");
+				break;
+			}
+			f = (struct udp_flow *)calloc(1, sizeof(*f));
+			if (!f) {
+				CHECK(!"calloc");
+				break;
+			}
+			f->client.sin_addr.s_addr = htonl(0x7f000001);
+			f->client.sin_port = htons((uint16_t)port++);
+			f->hash = test_hash();
+			flow_place(u.flows, u.size, f);
+			u.nflows++;
+			live[nlive++] = f;
+		} else {
+			i = (size_t)rand() % nlive;
+			f = live[i];
+			flow_remove(&u, f);
+			live[i] = live[--nlive];
+			CHECK(!flow_find(&u, &f->client, f->local, f->hash));
+			free(f);
+		}
+		if (!(step % 16) || (step >= TEST_STEPS - 64)) {
+			check_table(&u, live, nlive);
+		}
+	}
+	check_table(&u, live, nlive);
+	for (i = 0; i < nlive; i++) {
+		free(live[i]);
+	}
+	free(u.flows);
+	return test_done("udp_flow");
+}
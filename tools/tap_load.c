@@ -0,0 +1,1266 @@
+/*
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2022, k4m1
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIA LDAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVE RCAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * tap-load, a load generator for sizing tap. Worker threads start
+ * requests at a fixed arrival rate whether earlier ones finished or not
+ * (open loop), either each over a connection of its own (--mode conn) or
+ * over a pool of persistent connections (--mode stream), optionally with
+ * --idle connections held open next to them. Requests go to --target,
+ * normally tap, which is pointed at the stand-in backend this runs on
+ * --backend.
+ *
+ * Backend stamps when it accepted the connection, got the request and
+ * sent the response into the response, and shares the clock with the
+ * workers, so time spent in the backend is told apart from time spent
+ * getting there & back. Latencies counted from when a request was due
+ * rather than when it was sent are corrected for coordinated omission,
+ * a stall holding requests back shows up in them. Output is key=value
+ * lines like the benchmarks.
+ */
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <log.h>
+#include <net_io.h>
+
+#define LOAD_MAGIC 	0x7a9c10adU
+#define LOAD_EVENTS 	256
+#define LOAD_CHUNK 	65536
+#define LOAD_SIZE_MAX 	(1U << 30)
+#define LOAD_SAMPLE_MS 	100 		/* throughput interval */
+#define LOAD_DRAIN_MS 	2000 		/* wait for late responses */
+
+enum load_mode {
+	MODE_CONN,
+	MODE_STREAM,
+};
+
+/* Latencies recorded per request */
+enum load_lat {
+	LAT_CONNECT, 		/* connect() until connected, conn mode */
+	LAT_ACCEPT, 		/* connect() until backend accepted, conn mode */
+	LAT_TTFB, 		/* request sent until first byte back */
+	LAT_TTFB_CO, 		/* request due until first byte back */
+	LAT_TOTAL_CO, 		/* request due until last byte back */
+	LAT_UP, 		/* request sent until backend got it */
+	LAT_DOWN, 		/* backend sent until first byte back */
+	LAT_ADDED, 		/* up + down, ttfb less backend */
+	LAT_BACKEND, 		/* backend got request until it responded */
+	LAT_N,
+};
+
+static char *lat_names[LAT_N] = {
+	"connect",
+	"accept",
+	"ttfb",
+	"ttfb_corrected",
+	"total_corrected",
+	"up",
+	"down",
+	"added",
+	"backend",
+};
+
+/* Sent by client, size is how much backend responds with */
+struct load_req {
+	uint32_t magic;
+	uint32_t size;
+};
+
+/* Starts every response, rest of it is filler */
+struct load_resp {
+	uint64_t accept_ns;
+	uint64_t req_ns;
+	uint64_t resp_ns;
+};
+
+struct load_opts {
+	char *target;
+	char *backend;
+	int mode;
+	int rate; 		/* requests per second over all workers */
+	int threads;
+	int backend_threads;
+	int conns; 		/* persistent connections, stream mode */
+	int idle;
+	int max_inflight; 	/* per worker, conn mode */
+	size_t size;
+	double duration;
+	double warmup;
+};
+
+/* Latencies in ns */
+struct samples {
+	uint64_t *v;
+	size_t n;
+	size_t cap;
+};
+
+enum conn_state {
+	C_CONNECTING,
+	C_WAITING, 		/* request sent */
+	C_READY, 		/* persistent, waiting for a request */
+	C_IDLE, 		/* held open, never used */
+};
+
+struct load_conn {
+	int sock;
+	int state;
+	uint64_t due_ns; 	/* when request was due */
+	uint64_t start_ns; 	/* connect() */
+	uint64_t sent_ns;
+	uint64_t first_ns;
+	size_t got;
+	struct load_resp resp;
+	struct load_conn *next; /* of ready ones */
+};
+
+struct load;
+
+struct load_worker {
+	struct load *l;
+	int id;
+	pthread_t thread;
+	int epfd;
+	int tfd;
+	int failed_setup;
+	uint64_t t0;
+	uint64_t measure_ns; 	/* requests due before are warmup */
+	uint64_t interval; 	/* ns between requests */
+	uint64_t total; 	/* requests due before the end */
+	uint64_t due; 		/* requests due so far */
+	uint64_t started;
+	uint64_t max_backlog;
+	int inflight;
+	int nconns; 		/* persistent & idle */
+	struct load_conn *conns;
+	struct load_conn *ready;
+	struct samples lat[LAT_N];
+	uint64_t completed; 	/* these are of measured requests */
+	uint64_t connects;
+	uint64_t failed;
+	uint64_t lost; 		/* persistent or idle connections closed */
+	uint64_t bytes; 	/* read, sampled by main thread */
+};
+
+struct load_backend {
+	struct load *l;
+	pthread_t thread;
+	int epfd;
+	int lsock;
+	struct be_conn *conns;
+	uint64_t accepts;
+};
+
+/* Backend side of a connection */
+struct be_conn {
+	int sock;
+	uint64_t accept_ns;
+	struct load_req req;
+	size_t got;
+	struct load_resp resp;
+	size_t off; 		/* of response sent */
+	size_t size;
+	struct be_conn *prev;
+	struct be_conn *next;
+};
+
+struct load {
+	struct load_opts opts;
+	struct sockaddr_in target;
+	struct load_worker *w;
+	struct load_backend *b;
+	pthread_barrier_t barrier;
+	uint64_t start_ns;
+	int abort;
+	volatile int be_stop;
+};
+
+static unsigned char filler[LOAD_CHUNK];
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL) + (uint64_t)ts.tv_nsec;
+}
+
+static void
+samples_add(struct samples *s, uint64_t v)
+{
+	uint64_t *n;
+	size_t cap;
+
+	if (s->n == s->cap) {
+		cap = s->cap ? (s->cap * 2) : 4096;
+		n = (uint64_t *)realloc(s->v, cap * sizeof(*n));
+		/* Out of memory loses samples rather than the run */
+		if (!n) {
+			return;
+		}
+		s->v = n;
+		s->cap = cap;
+	}
+	s->v[s->n++] = v;
+}
+
+static int
+cmp_u64(const void *a, const void *b)
+{
+	uint64_t x;
+	uint64_t y;
+
+	x = *(const uint64_t *)a;
+	y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+	double x;
+	double y;
+
+	x = *(const double *)a;
+	y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+/* Index of permille pm in n sorted values, 999 is p99.9 */
+static size_t
+permille(size_t n, int pm)
+{
+	size_t i;
+
+	i = (n * (size_t)pm) / 1000;
+	return (i >= n) ? (n - 1) : i;
+}
+
+/* Split ADDR:PORT, addr points into buf */
+static int
+parse_addr(char *s, char *buf, size_t size, short *port)
+{
+	char *colon;
+
+	colon = strrchr(s, ':');
+	if (!colon || ((size_t)(colon - s) >= size) || !atoi(colon + 1)) {
+		ERR("%s isn't ADDR:PORT\n", s);
+		return -1;
+	}
+	memcpy(buf, s, (size_t)(colon - s));
+	buf[colon - s] = 0;
+	*port = (short)atoi(colon + 1);
+	return 0;
+}
+
+static void
+nodelay(int sock)
+{
+	int one;
+
+	one = 1;
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+/* Backend */
+
+static void
+be_close(struct load_backend *b, struct be_conn *c)
+{
+	if (c->prev) {
+		c->prev->next = c->next;
+	} else {
+		b->conns = c->next;
+	}
+	if (c->next) {
+		c->next->prev = c->prev;
+	}
+	epoll_ctl(b->epfd, EPOLL_CTL_DEL, c->sock, 0);
+	close(c->sock);
+	free(c);
+}
+
+static void
+be_watch(struct load_backend *b, struct be_conn *c, uint32_t events, int op)
+{
+	struct epoll_event ev;
+
+	ev.events = events;
+	ev.data.ptr = c;
+	epoll_ctl(b->epfd, op, c->sock, &ev);
+}
+
+/*
+ * Send what's left of response, timestamps first & filler after.
+ * Returns:
+ * 	0 when all of it is sent, 1 if socket is full, -1 on error
+ */
+static int
+be_send(struct be_conn *c)
+{
+	struct iovec iov[2];
+	struct msghdr msg;
+	size_t hdr_end;
+	size_t rest;
+	ssize_t stat;
+
+	while (c->off < c->size) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		if (c->off < sizeof(c->resp)) {
+			iov[0].iov_base = (unsigned char *)&c->resp + c->off;
+			iov[0].iov_len = sizeof(c->resp) - c->off;
+			msg.msg_iovlen++;
+		}
+		hdr_end = (c->off > sizeof(c->resp)) ? c->off : 
+			sizeof(c->resp);
+		rest = c->size - hdr_end;
+		if (rest) {
+			iov[msg.msg_iovlen].iov_base = filler;
+			iov[msg.msg_iovlen].iov_len = (rest < sizeof(filler)) ?
+				rest : sizeof(filler);
+			msg.msg_iovlen++;
+		}
+		stat = sendmsg(c->sock, &msg, MSG_NOSIGNAL);
+		if (stat < 0) {
+			return (errno == EAGAIN) ? 1 : -1;
+		}
+		c->off += (size_t)stat;
+	}
+	return 0;
+}
+
+/* Read request, respond to it once it's whole */
+static int
+be_read(struct load_backend *b, struct be_conn *c)
+{
+	ssize_t stat;
+	int ret;
+
+	for (;;) {
+		stat = recv(c->sock, (unsigned char *)&c->req + c->got,
+				sizeof(c->req) - c->got, 0);
+		if (stat <= 0) {
+			return ((stat < 0) && (errno == EAGAIN)) ? 0 : -1;
+		}
+		c->got += (size_t)stat;
+		if (c->got < sizeof(c->req)) {
+			continue;
+		}
+		if ((c->req.magic != LOAD_MAGIC) || 
+				(c->req.size < sizeof(c->resp)) ||
+				(c->req.size > LOAD_SIZE_MAX)) {
+			return -1;
+		}
+		c->got = 0;
+		c->resp.accept_ns = c->accept_ns;
+		c->resp.req_ns = now_ns();
+		c->off = 0;
+		c->size = c->req.size;
+		c->resp.resp_ns = now_ns();
+		ret = be_send(c);
+		if (ret) {
+			/* Client waits for response before next request */
+			if (ret > 0) {
+				be_watch(b, c, EPOLLOUT, EPOLL_CTL_MOD);
+			}
+			return (ret > 0) ? 0 : -1;
+		}
+	}
+}
+
+static void
+be_accept(struct load_backend *b)
+{
+	struct be_conn *c;
+	int sock;
+
+	while ((sock = accept4(b->lsock, 0, 0, 
+			SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+		c = (struct be_conn *)calloc(1, sizeof(*c));
+		if (!c) {
+			close(sock);
+			continue;
+		}
+		c->sock = sock;
+		c->accept_ns = now_ns();
+		c->next = b->conns;
+		if (b->conns) {
+			b->conns->prev = c;
+		}
+		b->conns = c;
+		nodelay(sock);
+		be_watch(b, c, EPOLLIN, EPOLL_CTL_ADD);
+		__atomic_fetch_add(&b->accepts, 1, __ATOMIC_RELAXED);
+	}
+}
+
+static void *
+be_main(void *arg)
+{
+	struct epoll_event evs[LOAD_EVENTS];
+	struct load_backend *b;
+	struct be_conn *c;
+	int stat;
+	int cnt;
+	int i;
+
+	b = (struct load_backend *)arg;
+	while (!b->l->be_stop) {
+		cnt = epoll_wait(b->epfd, evs, LOAD_EVENTS, 100);
+		for (i = 0; i < cnt; i++) {
+			c = (struct be_conn *)evs[i].data.ptr;
+			if (!c) {
+				be_accept(b);
+				continue;
+			}
+			if (c->off < c->size) {
+				stat = be_send(c);
+				if (!stat) {
+					be_watch(b, c, EPOLLIN, EPOLL_CTL_MOD);
+					stat = be_read(b, c);
+				}
+			} else {
+				stat = be_read(b, c);
+			}
+			if (stat < 0) {
+				be_close(b, c);
+			}
+		}
+	}
+	return 0;
+}
+
+static int
+be_init(struct load_backend *b, struct load *l)
+{
+	struct sockaddr_in saddr;
+	struct epoll_event ev;
+	char addr[64];
+	short port;
+
+	b->l = l;
+	b->lsock = -1;
+	b->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if ((b->epfd < 0) || 
+		(parse_addr(l->opts.backend, addr, sizeof(addr), &port) < 0)) {
+		return -1;
+	}
+	b->lsock = sock_op_do(addr, port, &saddr, SOCK_OP_BIND | 
+			SOCK_OP_NONBLOCK | SOCK_OP_REUSEPORT);
+	if ((b->lsock < 0) || (listen(b->lsock, SOMAXCONN) < 0)) {
+		ERR("Backend can't listen on %s\n", l->opts.backend);
+		return -1;
+	}
+	ev.events = EPOLLIN;
+	ev.data.ptr = 0;
+	return epoll_ctl(b->epfd, EPOLL_CTL_ADD, b->lsock, &ev);
+}
+
+/* Workers */
+
+static void
+conn_watch(struct load_worker *w, struct load_conn *c, uint32_t events,
+		int op)
+{
+	struct epoll_event ev;
+
+	ev.events = events;
+	ev.data.ptr = c;
+	epoll_ctl(w->epfd, op, c->sock, &ev);
+}
+
+/* Persistent connections live in w->conns, rest are allocated */
+static void
+conn_close(struct load_worker *w, struct load_conn *c)
+{
+	epoll_ctl(w->epfd, EPOLL_CTL_DEL, c->sock, 0);
+	close(c->sock);
+	c->sock = -1;
+	if ((c < w->conns) || (c >= &w->conns[w->nconns])) {
+		free(c);
+	}
+}
+
+static int
+conn_send(struct load_worker *w, struct load_conn *c)
+{
+	struct load_req req;
+
+	req.magic = LOAD_MAGIC;
+	req.size = (uint32_t)w->l->opts.size;
+	c->got = 0;
+	c->sent_ns = now_ns();
+	/* Fits an empty socket buffer */
+	if (send(c->sock, &req, sizeof(req), MSG_NOSIGNAL) != sizeof(req)) {
+		return -1;
+	}
+	c->state = C_WAITING;
+	return 0;
+}
+
+static void
+conn_fail(struct load_worker *w, struct load_conn *c)
+{
+	if (c->due_ns >= w->measure_ns) {
+		w->failed++;
+	}
+	w->inflight--;
+	conn_close(w, c);
+}
+
+static void
+conn_start(struct load_worker *w, uint64_t due_ns)
+{
+	struct load_conn *c;
+	int sock;
+
+	if (w->l->opts.mode == MODE_STREAM) {
+		c = w->ready;
+		w->ready = c->next;
+		c->due_ns = due_ns;
+		w->inflight++;
+		if (conn_send(w, c) < 0) {
+			w->lost++;
+			conn_fail(w, c);
+		}
+		return;
+	}
+	c = (struct load_conn *)calloc(1, sizeof(*c));
+	sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (!c || (sock < 0)) {
+		w->failed += (due_ns >= w->measure_ns);
+		free(c);
+		if (sock >= 0) {
+			close(sock);
+		}
+		return;
+	}
+	c->sock = sock;
+	c->due_ns = due_ns;
+	c->state = C_CONNECTING;
+	c->start_ns = now_ns();
+	nodelay(sock);
+	w->inflight++;
+	if ((connect(sock, (struct sockaddr *)&w->l->target, 
+			sizeof(w->l->target)) < 0) && (errno != EINPROGRESS)) {
+		conn_fail(w, c);
+		return;
+	}
+	conn_watch(w, c, EPOLLOUT, EPOLL_CTL_ADD);
+}
+
+static void
+conn_connected(struct load_worker *w, struct load_conn *c)
+{
+	socklen_t len;
+	int err;
+
+	err = 0;
+	len = sizeof(err);
+	getsockopt(c->sock, SOL_SOCKET, SO_ERROR, &err, &len);
+	if (err || (conn_send(w, c) < 0)) {
+		conn_fail(w, c);
+		return;
+	}
+	if (c->due_ns >= w->measure_ns) {
+		samples_add(&w->lat[LAT_CONNECT], c->sent_ns - c->start_ns);
+		w->connects++;
+	}
+	conn_watch(w, c, EPOLLIN, EPOLL_CTL_MOD);
+}
+
+static void
+conn_done(struct load_worker *w, struct load_conn *c)
+{
+	struct load_resp *r;
+	uint64_t done;
+	uint64_t up;
+	uint64_t down;
+
+	done = now_ns();
+	r = &c->resp;
+	w->inflight--;
+	if (c->due_ns >= w->measure_ns) {
+		w->completed++;
+		if ((w->l->opts.mode == MODE_CONN) && 
+				(r->accept_ns >= c->start_ns)) {
+			samples_add(&w->lat[LAT_ACCEPT], r->accept_ns - 
+					c->start_ns);
+		}
+		up = (r->req_ns > c->sent_ns) ? (r->req_ns - c->sent_ns) : 0;
+		down = (c->first_ns > r->resp_ns) ? 
+			(c->first_ns - r->resp_ns) : 0;
+		samples_add(&w->lat[LAT_TTFB], c->first_ns - c->sent_ns);
+		samples_add(&w->lat[LAT_TTFB_CO], c->first_ns - c->due_ns);
+		samples_add(&w->lat[LAT_TOTAL_CO], done - c->due_ns);
+		samples_add(&w->lat[LAT_UP], up);
+		samples_add(&w->lat[LAT_DOWN], down);
+		samples_add(&w->lat[LAT_ADDED], up + down);
+		samples_add(&w->lat[LAT_BACKEND], r->resp_ns - r->req_ns);
+	}
+	if (w->l->opts.mode == MODE_CONN) {
+		conn_close(w, c);
+		return;
+	}
+	c->state = C_READY;
+	c->next = w->ready;
+	w->ready = c;
+}
+
+static void
+conn_read(struct load_worker *w, struct load_conn *c)
+{
+	unsigned char buf[LOAD_CHUNK];
+	struct load_conn **p;
+	size_t hdr;
+	ssize_t stat;
+
+	for (;;) {
+		stat = recv(c->sock, buf, sizeof(buf), 0);
+		if ((stat < 0) && (errno == EAGAIN)) {
+			return;
+		}
+		if (stat <= 0) {
+			break;
+		}
+		/* Nothing's expected on connections not waiting */
+		if (c->state != C_WAITING) {
+			break;
+		}
+		if (!c->got) {
+			c->first_ns = now_ns();
+		}
+		if (c->got < sizeof(c->resp)) {
+			hdr = sizeof(c->resp) - c->got;
+			hdr = ((size_t)stat < hdr) ? (size_t)stat : hdr;
+			memcpy((unsigned char *)&c->resp + c->got, buf, hdr);
+		}
+		c->got += (size_t)stat;
+		__atomic_store_n(&w->bytes, w->bytes + (uint64_t)stat, 
+				__ATOMIC_RELAXED);
+		if (c->got > w->l->opts.size) {
+			break;
+		}
+		if (c->got == w->l->opts.size) {
+			conn_done(w, c);
+			return;
+		}
+	}
+	if ((c->state == C_READY) || (c->state == C_IDLE)) {
+		/* Pull out of ready ones so it isn't handed a request */
+		for (p = &w->ready; *p && (*p != c); p = &(*p)->next);
+		if (*p) {
+			*p = c->next;
+		}
+		w->lost++;
+		conn_close(w, c);
+		return;
+	}
+	if (w->l->opts.mode == MODE_STREAM) {
+		w->lost++;
+	}
+	conn_fail(w, c);
+}
+
+/* Open persistent & idle connections before the run */
+static int
+worker_open(struct load_worker *w)
+{
+	struct load_opts *o;
+	struct load_conn *c;
+	int nstream;
+	int nidle;
+	int i;
+
+	o = &w->l->opts;
+	nstream = 0;
+	if (o->mode == MODE_STREAM) {
+		nstream = o->conns / o->threads + 
+			(w->id < (o->conns % o->threads));
+	}
+	nidle = o->idle / o->threads + (w->id < (o->idle % o->threads));
+	w->nconns = nstream + nidle;
+	w->conns = (struct load_conn *)calloc((size_t)w->nconns + 1, 
+			sizeof(*c));
+	if (!w->conns) {
+		return -1;
+	}
+	for (i = 0; i < w->nconns; i++) {
+		c = &w->conns[i];
+		c->sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if ((c->sock < 0) || (connect(c->sock, (struct sockaddr *)
+				&w->l->target, sizeof(w->l->target)) < 0)) {
+			ERR("Can't open connection %d: %s\n", i, 
+					strerror(errno));
+			w->nconns = i + (c->sock >= 0);
+			return -1;
+		}
+		nodelay(c->sock);
+		set_nonblocking(c->sock);
+		if (i < nstream) {
+			c->state = C_READY;
+			c->next = w->ready;
+			w->ready = c;
+		} else {
+			c->state = C_IDLE;
+		}
+		conn_watch(w, c, EPOLLIN, EPOLL_CTL_ADD);
+	}
+	return 0;
+}
+
+/* Start requests that are due, as many as there's room for */
+static void
+worker_arrivals(struct load_worker *w, uint64_t now)
+{
+	uint64_t backlog;
+
+	if (now >= w->t0) {
+		w->due = (now - w->t0) / w->interval + 1;
+		if (w->due > w->total) {
+			w->due = w->total;
+		}
+	}
+	while (w->started < w->due) {
+		if ((w->l->opts.mode == MODE_STREAM) ? !w->ready : 
+				(w->inflight >= w->l->opts.max_inflight)) {
+			break;
+		}
+		conn_start(w, w->t0 + w->started * w->interval);
+		w->started++;
+	}
+	backlog = w->due - w->started;
+	if (backlog > w->max_backlog) {
+		w->max_backlog = backlog;
+	}
+}
+
+static void
+worker_arm(struct load_worker *w)
+{
+	struct itimerspec its;
+	uint64_t next;
+
+	memset(&its, 0, sizeof(its));
+	next = w->t0 + w->due * w->interval;
+	its.it_value.tv_sec = (time_t)(next / 1000000000ULL);
+	its.it_value.tv_nsec = (long)(next % 1000000000ULL);
+	timerfd_settime(w->tfd, TFD_TIMER_ABSTIME, &its, 0);
+}
+
+static void *
+worker_main(void *arg)
+{
+	struct epoll_event evs[LOAD_EVENTS];
+	struct epoll_event ev;
+	struct load_worker *w;
+	struct load_conn *c;
+	struct load *l;
+	uint64_t expirations;
+	uint64_t now;
+	uint64_t end;
+	int cnt;
+	int i;
+
+	w = (struct load_worker *)arg;
+	l = w->l;
+	w->epfd = epoll_create1(EPOLL_CLOEXEC);
+	w->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	ev.events = EPOLLIN;
+	ev.data.ptr = 0;
+	if ((w->epfd < 0) || (w->tfd < 0) || 
+			(epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->tfd, &ev) < 0) ||
+			(worker_open(w) < 0)) {
+		w->failed_setup = 1;
+	}
+	pthread_barrier_wait(&l->barrier);
+	/* Main thread sets start once everyone's connected */
+	pthread_barrier_wait(&l->barrier);
+	if (l->abort) {
+		goto out;
+	}
+
+	/* Workers take turns so arrivals are evenly spaced over all */
+	w->interval = (uint64_t)(1e9 * l->opts.threads / l->opts.rate);
+	w->t0 = l->start_ns + (w->interval * (uint64_t)w->id) / 
+		(uint64_t)l->opts.threads;
+	w->measure_ns = w->t0 + (uint64_t)(l->opts.warmup * 1e9);
+	end = l->start_ns + (uint64_t)(l->opts.duration * 1e9);
+	w->total = (end > w->t0) ? ((end - w->t0 - 1) / w->interval + 1) : 0;
+	for (;;) {
+		now = now_ns();
+		worker_arrivals(w, now);
+		if ((now >= end) && ((!w->inflight && (w->started == w->due)) ||
+				(now >= end + LOAD_DRAIN_MS * 1000000ULL))) {
+			break;
+		}
+		if ((w->started == w->due) && (w->due < w->total)) {
+			worker_arm(w);
+		}
+		cnt = epoll_wait(w->epfd, evs, LOAD_EVENTS, 100);
+		for (i = 0; i < cnt; i++) {
+			c = (struct load_conn *)evs[i].data.ptr;
+			if (!c) {
+				while (read(w->tfd, &expirations, 
+					sizeof(expirations)) > 0);
+				continue;
+			}
+			if (c->state == C_CONNECTING) {
+				conn_connected(w, c);
+			} else {
+				conn_read(w, c);
+			}
+		}
+	}
+out:
+	for (i = 0; i < w->nconns; i++) {
+		if (w->conns[i].sock >= 0) {
+			close(w->conns[i].sock);
+		}
+	}
+	/* Connections still waiting in conn mode are leaked to exit */
+	if (w->tfd >= 0) {
+		close(w->tfd);
+	}
+	if (w->epfd >= 0) {
+		close(w->epfd);
+	}
+	return 0;
+}
+
+/* Report */
+
+static uint64_t
+load_bytes(struct load *l)
+{
+	uint64_t sum;
+	int i;
+
+	sum = 0;
+	for (i = 0; i < l->opts.threads; i++) {
+		sum += __atomic_load_n(&l->w[i].bytes, __ATOMIC_RELAXED);
+	}
+	return sum;
+}
+
+static uint64_t
+load_accepts(struct load *l)
+{
+	uint64_t sum;
+	int i;
+
+	sum = 0;
+	for (i = 0; i < l->opts.backend_threads; i++) {
+		sum += __atomic_load_n(&l->b[i].accepts, __ATOMIC_RELAXED);
+	}
+	return sum;
+}
+
+static void
+sleep_until(uint64_t ns)
+{
+	struct timespec ts;
+
+	ts.tv_sec = (time_t)(ns / 1000000000ULL);
+	ts.tv_nsec = (long)(ns % 1000000000ULL);
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0) == 
+			EINTR);
+}
+
+static void
+report_lat(struct load *l, int lat)
+{
+	struct samples all;
+	int i;
+
+	memset(&all, 0, sizeof(all));
+	for (i = 0; i < l->opts.threads; i++) {
+		all.n += l->w[i].lat[lat].n;
+	}
+	if (!all.n) {
+		return;
+	}
+	all.v = (uint64_t *)malloc(all.n * sizeof(uint64_t));
+	if (!all.v) {
+		return;
+	}
+	all.n = 0;
+	for (i = 0; i < l->opts.threads; i++) {
+		memcpy(&all.v[all.n], l->w[i].lat[lat].v, 
+				l->w[i].lat[lat].n * sizeof(uint64_t));
+		all.n += l->w[i].lat[lat].n;
+	}
+	qsort(all.v, all.n, sizeof(uint64_t), cmp_u64);
+	printf("lat=%s samples=%zu p50_us=%.1f p90_us=%.1f p99_us=%.1f "
+			"p999_us=%.1f max_us=%.1f\n", lat_names[lat], all.n,
+			(double)all.v[permille(all.n, 500)] / 1e3,
+			(double)all.v[permille(all.n, 900)] / 1e3,
+			(double)all.v[permille(all.n, 990)] / 1e3,
+			(double)all.v[permille(all.n, 999)] / 1e3,
+			(double)all.v[all.n - 1] / 1e3);
+	free(all.v);
+}
+
+static void
+report(struct load *l, double secs, uint64_t accepts, uint64_t bytes,
+		double *mbs, size_t nmbs)
+{
+	struct load_worker *w;
+	uint64_t measured;
+	uint64_t completed;
+	uint64_t connects;
+	uint64_t failed;
+	uint64_t lost;
+	uint64_t backlog;
+	uint64_t unstarted;
+	uint64_t first;
+	int i;
+
+	measured = 0;
+	completed = 0;
+	connects = 0;
+	failed = 0;
+	lost = 0;
+	backlog = 0;
+	unstarted = 0;
+	for (i = 0; i < l->opts.threads; i++) {
+		w = &l->w[i];
+		/* First request due after warmup */
+		first = ((uint64_t)(l->opts.warmup * 1e9) + w->interval - 1) /
+			w->interval;
+		measured += (w->due > first) ? (w->due - first) : 0;
+		completed += w->completed;
+		connects += w->connects;
+		failed += w->failed;
+		lost += w->lost;
+		unstarted += w->due - w->started;
+		if (w->max_backlog > backlog) {
+			backlog = w->max_backlog;
+		}
+	}
+	printf("mode=%s target=%s threads=%d rate=%d size=%zu conns=%d "
+			"idle=%d due=%llu completed=%llu failed=%llu "
+			"lost=%llu unstarted=%llu max_backlog=%llu "
+			"seconds=%.3f completed_per_s=%.1f connect_per_s=%.1f "
+			"backend_accept_per_s=%.1f mb_per_s=%.3f\n",
+			(l->opts.mode == MODE_CONN) ? "conn" : "stream",
+			l->opts.target, l->opts.threads, l->opts.rate, 
+			l->opts.size, (l->opts.mode == MODE_STREAM) ? 
+			l->opts.conns : 0, l->opts.idle,
+			(unsigned long long)measured, 
+			(unsigned long long)completed,
+			(unsigned long long)failed, (unsigned long long)lost,
+			(unsigned long long)unstarted, 
+			(unsigned long long)backlog, secs, 
+			(double)completed / secs, (double)connects / secs,
+			(double)accepts / secs, 
+			(double)bytes / secs / (1024.0 * 1024.0));
+	for (i = 0; i < LAT_N; i++) {
+		report_lat(l, i);
+	}
+	if (nmbs) {
+		qsort(mbs, nmbs, sizeof(double), cmp_double);
+		printf("throughput interval_ms=%d p1_mb_per_s=%.3f "
+				"p50_mb_per_s=%.3f p99_mb_per_s=%.3f\n",
+				LOAD_SAMPLE_MS, mbs[permille(nmbs, 10)],
+				mbs[permille(nmbs, 500)], 
+				mbs[permille(nmbs, 990)]);
+	}
+}
+
+static void
+usage(char *name)
+{
+	printf("Usage: %s [options]\n", name);
+	printf("\t--target ADDR:PORT   Where to send requests, defaults to 127.0.0.1:1337\n");
+	printf("\t--backend ADDR:PORT  Where to run backend, defaults to 127.0.0.1:1338\n");
+	printf("\t--mode MODE          conn for a connection per request, stream for persistent ones, defaults to conn\n");
+	printf("\t--rate N             Requests per second, defaults to 1000\n");
+	printf("\t--size BYTES         Size of a response, defaults to 64, at least %zu\n", sizeof(struct load_resp));
+	printf("\t--conns N            Persistent connections in stream mode, defaults to 64\n");
+	printf("\t--idle N             Connections to hold open without using them, defaults to 0\n");
+	printf("\t--threads N          Worker threads, defaults to 1\n");
+	printf("\t--backend-threads N  Backend threads, defaults to 1\n");
+	printf("\t--max-inflight N     Connections open at once per worker in conn mode, defaults to 10000\n");
+	printf("\t--duration SECONDS   How long to run, defaults to 10\n");
+	printf("\t--warmup SECONDS     How long of the start not to measure, defaults to 1\n");
+}
+
+int
+main(int argc, char **argv)
+{
+	static struct option opts[] = {
+		{ "target", 	required_argument, 	0, 't' },
+		{ "backend", 	required_argument, 	0, 'b' },
+		{ "mode", 	required_argument, 	0, 'm' },
+		{ "rate", 	required_argument, 	0, 'r' },
+		{ "size", 	required_argument, 	0, 's' },
+		{ "conns", 	required_argument, 	0, 'c' },
+		{ "idle", 	required_argument, 	0, 'i' },
+		{ "threads", 	required_argument, 	0, 'T' },
+		{ "backend-threads", required_argument, 0, 'B' },
+		{ "max-inflight", required_argument, 	0, 'I' },
+		{ "duration", 	required_argument, 	0, 'd' },
+		{ "warmup", 	required_argument, 	0, 'w' },
+		{ "help", 	no_argument, 		0, 'h' },
+		{ 0, 		0, 			0, 0 }
+	};
+	struct rlimit rl;
+	struct load l;
+	char addr[64];
+	double *mbs;
+	size_t nmbs;
+	uint64_t accepts;
+	uint64_t bytes;
+	uint64_t prev;
+	uint64_t cur;
+	uint64_t t;
+	uint64_t end;
+	short port;
+	int ret;
+	int opt;
+	int i;
+
+	memset(&l, 0, sizeof(l));
+	l.opts.target = "127.0.0.1:1337";
+	l.opts.backend = "127.0.0.1:1338";
+	l.opts.mode = MODE_CONN;
+	l.opts.rate = 1000;
+	l.opts.size = 64;
+	l.opts.conns = 64;
+	l.opts.threads = 1;
+	l.opts.backend_threads = 1;
+	l.opts.max_inflight = 10000;
+	l.opts.duration = 10;
+	l.opts.warmup = 1;
+	while ((opt = getopt_long(argc, argv, "h", opts, 0)) != -1) {
+		switch (opt) {
+		case ('t'):
+			l.opts.target = optarg;
+			break;
+		case ('b'):
+			l.opts.backend = optarg;
+			break;
+		case ('m'):
+			if (!strcmp(optarg, "conn")) {
+				l.opts.mode = MODE_CONN;
+			} else if (!strcmp(optarg, "stream")) {
+				l.opts.mode = MODE_STREAM;
+			} else {
+				ERR("Unknown mode %s\n", optarg);
+				return -1;
+			}
+			break;
+		case ('r'):
+			l.opts.rate = atoi(optarg);
+			break;
+		case ('s'):
+			l.opts.size = (size_t)strtoul(optarg, 0, 0);
+			break;
+		case ('c'):
+			l.opts.conns = atoi(optarg);
+			break;
+		case ('i'):
+			l.opts.idle = atoi(optarg);
+			break;
+		case ('T'):
+			l.opts.threads = atoi(optarg);
+			break;
+		case ('B'):
+			l.opts.backend_threads = atoi(optarg);
+			break;
+		case ('I'):
+			l.opts.max_inflight = atoi(optarg);
+			break;
+		case ('d'):
+			l.opts.duration = atof(optarg);
+			break;
+		case ('w'):
+			l.opts.warmup = atof(optarg);
+			break;
+		case ('h'):
+			usage(argv[0]);
+			return 0;
+		default:
+			usage(argv[0]);
+			return -1;
+		}
+	}
+	if ((l.opts.rate < 1) || (l.opts.threads < 1) || 
+			(l.opts.backend_threads < 1) || 
+			(l.opts.max_inflight < 1) || (l.opts.idle < 0)) {
+		ERR("--rate, --threads, --backend-threads and "
+				"--max-inflight must be at least 1\n");
+		return -1;
+	}
+	if ((l.opts.mode == MODE_STREAM) && 
+			(l.opts.conns < l.opts.threads)) {
+		ERR("--conns must be at least --threads\n");
+		return -1;
+	}
+	if ((l.opts.size < sizeof(struct load_resp)) || 
+			(l.opts.size > LOAD_SIZE_MAX)) {
+		ERR("--size must be %zu to %u\n", sizeof(struct load_resp),
+				LOAD_SIZE_MAX);
+		return -1;
+	}
+	if ((l.opts.warmup < 0) || (l.opts.duration <= l.opts.warmup)) {
+		ERR("--duration must be more than --warmup\n");
+		return -1;
+	}
+	if (parse_addr(l.opts.target, addr, sizeof(addr), &port) < 0) {
+		return -1;
+	}
+	sock_addr_init(addr, port, &l.target);
+	log_set_level(LOG_LVL_ERR);
+	memset(filler, 'x', sizeof(filler));
+
+	/* Every connection is a descriptor here, and one in backend */
+	if (!getrlimit(RLIMIT_NOFILE, &rl)) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	ret = -1;
+	l.b = (struct load_backend *)calloc((size_t)l.opts.backend_threads,
+			sizeof(*l.b));
+	l.w = (struct load_worker *)calloc((size_t)l.opts.threads, 
+			sizeof(*l.w));
+	nmbs = (size_t)(l.opts.duration * 1000 / LOAD_SAMPLE_MS) + 1;
+	mbs = (double *)calloc(nmbs, sizeof(double));
+	if (!l.b || !l.w || !mbs) {
+		goto out;
+	}
+	for (i = 0; i < l.opts.backend_threads; i++) {
+		if (be_init(&l.b[i], &l) < 0) {
+			l.opts.backend_threads = i + 1;
+			goto out_backend;
+		}
+	}
+	for (i = 0; i < l.opts.backend_threads; i++) {
+		pthread_create(&l.b[i].thread, 0, be_main, &l.b[i]);
+	}
+
+	pthread_barrier_init(&l.barrier, 0, (unsigned)l.opts.threads + 1);
+	for (i = 0; i < l.opts.threads; i++) {
+		l.w[i].l = &l;
+		l.w[i].id = i;
+		pthread_create(&l.w[i].thread, 0, worker_main, &l.w[i]);
+	}
+	pthread_barrier_wait(&l.barrier);
+	for (i = 0; i < l.opts.threads; i++) {
+		l.abort |= l.w[i].failed_setup;
+	}
+	l.start_ns = now_ns();
+	pthread_barrier_wait(&l.barrier);
+
+	/* Count what happened after warmup only */
+	nmbs = 0;
+	accepts = 0;
+	bytes = 0;
+	if (!l.abort) {
+		t = l.start_ns + (uint64_t)(l.opts.warmup * 1e9);
+		end = l.start_ns + (uint64_t)(l.opts.duration * 1e9);
+		sleep_until(t);
+		accepts = load_accepts(&l);
+		bytes = load_bytes(&l);
+		prev = bytes;
+		while (t + LOAD_SAMPLE_MS * 1000000ULL <= end) {
+			t += LOAD_SAMPLE_MS * 1000000ULL;
+			sleep_until(t);
+			cur = load_bytes(&l);
+			mbs[nmbs++] = (double)(cur - prev) * 
+				(1000.0 / LOAD_SAMPLE_MS) / (1024.0 * 1024.0);
+			prev = cur;
+		}
+		sleep_until(end);
+		accepts = load_accepts(&l) - accepts;
+		bytes = load_bytes(&l) - bytes;
+	}
+	for (i = 0; i < l.opts.threads; i++) {
+		pthread_join(l.w[i].thread, 0);
+	}
+	pthread_barrier_destroy(&l.barrier);
+	if (!l.abort) {
+		report(&l, l.opts.duration - l.opts.warmup, accepts, bytes,
+				mbs, nmbs);
+		ret = 0;
+	}
+	for (i = 0; i < l.opts.threads; i++) {
+		for (opt = 0; opt < LAT_N; opt++) {
+			free(l.w[i].lat[opt].v);
+		}
+		free(l.w[i].conns);
+	}
+
+out_backend:
+	l.be_stop = 1;
+	for (i = 0; i < l.opts.backend_threads; i++) {
+		if (l.b[i].thread) {
+			pthread_join(l.b[i].thread, 0);
+		}
+		while (l.b[i].conns) {
+			be_close(&l.b[i], l.b[i].conns);
+		}
+		if (l.b[i].lsock >= 0) {
+			close(l.b[i].lsock);
+		}
+		if (l.b[i].epfd >= 0) {
+			close(l.b[i].epfd);
+		}
+	}
+out:
+	free(mbs);
+	free(l.w);
+	free(l.b);
+	return ret;
+}
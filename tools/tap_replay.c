@@ -0,0 +1,682 @@
+/*
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2022, k4m1
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, 
+ *    this list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright 
+ *    notice, this list of conditions and the following disclaimer in the 
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE 
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+ * CONSEQUENTIA LDAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVE RCAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ * tap-replay, replays sessions captured with tap --capture through a
+ * ruleset to see what it would do to real traffic, and how fast.
+ *
+ * Sessions are spread over threads. Each one replays the reads of a
+ * session in order, either straight through the matching engine of
+ * the relay, or with --sockets through loopback connections to an event
+ * loop of its own and a stand-in for upstream which sends what upstream
+ * sent. Output is key=value lines like the benchmarks.
+ */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <netinet/in.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <buf_pool.h>
+#include <capture.h>
+#include <event_loop.h>
+#include <intercept_parser.h>
+#include <log.h>
+#include <net_io.h>
+#include <ring_buf.h>
+#include <rules_domain.h>
+#include <stream_match.h>
+
+/* Output described at once when draining engine */
+#define REPLAY_IOV 16
+
+/* Give up on a session if tap goes quiet for this long, --sockets */
+#define REPLAY_TIMEOUT_MS 5000
+
+struct replay_opts {
+	char *rules_path;
+	int threads;
+	int timed; 		/* keep time between reads */
+	int sockets;
+	int repeat; 		/* times to replay every session */
+};
+
+struct replay {
+	struct replay_opts opts;
+	struct capture_set set;
+	struct rules_domain dom;
+	struct rules_gen *gen; 	/* rules replayed, no reloads here */
+	size_t next; 		/* session to replay next, of n * repeat */
+	uint64_t first_us; 	/* first read of capture */
+	double start;
+};
+
+struct replay_worker {
+	struct replay *r;
+	int id;
+	pthread_t thread;
+	struct buf_pool pool; 		/* rings of engine */
+	uint64_t in[2]; 		/* per direction */
+	uint64_t out[2]; 		/* after rules */
+	uint64_t sessions;
+	uint64_t failed;
+	struct event_loop loop; 	/* --sockets */
+	pthread_t loop_thread;
+	int upstream; 			/* listener of stand-in */
+	short lport; 			/* of loop */
+};
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + ((double)ts.tv_nsec / 1e9);
+}
+
+/*
+ * Returns:
+ * 	seconds until read captured at us is due, <= 0 if it is
+ */
+static double
+replay_due(struct replay *r, uint64_t us)
+{
+	if (!r->opts.timed) {
+		return 0;
+	}
+	return r->start + (double)(us - r->first_us) / 1e6 - now();
+}
+
+static void
+replay_wait(struct replay *r, uint64_t us)
+{
+	struct timespec ts;
+	double left;
+
+	left = replay_due(r, us);
+	if (left > 0) {
+		ts.tv_sec = (time_t)left;
+		ts.tv_nsec = (long)((left - (double)ts.tv_sec) * 1e9);
+		nanosleep(&ts, 0);
+	}
+}
+
+/*
+ * Take output of direction that can be sent, as relay would send it
+ *
+ * Returns:
+ * 	amount of bytes taken
+ */
+static size_t
+engine_drain(struct stream_ctx *ctx, struct ring_buf *ring)
+{
+	struct iovec iov[REPLAY_IOV];
+	size_t total;
+	size_t len;
+	int cnt;
+	int i;
+
+	total = 0;
+	while ((cnt = stream_peek_iov(ctx, ring, iov, REPLAY_IOV)) > 0) {
+		len = 0;
+		for (i = 0; i < cnt; i++) {
+			len += iov[i].iov_len;
+		}
+		stream_consume(ctx, ring, len);
+		total += len;
+	}
+	/* Deleted bytes may still be at the start */
+	stream_consume(ctx, ring, 0);
+	return total;
+}
+
+/*
+ * Replay session through matching engine, each read is scanned as the
+ * relay scans a read
+ *
+ * Returns:
+ * 	0 on success or -1 on error
+ */
+static int
+replay_engine(struct replay_worker *w, struct capture_session *s)
+{
+	struct stream_rules *rules;
+	struct capture_chunk *c;
+	struct stream_ctx ctx[2];
+	struct ring_buf ring[2];
+	size_t i;
+	int ret;
+	int d;
+
+	rules = &w->r->gen->rules;
+	memset(ctx, 0, sizeof(ctx));
+	memset(ring, 0, sizeof(ring));
+	for (d = 0; d < 2; d++) {
+		ctx[d].hits = rules_gen_hits(w->r->gen, w->id);
+		ring[d].pool = &w->pool;
+	}
+	ret = 0;
+	for (i = 0; i < s->nchunks; i++) {
+		c = &s->chunks[i];
+		d = (int)c->dir;
+		replay_wait(w->r, c->us);
+		if ((ring_push(&ring[d], s->data + c->off, c->len, 
+				SIZE_MAX) != c->len) ||
+				(stream_scan(rules, &ctx[d], d, &ring[d],
+					c->len) < 0)) {
+			ret = -1;
+			break;
+		}
+		w->in[d] += c->len;
+		w->out[d] += engine_drain(&ctx[d], &ring[d]);
+	}
+	for (d = 0; d < 2; d++) {
+		/* Peer is done, held back bytes go out as they are */
+		stream_release(&ctx[d]);
+		w->out[d] += engine_drain(&ctx[d], &ring[d]);
+		ring_free(&ring[d]);
+		stream_ctx_free(&ctx[d]);
+	}
+	return ret;
+}
+
+/*
+ * Wait for sockets of session, reading what tap sends meanwhile.
+ * fd[0] is client end and reads DIR_U2C output, fd[1] upstream end.
+ *
+ * Requires:
+ * 	struct replay_worker *w 	- worker replaying
+ * 	int fd[2] 			- sockets of session, -1 when at eof
+ * 	int out 			- socket to wait to be writable,
+ * 					  or -1 to wait for eof of both
+ * 	double until 			- when to stop waiting if nothing is
+ * 					  written, 0 for right away
+ * Returns:
+ * 	0 if out is writable or both reached eof, 1 if until passed, -1
+ * 	on error or timeout
+ */
+static int
+sock_wait(struct replay_worker *w, int fd[2], int out, double until)
+{
+	unsigned char buf[65536];
+	struct pollfd pfd[2];
+	ssize_t stat;
+	double left;
+	int timeout;
+	int i;
+
+	for (;;) {
+		if ((out < 0) && (fd[0] < 0) && (fd[1] < 0)) {
+			return 0;
+		}
+		timeout = REPLAY_TIMEOUT_MS;
+		if (until > 0) {
+			left = until - now();
+			if (left <= 0) {
+				return 1;
+			}
+			if (left * 1000 < timeout) {
+				timeout = (int)(left * 1000) + 1;
+			}
+		}
+		for (i = 0; i < 2; i++) {
+			pfd[i].fd = fd[i];
+			pfd[i].events = POLLIN;
+			if (fd[i] == out) {
+				pfd[i].events |= POLLOUT;
+			}
+		}
+		stat = poll(pfd, 2, timeout);
+		if (stat < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		if ((stat == 0) && (until <= 0)) {
+			ERR("Session timed out\n");
+			return -1;
+		}
+		for (i = 0; i < 2; i++) {
+			if (fd[i] < 0) {
+				continue;
+			}
+			if (pfd[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+				stat = recv(fd[i], buf, sizeof(buf), 0);
+				if ((stat < 0) && (errno != EAGAIN)) {
+					return -1;
+				}
+				if (stat == 0) {
+					fd[i] = -1;
+				} else if (stat > 0) {
+					w->out[!i] += (size_t)stat;
+				}
+			}
+			if ((fd[i] == out) && (pfd[i].revents & POLLOUT)) {
+				return 0;
+			}
+		}
+	}
+}
+
+/*
+ * Replay session through loopback connections and event loop of worker
+ *
+ * Returns:
+ * 	0 on success or -1 on error
+ */
+static int
+replay_sockets(struct replay_worker *w, struct capture_session *s)
+{
+	struct sockaddr_in saddr;
+	struct capture_chunk *c;
+	struct pollfd pfd;
+	int sock[2];
+	int fd[2];
+	size_t off;
+	ssize_t stat;
+	size_t i;
+	int ret;
+	int d;
+
+	sock[1] = -1;
+	sock[0] = sock_op_do("127.0.0.1", w->lport, &saddr, SOCK_OP_CONN);
+	if (sock[0] < 0) {
+		return -1;
+	}
+	/* Connection of tap to upstream is the one we're waiting for */
+	pfd.fd = w->upstream;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, REPLAY_TIMEOUT_MS) == 1) {
+		sock[1] = accept4(w->upstream, 0, 0, SOCK_CLOEXEC);
+	}
+	if (sock[1] < 0) {
+		ERR("tap didn't connect upstream\n");
+		close(sock[0]);
+		return -1;
+	}
+	for (d = 0; d < 2; d++) {
+		fcntl(sock[d], F_SETFL, O_NONBLOCK);
+		fd[d] = sock[d];
+	}
+
+	ret = 0;
+	for (i = 0; (i < s->nchunks) && !ret; i++) {
+		c = &s->chunks[i];
+		d = (int)c->dir;
+		if (replay_due(w->r, c->us) > 0) {
+			sock_wait(w, fd, -1, w->r->start + 
+					(double)(c->us - w->r->first_us) / 1e6);
+		}
+		for (off = 0; off < c->len; ) {
+			stat = send(sock[d], s->data + c->off + off, 
+					c->len - off, MSG_NOSIGNAL);
+			if (stat > 0) {
+				off += (size_t)stat;
+				continue;
+			}
+			if ((stat < 0) && (errno != EAGAIN)) {
+				ret = -1;
+				break;
+			}
+			if (sock_wait(w, fd, sock[d], 0) < 0) {
+				ret = -1;
+				break;
+			}
+		}
+		w->in[d] += off;
+	}
+	if (!ret) {
+		shutdown(sock[0], SHUT_WR);
+		shutdown(sock[1], SHUT_WR);
+		ret = sock_wait(w, fd, -1, 0);
+	}
+	close(sock[0]);
+	close(sock[1]);
+	return ret;
+}
+
+static void *
+loop_main(void *arg)
+{
+	ev_loop_run((struct event_loop *)arg);
+	return 0;
+}
+
+/*
+ * Start event loop of worker, listening on an unused port and relaying
+ * to a stand-in for upstream on another
+ *
+ * Returns:
+ * 	0 on success or -1 on error
+ */
+static int
+worker_sockets(struct replay_worker *w)
+{
+	struct sockaddr_in saddr;
+	struct relay_cfg cfg;
+	socklen_t len;
+	int lsock;
+
+	w->upstream = sock_op_do("127.0.0.1", 0, &saddr, SOCK_OP_BIND);
+	len = sizeof(saddr);
+	if ((w->upstream < 0) || (listen(w->upstream, SOMAXCONN) < 0) ||
+			(getsockname(w->upstream, (struct sockaddr *)&saddr, 
+				     &len) < 0)) {
+		ERR("Failed to listen for tap: %s\n", strerror(errno));
+		return -1;
+	}
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.addrout = "127.0.0.1";
+	cfg.dport = (short)ntohs(saddr.sin_port);
+	cfg.tx_size = 16384;
+	cfg.rules = &w->r->dom;
+	cfg.reader = w->id;
+	cfg.backend = BACKEND_EPOLL;
+	cfg.splice = 1;
+	if (ev_loop_init(&w->loop, &cfg) < 0) {
+		return -1;
+	}
+	lsock = sock_op_do("127.0.0.1", 0, &saddr, SOCK_OP_BIND);
+	len = sizeof(saddr);
+	if ((lsock < 0) || (listen(lsock, SOMAXCONN) < 0) ||
+			(getsockname(lsock, (struct sockaddr *)&saddr, 
+				     &len) < 0) ||
+			(ev_loop_add_listener(&w->loop, lsock) < 0)) {
+		ERR("Failed to listen for clients: %s\n", strerror(errno));
+		if (lsock >= 0) {
+			close(lsock);
+		}
+		ev_loop_destroy(&w->loop);
+		return -1;
+	}
+	w->lport = (short)ntohs(saddr.sin_port);
+	if (pthread_create(&w->loop_thread, 0, loop_main, &w->loop)) {
+		ev_loop_destroy(&w->loop);
+		return -1;
+	}
+	return 0;
+}
+
+static void *
+worker_main(void *arg)
+{
+	struct replay_worker *w;
+	struct replay *r;
+	size_t i;
+	int stat;
+
+	w = (struct replay_worker *)arg;
+	r = w->r;
+	for (;;) {
+		i = __atomic_fetch_add(&r->next, 1, __ATOMIC_RELAXED);
+		if (i >= r->set.n * (size_t)r->opts.repeat) {
+			break;
+		}
+		i %= r->set.n;
+		if (r->opts.sockets) {
+			stat = replay_sockets(w, &r->set.s[i]);
+		} else {
+			stat = replay_engine(w, &r->set.s[i]);
+		}
+		if (stat < 0) {
+			w->failed++;
+		} else {
+			w->sessions++;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Print totals and replacements per rule
+ */
+static void
+report(struct replay *r, struct replay_worker *workers, double secs)
+{
+	struct stream_rules *rules;
+	uint64_t in[2] = { 0, 0 };
+	uint64_t out[2] = { 0, 0 };
+	uint64_t sessions = 0;
+	uint64_t failed = 0;
+	uint64_t rewrites = 0;
+	uint64_t hits;
+	uint32_t n;
+	int i;
+
+	rules = &r->gen->rules;
+	for (i = 0; i < r->opts.threads; i++) {
+		in[0] += workers[i].in[0];
+		in[1] += workers[i].in[1];
+		out[0] += workers[i].out[0];
+		out[1] += workers[i].out[1];
+		sessions += workers[i].sessions;
+		failed += workers[i].failed;
+	}
+	for (n = 0; n < rules->nrules; n++) {
+		for (i = 0; i < r->opts.threads; i++) {
+			rewrites += rules_gen_hits(r->gen, i)[n];
+		}
+	}
+	printf("mode=%s threads=%d sessions=%llu failed=%llu seconds=%.3f "
+		"mb_in=%.1f mb_out=%.1f mb_per_s=%.1f c2u_in=%llu "
+		"c2u_out=%llu u2c_in=%llu u2c_out=%llu rewrites=%llu "
+		"rewrites_per_s=%.1f\n",
+		r->opts.sockets ? "sockets" : "engine", r->opts.threads,
+		(unsigned long long)sessions, (unsigned long long)failed, secs,
+		(double)(in[0] + in[1]) / (1024.0 * 1024.0),
+		(double)(out[0] + out[1]) / (1024.0 * 1024.0),
+		(double)(in[0] + in[1]) / (1024.0 * 1024.0) / secs,
+		(unsigned long long)in[0], (unsigned long long)out[0],
+		(unsigned long long)in[1], (unsigned long long)out[1],
+		(unsigned long long)rewrites, (double)rewrites / secs);
+	for (n = 0; n < rules->nrules; n++) {
+		hits = 0;
+		for (i = 0; i < r->opts.threads; i++) {
+			hits += rules_gen_hits(r->gen, i)[n];
+		}
+		printf("rule=%u rewrites=%llu rewrites_per_s=%.1f\n", n,
+				(unsigned long long)hits, (double)hits / secs);
+	}
+}
+
+static void
+usage(char *name)
+{
+	printf("Usage: %s [options] --rules FILE CAPTURE...\n", name);
+	printf("\t--rules FILE     Ruleset to replay captured sessions through\n");
+	printf("\t--threads N      Threads to spread sessions over, defaults to one per cpu\n");
+	printf("\t--timed          Keep time between reads as captured, defaults to full speed\n");
+	printf("\t--sockets        Replay over loopback through an event loop\n");
+	printf("\t--repeat N       Replay every session N times, defaults to 1\n");
+}
+
+int
+main(int argc, char **argv)
+{
+	static struct option opts[] = {
+		{ "rules", 	required_argument, 	0, 'f' },
+		{ "threads", 	required_argument, 	0, 't' },
+		{ "timed", 	no_argument, 		0, 'T' },
+		{ "sockets", 	no_argument, 		0, 's' },
+		{ "repeat", 	required_argument, 	0, 'r' },
+		{ "help", 	no_argument, 		0, 'h' },
+		{ 0, 		0, 			0, 0 }
+	};
+	struct replay_worker *workers;
+	struct stream_rules rules;
+	struct replay r;
+	size_t i;
+	double secs;
+	int ret;
+	int opt;
+	int n;
+
+	/* Connections of --sockets would log over the results */
+	log_set_level(LOG_LVL_ERR);
+	memset(&r, 0, sizeof(r));
+	r.opts.threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	r.opts.repeat = 1;
+	while ((opt = getopt_long(argc, argv, "h", opts, 0)) != -1) {
+		switch (opt) {
+		case ('f'):
+			r.opts.rules_path = optarg;
+			break;
+		case ('t'):
+			r.opts.threads = atoi(optarg);
+			break;
+		case ('T'):
+			r.opts.timed = 1;
+			break;
+		case ('s'):
+			r.opts.sockets = 1;
+			break;
+		case ('r'):
+			r.opts.repeat = atoi(optarg);
+			break;
+		case ('h'):
+			usage(argv[0]);
+			return 0;
+		default:
+			usage(argv[0]);
+			return -1;
+		}
+	}
+	if (!r.opts.rules_path || (optind == argc)) {
+		usage(argv[0]);
+		return -1;
+	}
+	if ((r.opts.threads < 1) || (r.opts.repeat < 1)) {
+		ERR("--threads and --repeat must be at least 1\n");
+		return -1;
+	}
+
+	for (n = optind; n < argc; n++) {
+		if (capture_load(&r.set, argv[n]) < 0) {
+			capture_set_free(&r.set);
+			return -1;
+		}
+	}
+	if (!r.set.n) {
+		ERR("No sessions in capture\n");
+		capture_set_free(&r.set);
+		return -1;
+	}
+	r.first_us = UINT64_MAX;
+	for (i = 0; i < r.set.n; i++) {
+		if (r.set.s[i].nchunks && 
+				(r.set.s[i].chunks[0].us < r.first_us)) {
+			r.first_us = r.set.s[i].chunks[0].us;
+		}
+	}
+
+	if ((ruleset_load(&rules, r.opts.rules_path) < 0)) {
+		capture_set_free(&r.set);
+		return -1;
+	}
+	if (rules_domain_init(&r.dom, r.opts.threads) < 0) {
+		stream_rules_free(&rules);
+		capture_set_free(&r.set);
+		return -1;
+	}
+	if (rules_domain_publish(&r.dom, &rules) < 0) {
+		rules_domain_destroy(&r.dom);
+		capture_set_free(&r.set);
+		return -1;
+	}
+	r.gen = r.dom.cur;
+
+	workers = (struct replay_worker *)calloc(r.opts.threads, 
+			sizeof(*workers));
+	if (!workers) {
+		ERR("calloc() failed\n");
+		rules_domain_destroy(&r.dom);
+		capture_set_free(&r.set);
+		return -1;
+	}
+	ret = 0;
+	for (n = 0; n < r.opts.threads; n++) {
+		workers[n].r = &r;
+		workers[n].id = n;
+		workers[n].upstream = -1;
+		buf_pool_init(&workers[n].pool, 0);
+		if (r.opts.sockets && (worker_sockets(&workers[n]) < 0)) {
+			ret = -1;
+			break;
+		}
+	}
+	r.opts.threads = n;
+
+	r.start = now();
+	for (n = 0; !ret && (n < r.opts.threads); n++) {
+		if (pthread_create(&workers[n].thread, 0, worker_main, 
+					&workers[n])) {
+			ERR("Failed to start thread %d\n", n);
+			/* Rest of sessions go to threads that did start */
+			break;
+		}
+	}
+	while (n-- > 0) {
+		pthread_join(workers[n].thread, 0);
+	}
+	secs = now() - r.start;
+	if (!ret) {
+		report(&r, workers, secs);
+	}
+
+	for (n = 0; n < r.opts.threads; n++) {
+		if (r.opts.sockets) {
+			ev_loop_stop(&workers[n].loop, EV_STOP_NOW);
+			pthread_join(workers[n].loop_thread, 0);
+			ev_loop_destroy(&workers[n].loop);
+			close(workers[n].upstream);
+		}
+		buf_pool_destroy(&workers[n].pool);
+	}
+	free(workers);
+	rules_domain_destroy(&r.dom);
+	capture_set_free(&r.set);
+	return ret;
+}